@@ -0,0 +1,262 @@
+#include "allocator.h"
+#include "cow.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define NODE_SLOT_SIZE ((long)sizeof(RBTNode))
+
+static long round_size(long size) {
+    size = (size + FS_ALLOC_ALIGN - 1) & ~(long)(FS_ALLOC_ALIGN - 1);
+    return size < FS_FREE_MIN ? FS_FREE_MIN : size;
+}
+
+// Bins 1 and up: extents of [2^(i+3), 2^(i+4)) bytes, the last bin takes the rest.
+static int size_class(long size) {
+    int bin = 0;
+    while ((FS_FREE_MIN << bin) <= size && bin < FS_FREE_BINS - 1) bin++;
+    return bin;
+}
+
+// Bin 0: node slots.
+static int bin_of(long size) {
+    return size == NODE_SLOT_SIZE ? 0 : size_class(size);
+}
+
+static void push_extent(FSContext *ctx, long offset, long size) {
+    int bin = bin_of(size);
+    FreeExtent ext;
+    ext.size = size;
+    ext.next = ctx->sb.free_bins[bin];
+    cache_write(&ctx->cache, offset, &ext, sizeof(FreeExtent));
+    ctx->sb.free_bins[bin] = offset;
+}
+
+// First fit among the first FS_FREE_SCAN extents of the bin: unlinks it and returns its offset
+// (its size in *found_size), or 0. An extent only fits if it is exact or leaves a tail big enough
+// to be tracked: an untracked sliver would keep its neighbours from ever being merged.
+static long take_from_bin(FSContext *ctx, int bin, long size, long *found_size) {
+    long prev = 0;
+    long offset = ctx->sb.free_bins[bin];
+    for (int i = 0; offset != 0 && i < FS_FREE_SCAN; i++) {
+        FreeExtent ext;
+        if (cache_read(&ctx->cache, offset, &ext, sizeof(FreeExtent)) != 0) return 0;
+        if (ext.size == size || ext.size >= size + FS_FREE_MIN) {
+            if (prev == 0) {
+                ctx->sb.free_bins[bin] = ext.next;
+            } else {
+                FreeExtent prev_ext;
+                cache_read(&ctx->cache, prev, &prev_ext, sizeof(FreeExtent));
+                prev_ext.next = ext.next;
+                cache_write(&ctx->cache, prev, &prev_ext, sizeof(FreeExtent));
+            }
+            *found_size = ext.size;
+            return offset;
+        }
+        prev = offset;
+        offset = ext.next;
+    }
+    return 0;
+}
+
+static long bump_allocate(FSContext *ctx, long size) {
+    // Bump allocation at the end of the used space.
+    long offset = (ctx->sb.next_free_page_offset + FS_ALLOC_ALIGN - 1) & ~(long)(FS_ALLOC_ALIGN - 1);
+    ctx->sb.next_free_page_offset = offset + size;
+    if (ctx->sb.fs_size < ctx->sb.next_free_page_offset) {
+        ctx->sb.fs_size = ctx->sb.next_free_page_offset;
+    }
+    return offset;
+}
+
+static long take_extent(FSContext *ctx, int bin, long size) {
+    long found_size = 0;
+    long offset = take_from_bin(ctx, bin, size, &found_size);
+    if (offset != 0 && found_size > size) {
+        push_extent(ctx, offset + size, found_size - size);
+    }
+    return offset;
+}
+
+static long find_free(FSContext *ctx, long size) {
+    long offset = 0;
+    if (size == NODE_SLOT_SIZE && ctx->sb.free_bins[0] != 0) offset = take_extent(ctx, 0, size);
+    for (int bin = size_class(size); offset == 0 && bin < FS_FREE_BINS; bin++) {
+        if (ctx->sb.free_bins[bin] != 0) offset = take_extent(ctx, bin, size);
+    }
+    return offset;
+}
+
+long fs_allocate(FSContext *ctx, long size) {
+    // Empty payloads take no space (their offset is never read).
+    if (ctx->sb.version < 2 || size == 0) return bump_allocate(ctx, size);
+
+    size = round_size(size);
+    if (ctx->cow) {
+        long offset = cow_take(ctx, size);
+        return offset != 0 ? offset : bump_allocate(ctx, size);
+    }
+    long offset = find_free(ctx, size);
+    if (offset == 0 && ctx->pending_releases >= FS_MERGE_MIN
+        && ctx->pending_releases >= ctx->merged_extents / FS_MERGE_RATIO) {
+        // Before growing the image, retry once the neighbours freed since the last merge are joined.
+        fs_merge_free_space(ctx);
+        offset = find_free(ctx, size);
+    }
+    return offset != 0 ? offset : bump_allocate(ctx, size);
+}
+
+long fs_extent_size(FSContext *ctx, long size) {
+    if (ctx->sb.version < 2 || size == 0) return size;
+    return round_size(size);
+}
+
+void fs_release(FSContext *ctx, long offset, long size) {
+    if (ctx->sb.version < 2 || size <= 0) return;
+    if (offset < FS_HEADER_SIZE || (offset & (FS_ALLOC_ALIGN - 1)) != 0) return; // Not from fs_allocate
+    if (ctx->cow) {
+        cow_give(ctx, offset, round_size(size));
+        return;
+    }
+    push_extent(ctx, offset, round_size(size));
+    ctx->pending_releases++;
+}
+
+static int compare_extent_offsets(const void *a, const void *b) {
+    long oa = ((const long *)a)[0], ob = ((const long *)b)[0];
+    return (oa > ob) - (oa < ob);
+}
+
+int fs_merge_free_space(FSContext *ctx) {
+    if (ctx->sb.version < 2 || ctx->cow) return 0;
+
+    // Collect every free extent as (offset, size) pairs
+    long count = 0, capacity = 256;
+    long *extents = malloc(capacity * 2 * sizeof(long));
+    if (!extents) return -1;
+    for (int bin = 0; bin < FS_FREE_BINS; bin++) {
+        for (long offset = ctx->sb.free_bins[bin]; offset != 0; ) {
+            FreeExtent ext;
+            if (cache_read(&ctx->cache, offset, &ext, sizeof(FreeExtent)) != 0) {
+                free(extents);
+                return -1;
+            }
+            if (count == capacity) {
+                long *grown = realloc(extents, capacity * 4 * sizeof(long));
+                if (!grown) {
+                    free(extents);
+                    return -1;
+                }
+                extents = grown;
+                capacity *= 2;
+            }
+            extents[count * 2] = offset;
+            extents[count * 2 + 1] = ext.size;
+            count++;
+            offset = ext.next;
+        }
+    }
+    qsort(extents, count, 2 * sizeof(long), compare_extent_offsets);
+
+    // Join neighbours in place
+    long merged = 0;
+    for (long i = 0; i < count; i++) {
+        long offset = extents[i * 2], size = extents[i * 2 + 1];
+        if (merged > 0 && extents[(merged - 1) * 2] + extents[(merged - 1) * 2 + 1] == offset) {
+            extents[(merged - 1) * 2 + 1] += size;
+        } else {
+            extents[merged * 2] = offset;
+            extents[merged * 2 + 1] = size;
+            merged++;
+        }
+    }
+
+    // A free extent at the end of the used space goes back to the bump pointer
+    if (merged > 0 && extents[(merged - 1) * 2] + extents[(merged - 1) * 2 + 1] >= ctx->sb.next_free_page_offset) {
+        merged--;
+        ctx->sb.next_free_page_offset = extents[merged * 2];
+        ctx->sb.fs_size = ctx->sb.next_free_page_offset;
+    }
+
+    // Rebuild the bins, highest offsets first so that each list starts with its lowest extent
+    memset(ctx->sb.free_bins, 0, sizeof(ctx->sb.free_bins));
+    for (long i = merged - 1; i >= 0; i--) {
+        push_extent(ctx, extents[i * 2], extents[i * 2 + 1]);
+    }
+    free(extents);
+    ctx->pending_releases = 0;
+    ctx->merged_extents = merged;
+    return 0;
+}
+
+long fs_allocate_page(FSContext *ctx) {
+    long offset = ctx->sb.free_pages;
+    if (ctx->cow) {
+        offset = cow_take_page(ctx);
+        if (offset != 0) return offset;
+    } else if (offset != 0) {
+        FreeExtent ext;
+        cache_read(&ctx->cache, offset, &ext, sizeof(FreeExtent));
+        ctx->sb.free_pages = ext.next;
+        return offset;
+    }
+
+    // Page-aligned bump allocation; the gap before the page goes to the free lists
+    long start = (ctx->sb.next_free_page_offset + FS_ALLOC_ALIGN - 1) & ~(long)(FS_ALLOC_ALIGN - 1);
+    offset = (start + FS_PAGE_SIZE - 1) & ~(long)(FS_PAGE_SIZE - 1);
+    if (offset - start >= FS_FREE_MIN && ctx->cow) {
+        cow_give(ctx, start, offset - start);
+    } else if (offset - start >= FS_FREE_MIN) {
+        push_extent(ctx, start, offset - start);
+        ctx->pending_releases++;
+    }
+    ctx->sb.next_free_page_offset = offset;
+    return bump_allocate(ctx, FS_PAGE_SIZE);
+}
+
+void fs_release_page(FSContext *ctx, long offset) {
+    if (offset < FS_HEADER_SIZE || (offset & (FS_PAGE_SIZE - 1)) != 0) return;
+    if (ctx->cow) {
+        cow_give(ctx, offset, FS_PAGE_SIZE);
+        return;
+    }
+    FreeExtent ext;
+    ext.size = FS_PAGE_SIZE;
+    ext.next = ctx->sb.free_pages;
+    cache_write(&ctx->cache, offset, &ext, sizeof(FreeExtent));
+    ctx->sb.free_pages = offset;
+}
+
+int get_free_space_stats(FSContext *ctx, FreeSpaceStats *stats) {
+    memset(stats, 0, sizeof(FreeSpaceStats));
+    long header = ctx->sb.version >= 2 ? FS_HEADER_SIZE : (long)LEGACY_SUPERBLOCK_SIZE;
+    if (ctx->cow) {
+        cow_free_space_stats(ctx, stats);
+    } else if (ctx->sb.version >= 2) {
+        for (int bin = 0; bin < FS_FREE_BINS; bin++) {
+            long offset = ctx->sb.free_bins[bin];
+            while (offset != 0) {
+                FreeExtent ext;
+                if (cache_read(&ctx->cache, offset, &ext, sizeof(FreeExtent)) != 0) return -1;
+                stats->bin_extents[bin]++;
+                stats->bin_bytes[bin] += ext.size;
+                stats->free_extents++;
+                stats->free_bytes += ext.size;
+                if (ext.size > stats->largest_extent) stats->largest_extent = ext.size;
+                offset = ext.next;
+            }
+        }
+        for (long offset = ctx->sb.free_pages; offset != 0; ) {
+            FreeExtent ext;
+            if (cache_read(&ctx->cache, offset, &ext, sizeof(FreeExtent)) != 0) return -1;
+            stats->free_pages++;
+            offset = ext.next;
+        }
+    }
+    stats->used_bytes = ctx->sb.next_free_page_offset - header - stats->free_bytes - stats->free_pages * FS_PAGE_SIZE;
+    return 0;
+}
+
+double fragmentation_percent(const FreeSpaceStats *stats) {
+    if (stats->free_bytes == 0) return 0.0;
+    return 100.0 * (stats->free_bytes - stats->largest_extent) / stats->free_bytes;
+}
@@ -0,0 +1,72 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+
+#include "fs_core.h"
+
+// Image space allocator.
+// Released extents are kept in persisted free lists (SuperBlock.free_bins): each free extent starts
+// with a FreeExtent header holding its size and the offset of the next extent of the same bin.
+// Bin 0 holds node-sized slots (RBTNode records are all the same size), the other bins hold
+// extents by power-of-two size class. Requests are served from the bins first (splitting larger
+// extents), then by bumping SuperBlock.next_free_page_offset.
+// Index pages (FS_PAGE_SIZE, page-aligned) have their own list (SuperBlock.free_pages).
+// Version 1 images have no room for the bins: released space is simply not reused there.
+//
+// Released extents are not merged with their neighbours right away (allocated records carry no
+// boundary tags): fs_merge_free_space sorts the free lists by offset and joins adjacent extents.
+// It rewrites every free extent, so it only runs before the image would grow once enough was
+// released since the last merge (FS_MERGE_MIN extents and 1/FS_MERGE_RATIO of the free extents it
+// left: a constant number of header writes per release on average), and at close.
+//
+// Copy-on-write images (cow.h) keep their free space in memory instead, and write it out as a
+// table at each publication: space the published version uses is only reused after the next one.
+
+// Every extent is a multiple of FS_ALLOC_ALIGN and at least FS_FREE_MIN bytes (room for the header).
+#define FS_FREE_MIN 16
+// Entries looked at in a bin before moving to the next size class.
+#define FS_FREE_SCAN 32
+// Releases before fs_allocate merges the free lists again: at least FS_MERGE_MIN, and at least the
+// free extents of the last merge divided by FS_MERGE_RATIO.
+#define FS_MERGE_MIN 64
+#define FS_MERGE_RATIO 8
+
+typedef struct FreeExtent {
+    long size;
+    long next;    // Offset of the next free extent in the same bin, 0 = end of list
+} FreeExtent;
+
+typedef struct FreeSpaceStats {
+    long free_bytes;
+    long free_extents;
+    long largest_extent;
+    long free_pages;                 // Released index pages
+    long used_bytes;                 // Allocated space past the header (live data and nodes)
+    long bin_extents[FS_FREE_BINS];
+    long bin_bytes[FS_FREE_BINS];
+} FreeSpaceStats;
+
+// Reserve `size` bytes of image space. Returns the offset (aligned on FS_ALLOC_ALIGN).
+long fs_allocate(FSContext *ctx, long size);
+
+// Space fs_allocate reserves for a `size` byte request. Consecutive extents of these sizes carved
+// out of one allocation can each be given back on their own with fs_release.
+long fs_extent_size(FSContext *ctx, long size);
+
+// Give back an extent obtained from fs_allocate (same size as requested).
+void fs_release(FSContext *ctx, long offset, long size);
+
+// Reserve / give back one index page (FS_PAGE_SIZE bytes, page-aligned).
+long fs_allocate_page(FSContext *ctx);
+void fs_release_page(FSContext *ctx, long offset);
+
+// Joins adjacent free extents and gives a free extent at the end of the used space back to
+// next_free_page_offset. Returns 0 on success.
+int fs_merge_free_space(FSContext *ctx);
+
+// Walks the free lists. Returns 0 on success.
+int get_free_space_stats(FSContext *ctx, FreeSpaceStats *stats);
+
+// External fragmentation in percent: share of the free space outside the largest free extent.
+double fragmentation_percent(const FreeSpaceStats *stats);
+
+#endif // ALLOCATOR_H
@@ -0,0 +1,570 @@
+#include "batch.h"
+#include "allocator.h"
+#include "index.h"
+#include "btree.h"
+#include "codec.h"
+#include "stream.h"
+#include "dict.h"
+#include "snapshot.h"
+#include "hash_table.h"
+#include "directory.h"
+#include "dedup.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// Files a compression thread claims at a time (small files: keeps the lock out of the way).
+#define BATCH_CLAIM 8
+
+typedef struct BatchItem {
+    BatchEntry *entry;
+    char name[MAX_NAME_LEN];
+    size_t index;               // Position in the caller's array: the first of equal names wins
+    int large;                  // Over FS_STREAM_BLOCK: stored in blocks by add_file afterwards
+    int codec;                  // -1 = could not be encoded
+    unsigned char *encoded;     // NULL: the payload is entry->data itself (stored)
+    size_t payload_size;
+    long offset;
+    // Dedup (dedup.h): the payload is in the image already (shared), or is the one of an earlier
+    // item with the same bytes (twin), written by the first accepted item of the group (writer)
+    int dedup;
+    DedupHash hash;
+    int shared;
+    struct BatchItem *twin;
+    struct BatchItem *writer;
+} BatchItem;
+
+typedef struct CompressPool {
+    BatchItem *items;
+    size_t count;
+    size_t next;                // First item nobody has claimed yet
+    FSContext *ctx;             // Read only while compressing (shared code tables)
+    int legacy;                 // Version 1 image: legacy Huffman streams only
+    pthread_mutex_t lock;
+} CompressPool;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Same codec choice as add_file.
+static void encode_item(FSContext *ctx, BatchItem *item, int legacy) {
+    const BatchEntry *e = item->entry;
+    if (item->shared || item->twin) return; // Nothing to encode (dedup.h)
+    item->payload_size = e->size;
+    if (item->large) {
+        item->codec = CODEC_BLOCKS;
+    } else if (legacy) {
+        item->codec = CODEC_HUFFMAN_LEGACY;
+        item->encoded = codec_compress(item->codec, e->data, e->size, &item->payload_size);
+        if (!item->encoded) item->codec = -1;
+    } else {
+        item->codec = dict_encode(ctx, CODEC_AUTO, e->data, e->size, &item->encoded, &item->payload_size);
+    }
+}
+
+static void* compress_worker(void *arg) {
+    CompressPool *pool = arg;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t from = pool->next;
+        pool->next += BATCH_CLAIM;
+        pthread_mutex_unlock(&pool->lock);
+        if (from >= pool->count) break;
+
+        size_t to = from + BATCH_CLAIM < pool->count ? from + BATCH_CLAIM : pool->count;
+        for (size_t i = from; i < to; i++) encode_item(pool->ctx, &pool->items[i], pool->legacy);
+    }
+    return NULL;
+}
+
+// The codecs keep no shared state and the image is only read (its shared code tables): items are
+// encoded independently, the calling thread included.
+static void compress_all(FSContext *ctx, BatchItem *items, size_t n, int legacy) {
+    CompressPool pool;
+    pool.ctx = ctx;
+    pool.items = items;
+    pool.count = n;
+    pool.next = 0;
+    pool.legacy = legacy;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads = cpus < 1 ? 1 : (size_t)cpus;
+    if (threads > BATCH_MAX_THREADS) threads = BATCH_MAX_THREADS;
+    if (threads > (n + BATCH_CLAIM - 1) / BATCH_CLAIM) threads = (n + BATCH_CLAIM - 1) / BATCH_CLAIM;
+
+    pthread_t workers[BATCH_MAX_THREADS];
+    size_t started = 0;
+    while (started + 1 < threads && pthread_create(&workers[started], NULL, compress_worker, &pool) == 0) {
+        started++;
+    }
+    compress_worker(&pool);
+    for (size_t i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+}
+
+static int compare_items(const void *a, const void *b) {
+    const BatchItem *x = *(BatchItem * const *)a, *y = *(BatchItem * const *)b;
+    int cmp = strcmp(x->name, y->name);
+    if (cmp != 0) return cmp;
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+// Images with directories: path order, each directory's entries together (directory.h).
+static int compare_item_paths(const void *a, const void *b) {
+    const BatchItem *x = *(BatchItem * const *)a, *y = *(BatchItem * const *)b;
+    int cmp = dir_compare_paths(x->name, y->name);
+    if (cmp != 0) return cmp;
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+static void fill_inode(Inode *inode, const BatchItem *item) {
+    memset(inode, 0, sizeof(Inode));
+    inode->type = FILE_NODE;
+    inode->codec = item->codec;
+    memcpy(inode->name, item->name, MAX_NAME_LEN);
+    inode->original_size = item->entry->size;
+    inode->compressed_size = item->payload_size;
+    inode->data_offset = item->offset;
+    inode->parent_offset = -1;
+    inode->children_offset = -1;
+}
+
+// Accepted, and written with the batch (not a large file).
+static int in_batch(const BatchItem *item) {
+    return item->entry->result == 0 && !item->large;
+}
+
+// Its payload is written by the batch (not shared with the image or another item).
+static int writes_payload(const BatchItem *item) {
+    return in_batch(item) && !item->shared && !item->twin;
+}
+
+// Hashes the files stored in one piece and looks them up, in the image first, then among the
+// earlier items (open addressing on the hash, bytes compared). Only the others are encoded.
+static int find_duplicates(FSContext *ctx, BatchItem *items, size_t n) {
+    size_t slots = 16;
+    while (slots < n * 2) slots *= 2;
+    BatchItem **seen = calloc(slots, sizeof(BatchItem *));
+    if (!seen) return -1;
+    for (size_t i = 0; i < n; i++) {
+        BatchItem *item = &items[i];
+        const BatchEntry *e = item->entry;
+        if (item->large || e->size == 0) continue;
+        item->dedup = 1;
+        item->hash = dedup_hash(e->data, e->size);
+        DedupRecord hit;
+        int res = dedup_lookup(ctx, &item->hash, e->data, (long)e->size, &hit);
+        if (res == 0) {
+            item->shared = 1;
+            item->codec = hit.codec;
+            item->payload_size = hit.compressed_size;
+            item->offset = hit.data_offset;
+            continue;
+        }
+        size_t j = item->hash.lo & (slots - 1);
+        for (; seen[j]; j = (j + 1) & (slots - 1)) {
+            const BatchItem *other = seen[j];
+            if (other->hash.lo == item->hash.lo && other->hash.hi == item->hash.hi && other->entry->size == e->size) break;
+        }
+        if (res == 2 || (seen[j] && memcmp(seen[j]->entry->data, e->data, e->size) != 0)) {
+            // Other bytes with the same hash: the index keeps the first, this payload is not shared
+            item->dedup = 0;
+        } else if (seen[j]) {
+            item->twin = seen[j];
+        } else {
+            seen[j] = item;
+        }
+    }
+    free(seen);
+    return 0;
+}
+
+// Once the names are checked: the first accepted item of each group writes its payload (taking
+// over the encoding of the first item if that one was turned down).
+static void pick_writers(BatchItem *items, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        BatchItem *item = &items[i];
+        if (item->twin || item->shared || !in_batch(item)) continue;
+        item->writer = item;
+    }
+    for (size_t i = 0; i < n; i++) {
+        BatchItem *item = &items[i];
+        BatchItem *first = item->twin;
+        if (!first || !in_batch(item) || first->writer) continue;
+        first->writer = item;
+        item->encoded = first->encoded;
+        first->encoded = NULL;
+        item->twin = NULL;
+    }
+}
+
+// Records the payloads written by the batch, then the references of the files sharing one
+// (before the index has them: a file in the index never counts for less than it is).
+static int add_references(FSContext *ctx, BatchItem *items, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        BatchItem *item = &items[i];
+        if (!item->dedup || !writes_payload(item)) continue;
+        Inode inode;
+        fill_inode(&inode, item);
+        if (dedup_insert(ctx, &item->hash, &inode) != 0) return -1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        BatchItem *item = &items[i];
+        if (!in_batch(item) || !(item->shared || item->twin)) continue;
+        if (item->twin) item->offset = item->twin->writer->offset;
+        DedupRecord r;
+        memset(&r, 0, sizeof(DedupRecord));
+        r.data_offset = item->offset;
+        r.compressed_size = (long)item->payload_size;
+        if (dedup_ref(ctx, &r) != 0) return -1;
+        item->entry->stored_size = 0;
+        item->entry->deduplicated = 1;
+    }
+    return 0;
+}
+
+// Payloads of the accepted items (sorted by name), back to back, in a single write.
+static int write_payloads(FSContext *ctx, BatchItem **sorted, size_t n) {
+    long total = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (writes_payload(sorted[i])) total += fs_extent_size(ctx, sorted[i]->payload_size);
+    }
+    if (total == 0) return 0;
+
+    unsigned char *buf = calloc(total, 1); // Zeroed padding between extents
+    if (!buf) return -1;
+    long base = fs_allocate(ctx, total);
+    long pos = 0;
+    for (size_t i = 0; i < n; i++) {
+        BatchItem *item = sorted[i];
+        if (!writes_payload(item)) continue;
+        item->offset = base + pos;
+        memcpy(buf + pos, item->encoded ? item->encoded : item->entry->data, item->payload_size);
+        pos += fs_extent_size(ctx, item->payload_size);
+    }
+    int res = cache_write(&ctx->cache, base, buf, total);
+    free(buf);
+    return res;
+}
+
+static int hash_name(FSContext *ctx, const Inode *inode, void *arg) {
+    return ht_insert(ctx, inode);
+}
+
+// Empty B+tree: build it bottom-up rather than by inserts (one tree per directory with directories).
+static int build_index(FSContext *ctx, BatchItem **sorted, size_t n) {
+    if (snapshot_invalidate(ctx) != 0) return -1;
+    int dirs = dir_enabled(ctx);
+    BTBuilder builder;
+    DirBuilder dir_builder;
+    if ((dirs ? dir_build_begin(&dir_builder, ctx) : bt_build_begin(&builder, ctx)) != 0) {
+        if (dirs) dir_build_finish(&dir_builder);
+        return -1;
+    }
+    int res = 0;
+    for (size_t i = 0; i < n && res == 0; i++) {
+        if (!in_batch(sorted[i])) continue;
+        Inode inode;
+        fill_inode(&inode, sorted[i]);
+        res = dirs ? dir_build_add(&dir_builder, &inode) : bt_build_add(&builder, &inode);
+    }
+    long root = dirs ? dir_build_finish(&dir_builder) : bt_build_finish(&builder);
+    if (res != 0 || root == -2) return -1;
+    ctx->sb.root_inode_offset = root;
+
+    // The hash index an empty index gets with its first name (index_insert), sized for the batch.
+    // The index holds the batch alone, directories included. Copy-on-write images have none (cow.h).
+    if (ctx->cow || (ctx->sb.version >= 2 && ctx->sb.hash_offset == 0 && ht_create(ctx, (long)n) != 0)) return 0;
+    if (index_for_each(ctx, hash_name, NULL) != 0) ht_drop(ctx);
+    return 0;
+}
+
+static int insert_index(FSContext *ctx, BatchItem **sorted, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        BatchItem *item = sorted[i];
+        if (!in_batch(item)) continue;
+        Inode inode;
+        fill_inode(&inode, item);
+        if (index_insert(ctx, &inode) != 0) {
+            item->entry->result = -1;
+            dedup_release(ctx, item->offset, item->payload_size);
+        }
+    }
+    return 0;
+}
+
+long add_files_batch(FSContext *ctx, BatchEntry *entries, size_t n) {
+    if (n == 0) return 0;
+    BatchItem *items = calloc(n, sizeof(BatchItem));
+    BatchItem **sorted = malloc(n * sizeof(BatchItem *));
+    if (!items || !sorted) {
+        free(items);
+        free(sorted);
+        return -1;
+    }
+
+    // 1. Compress, in parallel
+    for (size_t i = 0; i < n; i++) {
+        items[i].entry = &entries[i];
+        items[i].index = i;
+        items[i].large = ctx->sb.version >= 2 && entries[i].size > FS_STREAM_BLOCK;
+        strncpy(items[i].name, entries[i].name, MAX_NAME_LEN - 1);
+        entries[i].deduplicated = 0;
+        sorted[i] = &items[i];
+    }
+    if (dedup_enabled(ctx) && find_duplicates(ctx, items, n) != 0) {
+        free(items);
+        free(sorted);
+        return -1;
+    }
+    compress_all(ctx, items, n, ctx->sb.version < 2);
+    for (size_t i = 0; i < n; i++) {
+        if (!items[i].twin) continue;
+        items[i].codec = items[i].twin->codec;
+        items[i].payload_size = items[i].twin->payload_size;
+    }
+
+    // 2. Sort by name and drop the names that cannot be added. With directories, a path below a
+    // file of the batch cannot either (the file comes first in path order).
+    int dirs = dir_enabled(ctx);
+    qsort(sorted, n, sizeof(BatchItem *), dirs ? compare_item_paths : compare_items);
+    const char *last_file = NULL;
+    for (size_t i = 0; i < n; i++) {
+        BatchItem *item = sorted[i];
+        Inode existing;
+        int duplicate = i > 0 && strcmp(item->name, sorted[i - 1]->name) == 0;
+        int below_file = 0;
+        if (dirs && last_file) {
+            size_t len = strlen(last_file);
+            below_file = strncmp(item->name, last_file, len) == 0 && item->name[len] == '/';
+        }
+        int bad_path = dirs && !dir_valid_path(item->name);
+        item->entry->result = item->codec < 0 || item->name[0] == '\0' || duplicate || below_file || bad_path
+            || index_lookup(ctx, item->name, &existing) == 0 ? -1 : 0;
+        if (item->entry->result == 0) last_file = item->name;
+        item->entry->stored_size = item->entry->result == 0 ? item->payload_size : 0;
+    }
+
+    // 3. Payloads in name order, then the index
+    pick_writers(items, n);
+    int res = write_payloads(ctx, sorted, n);
+    if (res == 0) res = add_references(ctx, items, n);
+    if (res == 0) {
+        int empty_btree = ctx->sb.index_type == INDEX_BTREE && ctx->sb.root_inode_offset == BT_NONE;
+        res = empty_btree ? build_index(ctx, sorted, n) : insert_index(ctx, sorted, n);
+    }
+
+    // Large files go in blocks, each on its own
+    for (size_t i = 0; i < n && res == 0; i++) {
+        BatchEntry *e = sorted[i]->entry;
+        if (!sorted[i]->large || e->result != 0) continue;
+        Inode inode;
+        e->stored_size = 0;
+        e->result = add_file(ctx, sorted[i]->name, e->data, e->size) == 0 ? 0 : -1;
+        if (e->result == 0 && index_lookup(ctx, sorted[i]->name, &inode) == 0) e->stored_size = inode.compressed_size;
+    }
+
+    long added = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (entries[i].result == 0) added++;
+        free(items[i].encoded);
+    }
+    free(items);
+    free(sorted);
+
+    // 4. One SuperBlock update for the whole batch (one operation of the commit group)
+    if (res != 0 || sync_superblock(ctx) != 0 || end_operation(ctx) != 0) return -1;
+    return added;
+}
+
+// --- Host directory import ---
+
+typedef struct PathList {
+    char **paths;
+    size_t count;
+    size_t capacity;
+} PathList;
+
+static int path_list_add(PathList *list, const char *path) {
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 256;
+        char **grown = realloc(list->paths, capacity * sizeof(char *));
+        if (!grown) return -1;
+        list->paths = grown;
+        list->capacity = capacity;
+    }
+    list->paths[list->count] = strdup(path);
+    return list->paths[list->count++] ? 0 : -1;
+}
+
+static void path_list_free(PathList *list) {
+    for (size_t i = 0; i < list->count; i++) free(list->paths[i]);
+    free(list->paths);
+}
+
+// Collects the regular files below root/rel (paths relative to root). Symbolic links to files are
+// followed, links to directories are not (no cycles).
+static int collect_files(const char *root, const char *rel, PathList *list, long *skipped) {
+    char dir_path[4096];
+    snprintf(dir_path, sizeof(dir_path), "%s%s%s", root, rel[0] ? "/" : "", rel);
+    DIR *dir = opendir(dir_path);
+    if (!dir) return -1;
+
+    int res = 0;
+    struct dirent *de;
+    while (res == 0 && (de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+        char child[4096], full[8192];
+        snprintf(child, sizeof(child), "%s%s%s", rel, rel[0] ? "/" : "", de->d_name);
+        snprintf(full, sizeof(full), "%s/%s", root, child);
+
+        struct stat st;
+        if (lstat(full, &st) == 0 && S_ISDIR(st.st_mode)) {
+            if (collect_files(root, child, list, skipped) != 0) (*skipped)++;
+        } else if (stat(full, &st) == 0 && S_ISREG(st.st_mode) && strlen(child) < MAX_NAME_LEN) {
+            res = path_list_add(list, child);
+        } else {
+            (*skipped)++; // Special file, dangling link or name too long for an inode
+        }
+    }
+    closedir(dir);
+    return res;
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static unsigned char* read_host_file(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    struct stat st;
+    unsigned char *buf = NULL;
+    if (fstat(fileno(f), &st) == 0) {
+        buf = malloc(st.st_size + 1); // +1: never malloc(0) for empty files
+        if (buf && fread(buf, 1, st.st_size, f) != (size_t)st.st_size) {
+            free(buf);
+            buf = NULL;
+        }
+        *size = st.st_size;
+    }
+    fclose(f);
+    return buf;
+}
+
+// Files over FS_STREAM_BLOCK are streamed on their own instead (never held in memory whole).
+static void import_large_file(FSContext *ctx, const char *name, const char *path, ImportReport *report) {
+    FILE *in = fopen(path, "rb");
+    FSFile *out = in ? fs_open_write(ctx, name) : NULL;
+    int res = out ? 0 : -1;
+    if (out) {
+        unsigned char buf[64 * 1024];
+        size_t n;
+        while (res == 0 && (n = fread(buf, 1, sizeof(buf), in)) > 0) {
+            if (fs_write(out, buf, n) < 0) res = -1;
+        }
+        if (ferror(in)) res = -1;
+        if (fs_close(out) != 0) res = -1;
+    }
+    if (in) fclose(in);
+
+    Inode inode;
+    if (res == 0 && index_lookup(ctx, name, &inode) == 0) {
+        report->files++;
+        report->bytes_in += inode.original_size;
+        report->bytes_stored += inode.compressed_size;
+    } else {
+        report->skipped++;
+    }
+}
+
+static int flush_batch(FSContext *ctx, BatchEntry *batch, size_t n, ImportReport *report) {
+    double start = now_seconds();
+    long added = add_files_batch(ctx, batch, n);
+    double elapsed = now_seconds() - start;
+    long encoded_bytes = 0, deduplicated_bytes = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (batch[i].result == 0) {
+            report->bytes_in += batch[i].size;
+            report->bytes_stored += batch[i].stored_size;
+            if (batch[i].deduplicated) {
+                report->deduplicated++;
+                deduplicated_bytes += batch[i].size;
+            } else {
+                encoded_bytes += batch[i].size;
+            }
+        }
+        free((unsigned char *)batch[i].data);
+    }
+    // At the rate of the files the batch did encode and write
+    report->bytes_deduplicated += deduplicated_bytes;
+    if (encoded_bytes > 0) report->seconds_saved += elapsed * deduplicated_bytes / encoded_bytes;
+    if (added < 0) return -1;
+    report->files += added;
+    report->skipped += n - added;
+    return 0;
+}
+
+int import_directory(FSContext *ctx, const char *dir, ImportReport *report) {
+    memset(report, 0, sizeof(ImportReport));
+    double start = now_seconds();
+
+    // Whole listing first: sorted names make every batch a run of increasing keys
+    PathList list;
+    memset(&list, 0, sizeof(PathList));
+    if (collect_files(dir, "", &list, &report->skipped) != 0) {
+        path_list_free(&list);
+        return -1;
+    }
+    qsort(list.paths, list.count, sizeof(char *), compare_paths);
+
+    BatchEntry *batch = malloc(BATCH_MAX_FILES * sizeof(BatchEntry));
+    if (!batch) {
+        path_list_free(&list);
+        return -1;
+    }
+    size_t n = 0;
+    long batch_bytes = 0;
+    int res = 0;
+    for (size_t i = 0; i < list.count && res == 0; i++) {
+        char full[8192];
+        snprintf(full, sizeof(full), "%s/%s", dir, list.paths[i]);
+        struct stat st;
+        if (stat(full, &st) == 0 && st.st_size > FS_STREAM_BLOCK) {
+            import_large_file(ctx, list.paths[i], full, report);
+            continue;
+        }
+        size_t size = 0;
+        unsigned char *data = read_host_file(full, &size);
+        if (!data) {
+            report->skipped++;
+            continue;
+        }
+
+        memset(&batch[n], 0, sizeof(BatchEntry));
+        batch[n].name = list.paths[i];
+        batch[n].data = data;
+        batch[n].size = size;
+        n++;
+        batch_bytes += size;
+        if (n == BATCH_MAX_FILES || batch_bytes >= BATCH_MAX_BYTES) {
+            res = flush_batch(ctx, batch, n, report);
+            n = 0;
+            batch_bytes = 0;
+        }
+    }
+    if (res == 0 && n > 0) res = flush_batch(ctx, batch, n, report);
+
+    free(batch);
+    path_list_free(&list);
+    report->seconds = now_seconds() - start;
+    return res;
+}
@@ -0,0 +1,52 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "fs_core.h"
+
+// Batch ingestion of many files in one pass.
+// Files are compressed on a pool of threads (one per CPU, at most BATCH_MAX_THREADS), their
+// payloads laid out back to back in name order and written with one sequential write, then their
+// names inserted into the index in increasing order (bulk-built when the image is empty, one
+// tree per directory in images with directories: directory.h).
+// The SuperBlock is written once per batch instead of once per file.
+//
+// Each payload still gets its own extent: the files of a batch can be deleted one by one later.
+// With dedup (dedup.h), files whose bytes the image or an earlier file of the batch already has
+// share that payload instead: they are not compressed.
+// Files larger than FS_STREAM_BLOCK are stored in blocks (stream.h) by add_file, one at a time;
+// import_directory streams them from the host file instead of reading them whole.
+
+#define BATCH_MAX_THREADS 16
+// import_directory hands the files to add_files_batch in groups of at most this many files / bytes.
+#define BATCH_MAX_FILES 4096
+#define BATCH_MAX_BYTES (64L * 1024 * 1024)
+
+typedef struct BatchEntry {
+    const char *name;               // Name in the image (truncated to MAX_NAME_LEN - 1 like add_file)
+    const unsigned char *data;
+    size_t size;
+    int result;                     // Out: 0 if added, -1 if the name exists (in the image or earlier
+                                    // in the batch) or the file could not be encoded
+    size_t stored_size;             // Out: payload bytes in the image (0 when deduplicated)
+    int deduplicated;               // Out: 1 if it shares a payload the image or the batch already had (dedup.h)
+} BatchEntry;
+
+// Adds n files. Returns the number of files added, or -1 on I/O error.
+long add_files_batch(FSContext *ctx, BatchEntry *entries, size_t n);
+
+typedef struct ImportReport {
+    long files;         // Added
+    long skipped;       // Names too long, unreadable files, names already present
+    long bytes_in;      // Original size of the added files
+    long bytes_stored;  // Their payloads in the image
+    long deduplicated;  // Files that share a payload stored before them (dedup.h)
+    long bytes_deduplicated;    // Their original size: neither compressed nor written
+    double seconds_saved;       // Estimated: what those bytes cost at the rate of the other files
+    double seconds;     // Wall time
+} ImportReport;
+
+// Adds every regular file below host directory `dir`, named by its path relative to `dir`
+// ("docs/notes.txt"). Returns 0 on success, -1 if the directory cannot be read or on I/O error.
+int import_directory(FSContext *ctx, const char *dir, ImportReport *report);
+
+#endif // BATCH_H
@@ -0,0 +1,1272 @@
+#include "bench.h"
+#include "huffman.h"
+#include "histogram.h"
+#include "fs_core.h"
+#include "batch.h"
+#include "index.h"
+#include "snapshot.h"
+#include "hash_table.h"
+#include "btree.h"
+#include "red_black_tree.h"
+#include "directory.h"
+#include "journal.h"
+#include "cow.h"
+#include "reader.h"
+#include "dedup.h"
+#include <pthread.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define BENCH_INPUT_SIZE (4 * 1024 * 1024)
+#define BENCH_REPEAT 3
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned int bench_rand_state = 12345;
+
+static unsigned int bench_rand(void) {
+    // xorshift32: deterministic inputs from one run to the next
+    unsigned int x = bench_rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    bench_rand_state = x;
+    return x;
+}
+
+// English-like text: words from a small vocabulary, skewed towards the first ones.
+static void fill_text(unsigned char *buf, size_t size) {
+    static const char *words[] = {
+        "the", "file", "system", "data", "of", "and", "a", "to", "node", "tree",
+        "compression", "huffman", "offset", "block", "read", "write", "inode", "directory",
+        "superblock", "page", "cache", "value", "error", "log", "request", "user"
+    };
+    const int nwords = sizeof(words) / sizeof(words[0]);
+    size_t pos = 0;
+    while (pos < size) {
+        unsigned int r = bench_rand();
+        const char *w = words[(r % nwords) * (r % nwords) / nwords];
+        for (size_t i = 0; w[i] && pos < size; i++) buf[pos++] = (unsigned char)w[i];
+        if (pos < size) buf[pos++] = (r & 0xF000) == 0 ? '\n' : ' ';
+    }
+}
+
+// Binary-like data: fixed-size records with small integers, flags and padding.
+static void fill_binary(unsigned char *buf, size_t size) {
+    for (size_t pos = 0; pos < size; pos++) {
+        unsigned int r = bench_rand();
+        switch (pos % 16) {
+            case 0: case 1: buf[pos] = (unsigned char)(r % 200); break;
+            case 2: buf[pos] = (unsigned char)(pos >> 4); break;
+            case 3: buf[pos] = (unsigned char)(r & 0x3); break;
+            case 8: buf[pos] = (unsigned char)r; break;
+            default: buf[pos] = 0; break;
+        }
+    }
+}
+
+static void fill_random(unsigned char *buf, size_t size) {
+    for (size_t pos = 0; pos < size; pos++) buf[pos] = (unsigned char)bench_rand();
+}
+
+// Log-file padding, sparse images: one value throughout.
+static void fill_constant(unsigned char *buf, size_t size) {
+    memset(buf, ' ', size);
+}
+
+static const struct {
+    const char *name;
+    void (*fill)(unsigned char *, size_t);
+} inputs[] = {
+    { "text", fill_text },
+    { "binary", fill_binary },
+    { "random", fill_random },
+};
+
+typedef unsigned char* (*DecodeFn)(const unsigned char *, size_t, size_t);
+
+// Best-of-N throughput of a decoder, in MB/s of decompressed output.
+static double time_decoder(DecodeFn decode, const unsigned char *comp, size_t comp_size,
+                           const unsigned char *expected, size_t size, int *mismatch) {
+    double best = 0;
+    for (int r = 0; r < BENCH_REPEAT; r++) {
+        double start = now_seconds();
+        unsigned char *out = decode(comp, comp_size, size);
+        double elapsed = now_seconds() - start;
+        if (!out || memcmp(out, expected, size) != 0) *mismatch = 1;
+        free(out);
+        if (best == 0 || elapsed < best) best = elapsed;
+    }
+    return best > 0 ? (size / (1024.0 * 1024.0)) / best : 0;
+}
+
+static int bench_huffman_decode(void) {
+    int failed = 0;
+
+    printf("Huffman decode (%d MB input, best of %d)\n", BENCH_INPUT_SIZE / (1024 * 1024), BENCH_REPEAT);
+    printf("v1 = legacy frequency-table streams, v2 = canonical streams\n");
+    printf("%-8s %9s %9s %14s %14s %14s\n", "input", "v1 ratio", "v2 ratio",
+           "v1 bitwise", "v1 table", "v2 table");
+
+    unsigned char *data = malloc(BENCH_INPUT_SIZE);
+    for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+        inputs[i].fill(data, BENCH_INPUT_SIZE);
+
+        size_t legacy_size = 0, comp_size = 0;
+        unsigned char *legacy = compress_data_legacy(data, BENCH_INPUT_SIZE, &legacy_size);
+        unsigned char *comp = compress_data(data, BENCH_INPUT_SIZE, &comp_size);
+        int mismatch = 0;
+        double bitwise = time_decoder(decompress_data_bitwise, legacy, legacy_size, data, BENCH_INPUT_SIZE, &mismatch);
+        double table_v1 = time_decoder(decompress_data_legacy, legacy, legacy_size, data, BENCH_INPUT_SIZE, &mismatch);
+        double table_v2 = time_decoder(decompress_data, comp, comp_size, data, BENCH_INPUT_SIZE, &mismatch);
+
+        printf("%-8s %8.1f%% %8.1f%% %9.1f MB/s %9.1f MB/s %9.1f MB/s%s\n", inputs[i].name,
+               100.0 * legacy_size / BENCH_INPUT_SIZE, 100.0 * comp_size / BENCH_INPUT_SIZE,
+               bitwise, table_v1, table_v2, mismatch ? "  MISMATCH" : "");
+        if (mismatch) failed = 1;
+        free(legacy);
+        free(comp);
+    }
+    free(data);
+    return failed;
+}
+
+#define HISTOGRAM_INPUT_SIZE (16 * 1024 * 1024)
+
+static int bench_histogram(void) {
+    static const struct {
+        const char *name;
+        void (*fill)(unsigned char *, size_t);
+    } histogram_inputs[] = {
+        { "uniform", fill_random },
+        { "text", fill_text },
+        { "binary", fill_binary },
+        { "constant", fill_constant },
+    };
+    static const int kernels[] = { HISTOGRAM_NAIVE, HISTOGRAM_SCALAR, HISTOGRAM_AVX2 };
+    const int nkernels = sizeof(kernels) / sizeof(kernels[0]);
+    int failed = 0;
+
+    printf("Byte histogram (%d MB input, best of %d, auto = %s)\n", HISTOGRAM_INPUT_SIZE / (1024 * 1024), BENCH_REPEAT,
+           histogram_kernel_name(histogram_kernel_available(HISTOGRAM_AVX2) ? HISTOGRAM_AVX2 : HISTOGRAM_SCALAR));
+    printf("%-9s", "input");
+    for (int k = 0; k < nkernels; k++) printf(" %14s", histogram_kernel_name(kernels[k]));
+    printf("\n");
+
+    unsigned char *data = malloc(HISTOGRAM_INPUT_SIZE);
+    for (size_t i = 0; i < sizeof(histogram_inputs) / sizeof(histogram_inputs[0]); i++) {
+        histogram_inputs[i].fill(data, HISTOGRAM_INPUT_SIZE);
+        unsigned int expected[HISTOGRAM_SYMBOLS];
+        byte_histogram_kernel(HISTOGRAM_NAIVE, data, HISTOGRAM_INPUT_SIZE, expected);
+
+        printf("%-9s", histogram_inputs[i].name);
+        for (int k = 0; k < nkernels; k++) {
+            if (!histogram_kernel_available(kernels[k])) {
+                printf(" %14s", "n/a");
+                continue;
+            }
+            unsigned int freq[HISTOGRAM_SYMBOLS];
+            double best = 0;
+            for (int r = 0; r < BENCH_REPEAT; r++) {
+                double start = now_seconds();
+                byte_histogram_kernel(kernels[k], data, HISTOGRAM_INPUT_SIZE, freq);
+                double elapsed = now_seconds() - start;
+                if (memcmp(freq, expected, sizeof(freq)) != 0) failed = 1;
+                if (best == 0 || elapsed < best) best = elapsed;
+            }
+            printf(" %9.0f MB/s", HISTOGRAM_INPUT_SIZE / (1024.0 * 1024.0) / best);
+        }
+        printf("%s\n", failed ? "  MISMATCH" : "");
+    }
+    free(data);
+    return failed;
+}
+
+// Best-of-N single-thread throughput of an encoder, in MB/s of input. Checks the output decodes back.
+static double time_encoder(int format, const unsigned char *data, size_t size, size_t *comp_size, int *mismatch) {
+    double best = 0;
+    for (int r = 0; r < BENCH_REPEAT; r++) {
+        double start = now_seconds();
+        unsigned char *comp = format == 1 ? compress_data_legacy(data, size, comp_size)
+                            : format == 2 ? compress_data_mt(data, size, comp_size, 1)
+                            : compress_data_x4(data, size, comp_size);
+        double elapsed = now_seconds() - start;
+        unsigned char *out = !comp ? NULL : format == 1 ? decompress_data_legacy(comp, *comp_size, size)
+                                                        : decompress_data_mt(comp, *comp_size, size, 1);
+        if (!out || memcmp(out, data, size) != 0) *mismatch = 1;
+        free(out);
+        free(comp);
+        if (best == 0 || elapsed < best) best = elapsed;
+    }
+    return best > 0 ? (size / (1024.0 * 1024.0)) / best : 0;
+}
+
+static int bench_huffman_encode(void) {
+    int failed = 0;
+    printf("Huffman encode on one core (%d MB input, best of %d, histogram and code included)\n",
+           BENCH_INPUT_SIZE / (1024 * 1024), BENCH_REPEAT);
+    printf("%-8s %14s %14s %14s\n", "input", "v1 legacy", "v2 canonical", "4 streams");
+
+    unsigned char *data = malloc(BENCH_INPUT_SIZE);
+    for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+        inputs[i].fill(data, BENCH_INPUT_SIZE);
+        size_t comp_size = 0;
+        int mismatch = 0;
+        double v1 = time_encoder(1, data, BENCH_INPUT_SIZE, &comp_size, &mismatch);
+        double v2 = time_encoder(2, data, BENCH_INPUT_SIZE, &comp_size, &mismatch);
+        double x4 = time_encoder(4, data, BENCH_INPUT_SIZE, &comp_size, &mismatch);
+        printf("%-8s %9.1f MB/s %9.1f MB/s %9.1f MB/s%s\n", inputs[i].name, v1, v2, x4, mismatch ? "  MISMATCH" : "");
+        if (mismatch) failed = 1;
+    }
+    free(data);
+    return failed;
+}
+
+// Both decoders on the calling thread only: the single-stream format is segmented at this size.
+static unsigned char* decompress_one_thread(const unsigned char *comp, size_t comp_size, size_t size) {
+    return decompress_data_mt(comp, comp_size, size, 1);
+}
+
+static int bench_huffman_interleaved(void) {
+    int failed = 0;
+
+    printf("Huffman decode on one core, 1 stream vs 4 interleaved streams (%d MB input, best of %d)\n",
+           BENCH_INPUT_SIZE / (1024 * 1024), BENCH_REPEAT);
+    printf("%-8s %9s %9s %14s %14s %9s\n", "input", "1x ratio", "4x ratio", "1 stream", "4 streams", "speedup");
+
+    unsigned char *data = malloc(BENCH_INPUT_SIZE);
+    for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+        inputs[i].fill(data, BENCH_INPUT_SIZE);
+
+        size_t single_size = 0, x4_size = 0;
+        unsigned char *single = compress_data_mt(data, BENCH_INPUT_SIZE, &single_size, 1);
+        unsigned char *x4 = compress_data_x4(data, BENCH_INPUT_SIZE, &x4_size);
+        int mismatch = 0;
+        double one = time_decoder(decompress_one_thread, single, single_size, data, BENCH_INPUT_SIZE, &mismatch);
+        double four = time_decoder(decompress_one_thread, x4, x4_size, data, BENCH_INPUT_SIZE, &mismatch);
+
+        printf("%-8s %8.1f%% %8.1f%% %9.1f MB/s %9.1f MB/s %8.2fx%s\n", inputs[i].name,
+               100.0 * single_size / BENCH_INPUT_SIZE, 100.0 * x4_size / BENCH_INPUT_SIZE,
+               one, four, one > 0 ? four / one : 0, mismatch ? "  MISMATCH" : "");
+        if (mismatch) failed = 1;
+        free(single);
+        free(x4);
+    }
+    free(data);
+    return failed;
+}
+
+#define SCALING_INPUT_SIZE (128 * 1024 * 1024)
+
+static int bench_huffman_scaling(void) {
+    static const int thread_counts[] = { 1, 2, 4, 8 };
+    unsigned char *data = malloc(SCALING_INPUT_SIZE);
+    if (!data) return 1;
+    fill_text(data, SCALING_INPUT_SIZE);
+
+    printf("Segmented Huffman (%d MB of text, %d KB segments, %ld CPUs online, best of %d)\n",
+           SCALING_INPUT_SIZE / (1024 * 1024), HUFFMAN_SEGMENT_SIZE / 1024, sysconf(_SC_NPROCESSORS_ONLN), BENCH_REPEAT);
+    printf("%-8s %14s %9s %14s %9s\n", "threads", "compress", "speedup", "decompress", "speedup");
+
+    int failed = 0;
+    double base_comp = 0, base_decomp = 0;
+    for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]); t++) {
+        double best_comp = 0, best_decomp = 0;
+        for (int r = 0; r < BENCH_REPEAT; r++) {
+            size_t comp_size = 0;
+            double start = now_seconds();
+            unsigned char *comp = compress_data_mt(data, SCALING_INPUT_SIZE, &comp_size, thread_counts[t]);
+            double comp_time = now_seconds() - start;
+
+            start = now_seconds();
+            unsigned char *out = comp ? decompress_data_mt(comp, comp_size, SCALING_INPUT_SIZE, thread_counts[t]) : NULL;
+            double decomp_time = now_seconds() - start;
+            if (!out || memcmp(out, data, SCALING_INPUT_SIZE) != 0) failed = 1;
+            free(out);
+            free(comp);
+
+            if (best_comp == 0 || comp_time < best_comp) best_comp = comp_time;
+            if (best_decomp == 0 || decomp_time < best_decomp) best_decomp = decomp_time;
+        }
+        double comp_mbs = SCALING_INPUT_SIZE / (1024.0 * 1024.0) / best_comp;
+        double decomp_mbs = SCALING_INPUT_SIZE / (1024.0 * 1024.0) / best_decomp;
+        if (t == 0) {
+            base_comp = comp_mbs;
+            base_decomp = decomp_mbs;
+        }
+        printf("%-8d %9.1f MB/s %8.2fx %9.1f MB/s %8.2fx%s\n", thread_counts[t], comp_mbs, comp_mbs / base_comp,
+               decomp_mbs, decomp_mbs / base_decomp, failed ? "  MISMATCH" : "");
+    }
+    free(data);
+    return failed;
+}
+
+#define INGEST_FILES 20000
+
+// Every file read back and compared, in a fresh context.
+static int check_ingested(const char *image, BatchEntry *entries, size_t n) {
+    FSContext ctx;
+    if (load_filesystem(image, &ctx) != 0) return 1;
+    int failed = 0;
+    for (size_t i = 0; i < n && !failed; i++) {
+        size_t size = 0;
+        unsigned char *content = get_file_content(&ctx, entries[i].name, &size);
+        failed = !content || size != entries[i].size || memcmp(content, entries[i].data, size) != 0;
+        free(content);
+    }
+    close_filesystem(&ctx);
+    return failed;
+}
+
+static long image_size(const char *image) {
+    FILE *f = fopen(image, "rb");
+    if (!f) return -1;
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    return size;
+}
+
+static int bench_ingest(void) {
+    char image[64];
+    snprintf(image, sizeof(image), "/tmp/fs_bench_%d.bin", (int)getpid());
+
+    // Small text files of 200 bytes to 4 KB, added in random name order
+    BatchEntry *entries = calloc(INGEST_FILES, sizeof(BatchEntry));
+    char (*names)[MAX_NAME_LEN] = malloc(INGEST_FILES * sizeof(*names));
+    for (size_t i = 0; i < INGEST_FILES; i++) {
+        unsigned int r = bench_rand();
+        snprintf(names[i], MAX_NAME_LEN, "logs/%02u/entry_%08u.txt", r % 64, r);
+        size_t size = 200 + bench_rand() % 3900;
+        unsigned char *data = malloc(size);
+        fill_text(data, size);
+        entries[i].name = names[i];
+        entries[i].data = data;
+        entries[i].size = size;
+    }
+
+    printf("Ingest of %d small files (200 B - 4 KB of text) into a new image\n", INGEST_FILES);
+    printf("%-22s %10s %12s %12s\n", "method", "time", "files/s", "image");
+    int failed = 0;
+
+    // add_file one at a time (one context: what addfile does per file, minus load/close)
+    FSContext ctx;
+    init_filesystem(image);
+    double start = now_seconds();
+    if (load_filesystem(image, &ctx) != 0) failed = 1;
+    for (size_t i = 0; i < INGEST_FILES && !failed; i++) {
+        if (add_file(&ctx, entries[i].name, entries[i].data, entries[i].size) != 0) entries[i].result = -1;
+    }
+    if (!failed) close_filesystem(&ctx);
+    double single = now_seconds() - start;
+    printf("%-22s %8.3f s %12.0f %10ld B\n", "add_file", single, INGEST_FILES / single, image_size(image));
+    if (!failed) failed = check_ingested(image, entries, INGEST_FILES);
+
+    // add_files_batch in groups of BATCH_MAX_FILES, like import
+    init_filesystem(image);
+    start = now_seconds();
+    if (load_filesystem(image, &ctx) != 0) failed = 1;
+    for (size_t i = 0; i < INGEST_FILES && !failed; i += BATCH_MAX_FILES) {
+        size_t n = INGEST_FILES - i < BATCH_MAX_FILES ? INGEST_FILES - i : BATCH_MAX_FILES;
+        if (add_files_batch(&ctx, &entries[i], n) < 0) failed = 1;
+    }
+    if (!failed) close_filesystem(&ctx);
+    double batch = now_seconds() - start;
+    printf("%-22s %8.3f s %12.0f %10ld B\n", "add_files_batch", batch, INGEST_FILES / batch, image_size(image));
+    if (!failed) failed = check_ingested(image, entries, INGEST_FILES);
+    printf("speedup x%.1f%s\n", single / batch, failed ? "  MISMATCH" : "");
+
+    unlink(image);
+    for (size_t i = 0; i < INGEST_FILES; i++) free((unsigned char *)entries[i].data);
+    free(entries);
+    free(names);
+    return failed;
+}
+
+#define DEDUP_FILES 20000
+#define DEDUP_DISTINCT 2000         // Contents the files are drawn from
+
+// Ingest of files that repeat (vendored assets, configs): add_file with and without dedup.
+static int bench_dedup(void) {
+    char image[64];
+    snprintf(image, sizeof(image), "/tmp/fs_bench_%d.bin", (int)getpid());
+
+    unsigned char **contents = malloc(DEDUP_DISTINCT * sizeof(unsigned char *));
+    size_t *sizes = malloc(DEDUP_DISTINCT * sizeof(size_t));
+    for (size_t i = 0; i < DEDUP_DISTINCT; i++) {
+        sizes[i] = 1024 + bench_rand() % 31744;
+        contents[i] = malloc(sizes[i]);
+        fill_text(contents[i], sizes[i]);
+    }
+    BatchEntry *entries = calloc(DEDUP_FILES, sizeof(BatchEntry));
+    char (*names)[MAX_NAME_LEN] = malloc(DEDUP_FILES * sizeof(*names));
+    for (size_t i = 0; i < DEDUP_FILES; i++) {
+        unsigned int r = bench_rand();
+        snprintf(names[i], MAX_NAME_LEN, "vendor/%02u/asset_%08u.txt", r % 64, r);
+        size_t k = bench_rand() % DEDUP_DISTINCT;
+        entries[i].name = names[i];
+        entries[i].data = contents[k];
+        entries[i].size = sizes[k];
+    }
+
+    printf("add_file of %d files (1 - 32 KB of text) drawn from %d distinct contents\n", DEDUP_FILES, DEDUP_DISTINCT);
+    printf("%-12s %10s %12s %12s %8s\n", "dedup", "time", "files/s", "image", "ratio");
+    int failed = 0;
+    double base = 0;
+    for (int on = 0; on < 2; on++) {
+        FSContext ctx;
+        init_filesystem(image);
+        double start = now_seconds();
+        int res = load_filesystem(image, &ctx);
+        if (res == 0 && on) res = dedup_create(&ctx);
+        for (size_t i = 0; i < DEDUP_FILES && res == 0; i++) {
+            res = add_file(&ctx, entries[i].name, entries[i].data, entries[i].size);
+        }
+        DedupHeader h;
+        double ratio = on && dedup_stats(&ctx, &h) == 0 && h.count ? (double)h.references / h.count : 1.0;
+        if (res == 0) close_filesystem(&ctx);
+        double t = now_seconds() - start;
+        int mismatch = res != 0 || check_ingested(image, entries, DEDUP_FILES);
+        if (mismatch) failed = 1;
+        if (!on) base = t;
+        printf("%-12s %8.3f s %12.0f %10ld B %7.2fx%s\n", on ? "on" : "off", t, DEDUP_FILES / t, image_size(image),
+               ratio, mismatch ? "  MISMATCH" : "");
+        if (on) printf("time saved %.3f s (x%.1f)\n", base - t, base / t);
+    }
+
+    unlink(image);
+    for (size_t i = 0; i < DEDUP_DISTINCT; i++) free(contents[i]);
+    free(contents);
+    free(sizes);
+    free(entries);
+    free(names);
+    return failed;
+}
+
+#define CHUNKS_VERSIONS 8
+#define CHUNKS_FILE_SIZE (16 * 1024 * 1024)
+#define CHUNKS_EDITS 4              // Per version: insertions, deletions or rewrites of up to 4 KB
+
+// Successive versions of a large file that differ in a few places, fixed blocks vs chunks.
+static int bench_chunks(void) {
+    char image[64];
+    snprintf(image, sizeof(image), "/tmp/fs_bench_%d.bin", (int)getpid());
+
+    unsigned char *versions[CHUNKS_VERSIONS];
+    size_t sizes[CHUNKS_VERSIONS];
+    sizes[0] = CHUNKS_FILE_SIZE;
+    versions[0] = malloc(sizes[0]);
+    fill_text(versions[0], sizes[0]);
+    for (int v = 1; v < CHUNKS_VERSIONS; v++) {
+        size_t n = sizes[v - 1];
+        unsigned char *data = malloc(n + CHUNKS_EDITS * 4096);
+        memcpy(data, versions[v - 1], n);
+        for (int e = 0; e < CHUNKS_EDITS; e++) {
+            size_t at = bench_rand() % n;
+            size_t len = 1 + bench_rand() % 4096;
+            if (len > n - at) len = n - at;
+            switch (bench_rand() % 3) {
+            case 0:
+                memmove(data + at + len, data + at, n - at);
+                fill_text(data + at, len);
+                n += len;
+                break;
+            case 1:
+                memmove(data + at, data + at + len, n - at - len);
+                n -= len;
+                break;
+            default:
+                fill_text(data + at, len);
+            }
+        }
+        versions[v] = data;
+        sizes[v] = n;
+    }
+
+    printf("add_file of %d versions of a %d MB text file, %d small edits each\n", CHUNKS_VERSIONS,
+           CHUNKS_FILE_SIZE / (1024 * 1024), CHUNKS_EDITS);
+    printf("%-16s %14s %14s %12s\n", "storage", "first version", "next ones", "image");
+    int failed = 0;
+    for (int on = 0; on < 2; on++) {
+        FSContext ctx;
+        init_filesystem(image);
+        int res = load_filesystem(image, &ctx);
+        if (res == 0 && on) res = dedup_create(&ctx);
+        double first = 0;
+        double start = now_seconds();
+        for (int v = 0; v < CHUNKS_VERSIONS && res == 0; v++) {
+            char name[MAX_NAME_LEN];
+            snprintf(name, sizeof(name), "logs/app_v%d.log", v);
+            res = add_file(&ctx, name, versions[v], sizes[v]);
+            if (v == 0) first = now_seconds() - start;
+        }
+        double rest = now_seconds() - start - first;
+        for (int v = 0; v < CHUNKS_VERSIONS && res == 0; v++) {
+            char name[MAX_NAME_LEN];
+            snprintf(name, sizeof(name), "logs/app_v%d.log", v);
+            size_t size = 0;
+            unsigned char *content = get_file_content(&ctx, name, &size);
+            if (!content || size != sizes[v] || memcmp(content, versions[v], size) != 0) res = -1;
+            free(content);
+        }
+        if (res == 0) close_filesystem(&ctx);
+        if (res != 0) failed = 1;
+        printf("%-16s %12.3f s %10.3f s/v %10ld B%s\n", on ? "chunks (dedup)" : "blocks", first,
+               rest / (CHUNKS_VERSIONS - 1), image_size(image), res != 0 ? "  MISMATCH" : "");
+    }
+
+    unlink(image);
+    for (int v = 0; v < CHUNKS_VERSIONS; v++) free(versions[v]);
+    return failed;
+}
+
+#define STARTUP_FILES 1000000
+#define STARTUP_COLD_RUNS 5
+#define STARTUP_WARM_LOOKUPS 200000
+
+static void startup_name(char *name, unsigned int i) {
+    snprintf(name, MAX_NAME_LEN, "data/%03u/object_%07u.json", i % 997, i);
+}
+
+// Writes the image back and drops it from the OS page cache: the next load starts cold.
+static void evict_image(const char *image) {
+    int fd = open(image, O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+// Cold load + first lookup (best of STARTUP_COLD_RUNS), then warm lookups in the same context.
+// Every answer is checked against the name it was asked for.
+static int time_startup(const char *label, const char *image, double *cold, double *warm) {
+    int failed = 0;
+    *cold = 0;
+    for (int r = 0; r < STARTUP_COLD_RUNS && !failed; r++) {
+        char name[MAX_NAME_LEN];
+        startup_name(name, bench_rand() % STARTUP_FILES);
+        evict_image(image);
+        double start = now_seconds();
+        FSContext ctx;
+        if (load_filesystem(image, &ctx) != 0) return 1;
+        Inode inode;
+        int res = index_lookup(&ctx, name, &inode);
+        double t = now_seconds() - start;
+        if (res != 0 || strcmp(inode.name, name) != 0) failed = 1;
+        if (*cold == 0 || t < *cold) *cold = t;
+
+        if (r == STARTUP_COLD_RUNS - 1) {
+            start = now_seconds();
+            for (int i = 0; i < STARTUP_WARM_LOOKUPS && !failed; i++) {
+                unsigned int k = bench_rand() % (STARTUP_FILES + STARTUP_FILES / 8); // Some misses
+                startup_name(name, k);
+                res = index_lookup(&ctx, name, &inode);
+                if (k < STARTUP_FILES ? res != 0 || strcmp(inode.name, name) != 0 : res != -1) failed = 1;
+            }
+            *warm = STARTUP_WARM_LOOKUPS / (now_seconds() - start);
+        }
+        close_filesystem(&ctx);
+    }
+    printf("%-26s %9.3f ms %12.0f%s\n", label, *cold * 1000, *warm, failed ? "  MISMATCH" : "");
+    return failed;
+}
+
+// Image of `n` small files indexed by `index_type` (the red-black tree of older images is filled
+// by inserts, the B+tree is bulk-built, one per directory unless `flat`), without a snapshot.
+// Without its hash index too if `trees_only`.
+static int build_index_image(const char *image, int index_type, int flat, BatchEntry *entries, size_t n,
+                             int trees_only) {
+    FSContext ctx;
+    if (init_filesystem(image) != 0 || load_filesystem(image, &ctx) != 0) return 1;
+    ctx.sb.index_type = index_type;
+    if (flat) ctx.sb.directories = 0;
+    int failed = add_files_batch(&ctx, entries, n) != (long)n;
+    if (trees_only) ht_drop(&ctx);
+    close_filesystem(&ctx);
+    return failed;
+}
+
+static int bench_startup(void) {
+    static const struct {
+        int index_type;
+        const char *label;
+        const char *snapshot_label;
+    } indexes[] = {
+        { INDEX_RBTREE, "red-black tree", "red-black tree + snapshot" },
+        { INDEX_BTREE, "B+tree", "B+tree + snapshot" },
+    };
+    char image[64];
+    snprintf(image, sizeof(image), "/tmp/fs_bench_%d.bin", (int)getpid());
+
+    BatchEntry *entries = calloc(STARTUP_FILES, sizeof(BatchEntry));
+    char (*names)[MAX_NAME_LEN] = malloc(STARTUP_FILES * sizeof(*names));
+    static const unsigned char payload[] = "{\"ok\":1}";
+    if (!entries || !names) {
+        free(entries);
+        free(names);
+        return 1;
+    }
+    for (unsigned int i = 0; i < STARTUP_FILES; i++) {
+        startup_name(names[i], i);
+        entries[i].name = names[i];
+        entries[i].data = payload;
+        entries[i].size = sizeof(payload) - 1;
+    }
+
+    printf("Cold start to first lookup, image of %d files (dropped from the OS cache, best of %d)\n",
+           STARTUP_FILES, STARTUP_COLD_RUNS);
+    printf("%-26s %12s %12s\n", "index", "load+lookup", "lookups/s");
+    int failed = 0;
+    for (size_t t = 0; t < sizeof(indexes) / sizeof(indexes[0]) && !failed; t++) {
+        double cold_index = 0, cold_snapshot = 0, warm_index = 0, warm_snapshot = 0;
+        failed = build_index_image(image, indexes[t].index_type, 0, entries, STARTUP_FILES, 1);
+        if (!failed) failed = time_startup(indexes[t].label, image, &cold_index, &warm_index);
+
+        FSContext ctx;
+        if (!failed && load_filesystem(image, &ctx) == 0) {
+            double start = now_seconds();
+            if (snapshot_write(&ctx) != 0) failed = 1;
+            long bytes = 0;
+            snapshot_info(&ctx, NULL, &bytes);
+            printf("%-26s %9.3f s  %10ld B\n", "  (snapshot written)", now_seconds() - start, bytes);
+            close_filesystem(&ctx);
+        }
+        if (!failed) failed = time_startup(indexes[t].snapshot_label, image, &cold_snapshot, &warm_snapshot);
+        if (!failed) {
+            printf("  cold start x%.1f, lookups x%.1f\n", cold_index / cold_snapshot, warm_snapshot / warm_index);
+        }
+    }
+    free(entries);
+    free(names);
+
+    unlink(image);
+    return failed;
+}
+
+#define LOOKUP_SAMPLES 200000
+
+// Average time of a lookup of an existing name, in ns. `how`: 0 = the image's tree, 1 = hash index,
+// 2 = directory trees (directory.h, walked from the directory cache).
+static double time_lookups(FSContext *ctx, int how, unsigned int n, int *failed) {
+    double start = now_seconds();
+    for (int i = 0; i < LOOKUP_SAMPLES && !*failed; i++) {
+        char name[MAX_NAME_LEN];
+        startup_name(name, bench_rand() % n);
+        Inode inode;
+        int res;
+        if (how == 1) {
+            res = ht_lookup(ctx, name, &inode);
+        } else if (how == 2) {
+            res = dir_lookup(ctx, name, &inode);
+        } else if (ctx->sb.index_type == INDEX_BTREE) {
+            res = bt_search(ctx, ctx->sb.root_inode_offset, name, &inode);
+        } else {
+            long node_offset = rb_search(ctx, ctx->sb.root_inode_offset, name);
+            res = node_offset == -1 ? -1 : 0;
+            if (res == 0) {
+                RBTNode node;
+                read_rb_node(ctx, node_offset, &node);
+                inode = node.inode;
+            }
+        }
+        if (res != 0 || strcmp(inode.name, name) != 0) *failed = 1;
+    }
+    return (now_seconds() - start) / LOOKUP_SAMPLES * 1e9;
+}
+
+static int bench_lookup(void) {
+    static const unsigned int sizes[] = { 10000, 100000, 1000000 };
+    char image[64];
+    snprintf(image, sizeof(image), "/tmp/fs_bench_%d.bin", (int)getpid());
+
+    const unsigned int max = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+    BatchEntry *entries = calloc(max, sizeof(BatchEntry));
+    char (*names)[MAX_NAME_LEN] = malloc(max * sizeof(*names));
+    static const unsigned char payload[] = "{\"ok\":1}";
+    if (!entries || !names) {
+        free(entries);
+        free(names);
+        return 1;
+    }
+    for (unsigned int i = 0; i < max; i++) {
+        startup_name(names[i], i);
+        entries[i].name = names[i];
+        entries[i].data = payload;
+        entries[i].size = sizeof(payload) - 1;
+    }
+
+    printf("Point lookups of random existing names (%d per run, default page cache of %d KB)\n",
+           LOOKUP_SAMPLES, CACHE_DEFAULT_PAGES * CACHE_PAGE_SIZE / 1024);
+    printf("Names are \"data/<dir>/object_<n>.json\" over 997 directories: the flat B+tree holds the full\n"
+           "paths, the directory trees one tree per directory (looked up from the directory cache).\n");
+    printf("%-10s %16s %16s %16s %16s\n", "names", "red-black tree", "B+tree", "directories", "hash index");
+    int failed = 0;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && !failed; s++) {
+        double rb = 0, bt = 0, dirs = 0, ht = 0;
+        FSContext ctx;
+        failed = build_index_image(image, INDEX_RBTREE, 1, entries, sizes[s], 0);
+        if (!failed && load_filesystem(image, &ctx) == 0) {
+            rb = time_lookups(&ctx, 0, sizes[s], &failed);
+            close_filesystem(&ctx);
+        }
+        if (!failed) failed = build_index_image(image, INDEX_BTREE, 1, entries, sizes[s], 0);
+        if (!failed && load_filesystem(image, &ctx) == 0) {
+            bt = time_lookups(&ctx, 0, sizes[s], &failed);
+            close_filesystem(&ctx);
+        }
+        if (!failed) failed = build_index_image(image, INDEX_BTREE, 0, entries, sizes[s], 0);
+        if (!failed && load_filesystem(image, &ctx) == 0) {
+            dirs = time_lookups(&ctx, 2, sizes[s], &failed);
+            ht = time_lookups(&ctx, 1, sizes[s], &failed);
+            close_filesystem(&ctx);
+        }
+        printf("%-10u %13.0f ns %13.0f ns %13.0f ns %13.0f ns%s\n", sizes[s], rb, bt, dirs, ht,
+               failed ? "  MISMATCH" : "");
+    }
+    free(entries);
+    free(names);
+    unlink(image);
+    return failed;
+}
+
+#define JOURNAL_FILES 4000
+
+// Adds the files one by one. group: journal group size (publication group size on a copy-on-write
+// image), 0 = no journal; sync_every: sync_filesystem after that many files, 0 = never.
+// Returns the seconds taken, load and close included, or -1.
+static double time_journaled_adds(const char *image, BatchEntry *entries, size_t n, int group, int sync_every,
+                                  int cow, long *fsyncs) {
+    FSOptions opts = {0};
+    opts.group_commit = group;
+    FSContext ctx;
+    init_filesystem(image);
+    if (cow) {
+        if (load_filesystem(image, &ctx) != 0 || cow_enable(&ctx) != 0) return -1;
+        close_filesystem(&ctx);
+    }
+    double start = now_seconds();
+    if (load_filesystem_opts(image, &ctx, &opts) != 0) return -1;
+    int failed = 0;
+    *fsyncs = 0;
+    for (size_t i = 0; i < n && !failed; i++) {
+        failed = add_file(&ctx, entries[i].name, entries[i].data, entries[i].size) != 0;
+        if (!failed && sync_every > 0 && (i + 1) % sync_every == 0) {
+            failed = sync_filesystem(&ctx) != 0;
+            (*fsyncs)++;
+        }
+    }
+    if (ctx.cache.journal) *fsyncs = ctx.cache.journal->stats.fsyncs;
+    if (ctx.cow) *fsyncs = ctx.cow->stats.fsyncs;
+    close_filesystem(&ctx);
+    double t = now_seconds() - start;
+    return failed ? -1 : t;
+}
+
+// Small text files under 64 directories, the workload of the durability benchmarks.
+static BatchEntry* make_log_entries(size_t n, char (**names)[MAX_NAME_LEN]) {
+    BatchEntry *entries = calloc(n, sizeof(BatchEntry));
+    *names = malloc(n * sizeof(**names));
+    if (!entries || !*names) {
+        free(entries);
+        free(*names);
+        return NULL;
+    }
+    for (size_t i = 0; i < n; i++) {
+        unsigned int r = bench_rand();
+        snprintf((*names)[i], MAX_NAME_LEN, "logs/%02u/entry_%08u.txt", r % 64, r);
+        size_t size = 200 + bench_rand() % 3900;
+        unsigned char *data = malloc(size);
+        fill_text(data, size);
+        entries[i].name = (*names)[i];
+        entries[i].data = data;
+        entries[i].size = size;
+    }
+    return entries;
+}
+
+static void free_log_entries(BatchEntry *entries, char (*names)[MAX_NAME_LEN], size_t n) {
+    for (size_t i = 0; i < n; i++) free((unsigned char *)entries[i].data);
+    free(entries);
+    free(names);
+}
+
+static int bench_journal(void) {
+    static const int groups[] = { 1, 8, 64, 512 };
+    char image[64];
+    snprintf(image, sizeof(image), "/tmp/fs_bench_%d.bin", (int)getpid());
+
+    char (*names)[MAX_NAME_LEN];
+    BatchEntry *entries = make_log_entries(JOURNAL_FILES, &names);
+    if (!entries) return 1;
+
+    printf("add_file of %d small files (200 B - 4 KB of text), durable vs write-back at close\n", JOURNAL_FILES);
+    printf("%-26s %10s %12s %10s\n", "mode", "time", "files/s", "fsyncs");
+    int failed = 0;
+    long fsyncs = 0;
+    double t = time_journaled_adds(image, entries, JOURNAL_FILES, 0, 0, 0, &fsyncs);
+    if (t < 0 || check_ingested(image, entries, JOURNAL_FILES)) failed = 1;
+    printf("%-26s %8.3f s %12.0f %10s  (nothing durable before close)\n", "no journal", t, JOURNAL_FILES / t, "-");
+    t = time_journaled_adds(image, entries, JOURNAL_FILES, 0, 1, 0, &fsyncs);
+    if (t < 0 || check_ingested(image, entries, JOURNAL_FILES)) failed = 1;
+    printf("%-26s %8.3f s %12.0f %10ld  (not crash-consistent)\n", "sync_filesystem per file", t, JOURNAL_FILES / t,
+           fsyncs);
+    for (size_t g = 0; g < sizeof(groups) / sizeof(groups[0]); g++) {
+        char label[32];
+        snprintf(label, sizeof(label), "journal, group of %d", groups[g]);
+        t = time_journaled_adds(image, entries, JOURNAL_FILES, groups[g], 0, 0, &fsyncs);
+        if (t < 0 || check_ingested(image, entries, JOURNAL_FILES)) failed = 1;
+        printf("%-26s %8.3f s %12.0f %10ld%s\n", label, t, JOURNAL_FILES / t, fsyncs, failed ? "  MISMATCH" : "");
+    }
+
+    unlink(image);
+    free_log_entries(entries, names, JOURNAL_FILES);
+    return failed;
+}
+
+#define CRASH_FILES 3000
+#define CRASH_CACHE_PAGES 16        // Small cache: pages leave it (to the log or new space) in the middle of groups
+
+typedef struct CrashReport {
+    long commits;           // Journal commits, or copy-on-write publications, before the crash
+    long checkpoints;
+    long epoch;             // Copy-on-write: last published version
+    long free_table;        // Copy-on-write: first page of its free space table
+} CrashReport;
+
+// Adds the first `crashed` entries in a child process, which then stops dead: no commit of the open
+// group, no close. Returns 0 once it did (*report filled in by the child), -1 otherwise.
+static int crash_during_adds(const char *image, const BatchEntry *entries, size_t crashed, int group,
+                             CrashReport *report) {
+    int fds[2];
+    if (pipe(fds) != 0) return -1;
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        FSOptions opts = {0};
+        opts.cache_pages = CRASH_CACHE_PAGES;
+        opts.group_commit = group;
+        FSContext ctx;
+        if (load_filesystem_opts(image, &ctx, &opts) != 0) _exit(1);
+        for (size_t i = 0; i < crashed; i++) {
+            if (add_file(&ctx, entries[i].name, entries[i].data, entries[i].size) != 0) _exit(1);
+        }
+        CrashReport r = {0};
+        if (ctx.cache.journal) {
+            r.commits = ctx.cache.journal->stats.commits;
+            r.checkpoints = ctx.cache.journal->stats.checkpoints;
+        }
+        if (ctx.cow) {
+            r.commits = ctx.cow->stats.publications;
+            r.epoch = ctx.cow->published.epoch;
+            r.free_table = ctx.cow->published.cow_free_offset;
+        }
+        _exit(write(fds[1], &r, sizeof(r)) == sizeof(r) ? 0 : 1);
+    }
+    close(fds[1]);
+    ssize_t got = read(fds[0], report, sizeof(CrashReport));
+    close(fds[0]);
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+    return got == sizeof(CrashReport) ? 0 : -1;
+}
+
+// After a crash: the first `committed` entries are there whole, the others not at all (nothing half
+// added), and the image takes them all again. epoch: copy-on-write, the version load_filesystem must
+// pick (0 = not checked). *seconds: time to load it (replay included). Returns 0 if so.
+static int check_recovered(const char *image, BatchEntry *entries, size_t n, size_t committed, long epoch,
+                           double *seconds) {
+    FSContext ctx;
+    double start = now_seconds();
+    if (load_filesystem(image, &ctx) != 0) return 1;
+    *seconds = now_seconds() - start;
+    int failed = epoch != 0 && ctx.sb.epoch != epoch;
+    for (size_t i = 0; i < n && !failed; i++) {
+        size_t size = 0;
+        unsigned char *content = get_file_content(&ctx, entries[i].name, &size);
+        if (i < committed) {
+            failed = !content || size != entries[i].size || memcmp(content, entries[i].data, size) != 0;
+        } else {
+            failed = content != NULL;
+        }
+        free(content);
+    }
+    for (size_t i = committed; i < n && !failed; i++) {
+        failed = add_file(&ctx, entries[i].name, entries[i].data, entries[i].size) != 0;
+    }
+    close_filesystem(&ctx);
+    return failed || check_ingested(image, entries, n);
+}
+
+// New empty image, copy-on-write if `cow`. Returns 0 on success.
+static int new_crash_image(const char *image, int cow) {
+    if (init_filesystem(image) != 0) return -1;
+    if (!cow) return 0;
+    FSContext ctx;
+    if (load_filesystem(image, &ctx) != 0) return -1;
+    int res = cow_enable(&ctx);
+    close_filesystem(&ctx);
+    return res;
+}
+
+// Crashes in the middle of a group (a quarter and three quarters into the files) at each group size
+// and checks what load_filesystem brings back. cow: copy-on-write image instead of a journal.
+static int run_crash_checks(const char *image, BatchEntry *entries, int cow) {
+    static const int groups[] = { 1, 8, 64 };
+    printf("%-8s %12s %10s %10s %12s %12s\n", "group", "crash after", "durable", cow ? "publish" : "commits",
+           cow ? "epoch" : "checkpoints", "load");
+    int failed = 0;
+    for (size_t g = 0; g < sizeof(groups) / sizeof(groups[0]); g++) {
+        for (int quarter = 1; quarter <= 3; quarter += 2) {
+            int group = groups[g];
+            size_t crashed = (CRASH_FILES * quarter / 4 / group) * group + group / 2;
+            size_t committed = crashed - crashed % group;
+            if (new_crash_image(image, cow) != 0) return 1;
+            CrashReport r = {0};
+            double seconds = 0;
+            int mismatch = crash_during_adds(image, entries, crashed, group, &r) != 0
+                           || check_recovered(image, entries, CRASH_FILES, committed, cow ? r.epoch : 0, &seconds) != 0;
+            if (mismatch) failed = 1;
+            printf("%-8d %12zu %10zu %10ld %12ld %10.3f s%s\n", group, crashed, committed, r.commits,
+                   cow ? r.epoch : r.checkpoints, seconds, mismatch ? "  MISMATCH" : "");
+        }
+    }
+    return failed;
+}
+
+// Crash recovery of the write-ahead log: a child process adds files and dies in the middle of a
+// commit group; the files of the committed groups must come back whole, the open group not at all.
+static int bench_journal_crash(void) {
+    char image[64];
+    snprintf(image, sizeof(image), "/tmp/fs_bench_%d.bin", (int)getpid());
+
+    char (*names)[MAX_NAME_LEN];
+    BatchEntry *entries = make_log_entries(CRASH_FILES, &names);
+    if (!entries) return 1;
+
+    printf("add_file of %d small files with the journal, killed in the middle of a group (%d cache pages)\n",
+           CRASH_FILES, CRASH_CACHE_PAGES);
+    int failed = run_crash_checks(image, entries, 0);
+
+    unlink(image);
+    journal_discard(image);
+    free_log_entries(entries, names, CRASH_FILES);
+    return failed;
+}
+
+// Overwrites `size` bytes of the image at `offset`. Returns 0 on success.
+static int damage_image(const char *image, long offset, const void *data, size_t size) {
+    int fd = open(image, O_WRONLY);
+    if (fd < 0) return -1;
+    int res = pwrite(fd, data, size, offset) == (ssize_t)size ? 0 : -1;
+    close(fd);
+    return res;
+}
+
+// Loads a damaged image in a child process. Returns 0 if load_filesystem turned it down, 1 if it
+// loaded it, -1 if the child died.
+static int load_in_child(const char *image) {
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        FSContext ctx;
+        if (load_filesystem(image, &ctx) != 0) _exit(0);
+        close_filesystem(&ctx);
+        _exit(1);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) return -1;
+    return WEXITSTATUS(status);
+}
+
+// Crash recovery of copy-on-write images: the same crashes in the middle of a group (load must pick
+// the last published SuperBlock), then a publication whose SuperBlock slot was torn (load must fall
+// back to the other slot) and damaged pages of the free space table (load must turn the image down
+// without crashing).
+static int bench_cow_crash(void) {
+    char image[64];
+    snprintf(image, sizeof(image), "/tmp/fs_bench_%d.bin", (int)getpid());
+
+    char (*names)[MAX_NAME_LEN];
+    BatchEntry *entries = make_log_entries(CRASH_FILES, &names);
+    if (!entries) return 1;
+
+    printf("add_file of %d small files on a copy-on-write image, killed in the middle of a group (%d cache pages)\n",
+           CRASH_FILES, CRASH_CACHE_PAGES);
+    int failed = run_crash_checks(image, entries, 1);
+
+    // Killed right after a publication, whose SuperBlock is then torn: the version before it is current
+    const int group = 8;
+    const size_t crashed = (CRASH_FILES / 2 / group) * group;
+    printf("\n%-34s %s\n", "damage (group of 8)", "load");
+    CrashReport r = {0};
+    double seconds = 0;
+    int mismatch = new_crash_image(image, 1) != 0 || crash_during_adds(image, entries, crashed, group, &r) != 0;
+    SuperBlock sb;
+    int fd = mismatch ? -1 : open(image, O_RDONLY);
+    long slot = (r.epoch % 2) * COW_SLOT_SIZE;
+    mismatch = fd < 0 || pread(fd, &sb, sizeof(SuperBlock), slot) != (ssize_t)sizeof(SuperBlock);
+    if (fd >= 0) close(fd);
+    sb.checksum ^= 1;
+    mismatch = mismatch || damage_image(image, slot, &sb, sizeof(SuperBlock)) != 0
+               || check_recovered(image, entries, CRASH_FILES, crashed - group, r.epoch - 1, &seconds) != 0;
+    if (mismatch) failed = 1;
+    printf("%-34s epoch %ld, %zu files%s\n", "newest SuperBlock slot torn", r.epoch - 1, crashed - group,
+           mismatch ? "  MISMATCH" : "");
+
+    // Pages of the free space table: unknown magic, too many entries, a chain looping on itself
+    for (int damage = 0; damage < 3; damage++) {
+        static const char *labels[] = { "free space table: bad magic", "free space table: bad count",
+                                        "free space table: loop" };
+        mismatch = new_crash_image(image, 1) != 0 || crash_during_adds(image, entries, crashed, group, &r) != 0
+                   || r.free_table == 0;
+        CowTableHeader h;
+        fd = mismatch ? -1 : open(image, O_RDONLY);
+        mismatch = fd < 0 || pread(fd, &h, sizeof(CowTableHeader), r.free_table) != (ssize_t)sizeof(CowTableHeader);
+        if (fd >= 0) close(fd);
+        if (damage == 0) h.magic = 0;
+        if (damage == 1) h.count = COW_TABLE_ENTRIES + 1;
+        if (damage == 2) h.next = r.free_table;
+        int loaded = mismatch || damage_image(image, r.free_table, &h, sizeof(CowTableHeader)) != 0
+                     ? -1 : load_in_child(image);
+        mismatch = loaded != 0;
+        if (mismatch) failed = 1;
+        printf("%-34s %s%s\n", labels[damage], loaded == 0 ? "turned down" : loaded == 1 ? "loaded" : "crashed",
+               mismatch ? "  MISMATCH" : "");
+    }
+
+    unlink(image);
+    free_log_entries(entries, names, CRASH_FILES);
+    return failed;
+}
+
+// Durable inserts three ways at the same group sizes: in place with sync_filesystem (fast but a
+// crash in the middle of a sync can leave a mix of old and new pages), write-ahead log, copy-on-write.
+static int bench_cow(void) {
+    static const int groups[] = { 1, 8, 64 };
+    char image[64];
+    snprintf(image, sizeof(image), "/tmp/fs_bench_%d.bin", (int)getpid());
+
+    char (*names)[MAX_NAME_LEN];
+    BatchEntry *entries = make_log_entries(JOURNAL_FILES, &names);
+    if (!entries) return 1;
+
+    printf("add_file of %d small files (200 B - 4 KB of text), durable every 1/8/64 files\n", JOURNAL_FILES);
+    printf("%-28s %10s %12s %10s %12s\n", "mode", "time", "files/s", "fsyncs", "image");
+    int failed = 0;
+    for (size_t g = 0; g < sizeof(groups) / sizeof(groups[0]); g++) {
+        for (int mode = 0; mode < 3; mode++) {
+            static const char *modes[] = { "in place + sync", "journal", "copy-on-write" };
+            long fsyncs = 0;
+            double t = time_journaled_adds(image, entries, JOURNAL_FILES, mode == 0 ? 0 : groups[g],
+                                           mode == 0 ? groups[g] : 0, mode == 2, &fsyncs);
+            int mismatch = t < 0 || check_ingested(image, entries, JOURNAL_FILES);
+            if (mismatch) failed = 1;
+            char label[48];
+            snprintf(label, sizeof(label), "%s, group of %d", modes[mode], groups[g]);
+            printf("%-28s %8.3f s %12.0f %10ld %12ld%s\n", label, t, JOURNAL_FILES / t, fsyncs, image_size(image),
+                   mismatch ? "  MISMATCH" : "");
+        }
+    }
+
+    unlink(image);
+    free_log_entries(entries, names, JOURNAL_FILES);
+    return failed;
+}
+
+#define READERS_FILES 20000
+#define READERS_LOOKUPS 100000     // Per thread
+#define READERS_MAX_THREADS 8
+#define READERS_REFRESH 4096        // Lookups between two reader_refresh
+
+typedef struct ReadWorker {
+    FSReader *reader;
+    const BatchEntry *entries;
+    size_t n;
+    unsigned int seed;
+    int failed;
+    pthread_mutex_t *lock;
+    int *running;               // Readers not done yet (the writer stops at 0)
+} ReadWorker;
+
+static void* read_worker(void *arg) {
+    ReadWorker *w = arg;
+    unsigned int x = w->seed;
+    for (int i = 0; i < READERS_LOOKUPS && !w->failed; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        if (i > 0 && i % READERS_REFRESH == 0 && reader_refresh(w->reader) != 0) {
+            w->failed = 1;
+            break;
+        }
+        const BatchEntry *e = &w->entries[x % w->n];
+        if (e->result != 0) continue; // Name drawn twice
+        size_t size = 0;
+        unsigned char *content = get_file_content(&w->reader->ctx, e->name, &size);
+        w->failed = !content || size != e->size || memcmp(content, e->data, size) != 0;
+        free(content);
+    }
+    pthread_mutex_lock(w->lock);
+    (*w->running)--;
+    pthread_mutex_unlock(w->lock);
+    return NULL;
+}
+
+// Random get_file_content on a copy-on-write image, one reader per thread moving to the latest
+// version every READERS_REFRESH lookups, with the writer idle or adding and deleting files
+// (publishing every 64 operations) the whole time.
+static int bench_readers(void) {
+    static const int thread_counts[] = { 1, 2, 4, 8 };
+    char image[64];
+    snprintf(image, sizeof(image), "/tmp/fs_bench_%d.bin", (int)getpid());
+
+    char (*names)[MAX_NAME_LEN], (*new_names)[MAX_NAME_LEN];
+    BatchEntry *entries = make_log_entries(READERS_FILES, &names);
+    BatchEntry *new_entries = make_log_entries(READERS_FILES, &new_names);
+    if (!entries || !new_entries) return 1;
+
+    FSContext ctx;
+    FSOptions opts = {0};
+    opts.group_commit = 64;
+    int failed = init_filesystem(image) != 0 || load_filesystem(image, &ctx) != 0;
+    if (!failed) {
+        failed = cow_enable(&ctx) != 0 || add_files_batch(&ctx, entries, READERS_FILES) < 0;
+        close_filesystem(&ctx);
+    }
+    if (failed || load_filesystem_opts(image, &ctx, &opts) != 0) {
+        unlink(image);
+        free_log_entries(entries, names, READERS_FILES);
+        free_log_entries(new_entries, new_names, READERS_FILES);
+        return 1;
+    }
+
+    printf("get_file_content of random files among %d (200 B - 4 KB of text), %d per thread, %ld CPUs online\n",
+           READERS_FILES, READERS_LOOKUPS, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-8s %-8s %14s %9s %14s %12s\n", "writer", "threads", "reads/s", "speedup", "writes/s", "image");
+    char *present = calloc(READERS_FILES, 1); // Which of new_entries the writer has added
+    size_t next = 0;
+    failed = !present;
+    for (int writing = 0; writing < 2 && !failed; writing++) {
+        double base = 0;
+        for (size_t t = 0; t < sizeof(thread_counts) / sizeof(thread_counts[0]) && !failed; t++) {
+            int threads = thread_counts[t];
+            pthread_mutex_t lock;
+            pthread_mutex_init(&lock, NULL);
+            int running = threads;
+            ReadWorker workers[READERS_MAX_THREADS];
+            pthread_t ids[READERS_MAX_THREADS];
+            int started = 0;
+            for (int i = 0; i < threads; i++) {
+                workers[i] = (ReadWorker){ reader_open(&ctx, 0), entries, READERS_FILES, 2463534242u + i * 7919u,
+                                           0, &lock, &running };
+                if (!workers[i].reader) failed = 1;
+            }
+
+            double start = now_seconds();
+            long writes = 0;
+            for (; started < threads && !failed; started++) {
+                if (pthread_create(&ids[started], NULL, read_worker, &workers[started]) != 0) failed = 1;
+            }
+            if (failed) {
+                // Let the started workers finish on their own
+                pthread_mutex_lock(&lock);
+                running -= threads - started;
+                pthread_mutex_unlock(&lock);
+            }
+            for (int busy = writing; busy && !failed; next = (next + 1) % READERS_FILES) {
+                const BatchEntry *e = &new_entries[next];
+                int res = present[next] ? delete_file(&ctx, e->name) : add_file(&ctx, e->name, e->data, e->size);
+                if (res == 0) {
+                    present[next] = !present[next];
+                    writes++;
+                }
+                pthread_mutex_lock(&lock);
+                busy = running > 0;
+                pthread_mutex_unlock(&lock);
+            }
+            for (int i = 0; i < started; i++) pthread_join(ids[i], NULL);
+            double elapsed = now_seconds() - start;
+            pthread_mutex_destroy(&lock);
+            for (int i = 0; i < threads; i++) {
+                if (workers[i].failed) failed = 1;
+                reader_close(workers[i].reader);
+            }
+
+            double rate = (double)threads * READERS_LOOKUPS / elapsed;
+            if (t == 0) base = rate;
+            char writes_label[32] = "-";
+            if (writing) snprintf(writes_label, sizeof(writes_label), "%.0f", writes / elapsed);
+            printf("%-8s %-8d %14.0f %8.2fx %14s %12ld%s\n", writing ? "writing" : "idle", threads, rate, rate / base,
+                   writes_label, image_size(image), failed ? "  MISMATCH" : "");
+        }
+    }
+
+    free(present);
+    close_filesystem(&ctx);
+    unlink(image);
+    free_log_entries(entries, names, READERS_FILES);
+    free_log_entries(new_entries, new_names, READERS_FILES);
+    return failed;
+}
+
+typedef struct Benchmark {
+    const char *name;
+    const char *description;
+    int (*run)(void);
+} Benchmark;
+
+static const Benchmark benchmarks[] = {
+    { "huffman", "Huffman decode throughput, bitwise tree walk vs lookup tables", bench_huffman_decode },
+    { "histogram", "Byte histogram kernels (first pass of every encoder) on uniform, skewed and constant data", bench_histogram },
+    { "huffman-enc", "Huffman encode throughput on one core, legacy, canonical and 4-stream formats", bench_huffman_encode },
+    { "huffman-x4", "Huffman decode on one core, 1 stream vs 4 interleaved streams", bench_huffman_interleaved },
+    { "huffman-mt", "Segmented Huffman compression and decompression at 1/2/4/8 threads", bench_huffman_scaling },
+    { "ingest", "Adding many small files: add_file one by one vs add_files_batch", bench_ingest },
+    { "dedup", "Ingest of repeated files with add_file, dedup off vs on: time, image size, ratio", bench_dedup },
+    { "chunks", "Versions of a large file with small edits: fixed blocks vs content-defined chunks", bench_chunks },
+    { "startup", "Cold start to first lookup on a 1M-file image, index vs index snapshot", bench_startup },
+    { "journal", "add_file throughput with the write-ahead log at group commit sizes 1/8/64/512", bench_journal },
+    { "journal-crash", "Journal crash recovery: killed in the middle of a group at sizes 1/8/64, committed files back whole", bench_journal_crash },
+    { "cow-crash", "Copy-on-write crash recovery: killed mid-group, torn SuperBlock slot, damaged free space table", bench_cow_crash },
+    { "cow", "Durable add_file throughput: in place + sync, write-ahead log and copy-on-write at groups of 1/8/64", bench_cow },
+    { "readers", "Concurrent get_file_content on a copy-on-write image at 1/2/4/8 reader threads, writer idle or busy", bench_readers },
+    { "lookup", "Point lookup latency at 10k, 100k and 1M names: red-black tree, B+tree, directory trees, hash index", bench_lookup },
+};
+
+int run_benchmark(const char *name) {
+    const int count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    int all = strcmp(name, "all") == 0;
+    int found = 0;
+    int failed = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (all || strcmp(name, benchmarks[i].name) == 0) {
+            found = 1;
+            if (benchmarks[i].run() != 0) failed = 1;
+            printf("\n");
+        }
+    }
+
+    if (!found) {
+        fprintf(stderr, "Unknown benchmark '%s'. Available:\n", name);
+        for (int i = 0; i < count; i++) {
+            fprintf(stderr, "  %-12s %s\n", benchmarks[i].name, benchmarks[i].description);
+        }
+        return 1;
+    }
+    return failed;
+}
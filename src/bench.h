@@ -0,0 +1,9 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// Micro-benchmarks for the storage and index code paths.
+// Run with: ./fs_manager bench <name>   (or "all")
+// Returns 0 on success, non-zero if a benchmark failed its own consistency checks.
+int run_benchmark(const char *name);
+
+#endif // BENCH_H
@@ -0,0 +1,875 @@
+#include "btree.h"
+#include "allocator.h"
+#include "cow.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BT_CAPACITY ((int)(FS_PAGE_SIZE - sizeof(BTPageHeader)))
+// Below this many bytes of entries, a page is merged with a neighbour when they fit together.
+#define BT_MIN_FILL (BT_CAPACITY / 4)
+// Smallest entry: prefix and suffix lengths, one key byte, a child offset.
+#define BT_MAX_ENTRIES (BT_CAPACITY / (2 + 1 + (int)sizeof(long)) + 1)
+
+typedef struct BTEntry {
+    char key[MAX_NAME_LEN];
+    long child;        // Internal pages
+    BTValue value;     // Leaves
+} BTEntry;
+
+struct BTPage {
+    BTPageHeader h;
+    BTEntry entries[BT_MAX_ENTRIES + 1];   // +1: room for the entry that makes a page split
+};
+
+// Pages from the root down to a leaf.
+typedef struct BTPath {
+    long offsets[BT_MAX_LEVELS];
+    int slots[BT_MAX_LEVELS];   // Child taken in the page above: -1 = first_child, else entry index
+    int depth;
+    int rightmost;              // Took the last child at every level: the leaf holds the last keys
+} BTPath;
+
+static void inode_to_value(const Inode *inode, BTValue *value) {
+    value->type = inode->type;
+    value->codec = inode->codec;
+    value->parent_offset = inode->parent_offset;
+    value->children_offset = inode->children_offset;
+    value->data_offset = inode->data_offset;
+    value->original_size = inode->original_size;
+    value->compressed_size = inode->compressed_size;
+}
+
+static void value_to_inode(const char *key, const BTValue *value, Inode *inode) {
+    memset(inode, 0, sizeof(Inode));
+    memcpy(inode->name, key, MAX_NAME_LEN - 1); // Keys live in MAX_NAME_LEN buffers
+    inode->type = value->type;
+    inode->codec = value->codec;
+    inode->parent_offset = value->parent_offset;
+    inode->children_offset = value->children_offset;
+    inode->data_offset = value->data_offset;
+    inode->original_size = value->original_size;
+    inode->compressed_size = value->compressed_size;
+}
+
+static int common_prefix(const char *a, const char *b) {
+    int n = 0;
+    while (a[n] && a[n] == b[n]) n++;
+    return n;
+}
+
+static BTPage* page_new(int level) {
+    BTPage *p = malloc(sizeof(BTPage));
+    if (!p) return NULL;
+    memset(&p->h, 0, sizeof(BTPageHeader));
+    p->h.level = level;
+    p->h.value_size = sizeof(BTValue);
+    p->h.next = BT_NONE;
+    p->h.prev = BT_NONE;
+    p->h.first_child = BT_NONE;
+    return p;
+}
+
+// --- Encoding ---
+
+static int payload_size(const BTPage *p) {
+    return p->h.level == 0 ? (int)sizeof(BTValue) : (int)sizeof(long);
+}
+
+// Encoded size of entry i when it follows entry i - 1 (first = 1: stored in full).
+static int entry_size(const BTPage *p, int i, int first) {
+    int len = strlen(p->entries[i].key);
+    int prefix = first ? 0 : common_prefix(p->entries[i - 1].key, p->entries[i].key);
+    return 2 + (len - prefix) + payload_size(p);
+}
+
+static int entries_size(const BTPage *p, int from, int to) {
+    int size = 0;
+    for (int i = from; i < to; i++) size += entry_size(p, i, i == from);
+    return size;
+}
+
+static void page_encode(const BTPage *p, unsigned char *raw) {
+    BTPageHeader h = p->h;
+    h.value_size = sizeof(BTValue);
+    unsigned char *out = raw + sizeof(BTPageHeader);
+    for (int i = 0; i < p->h.count; i++) {
+        const char *key = p->entries[i].key;
+        int len = strlen(key);
+        int prefix = i == 0 ? 0 : common_prefix(p->entries[i - 1].key, key);
+        *out++ = (unsigned char)prefix;
+        *out++ = (unsigned char)(len - prefix);
+        memcpy(out, key + prefix, len - prefix);
+        out += len - prefix;
+        if (p->h.level == 0) {
+            memcpy(out, &p->entries[i].value, sizeof(BTValue));
+            out += sizeof(BTValue);
+        } else {
+            memcpy(out, &p->entries[i].child, sizeof(long));
+            out += sizeof(long);
+        }
+    }
+    h.used = (int)(out - raw - sizeof(BTPageHeader));
+    memcpy(raw, &h, sizeof(BTPageHeader));
+    memset(out, 0, raw + FS_PAGE_SIZE - out);
+}
+
+// Walks the entries of a raw page. Returns the number of bytes of entry `i` (key rebuilt into `key`,
+// payload at *payload), or -1 if the page is corrupt.
+static int next_entry(const unsigned char *raw, const BTPageHeader *h, int pos, char *key, const unsigned char **payload) {
+    const unsigned char *in = raw + sizeof(BTPageHeader) + pos;
+    int psize = h->level == 0 ? h->value_size : (int)sizeof(long);
+    if (pos + 2 > h->used) return -1;
+    int prefix = in[0], suffix = in[1];
+    if (prefix + suffix >= MAX_NAME_LEN || pos + 2 + suffix + psize > h->used) return -1;
+    memcpy(key + prefix, in + 2, suffix);
+    key[prefix + suffix] = '\0';
+    *payload = in + 2 + suffix;
+    return 2 + suffix + psize;
+}
+
+static int header_valid(const BTPageHeader *h) {
+    return h->used >= 0 && h->used <= BT_CAPACITY && h->count >= 0 && h->count <= BT_MAX_ENTRIES
+        && (h->level > 0 || (h->value_size > 0 && h->value_size <= FS_PAGE_SIZE));
+}
+
+static int page_decode(const unsigned char *raw, BTPage *p) {
+    memcpy(&p->h, raw, sizeof(BTPageHeader));
+    if (!header_valid(&p->h)) return -1;
+    char key[MAX_NAME_LEN] = "";
+    int pos = 0;
+    for (int i = 0; i < p->h.count; i++) {
+        const unsigned char *payload;
+        int n = next_entry(raw, &p->h, pos, key, &payload);
+        if (n < 0) return -1;
+        memcpy(p->entries[i].key, key, MAX_NAME_LEN);
+        if (p->h.level == 0) {
+            // Values from pages written with fewer fields: the missing ones read as 0
+            memset(&p->entries[i].value, 0, sizeof(BTValue));
+            int vs = p->h.value_size < (int)sizeof(BTValue) ? p->h.value_size : (int)sizeof(BTValue);
+            memcpy(&p->entries[i].value, payload, vs);
+        } else {
+            memcpy(&p->entries[i].child, payload, sizeof(long));
+        }
+        pos += n;
+    }
+    p->h.value_size = sizeof(BTValue);
+    return 0;
+}
+
+// --- Page I/O ---
+
+// Page bytes: in place in a mapped image, else read into buf.
+static const unsigned char* raw_page(FSContext *ctx, long offset, unsigned char *buf) {
+    const unsigned char *mapped = cache_ptr(&ctx->cache, offset, FS_PAGE_SIZE);
+    if (mapped) return mapped;
+    if (cache_read(&ctx->cache, offset, buf, FS_PAGE_SIZE) != 0) return NULL;
+    return buf;
+}
+
+static int load_page(FSContext *ctx, long offset, BTPage *p) {
+    unsigned char buf[FS_PAGE_SIZE];
+    const unsigned char *raw = raw_page(ctx, offset, buf);
+    if (!raw) return -1;
+    return page_decode(raw, p);
+}
+
+static int store_page(FSContext *ctx, long offset, const BTPage *p) {
+    unsigned char raw[FS_PAGE_SIZE];
+    page_encode(p, raw);
+    return cache_write(&ctx->cache, offset, raw, FS_PAGE_SIZE);
+}
+
+static int page_fits(const BTPage *p) {
+    return entries_size(p, 0, p->h.count) <= BT_CAPACITY;
+}
+
+// --- Lookups ---
+
+// Child of an internal page for `name`: the last separator <= name. *slot receives its index
+// (-1 for first_child).
+static long find_child(const unsigned char *raw, const BTPageHeader *h, const char *name, int *slot) {
+    char key[MAX_NAME_LEN] = "";
+    long child = h->first_child;
+    int pos = 0;
+    *slot = -1;
+    for (int i = 0; i < h->count; i++) {
+        const unsigned char *payload;
+        int n = next_entry(raw, h, pos, key, &payload);
+        if (n < 0) return BT_NONE;
+        if (strcmp(key, name) > 0) break;
+        memcpy(&child, payload, sizeof(long));
+        *slot = i;
+        pos += n;
+    }
+    return child;
+}
+
+// Descends to the leaf that would hold `name`, recording the path.
+static int descend(FSContext *ctx, long root_offset, const char *name, BTPath *path) {
+    unsigned char buf[FS_PAGE_SIZE];
+    long offset = root_offset;
+    int slot = -1;
+    path->depth = 0;
+    path->rightmost = 1;
+    while (path->depth < BT_MAX_LEVELS) {
+        const unsigned char *raw = raw_page(ctx, offset, buf);
+        if (!raw) return -1;
+        BTPageHeader h;
+        memcpy(&h, raw, sizeof(BTPageHeader));
+        if (!header_valid(&h)) return -1;
+
+        path->offsets[path->depth] = offset;
+        path->slots[path->depth] = slot;
+        path->depth++;
+        if (h.level == 0) return 0;
+
+        offset = find_child(raw, &h, name, &slot);
+        if (offset == BT_NONE) return -1;
+        if (slot != h.count - 1) path->rightmost = 0;
+    }
+    return -1;
+}
+
+// Copy-on-write images (cow.h): the pages of the path that the published version uses move to
+// new pages, from the root down, before anything below is changed. Each parent, already a copy,
+// is pointed at the copy of its child.
+static int shadow_path(FSContext *ctx, long *root_offset, BTPath *path) {
+    if (!ctx->cow) return 0;
+    BTPage *p = NULL;
+    int res = 0;
+    for (int d = 0; d < path->depth && res == 0; d++) {
+        long old = path->offsets[d];
+        if (cow_is_fresh(ctx, old)) continue;
+        unsigned char raw[FS_PAGE_SIZE];
+        long copy = fs_allocate_page(ctx);
+        res = cache_read(&ctx->cache, old, raw, FS_PAGE_SIZE);
+        if (res == 0) res = cache_write(&ctx->cache, copy, raw, FS_PAGE_SIZE);
+        if (res != 0) break;
+        fs_release_page(ctx, old);
+        ctx->cow->stats.shadowed++;
+        path->offsets[d] = copy;
+        if (d == 0) {
+            *root_offset = copy;
+            continue;
+        }
+        if (!p && !(p = page_new(0))) return -1;
+        res = load_page(ctx, path->offsets[d - 1], p);
+        if (res == 0) {
+            if (path->slots[d] < 0) p->h.first_child = copy;
+            else p->entries[path->slots[d]].child = copy;
+            res = store_page(ctx, path->offsets[d - 1], p);
+        }
+    }
+    free(p);
+    return res;
+}
+
+int bt_search(FSContext *ctx, long root_offset, const char *name, Inode *out) {
+    unsigned char buf[FS_PAGE_SIZE];
+    long offset = root_offset;
+    for (int level = 0; offset != BT_NONE && level < BT_MAX_LEVELS; level++) {
+        const unsigned char *raw = raw_page(ctx, offset, buf);
+        if (!raw) return -1;
+        BTPageHeader h;
+        memcpy(&h, raw, sizeof(BTPageHeader));
+        if (!header_valid(&h)) return -1;
+
+        if (h.level > 0) {
+            int slot;
+            offset = find_child(raw, &h, name, &slot);
+            continue;
+        }
+
+        // Leaf: keys are sorted, stop at the first one past the name
+        char key[MAX_NAME_LEN] = "";
+        int pos = 0;
+        for (int i = 0; i < h.count; i++) {
+            const unsigned char *payload;
+            int n = next_entry(raw, &h, pos, key, &payload);
+            if (n < 0) return -1;
+            int cmp = strcmp(key, name);
+            if (cmp > 0) break;
+            if (cmp == 0) {
+                if (out) {
+                    BTValue value;
+                    memset(&value, 0, sizeof(BTValue));
+                    memcpy(&value, payload, h.value_size < (int)sizeof(BTValue) ? h.value_size : (int)sizeof(BTValue));
+                    value_to_inode(key, &value, out);
+                }
+                return 0;
+            }
+            pos += n;
+        }
+        return -1;
+    }
+    return -1;
+}
+
+// Index of the first entry >= name (entries[count] if none). *found tells whether it is equal.
+static int lower_bound(const BTPage *p, const char *name, int *found) {
+    int lo = 0, hi = p->h.count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(p->entries[mid].key, name) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    *found = lo < p->h.count && strcmp(p->entries[lo].key, name) == 0;
+    return lo;
+}
+
+static void insert_entry(BTPage *p, int at, const BTEntry *e) {
+    memmove(&p->entries[at + 1], &p->entries[at], (p->h.count - at) * sizeof(BTEntry));
+    p->entries[at] = *e;
+    p->h.count++;
+}
+
+static void remove_entry(BTPage *p, int at) {
+    memmove(&p->entries[at], &p->entries[at + 1], (p->h.count - at - 1) * sizeof(BTEntry));
+    p->h.count--;
+}
+
+// --- Insertion ---
+
+// Split point keeping both halves within a page, as even as possible in bytes.
+// Internal pages: the entry at the split point moves up and belongs to neither half.
+static int split_point(const BTPage *p) {
+    int n = p->h.count;
+    int leaf = p->h.level == 0;
+    int before[BT_MAX_ENTRIES + 2];   // before[i]: bytes of entries 0..i-1 stored in sequence
+    before[0] = 0;
+    for (int i = 0; i < n; i++) before[i + 1] = before[i] + entry_size(p, i, i == 0);
+
+    int best = -1, best_diff = 0;
+    for (int k = 1; k < n; k++) {
+        // The right half starts at `first`, its first key stored in full
+        int first = leaf ? k : k + 1;
+        int left = before[k];
+        int right = first < n ? entry_size(p, first, 1) + before[n] - before[first + 1] : 0;
+        if (left > BT_CAPACITY || right > BT_CAPACITY) continue;
+        int diff = left > right ? left - right : right - left;
+        if (best == -1 || diff < best_diff) {
+            best = k;
+            best_diff = diff;
+        }
+    }
+    return best;
+}
+
+// Writes page path->offsets[d] (modified in memory); splits it, and inserts the separator one
+// level up, when it no longer fits.
+// `append`: the entry making it overflow went past the last key of the tree (names inserted in
+// increasing order). The page is then split right before that entry, so the pages left behind
+// stay full instead of half full.
+static int write_or_split(FSContext *ctx, long *root_offset, BTPath *path, int d, BTPage *p, int append) {
+    if (page_fits(p)) return store_page(ctx, path->offsets[d], p);
+
+    // Internal pages keep one entry on the right: the entry at the split point moves up.
+    int k = append ? p->h.count - (p->h.level == 0 ? 1 : 2) : split_point(p);
+    if (k <= 0) return -1;
+    BTPage *right = page_new(p->h.level);
+    if (!right) return -1;
+    long left_offset = path->offsets[d];
+    long right_offset = fs_allocate_page(ctx);
+
+    BTEntry up;
+    memset(&up, 0, sizeof(BTEntry));
+    if (p->h.level == 0) {
+        right->h.count = p->h.count - k;
+        memcpy(right->entries, &p->entries[k], right->h.count * sizeof(BTEntry));
+        // Separator: shortest prefix of the right half's first key above the left half's last key
+        int len = common_prefix(p->entries[k - 1].key, p->entries[k].key) + 1;
+        memcpy(up.key, p->entries[k].key, len);
+        up.key[len] = '\0';
+
+        right->h.next = p->h.next;
+        right->h.prev = left_offset;
+        p->h.next = right_offset;
+        // Copy-on-write images do not keep the leaf chain: the next leaf may be a published page
+        if (right->h.next != BT_NONE && !ctx->cow) {
+            BTPage *after = page_new(0);
+            int res = after ? load_page(ctx, right->h.next, after) : -1;
+            if (res == 0) {
+                after->h.prev = right_offset;
+                res = store_page(ctx, right->h.next, after);
+            }
+            free(after);
+            if (res != 0) {
+                free(right);
+                return -1;
+            }
+        }
+    } else {
+        right->h.first_child = p->entries[k].child;
+        right->h.count = p->h.count - k - 1;
+        memcpy(right->entries, &p->entries[k + 1], right->h.count * sizeof(BTEntry));
+        strcpy(up.key, p->entries[k].key);
+    }
+    p->h.count = k;
+    up.child = right_offset;
+
+    int res = store_page(ctx, left_offset, p);
+    if (res == 0) res = store_page(ctx, right_offset, right);
+    free(right);
+    if (res != 0) return -1;
+
+    if (d == 0) {
+        // Root split: the tree grows by one level
+        BTPage *root = page_new(p->h.level + 1);
+        if (!root) return -1;
+        root->h.first_child = left_offset;
+        root->entries[0] = up;
+        root->h.count = 1;
+        long root_page = fs_allocate_page(ctx);
+        res = store_page(ctx, root_page, root);
+        free(root);
+        if (res == 0) *root_offset = root_page;
+        return res;
+    }
+
+    BTPage *parent = page_new(0);
+    if (!parent) return -1;
+    res = load_page(ctx, path->offsets[d - 1], parent);
+    if (res == 0) {
+        int found;
+        int at = lower_bound(parent, up.key, &found);
+        insert_entry(parent, at, &up);
+        res = write_or_split(ctx, root_offset, path, d - 1, parent, append && at == parent->h.count - 1);
+    }
+    free(parent);
+    return res;
+}
+
+int bt_insert(FSContext *ctx, long *root_offset, const Inode *inode) {
+    BTEntry e;
+    memset(&e, 0, sizeof(BTEntry));
+    memcpy(e.key, inode->name, MAX_NAME_LEN - 1);
+    if (e.key[0] == '\0') return -1;
+    inode_to_value(inode, &e.value);
+
+    BTPage *p = page_new(0);
+    if (!p) return -1;
+
+    if (*root_offset == BT_NONE) {
+        // First entry: a single leaf is the root
+        p->entries[0] = e;
+        p->h.count = 1;
+        long offset = fs_allocate_page(ctx);
+        int res = store_page(ctx, offset, p);
+        free(p);
+        if (res == 0) *root_offset = offset;
+        return res;
+    }
+
+    BTPath path;
+    int res = descend(ctx, *root_offset, e.key, &path);
+    if (res == 0) res = load_page(ctx, path.offsets[path.depth - 1], p);
+    if (res == 0) {
+        int found;
+        int at = lower_bound(p, e.key, &found);
+        if (found) {
+            res = -1; // Duplicate name
+        } else {
+            insert_entry(p, at, &e);
+            int append = at == p->h.count - 1 && path.rightmost;
+            res = shadow_path(ctx, root_offset, &path);
+            if (res == 0) res = write_or_split(ctx, root_offset, &path, path.depth - 1, p, append);
+        }
+    }
+    free(p);
+    return res;
+}
+
+int bt_update(FSContext *ctx, long *root_offset, const Inode *inode) {
+    if (*root_offset == BT_NONE) return -1;
+    BTPage *p = page_new(0);
+    if (!p) return -1;
+
+    BTPath path;
+    int res = descend(ctx, *root_offset, inode->name, &path);
+    if (res == 0) res = load_page(ctx, path.offsets[path.depth - 1], p);
+    if (res == 0) {
+        int found;
+        int at = lower_bound(p, inode->name, &found);
+        if (found) {
+            inode_to_value(inode, &p->entries[at].value);
+            // Same key, fixed-size value: the page keeps its size (pages written with fewer value
+            // fields would grow, they split like on insert)
+            res = shadow_path(ctx, root_offset, &path);
+            if (res == 0) res = write_or_split(ctx, root_offset, &path, path.depth - 1, p, 0);
+        } else {
+            res = -1;
+        }
+    }
+    free(p);
+    return res;
+}
+
+// --- Deletion ---
+
+// Page d (modified in memory) lost entries: merge it with a neighbour under the same parent when
+// it got small and both fit in one page, then fix the parent the same way.
+static int rebalance(FSContext *ctx, long *root_offset, BTPath *path, int d, BTPage *p) {
+    long offset = path->offsets[d];
+
+    if (d == 0) {
+        if (p->h.count == 0) {
+            // Empty leaf root: empty tree. Internal root with a single child: the child is the root.
+            *root_offset = p->h.level == 0 ? BT_NONE : p->h.first_child;
+            fs_release_page(ctx, offset);
+            return 0;
+        }
+        return write_or_split(ctx, root_offset, path, d, p, 0);
+    }
+    if (entries_size(p, 0, p->h.count) >= BT_MIN_FILL) {
+        return write_or_split(ctx, root_offset, path, d, p, 0);
+    }
+
+    BTPage *parent = page_new(0);
+    BTPage *sibling = page_new(0);
+    if (!parent || !sibling) {
+        free(parent);
+        free(sibling);
+        return -1;
+    }
+    int res = load_page(ctx, path->offsets[d - 1], parent);
+    int slot = path->slots[d];
+
+    // Prefer the right neighbour: left = p, right = sibling. Otherwise left = sibling, right = p.
+    int sep = -1;
+    long sibling_offset = BT_NONE;
+    if (res == 0 && slot + 1 < parent->h.count) {
+        sep = slot + 1;
+        sibling_offset = parent->entries[sep].child;
+    } else if (res == 0 && slot >= 0) {
+        sep = slot;
+        sibling_offset = slot == 0 ? parent->h.first_child : parent->entries[slot - 1].child;
+    }
+    if (res == 0 && sibling_offset != BT_NONE) res = load_page(ctx, sibling_offset, sibling);
+
+    if (res != 0 || sep == -1) {
+        free(parent);
+        free(sibling);
+        return res != 0 ? -1 : write_or_split(ctx, root_offset, path, d, p, 0);
+    }
+
+    int p_is_left = sep == slot + 1;
+    BTPage *left = p_is_left ? p : sibling;
+    BTPage *right = p_is_left ? sibling : p;
+    long left_offset = p_is_left ? offset : sibling_offset;
+    long right_offset = p_is_left ? sibling_offset : offset;
+
+    // Merged page, built in `left` if it fits
+    int total = left->h.count + right->h.count + (left->h.level > 0);
+    int merged = 0;
+    if (total <= BT_MAX_ENTRIES) {
+        int keep = left->h.count;
+        if (left->h.level > 0) {
+            // The separator comes down in front of the right page's first child
+            BTEntry down = parent->entries[sep];
+            down.child = right->h.first_child;
+            left->entries[left->h.count++] = down;
+        }
+        memcpy(&left->entries[left->h.count], right->entries, right->h.count * sizeof(BTEntry));
+        left->h.count += right->h.count;
+        if (page_fits(left)) {
+            merged = 1;
+        } else {
+            left->h.count = keep;
+        }
+    }
+
+    if (!merged) {
+        free(parent);
+        free(sibling);
+        return write_or_split(ctx, root_offset, path, d, p, 0);
+    }
+
+    if (!p_is_left && !cow_is_fresh(ctx, left_offset)) {
+        // Copy-on-write: the left neighbour is not on the path, the merged page goes to a new one
+        long copy = fs_allocate_page(ctx);
+        fs_release_page(ctx, left_offset);
+        left_offset = copy;
+        if (slot == 0) parent->h.first_child = left_offset;
+        else parent->entries[slot - 1].child = left_offset;
+    }
+    if (left->h.level == 0) {
+        left->h.next = right->h.next;
+        if (right->h.next != BT_NONE && !ctx->cow) {
+            BTPage *after = page_new(0);
+            res = after ? load_page(ctx, right->h.next, after) : -1;
+            if (res == 0) {
+                after->h.prev = left_offset;
+                res = store_page(ctx, right->h.next, after);
+            }
+            free(after);
+        }
+    }
+    if (res == 0) res = store_page(ctx, left_offset, left);
+    if (res == 0) {
+        fs_release_page(ctx, right_offset);
+        remove_entry(parent, sep);
+        res = rebalance(ctx, root_offset, path, d - 1, parent);
+    }
+    free(parent);
+    free(sibling);
+    return res;
+}
+
+int bt_delete(FSContext *ctx, long *root_offset, const char *name, Inode *removed) {
+    if (*root_offset == BT_NONE) return -1;
+    BTPage *p = page_new(0);
+    if (!p) return -1;
+
+    BTPath path;
+    int res = descend(ctx, *root_offset, name, &path);
+    if (res == 0) res = load_page(ctx, path.offsets[path.depth - 1], p);
+    if (res == 0) {
+        int found;
+        int at = lower_bound(p, name, &found);
+        if (found) {
+            if (removed) value_to_inode(p->entries[at].key, &p->entries[at].value, removed);
+            remove_entry(p, at);
+            res = shadow_path(ctx, root_offset, &path);
+            if (res == 0) res = rebalance(ctx, root_offset, &path, path.depth - 1, p);
+        } else {
+            res = -1;
+        }
+    }
+    free(p);
+    return res;
+}
+
+// --- Scans ---
+
+static long leftmost_leaf(FSContext *ctx, long root_offset, int *height) {
+    unsigned char buf[FS_PAGE_SIZE];
+    long offset = root_offset;
+    *height = 0;
+    while (offset != BT_NONE && *height < BT_MAX_LEVELS) {
+        const unsigned char *raw = raw_page(ctx, offset, buf);
+        if (!raw) return BT_NONE;
+        BTPageHeader h;
+        memcpy(&h, raw, sizeof(BTPageHeader));
+        (*height)++;
+        if (h.level == 0) return offset;
+        offset = h.first_child;
+    }
+    return BT_NONE;
+}
+
+// Leaves under `offset` in key order, through the internal pages (the leaf chain is not kept in
+// copy-on-write images). Calls visit for their entries, or leaf(offset) when visit is NULL.
+typedef struct BTWalk {
+    FileVisitor visit;
+    void *arg;
+    int (*leaf)(FSContext *ctx, long offset, void *arg);
+} BTWalk;
+
+static int walk_pages(FSContext *ctx, long offset, int depth, const BTWalk *w) {
+    if (depth >= BT_MAX_LEVELS) return -1;
+    BTPage *p = page_new(0);
+    if (!p) return -1;
+    int res = load_page(ctx, offset, p);
+    if (res != 0) {
+        res = -1;
+    } else if (p->h.level > 0) {
+        res = walk_pages(ctx, p->h.first_child, depth + 1, w);
+        for (int i = 0; i < p->h.count && res == 0; i++) res = walk_pages(ctx, p->entries[i].child, depth + 1, w);
+    } else if (!w->visit) {
+        res = w->leaf(ctx, offset, w->arg);
+    } else {
+        for (int i = 0; i < p->h.count && res == 0; i++) {
+            Inode inode;
+            value_to_inode(p->entries[i].key, &p->entries[i].value, &inode);
+            res = w->visit(ctx, &inode, w->arg);
+        }
+    }
+    free(p);
+    return res;
+}
+
+int bt_for_each(FSContext *ctx, long root_offset, FileVisitor visit, void *arg) {
+    if (ctx->sb.cow) { // Readers (reader.h) have no CowState
+        if (root_offset == BT_NONE) return 0;
+        BTWalk w = { visit, arg, NULL };
+        return walk_pages(ctx, root_offset, 0, &w);
+    }
+
+    int height;
+    long offset = leftmost_leaf(ctx, root_offset, &height);
+    if (offset == BT_NONE) return 0;
+
+    BTPage *p = page_new(0);
+    if (!p) return -1;
+    int res = 0;
+    while (offset != BT_NONE && res == 0) {
+        if (load_page(ctx, offset, p) != 0) {
+            res = -1;
+            break;
+        }
+        for (int i = 0; i < p->h.count && res == 0; i++) {
+            Inode inode;
+            value_to_inode(p->entries[i].key, &p->entries[i].value, &inode);
+            res = visit(ctx, &inode, arg);
+        }
+        offset = p->h.next;
+    }
+    free(p);
+    return res;
+}
+
+typedef struct LeafList {
+    long *offsets;
+    long count;
+    long capacity;
+} LeafList;
+
+static int collect_leaf(FSContext *ctx, long offset, void *arg) {
+    (void)ctx;
+    LeafList *l = arg;
+    if (l->count == l->capacity) {
+        long capacity = l->capacity ? l->capacity * 2 : 256;
+        long *grown = realloc(l->offsets, capacity * sizeof(long));
+        if (!grown) return -1;
+        l->offsets = grown;
+        l->capacity = capacity;
+    }
+    l->offsets[l->count++] = offset;
+    return 0;
+}
+
+int bt_relink(FSContext *ctx, long root_offset) {
+    if (root_offset == BT_NONE) return 0;
+    LeafList leaves = { NULL, 0, 0 };
+    BTWalk w = { NULL, &leaves, collect_leaf };
+    int res = walk_pages(ctx, root_offset, 0, &w);
+    BTPage *p = res == 0 ? page_new(0) : NULL;
+    if (res == 0 && !p) res = -1;
+    for (long i = 0; i < leaves.count && res == 0; i++) {
+        res = load_page(ctx, leaves.offsets[i], p);
+        if (res != 0) break;
+        p->h.prev = i > 0 ? leaves.offsets[i - 1] : BT_NONE;
+        p->h.next = i + 1 < leaves.count ? leaves.offsets[i + 1] : BT_NONE;
+        res = store_page(ctx, leaves.offsets[i], p);
+    }
+    free(p);
+    free(leaves.offsets);
+    return res;
+}
+
+int bt_height(FSContext *ctx, long root_offset) {
+    int height;
+    leftmost_leaf(ctx, root_offset, &height);
+    return height;
+}
+
+// --- Bulk loading ---
+
+int bt_build_begin(BTBuilder *b, FSContext *ctx) {
+    memset(b, 0, sizeof(BTBuilder));
+    b->ctx = ctx;
+    b->height = 1;
+    b->levels[0] = page_new(0);
+    if (!b->levels[0]) return -1;
+    b->leaf_offset = fs_allocate_page(ctx);
+    return 0;
+}
+
+// Appends `child` (whose keys start at `sep`) to the internal page being filled at `level`,
+// writing that page out when it is full.
+static int build_add_child(BTBuilder *b, int level, const char *sep, long child) {
+    if (level >= BT_MAX_LEVELS) return -1;
+    BTPage *p = b->levels[level];
+    if (!p) {
+        // First child of the level
+        p = b->levels[level] = page_new(level);
+        if (!p) return -1;
+        p->h.first_child = child;
+        strcpy(b->pending_sep[level], sep);
+        b->used[level] = 0;
+        if (b->height < level + 1) b->height = level + 1;
+        return 0;
+    }
+
+    BTEntry *e = &p->entries[p->h.count];
+    memset(e, 0, sizeof(BTEntry));
+    strcpy(e->key, sep);
+    e->child = child;
+    int size = entry_size(p, p->h.count, p->h.count == 0);
+    if (p->h.count == 0 || b->used[level] + size <= BT_BULK_FILL) {
+        p->h.count++;
+        b->used[level] += size;
+        return 0;
+    }
+
+    // Full: write it out, the new child starts the next page of the level
+    long offset = fs_allocate_page(b->ctx);
+    if (store_page(b->ctx, offset, p) != 0) return -1;
+    if (build_add_child(b, level + 1, b->pending_sep[level], offset) != 0) return -1;
+    p->h.count = 0;
+    p->h.first_child = child;
+    strcpy(b->pending_sep[level], sep);
+    b->used[level] = 0;
+    return 0;
+}
+
+int bt_build_add(BTBuilder *b, const Inode *inode) {
+    BTPage *leaf = b->levels[0];
+    char key[MAX_NAME_LEN];
+    memset(key, 0, sizeof(key));
+    memcpy(key, inode->name, MAX_NAME_LEN - 1);
+    if (key[0] == '\0' || (b->count > 0 && strcmp(key, b->last_key) <= 0)) return -1; // Not in order
+
+    BTEntry *e = &leaf->entries[leaf->h.count];
+    memset(e, 0, sizeof(BTEntry));
+    strcpy(e->key, key);
+    inode_to_value(inode, &e->value);
+    int size = entry_size(leaf, leaf->h.count, leaf->h.count == 0);
+
+    if (leaf->h.count > 0 && b->used[0] + size > BT_BULK_FILL) {
+        // Full: write it out and start the next leaf with this entry
+        long next = fs_allocate_page(b->ctx);
+        leaf->h.next = next;
+        if (store_page(b->ctx, b->leaf_offset, leaf) != 0) return -1;
+        if (build_add_child(b, 1, b->pending_sep[0], b->leaf_offset) != 0) return -1;
+
+        int len = common_prefix(b->last_key, key) + 1;
+        memcpy(b->pending_sep[0], key, len);
+        b->pending_sep[0][len] = '\0';
+        leaf->h.prev = b->leaf_offset;
+        leaf->h.next = BT_NONE;
+        leaf->entries[0] = *e;
+        leaf->h.count = 0;
+        b->leaf_offset = next;
+        b->used[0] = 0;
+        size = entry_size(leaf, 0, 1);
+    }
+    leaf->h.count++;
+    b->used[0] += size;
+    strcpy(b->last_key, key);
+    b->count++;
+    return 0;
+}
+
+long bt_build_finish(BTBuilder *b) {
+    long root = BT_NONE;
+    int res = 0;
+    if (b->count == 0) {
+        fs_release_page(b->ctx, b->leaf_offset);
+    } else {
+        // Close every level bottom-up: the highest page left is the root
+        for (int level = 0; level < b->height && res == 0; level++) {
+            long offset = level == 0 ? b->leaf_offset : fs_allocate_page(b->ctx);
+            if (store_page(b->ctx, offset, b->levels[level]) != 0) {
+                res = -1;
+            } else if (level + 1 < b->height) {
+                res = build_add_child(b, level + 1, b->pending_sep[level], offset);
+            } else {
+                root = offset;
+            }
+        }
+    }
+    for (int level = 0; level < BT_MAX_LEVELS; level++) free(b->levels[level]);
+    memset(b->levels, 0, sizeof(b->levels));
+    return res == 0 ? root : -2;
+}
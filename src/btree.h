@@ -0,0 +1,96 @@
+#ifndef BTREE_H
+#define BTREE_H
+
+#include "fs_structs.h"
+#include "fs_core.h"
+
+// B+tree name index (SuperBlock.index_type == INDEX_BTREE).
+// Pages are FS_PAGE_SIZE bytes, page-aligned in the image, so one lookup reads one cache page
+// per level (3 levels hold about a million files).
+// Entries are sorted by name. Each key is stored as the length of the prefix it shares with the
+// previous key of the page plus the remaining bytes; the first key of a page is stored in full.
+// Leaves hold the inode fields of every file and are chained both ways for ordered scans.
+// Internal pages hold separators (the shortest prefix telling two leaves apart) and child offsets:
+// keys below the first separator are under first_child, keys >= separator i under its child.
+//
+// Like the red-black tree functions, these read and write the image through the page cache and
+// take pages from the context's allocator.
+
+#define BT_NONE (-1L)
+
+typedef struct BTPageHeader {
+    int level;          // 0 = leaf
+    int count;          // Entries in the page
+    int used;           // Bytes of entries after the header
+    int value_size;     // Leaves: bytes stored per inode (older pages may store fewer fields)
+    long next;          // Leaves: right / left neighbours (BT_NONE at the ends)
+    long prev;
+    long first_child;   // Internal pages: child for the keys below the first separator
+} BTPageHeader;
+
+// Fixed fields of an inode as stored in a leaf (the name is the key).
+// New fields go at the end: pages written with a smaller value_size read them as 0.
+typedef struct BTValue {
+    int type;
+    int codec;
+    long parent_offset;
+    long children_offset;
+    long data_offset;
+    long original_size;
+    long compressed_size;
+} BTValue;
+
+// Looks `name` up. Returns 0 and fills *out, or -1 if not found.
+int bt_search(FSContext *ctx, long root_offset, const char *name, Inode *out);
+
+// Inserts an inode (keyed by its name). Updates *root_offset when the root splits.
+// Returns 0 on success, -1 if the name exists.
+int bt_insert(FSContext *ctx, long *root_offset, const Inode *inode);
+
+// Deletes by name, merging underfull pages with a neighbour and releasing emptied pages.
+// Returns 0 and the removed inode in *removed (may be NULL), or -1 if not found.
+int bt_delete(FSContext *ctx, long *root_offset, const char *name, Inode *removed);
+
+// Replaces the fields of an existing entry (same name). Returns 0 on success, -1 if not found.
+// The B+tree only: the hash index and the snapshot (index.h) do not see the change.
+int bt_update(FSContext *ctx, long *root_offset, const Inode *inode);
+
+// Calls visit for every entry in name order, walking the leaf chain (the internal pages in
+// copy-on-write images). Stops early if visit returns non-zero (and returns that value).
+int bt_for_each(FSContext *ctx, long root_offset, FileVisitor visit, void *arg);
+
+// Copy-on-write images (cow.h): pages the published version uses are never written. Insert,
+// update and delete first copy them to new pages along the path they change (and the left
+// neighbour a page merges into); the leaf chain is not kept up to date.
+// bt_relink chains the leaves of a tree again, in place, once copy-on-write is turned off.
+int bt_relink(FSContext *ctx, long root_offset);
+
+// Bulk loading from inodes given in strictly increasing name order (compaction).
+// Leaves are filled to BT_BULK_FILL of a page; each leaf page is allocated when it is started, so
+// whatever the caller allocates meanwhile (the payloads of its files) follows it in the image.
+#define BT_BULK_FILL (FS_PAGE_SIZE * 7 / 8)
+#define BT_MAX_LEVELS 16
+
+typedef struct BTPage BTPage;
+
+typedef struct BTBuilder {
+    FSContext *ctx;
+    BTPage *levels[BT_MAX_LEVELS];                // Page being filled at each level
+    int used[BT_MAX_LEVELS];                      // Its encoded entry bytes
+    char pending_sep[BT_MAX_LEVELS][MAX_NAME_LEN]; // Separator leading to it ("" for the first)
+    long leaf_offset;                             // Where the leaf being filled will go (internal
+                                                  // pages are placed when written)
+    char last_key[MAX_NAME_LEN];
+    int height;
+    long count;
+} BTBuilder;
+
+int bt_build_begin(BTBuilder *b, FSContext *ctx);
+int bt_build_add(BTBuilder *b, const Inode *inode);
+// Writes the pages still open. Returns the root offset (BT_NONE if empty), or -2 on error.
+long bt_build_finish(BTBuilder *b);
+
+// Page reads per level, for print_fs_stats.
+int bt_height(FSContext *ctx, long root_offset);
+
+#endif // BTREE_H
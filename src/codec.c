@@ -0,0 +1,146 @@
+#include "codec.h"
+#include "huffman.h"
+#include "lz.h"
+#include "histogram.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define CODEC_SAMPLE_SLICES 16
+
+// A codec must save at least 1/32 of the size to be worth its CPU cost on reads.
+#define CODEC_MIN_GAIN(size) ((size) / 32)
+
+// Copies the sample into buf: the whole buffer when small, otherwise evenly spaced slices.
+static size_t take_sample(const unsigned char *data, size_t size, unsigned char *buf) {
+    if (size <= CODEC_SAMPLE_SIZE) {
+        memcpy(buf, data, size);
+        return size;
+    }
+    size_t slice = CODEC_SAMPLE_SIZE / CODEC_SAMPLE_SLICES;
+    size_t stride = size / CODEC_SAMPLE_SLICES;
+    for (int i = 0; i < CODEC_SAMPLE_SLICES; i++) {
+        memcpy(buf + i * slice, data + i * stride, slice);
+    }
+    return CODEC_SAMPLE_SIZE;
+}
+
+// Order-0 entropy of the sample in bits per byte (what Huffman can reach, give or take a fraction of a bit).
+static double sample_entropy(const unsigned char *sample, size_t n) {
+    unsigned int freq[MAX_SYMBOLS];
+    byte_histogram(sample, n, freq);
+
+    double bits = 0;
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        if (freq[i]) {
+            double p = (double)freq[i] / n;
+            bits -= p * log2(p);
+        }
+    }
+    return bits;
+}
+
+int choose_codec(const unsigned char *data, size_t size) {
+    if (size < CODEC_MIN_COMPRESS_SIZE) return CODEC_STORED;
+
+    unsigned char *sample = malloc(size < CODEC_SAMPLE_SIZE ? size : CODEC_SAMPLE_SIZE);
+    if (!sample) return CODEC_HUFFMAN;
+    size_t n = take_sample(data, size, sample);
+
+    // Estimated sizes, scaled to the whole file.
+    double entropy = sample_entropy(sample, n);
+    double huffman_size = size * (entropy + 0.05) / 8.0 + HUFFMAN_MAX_HEADER;
+
+    double lz_size = size;
+    size_t lz_sample_size = 0;
+    unsigned char *lz_sample = lz_compress(sample, n, &lz_sample_size);
+    if (lz_sample) {
+        lz_size = (double)size * lz_sample_size / n;
+        free(lz_sample);
+    }
+    free(sample);
+
+    double limit = (double)size - CODEC_MIN_GAIN(size);
+    if (huffman_size >= limit && lz_size >= limit) return CODEC_STORED;
+
+    // LZ decodes several times faster: take it unless Huffman is clearly smaller.
+    if (lz_size <= huffman_size * 1.10) return CODEC_LZ;
+    return CODEC_HUFFMAN;
+}
+
+unsigned char* codec_compress(int codec, const unsigned char *data, size_t size, size_t *out_size) {
+    switch (codec) {
+        case CODEC_HUFFMAN: return compress_data(data, size, out_size);
+        case CODEC_HUFFMAN_X4: return compress_data_x4(data, size, out_size);
+        case CODEC_LZ: return lz_compress(data, size, out_size);
+        case CODEC_HUFFMAN_LEGACY: return compress_data_legacy(data, size, out_size);
+        default: return NULL;
+    }
+}
+
+unsigned char* codec_decompress(int codec, const unsigned char *payload, size_t payload_size, size_t original_size) {
+    switch (codec) {
+        case CODEC_HUFFMAN:
+        case CODEC_HUFFMAN_X4: return decompress_data(payload, payload_size, original_size);
+        case CODEC_LZ: return lz_decompress(payload, payload_size, original_size);
+        case CODEC_HUFFMAN_LEGACY: return decompress_data_legacy(payload, payload_size, original_size);
+        case CODEC_STORED: {
+            if (payload_size != original_size) return NULL;
+            unsigned char *copy = malloc(original_size + 1);
+            if (copy) memcpy(copy, payload, original_size);
+            return copy;
+        }
+        default: return NULL;
+    }
+}
+
+int codec_encode(const unsigned char *data, size_t size, unsigned char **payload, size_t *payload_size) {
+    return codec_encode_as(CODEC_AUTO, data, size, payload, payload_size);
+}
+
+int codec_encode_as(int codec, const unsigned char *data, size_t size, unsigned char **payload, size_t *payload_size) {
+    *payload = NULL;
+    *payload_size = size;
+    if (codec == CODEC_AUTO) codec = choose_codec(data, size);
+    if (codec == CODEC_STORED) return codec;
+
+    size_t compressed_size = 0;
+    unsigned char *compressed = codec_compress(codec, data, size, &compressed_size);
+    if (!compressed) return -1;
+    if (compressed_size >= size) {
+        // The estimate was wrong: keep the bytes as they are
+        free(compressed);
+        return CODEC_STORED;
+    }
+    *payload = compressed;
+    *payload_size = compressed_size;
+    return codec;
+}
+
+const char* codec_name(int codec) {
+    switch (codec) {
+        case CODEC_HUFFMAN: return "huffman";
+        case CODEC_STORED: return "stored";
+        case CODEC_LZ: return "lz";
+        case CODEC_HUFFMAN_LEGACY: return "huffman-v1";
+        case CODEC_BLOCKS: return "blocks";
+        case CODEC_HUFFMAN_X4: return "huffman-x4";
+        case CODEC_HUFFMAN_SHARED: return "huffman-shared";
+        default: return "unknown";
+    }
+}
+
+int codec_from_name(const char *name, int *codec) {
+    static const int requestable[] = { CODEC_HUFFMAN, CODEC_HUFFMAN_X4, CODEC_LZ, CODEC_STORED };
+    if (strcmp(name, "auto") == 0) {
+        *codec = CODEC_AUTO;
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(requestable) / sizeof(requestable[0]); i++) {
+        if (strcmp(name, codec_name(requestable[i])) == 0) {
+            *codec = requestable[i];
+            return 0;
+        }
+    }
+    return -1;
+}
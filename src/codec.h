@@ -0,0 +1,52 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+
+// Per-file payload encoding, recorded in Inode.codec (version >= 2 images).
+typedef enum Codec {
+    CODEC_HUFFMAN = 0,        // Huffman stream (huffman.h), format selected by its version byte
+    CODEC_STORED = 1,         // Raw bytes, for data that does not compress
+    CODEC_LZ = 2,             // Byte-oriented LZ77 (lz.h): fast, good on repeated content
+    CODEC_HUFFMAN_LEGACY = 3, // Frequency-table Huffman stream of version 1 images
+    CODEC_BLOCKS = 4,         // Chain of blocks encoded one by one (stream.h): files written with fs_write
+    CODEC_HUFFMAN_X4 = 5,     // Huffman in 4 interleaved streams (compress_data_x4): faster decode, on request
+    CODEC_HUFFMAN_SHARED = 6  // Bare Huffman bitstream coded with a shared table of the image (dict.h):
+                              // | table id (1) | bitstream |. Decoded by dict_decompress, not codec_decompress
+} Codec;
+
+// Requested codec meaning "let choose_codec decide" (add_file_codec, fs_open_write_codec).
+#define CODEC_AUTO (-1)
+
+// Below this size nothing is worth compressing (headers alone would eat the gain).
+#define CODEC_MIN_COMPRESS_SIZE 64
+// Bytes looked at by choose_codec (several slices spread over larger buffers).
+#define CODEC_SAMPLE_SIZE (64 * 1024)
+
+// Picks a codec from a cheap estimate over a sample of the data:
+// order-0 entropy for Huffman, a trial LZ pass on the sample for repeated content.
+int choose_codec(const unsigned char *data, size_t size);
+
+// Compresses with the given codec (not CODEC_STORED). Returns a buffer the caller must free.
+unsigned char* codec_compress(int codec, const unsigned char *data, size_t size, size_t *out_size);
+
+// Decompresses a payload written with `codec` (not CODEC_BLOCKS, whose blocks are decoded one by one).
+// Returns a buffer the caller must free, or NULL.
+unsigned char* codec_decompress(int codec, const unsigned char *payload, size_t payload_size, size_t original_size);
+
+// choose_codec + codec_compress, falling back to CODEC_STORED when the output is not smaller.
+// Returns the codec (or -1 on error). *payload is a buffer the caller must free, or NULL for
+// CODEC_STORED (the payload is `data` itself).
+int codec_encode(const unsigned char *data, size_t size, unsigned char **payload, size_t *payload_size);
+
+// Same with a codec picked by the caller (CODEC_AUTO = choose_codec). Still stored when the output
+// is not smaller.
+int codec_encode_as(int codec, const unsigned char *data, size_t size, unsigned char **payload, size_t *payload_size);
+
+const char* codec_name(int codec);
+
+// Codec a user can request by name: "auto" (CODEC_AUTO), "huffman", "huffman-x4", "lz" or "stored".
+// Returns 0 and sets *codec, or -1 for any other name.
+int codec_from_name(const char *name, int *codec);
+
+#endif // CODEC_H
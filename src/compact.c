@@ -0,0 +1,242 @@
+#include "compact.h"
+#include "fs_core.h"
+#include "btree.h"
+#include "allocator.h"
+#include "codec.h"
+#include "stream.h"
+#include "dict.h"
+#include "snapshot.h"
+#include "hash_table.h"
+#include "directory.h"
+#include "cow.h"
+#include "dedup.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+typedef struct CompactState {
+    FSContext *dst;
+    BTBuilder builder;
+    DirBuilder dirs;            // Used instead of builder when the new image has directories
+    int use_dirs;
+    long count;
+    long recoded;
+} CompactState;
+
+// Inodes of a flat image, to be put in path order.
+typedef struct InodeList {
+    Inode *inodes;
+    long count;
+    long cap;
+} InodeList;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long file_size_of(const char *filename) {
+    struct stat st;
+    return stat(filename, &st) == 0 ? (long)st.st_size : -1;
+}
+
+static int add_inode(CompactState *st, const Inode *inode) {
+    return st->use_dirs ? dir_build_add(&st->dirs, inode) : bt_build_add(&st->builder, inode);
+}
+
+static int copy_file(FSContext *src, const Inode *inode, void *arg) {
+    CompactState *st = arg;
+
+    if (inode->type == DIRECTORY_NODE) return add_inode(st, inode); // Its tree is rebuilt
+    if (inode->codec == CODEC_BLOCKS) {
+        // Large file written in blocks: copied a block at a time
+        Inode copy = *inode;
+        copy.data_offset = copy_blocks(src, inode->data_offset, st->dst);
+        if (copy.data_offset == -1) return -1;
+        st->count++;
+        return add_inode(st, &copy);
+    }
+
+    // A payload files share (dedup.h) is copied with the first of them, the others share the copy
+    DedupRecord shared;
+    int dedup = dedup_find_offset(src, inode->data_offset, inode->compressed_size, &shared) == 0;
+    if (dedup) {
+        DedupRecord copied;
+        if (dedup_lookup(st->dst, &shared.hash, NULL, shared.original_size, &copied) == 0) {
+            Inode copy = *inode;
+            copy.data_offset = copied.data_offset;
+            if (dedup_ref(st->dst, &copied) != 0) return -1;
+            st->count++;
+            return add_inode(st, &copy);
+        }
+    }
+
+    unsigned char *payload = malloc(inode->compressed_size + 1);
+    if (!payload) return -1;
+    if (cache_read(&src->cache, inode->data_offset, payload, inode->compressed_size) != 0) {
+        free(payload);
+        return -1;
+    }
+
+    Inode copy = *inode;
+    if (copy.codec == CODEC_HUFFMAN_LEGACY) {
+        // Version 1 stream: re-encode with the current codecs
+        unsigned char *data = codec_decompress(CODEC_HUFFMAN_LEGACY, payload, copy.compressed_size, copy.original_size);
+        if (!data) {
+            free(payload);
+            return -1;
+        }
+        unsigned char *encoded = NULL;
+        size_t encoded_size = 0;
+        copy.codec = dict_encode(st->dst, CODEC_AUTO, data, copy.original_size, &encoded, &encoded_size);
+        if (copy.codec < 0) {
+            free(data);
+            free(payload);
+            return -1;
+        }
+        free(payload);
+        if (encoded) {
+            free(data);
+            payload = encoded;
+        } else {
+            payload = data; // Stored
+        }
+        copy.compressed_size = encoded_size;
+        st->recoded++;
+    }
+
+    // Payloads follow each other in name order, right after the leaf that indexes them
+    copy.data_offset = fs_allocate(st->dst, copy.compressed_size);
+    int res = cache_write(&st->dst->cache, copy.data_offset, payload, copy.compressed_size);
+    free(payload);
+    if (res != 0) return -1;
+    if (dedup && dedup_insert(st->dst, &shared.hash, &copy) != 0) return -1;
+
+    st->count++;
+    return add_inode(st, &copy);
+}
+
+static int collect_inode(FSContext *ctx, const Inode *inode, void *arg) {
+    InodeList *list = arg;
+    if (list->count == list->cap) {
+        long cap = list->cap ? list->cap * 2 : 1024;
+        Inode *grown = realloc(list->inodes, cap * sizeof(Inode));
+        if (!grown) return -1;
+        list->inodes = grown;
+        list->cap = cap;
+    }
+    list->inodes[list->count++] = *inode;
+    return 0;
+}
+
+static int compare_inode_paths(const void *a, const void *b) {
+    return dir_compare_paths(((const Inode *)a)->name, ((const Inode *)b)->name);
+}
+
+// A flat image gets directories if its names make a tree: valid paths, none below a file (which
+// comes right before them in path order). Sorts the list.
+static int forms_tree(InodeList *list) {
+    qsort(list->inodes, list->count, sizeof(Inode), compare_inode_paths);
+    for (long i = 0; i < list->count; i++) {
+        const char *name = list->inodes[i].name;
+        if (!dir_valid_path(name)) return 0;
+        if (i + 1 < list->count) {
+            size_t len = strlen(name);
+            const char *next = list->inodes[i + 1].name;
+            if (strncmp(next, name, len) == 0 && next[len] == '/') return 0;
+        }
+    }
+    return 1;
+}
+
+// Make the rename itself durable.
+static void sync_parent_dir(const char *filename) {
+    char *copy = strdup(filename);
+    if (!copy) return;
+    int fd = open(dirname(copy), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(copy);
+}
+
+int compact_filesystem(const char *filename, CompactReport *report) {
+    memset(report, 0, sizeof(CompactReport));
+    double start = now_seconds();
+    report->old_size = file_size_of(filename);
+
+    FSContext src;
+    if (load_filesystem(filename, &src) != 0) return -2;
+
+    // The new image is written next to the original, then renamed over it
+    size_t name_len = strlen(filename) + sizeof(".compact");
+    char *tmp_name = malloc(name_len);
+    if (!tmp_name) {
+        close_filesystem(&src);
+        return -1;
+    }
+    snprintf(tmp_name, name_len, "%s.compact", filename);
+
+    // The new image has directories. A flat one is converted when its names allow it: they are
+    // copied in path order rather than in name order.
+    CompactState st;
+    memset(&st, 0, sizeof(CompactState));
+    InodeList flat;
+    memset(&flat, 0, sizeof(InodeList));
+    int res = 0;
+    st.use_dirs = 1;
+    if (!dir_enabled(&src)) {
+        res = for_each_file(&src, collect_inode, &flat) == 0 ? 0 : -1;
+        st.use_dirs = res == 0 && forms_tree(&flat);
+    }
+
+    FSContext dst;
+    if (res == 0) res = init_filesystem(tmp_name) == 0 && load_filesystem(tmp_name, &dst) == 0 ? 0 : -1;
+    if (res == 0) {
+        st.dst = &dst;
+        dst.sb.directories = st.use_dirs;
+        // Same tables under the same ids: payloads that use them are copied as they are
+        res = dict_copy(&src, &dst);
+        if (res == 0 && dedup_enabled(&src)) res = dedup_create(&dst);
+        if (res == 0) res = st.use_dirs ? dir_build_begin(&st.dirs, &dst) : bt_build_begin(&st.builder, &dst);
+        if (st.use_dirs && !dir_enabled(&src)) {
+            for (long i = 0; i < flat.count && res == 0; i++) res = copy_file(&src, &flat.inodes[i], &st);
+        } else if (res == 0 && for_each_file(&src, copy_file, &st) != 0) {
+            res = -1;
+        }
+
+        long root = st.use_dirs ? dir_build_finish(&st.dirs) : bt_build_finish(&st.builder);
+        if (root == -2) res = -1;
+        dst.sb.root_inode_offset = root;
+        if (res == 0 && !src.cow && ht_build(&dst) != 0) res = -1;
+        // An image that kept a snapshot keeps one, a copy-on-write image stays one
+        if (res == 0 && src.sb.snapshot_offset != 0 && snapshot_write(&dst) != 0) res = -1;
+        if (res == 0 && src.cow && cow_enable(&dst) != 0) res = -1;
+        if (res == 0 && sync_filesystem(&dst) != 0) res = -1;
+        close_filesystem(&dst);
+    }
+    close_filesystem(&src);
+    free(flat.inodes);
+
+    if (res == 0 && rename(tmp_name, filename) != 0) res = -1;
+    if (res != 0) {
+        unlink(tmp_name);
+        free(tmp_name);
+        return -1;
+    }
+    sync_parent_dir(filename);
+    free(tmp_name);
+
+    report->files = st.count;
+    report->recoded = st.recoded;
+    report->new_size = file_size_of(filename);
+    report->seconds = now_seconds() - start;
+    return 0;
+}
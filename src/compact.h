@@ -0,0 +1,36 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+// Compaction (vacuum) of an image file.
+// Live files are copied in name order into a fresh image next to the original, indexed by a
+// B+tree built bottom-up: each leaf page is followed by the payloads of its files, so a traversal
+// reads the image sequentially. Dead nodes, orphaned payloads and free extents are left behind.
+// The new image replaces the original with an atomic rename.
+// This is also the migration path of red-black tree images (version 1 and older version 2) to
+// the B+tree index, and of flat images to directories (directory.h): their names are taken as
+// paths, sorted in path order (the inodes are held in memory for that), unless some are not valid
+// paths or lead below a file, in which case the image stays flat. Images with directories are
+// copied a directory at a time, each one's tree built bottom-up.
+// Files are copied one at a time, files written in blocks (stream.h) one block at a time: memory
+// use is bounded by the largest file stored in one piece, not by the image.
+//
+// Version 1 images come out as current-version images, their legacy Huffman payloads re-encoded
+// with the codec add_file would pick.
+// The new image gets a hash index of the names (hash_table.h). Shared code tables are copied under
+// the same ids (dict.h); an image that kept an index snapshot (snapshot.h) gets a fresh one.
+// An image with dedup (dedup.h) keeps it: a payload shared by several files is copied once.
+
+typedef struct CompactReport {
+    long files;
+    long old_size;      // Bytes on disk before / after
+    long new_size;
+    long recoded;       // Payloads re-encoded (legacy Huffman streams)
+    double seconds;     // Wall time
+} CompactReport;
+
+// Compacts `filename` in place. Contexts that have the image open must be closed first, and
+// loaded again afterwards (the file is replaced).
+// Returns 0 on success, -1 on I/O error (the original is untouched), -2 if it cannot be loaded.
+int compact_filesystem(const char *filename, CompactReport *report);
+
+#endif // COMPACT_H
@@ -0,0 +1,522 @@
+#include "cow.h"
+#include "btree.h"
+#include "directory.h"
+#include "hash_table.h"
+#include "dedup.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static long sb_checksum(const SuperBlock *sb) {
+    uint64_t h = 1469598103934665603ULL; // FNV-1a
+    const unsigned char *p = (const unsigned char *)sb;
+    for (size_t i = 0; i < offsetof(SuperBlock, checksum); i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return (long)h;
+}
+
+static int slot_valid(const SuperBlock *sb) {
+    return sb->magic_number == MAGIC_NUMBER_V2 && sb->checksum == sb_checksum(sb);
+}
+
+int cow_select_superblock(FSContext *ctx) {
+    SuperBlock other;
+    if (cache_read(&ctx->cache, COW_SLOT_SIZE, &other, sizeof(SuperBlock)) != 0) return -1;
+    // Slot 1 only ever holds copy-on-write SuperBlocks. While it holds a valid one, slot 0 counts
+    // only if its checksum is right too (a torn write there); otherwise slot 0 is a plain SuperBlock.
+    int other_valid = other.cow == 1 && slot_valid(&other);
+    int first_valid = other_valid || ctx->sb.cow == 1 ? slot_valid(&ctx->sb) : 1;
+    if (other_valid && (!first_valid || other.epoch > ctx->sb.epoch)) {
+        ctx->sb = other;
+        return 0;
+    }
+    return first_valid ? 0 : -1;
+}
+
+// --- Free lists ---
+
+static int list_push(CowExtentList *l, long offset, long size, long epoch) {
+    if (l->count == l->capacity) {
+        long capacity = l->capacity ? l->capacity * 2 : 256;
+        CowExtent *grown = realloc(l->items, capacity * sizeof(CowExtent));
+        if (!grown) return -1;
+        l->items = grown;
+        l->capacity = capacity;
+    }
+    l->items[l->count].offset = offset;
+    l->items[l->count].size = size;
+    l->items[l->count].epoch = epoch;
+    l->count++;
+    return 0;
+}
+
+static int is_page(long offset, long size) {
+    return size == FS_PAGE_SIZE && (offset & (FS_PAGE_SIZE - 1)) == 0;
+}
+
+// Free space goes to the page list when it is exactly an index page.
+static int push_free(CowState *s, const CowExtent *e) {
+    return list_push(is_page(e->offset, e->size) ? &s->pages : &s->extents, e->offset, e->size, e->epoch);
+}
+
+static uint64_t page_hash(long offset) {
+    return (uint64_t)(offset / FS_PAGE_SIZE) * 0x9E3779B97F4A7C15ULL;
+}
+
+static int fresh_contains(const CowState *s, long offset) {
+    if (s->fresh_count == 0) return 0;
+    for (long i = page_hash(offset) & (s->fresh_capacity - 1);; i = (i + 1) & (s->fresh_capacity - 1)) {
+        if (s->fresh[i] == offset) return 1;
+        if (s->fresh[i] == 0) return 0;
+    }
+}
+
+static void fresh_put(CowState *s, long offset) {
+    if ((s->fresh_count + 1) * 2 > s->fresh_capacity) {
+        long capacity = s->fresh_capacity ? s->fresh_capacity * 2 : 1024;
+        long *grown = calloc(capacity, sizeof(long));
+        // Without room the page is shadowed again on its next change: wasteful, not wrong
+        if (!grown) return;
+        for (long i = 0; i < s->fresh_capacity; i++) {
+            long offset_i = s->fresh[i];
+            if (offset_i == 0) continue;
+            long j = page_hash(offset_i) & (capacity - 1);
+            while (grown[j] != 0) j = (j + 1) & (capacity - 1);
+            grown[j] = offset_i;
+        }
+        free(s->fresh);
+        s->fresh = grown;
+        s->fresh_capacity = capacity;
+    }
+    long i = page_hash(offset) & (s->fresh_capacity - 1);
+    while (s->fresh[i] != 0 && s->fresh[i] != offset) i = (i + 1) & (s->fresh_capacity - 1);
+    if (s->fresh[i] == 0) s->fresh_count++;
+    s->fresh[i] = offset;
+}
+
+// Space can be handed out once no pinned version uses it: its epoch is at most the oldest version
+// a reader pinned (the published one when there is none). Never decreases: pins are taken on the
+// published version.
+static long oldest_pinned(CowState *s) {
+    pthread_mutex_lock(&s->lock);
+    long oldest = s->published.epoch;
+    for (long i = 0; i < s->pin_count; i++) {
+        if (s->pins[i] < oldest) oldest = s->pins[i];
+    }
+    pthread_mutex_unlock(&s->lock);
+    return oldest;
+}
+
+int cow_is_fresh(FSContext *ctx, long page_offset) {
+    CowState *s = ctx->cow;
+    return !s || page_offset >= s->published_end || fresh_contains(s, page_offset);
+}
+
+long cow_take_page(FSContext *ctx) {
+    CowState *s = ctx->cow;
+    if (s->pages.count == 0) return 0;
+    long offset = s->pages.items[--s->pages.count].offset;
+    if (offset < s->published_end) fresh_put(s, offset);
+    s->changed = 1;
+    return offset;
+}
+
+long cow_take(FSContext *ctx, long size) {
+    CowState *s = ctx->cow;
+    CowExtentList *l = &s->extents;
+    // Most recently released first, like the bins (allocator.h)
+    for (long i = l->count - 1, scanned = 0; i >= 0 && scanned < FS_FREE_SCAN; i--, scanned++) {
+        CowExtent *e = &l->items[i];
+        if (e->size == size || e->size >= size + FS_FREE_MIN) {
+            long offset = e->offset;
+            if (e->size == size) {
+                *e = l->items[--l->count];
+            } else {
+                e->offset += size;
+                e->size -= size;
+            }
+            s->changed = 1;
+            return offset;
+        }
+    }
+
+    // A free index page, the tail back to the extents
+    if (size != FS_PAGE_SIZE && size > FS_PAGE_SIZE - FS_FREE_MIN) return 0;
+    long offset = cow_take_page(ctx);
+    if (offset != 0 && size < FS_PAGE_SIZE) list_push(&s->extents, offset + size, FS_PAGE_SIZE - size, 0);
+    return offset;
+}
+
+void cow_give(FSContext *ctx, long offset, long size) {
+    CowState *s = ctx->cow;
+    CowExtent e;
+    e.offset = offset;
+    e.size = size;
+    e.epoch = 0;
+    s->changed = 1;
+    // Space the published version does not use is free right away (no pinned version uses it
+    // either: it was taken after them); the rest waits for the next publication
+    if (offset >= s->published_end || (is_page(offset, size) && fresh_contains(s, offset))) {
+        push_free(s, &e);
+    } else {
+        list_push(&s->released, offset, size, s->published.epoch + 1);
+    }
+}
+
+void cow_free_space_stats(FSContext *ctx, FreeSpaceStats *stats) {
+    CowState *s = ctx->cow;
+    const CowExtentList *lists[3] = { &s->extents, &s->released, &s->waiting };
+    for (int k = 0; k < 3; k++) {
+        for (long i = 0; i < lists[k]->count; i++) {
+            const CowExtent *e = &lists[k]->items[i];
+            if (is_page(e->offset, e->size)) {
+                stats->free_pages++;
+                continue;
+            }
+            stats->free_extents++;
+            stats->free_bytes += e->size;
+            if (e->size > stats->largest_extent) stats->largest_extent = e->size;
+        }
+    }
+    stats->free_pages += s->pages.count;
+}
+
+static int compare_offsets(const void *a, const void *b) {
+    long oa = ((const CowExtent *)a)->offset, ob = ((const CowExtent *)b)->offset;
+    return (oa > ob) - (oa < ob);
+}
+
+// Joins adjacent free extents, and gives one at the end of the used space back to
+// next_free_page_offset, like fs_merge_free_space.
+static void merge_extents(FSContext *ctx, CowState *s) {
+    CowExtentList *l = &s->extents;
+    if (l->count == 0) return;
+    qsort(l->items, l->count, sizeof(CowExtent), compare_offsets);
+    long merged = 0;
+    for (long i = 0; i < l->count; i++) {
+        CowExtent *last = merged > 0 ? &l->items[merged - 1] : NULL;
+        if (last && last->offset + last->size == l->items[i].offset) {
+            last->size += l->items[i].size;
+            if (l->items[i].epoch > last->epoch) last->epoch = l->items[i].epoch;
+        } else {
+            l->items[merged++] = l->items[i];
+        }
+    }
+    l->count = merged;
+    CowExtent *last = &l->items[merged - 1];
+    if (last->offset + last->size >= ctx->sb.next_free_page_offset) {
+        ctx->sb.next_free_page_offset = last->offset;
+        ctx->sb.fs_size = last->offset;
+        l->count--;
+    }
+}
+
+// --- Publication ---
+
+int cow_publish(FSContext *ctx) {
+    CowState *s = ctx->cow;
+    if (!s) return 0;
+    s->stats.operations += s->pending;
+    s->pending = 0;
+    if (!s->changed && memcmp(&ctx->sb, &s->published, sizeof(SuperBlock)) == 0) return 0;
+    merge_extents(ctx, s);
+
+    // The free space of the new version: the free lists, what was released since the last
+    // publication, and the table pages of the published version, which the new one does not use
+    // (readers do not read the table: its pages do not wait for them, epoch 0)
+    for (long i = 0; i < s->table.count; i++) {
+        if (list_push(&s->released, s->table.items[i].offset, FS_PAGE_SIZE, 0) != 0) return -1;
+    }
+    s->table.count = 0;
+    ctx->sb.cow_free_offset = 0;
+
+    // Pages for the table first: taking them can only remove entries, but for the alignment gap
+    // a page at the end of the image may leave (one more entry)
+    long count = s->pages.count + s->extents.count + s->released.count + s->waiting.count;
+    long needed = 1;
+    while (needed * COW_TABLE_ENTRIES < count + 1) needed++;
+    for (long i = 0; i < needed; i++) {
+        if (list_push(&s->table, fs_allocate_page(ctx), FS_PAGE_SIZE, ctx->sb.epoch + 1) != 0) return -1;
+    }
+
+    // Entries in order through the pages, the last page holding what is left
+    const CowExtentList *lists[4] = { &s->pages, &s->extents, &s->released, &s->waiting };
+    int list = 0;
+    long from = 0;
+    int res = 0;
+    for (long i = 0; i < s->table.count && res == 0; i++) {
+        unsigned char page[FS_PAGE_SIZE];
+        memset(page, 0, sizeof(page));
+        CowTableHeader h;
+        h.magic = COW_TABLE_MAGIC;
+        h.count = 0;
+        h.next = i + 1 < s->table.count ? s->table.items[i + 1].offset : 0;
+        CowExtent *out = (CowExtent *)(page + sizeof(CowTableHeader));
+        while (h.count < COW_TABLE_ENTRIES && list < 4) {
+            if (from == lists[list]->count) {
+                list++;
+                from = 0;
+                continue;
+            }
+            out[h.count++] = lists[list]->items[from++];
+        }
+        memcpy(page, &h, sizeof(CowTableHeader));
+        res = cache_write(&ctx->cache, s->table.items[i].offset, page, FS_PAGE_SIZE);
+    }
+    if (res != 0) return -1;
+    ctx->sb.cow_free_offset = s->table.items[0].offset;
+
+    // Everything the new SuperBlock points to must be on disk before it is
+    res = cache_sync(&ctx->cache);
+    if (res == 0) res = fdatasync(ctx->cache.fd);
+    if (res != 0) return -1;
+    s->stats.fsyncs++;
+
+    // Into the slot of the older version: the published one is not touched until this one is on disk
+    ctx->sb.epoch++;
+    ctx->sb.checksum = sb_checksum(&ctx->sb);
+    res = cache_write(&ctx->cache, (ctx->sb.epoch % 2) * COW_SLOT_SIZE, &ctx->sb, sizeof(SuperBlock));
+    if (res == 0) res = cache_sync(&ctx->cache);
+    if (res == 0) res = fdatasync(ctx->cache.fd);
+    if (res != 0) {
+        ctx->sb.epoch--; // A retry writes the same slot again
+        return -1;
+    }
+    s->stats.fsyncs++;
+    s->stats.publications++;
+
+    pthread_mutex_lock(&s->lock);
+    s->published = ctx->sb;
+    pthread_mutex_unlock(&s->lock);
+
+    // The new version is current: what only the previous ones used is free, unless a reader
+    // still reads one of them
+    long oldest = oldest_pinned(s);
+    long kept = 0;
+    for (long i = 0; i < s->waiting.count; i++) {
+        if (s->waiting.items[i].epoch <= oldest) {
+            push_free(s, &s->waiting.items[i]);
+        } else {
+            s->waiting.items[kept++] = s->waiting.items[i];
+        }
+    }
+    s->waiting.count = kept;
+    for (long i = 0; i < s->released.count; i++) {
+        const CowExtent *e = &s->released.items[i];
+        if (e->epoch <= oldest) {
+            push_free(s, e);
+        } else {
+            list_push(&s->waiting, e->offset, e->size, e->epoch);
+        }
+    }
+    s->released.count = 0;
+    if (s->fresh) memset(s->fresh, 0, s->fresh_capacity * sizeof(long));
+    s->fresh_count = 0;
+    s->published_end = ctx->sb.next_free_page_offset;
+    s->changed = 0;
+    return 0;
+}
+
+int cow_end_operation(FSContext *ctx) {
+    CowState *s = ctx->cow;
+    if (!s) return 0;
+    s->pending++;
+    if (s->group_commit > 0 && s->pending >= s->group_commit) return cow_publish(ctx);
+    return 0;
+}
+
+// --- Setup ---
+
+static CowState* new_state(FSContext *ctx, int group_commit) {
+    CowState *s = calloc(1, sizeof(CowState));
+    if (!s) return NULL;
+    if (pthread_mutex_init(&s->lock, NULL) != 0) {
+        free(s);
+        return NULL;
+    }
+    s->group_commit = group_commit;
+    s->published = ctx->sb;
+    s->published_end = ctx->sb.next_free_page_offset;
+    return s;
+}
+
+static void free_state(CowState *s) {
+    if (!s) return;
+    free(s->pages.items);
+    free(s->extents.items);
+    free(s->released.items);
+    free(s->waiting.items);
+    free(s->table.items);
+    free(s->fresh);
+    free(s->pins);
+    pthread_mutex_destroy(&s->lock);
+    free(s);
+}
+
+int cow_load(FSContext *ctx, int group_commit) {
+    CowState *s = new_state(ctx, group_commit);
+    if (!s) return -1;
+    // A chain longer than the image has pages is a loop
+    long max_pages = ctx->sb.next_free_page_offset / FS_PAGE_SIZE;
+    int res = 0;
+    for (long offset = ctx->sb.cow_free_offset; offset != 0 && res == 0; ) {
+        unsigned char page[FS_PAGE_SIZE];
+        CowTableHeader h;
+        res = s->table.count < max_pages ? cache_read(&ctx->cache, offset, page, FS_PAGE_SIZE) : -1;
+        if (res == 0) {
+            memcpy(&h, page, sizeof(CowTableHeader));
+            if (h.magic != COW_TABLE_MAGIC || h.count < 0 || h.count > COW_TABLE_ENTRIES) res = -1;
+        }
+        if (res != 0) break; // h was not read, or is damaged
+        res = list_push(&s->table, offset, FS_PAGE_SIZE, ctx->sb.epoch);
+        const CowExtent *entries = (const CowExtent *)(page + sizeof(CowTableHeader));
+        for (long i = 0; i < h.count && res == 0; i++) res = push_free(s, &entries[i]);
+        if (res == 0) offset = h.next;
+    }
+    if (res != 0) {
+        free_state(s);
+        return -1;
+    }
+    ctx->cow = s;
+    return 0;
+}
+
+void cow_unload(FSContext *ctx) {
+    free_state(ctx->cow);
+    ctx->cow = NULL;
+}
+
+int cow_pin(FSContext *ctx, SuperBlock *out) {
+    CowState *s = ctx->cow;
+    if (!s) return -1;
+    pthread_mutex_lock(&s->lock);
+    int res = 0;
+    if (s->pin_count == s->pin_capacity) {
+        long capacity = s->pin_capacity ? s->pin_capacity * 2 : 16;
+        long *grown = realloc(s->pins, capacity * sizeof(long));
+        if (grown) {
+            s->pins = grown;
+            s->pin_capacity = capacity;
+        } else {
+            res = -1;
+        }
+    }
+    if (res == 0) {
+        *out = s->published;
+        s->pins[s->pin_count++] = s->published.epoch;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return res;
+}
+
+void cow_unpin(FSContext *ctx, long epoch) {
+    CowState *s = ctx->cow;
+    if (!s) return;
+    pthread_mutex_lock(&s->lock);
+    for (long i = 0; i < s->pin_count; i++) {
+        if (s->pins[i] == epoch) {
+            s->pins[i] = s->pins[--s->pin_count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Moves a persisted free list (FreeExtent headers, allocator.h) to `released`.
+static int collect_free_list(FSContext *ctx, CowState *s, long head) {
+    for (long offset = head; offset != 0; ) {
+        FreeExtent ext;
+        if (cache_read(&ctx->cache, offset, &ext, sizeof(FreeExtent)) != 0) return -1;
+        if (list_push(&s->released, offset, ext.size, ctx->sb.epoch + 1) != 0) return -1;
+        offset = ext.next;
+    }
+    return 0;
+}
+
+int cow_enable(FSContext *ctx) {
+    if (ctx->cow) return 0;
+    if (ctx->sb.version < 2 || ctx->sb.index_type != INDEX_BTREE || ctx->cache.journal) return -1;
+
+    // So is the dedup index, which files sharing a payload cannot do without
+    if (dedup_drop(ctx) != 0) return -1;
+    // Hash slots are updated in place on every insert: lookups go through the trees instead
+    ht_drop(ctx);
+    if (ctx->pending_releases > 0) fs_merge_free_space(ctx);
+    if (sync_filesystem(ctx) != 0) return -2;
+
+    CowState *s = new_state(ctx, 0);
+    if (!s) return -2;
+    // The free lists' headers sit in their extents and the image on disk still uses them: they
+    // are free from the first publication on, not before (a crash before it leaves that image)
+    int res = 0;
+    for (int bin = 0; bin < FS_FREE_BINS && res == 0; bin++) res = collect_free_list(ctx, s, ctx->sb.free_bins[bin]);
+    if (res == 0) res = collect_free_list(ctx, s, ctx->sb.free_pages);
+    if (res != 0) {
+        free_state(s);
+        return -2;
+    }
+    memset(ctx->sb.free_bins, 0, sizeof(ctx->sb.free_bins));
+    ctx->sb.free_pages = 0;
+    ctx->sb.cow = 1;
+    ctx->sb.cow_free_offset = 0;
+    s->changed = 1;
+    ctx->cow = s;
+    return cow_publish(ctx) == 0 ? 0 : -2;
+}
+
+static int relink_directory(FSContext *ctx, const Inode *inode, void *arg) {
+    (void)arg;
+    if (inode->type != DIRECTORY_NODE) return 0;
+    return bt_relink(ctx, inode->children_offset);
+}
+
+int cow_disable(FSContext *ctx) {
+    CowState *s = ctx->cow;
+    if (!s) return 0;
+    pthread_mutex_lock(&s->lock);
+    long readers = s->pin_count;
+    pthread_mutex_unlock(&s->lock);
+    if (readers > 0) return -1; // Relinking writes pages of the versions they read
+    if (cow_publish(ctx) != 0) return -2;
+    // The plain SuperBlock goes to slot 0: the current version must be in slot 1 meanwhile
+    if (ctx->sb.epoch % 2 == 0) {
+        s->changed = 1;
+        if (cow_publish(ctx) != 0) return -2;
+    }
+
+    // Only the leaf links change in the pages of the current version: it stays readable as it is
+    int res = bt_relink(ctx, ctx->sb.root_inode_offset);
+    if (res == 0 && dir_enabled(ctx)) res = dir_for_each(ctx, relink_directory, NULL);
+    if (res != 0) return -2;
+
+    // Back to the persisted free lists. Their headers go into space that the current version
+    // does not use, except the free space table: it is given back once the plain image is on disk.
+    ctx->cow = NULL;
+    for (long i = 0; i < s->pages.count; i++) fs_release_page(ctx, s->pages.items[i].offset);
+    for (long i = 0; i < s->extents.count; i++) fs_release(ctx, s->extents.items[i].offset, s->extents.items[i].size);
+    ctx->sb.cow = 0;
+    ctx->sb.cow_free_offset = 0;
+    ctx->sb.epoch++;
+    ctx->sb.checksum = sb_checksum(&ctx->sb);
+
+    SuperBlock cleared;
+    memset(&cleared, 0, sizeof(SuperBlock));
+    res = sync_superblock(ctx);
+    if (res == 0) res = cache_sync(&ctx->cache);
+    if (res == 0) res = fdatasync(ctx->cache.fd);
+    if (res == 0) res = cache_write(&ctx->cache, COW_SLOT_SIZE, &cleared, sizeof(SuperBlock));
+    if (res == 0) res = cache_sync(&ctx->cache);
+    if (res == 0) res = fdatasync(ctx->cache.fd);
+    if (res == 0) {
+        for (long i = 0; i < s->table.count; i++) fs_release_page(ctx, s->table.items[i].offset);
+    }
+    free_state(s);
+    if (res != 0) return -2;
+
+    if (ht_build(ctx) != 0) ht_drop(ctx);
+    return sync_filesystem(ctx) == 0 ? 0 : -2;
+}
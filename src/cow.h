@@ -0,0 +1,128 @@
+#ifndef COW_H
+#define COW_H
+
+#include "fs_core.h"
+#include "allocator.h"
+#include <pthread.h>
+
+// Copy-on-write images (SuperBlock.cow, B+tree index).
+// No page of the published version is ever written: the first change of a B+tree page since the
+// last publication writes a copy of it on a new page, and of every page above it up to the root
+// (btree.h); later changes in the same round update the copy in place. Payloads, the index pages
+// and the other sections all go to space that is free in the published version, mostly appended
+// at the end of the image. cow_publish then makes the new version durable with two fsyncs: first
+// everything it points to, then a SuperBlock naming its roots.
+//
+// The header holds two SuperBlock slots, written in turn: a publication overwrites the older one,
+// so the published SuperBlock is never written over and a torn write leaves the other one (the
+// checksum tells). load_filesystem takes the valid slot with the highest epoch: after a crash the
+// image is the last published version, whatever was written after it.
+//
+// Released space cannot be reused while the published version may still point to it: it waits
+// for the next publication. The free space of each version is kept in a table of its own
+// (cow_free_offset), written at publication on a chain of index pages, which are recycled like
+// the pages of the trees; the free lists of the SuperBlock are not used.
+// The hash index is not kept (lookups go through the trees), nor the dedup index (dedup.h), nor
+// the leaf chains of the B+tree (scans walk the tree): cow_disable links the leaves again.
+//
+// A context that loaded the image reads the version published at that time: it stays intact until
+// the writer publishes the next one, after which the space it no longer uses is handed out again.
+// Readers in the writer's process (reader.h) pin the version they read instead: released space
+// keeps the first version that no longer uses it (CowExtent.epoch) and waits until every pinned
+// version is at least that recent.
+
+#define COW_SLOT_SIZE (FS_HEADER_SIZE / 2)       // Slot i at offset i * COW_SLOT_SIZE
+#define COW_TABLE_MAGIC 0x434F5746L             // "COWF"
+
+typedef struct CowExtent {
+    long offset;
+    long size;
+    long epoch;             // First version that does not use it (readers of older ones may)
+} CowExtent;
+
+// Page of the free space table: header, then `count` CowExtent records.
+typedef struct CowTableHeader {
+    long magic;
+    long count;
+    long next;              // Next page of the table, 0 = last
+} CowTableHeader;
+
+#define COW_TABLE_ENTRIES ((long)((FS_PAGE_SIZE - sizeof(CowTableHeader)) / sizeof(CowExtent)))
+
+typedef struct CowStats {
+    long publications;
+    long fsyncs;
+    long shadowed;          // Pages copied on their first change since a publication
+    long operations;        // Operations published
+} CowStats;
+
+typedef struct CowExtentList {
+    CowExtent *items;
+    long count;
+    long capacity;
+} CowExtentList;
+
+typedef struct CowState {
+    int group_commit;       // Operations per publication (0: only on sync_filesystem / close)
+    int pending;            // Operations since the last publication
+    int changed;            // Something was allocated or released since the last publication
+    SuperBlock published;   // Last published SuperBlock
+    long published_end;     // Its next_free_page_offset: space past it is not used by the published version
+    CowExtentList table;    // Pages of the free space table of the current version
+    CowExtentList pages;    // Free index pages (FS_PAGE_SIZE, page-aligned)
+    CowExtentList extents;  // Other free extents
+    CowExtentList released; // Released since the last publication: still used by the published version
+    CowExtentList waiting;  // Released earlier, still used by a version a reader pinned
+    long *fresh;            // Pages taken from the free list since the last publication (open addressing, 0 = empty)
+    long fresh_capacity;
+    long fresh_count;
+    CowStats stats;
+    pthread_mutex_t lock;   // Guards `published` and the pins, which reader threads use
+    long *pins;             // Epoch read by each open reader (reader.h)
+    long pin_count;
+    long pin_capacity;
+} CowState;
+
+// Picks the current SuperBlock once slot 0 is in ctx->sb (load_filesystem). Returns 0, or -1 if
+// neither slot is valid.
+int cow_select_superblock(FSContext *ctx);
+
+// Sets up the context of a copy-on-write image (load_filesystem): reads its free space table.
+// group_commit: operations per publication, 0 = only on sync_filesystem / close_filesystem.
+// Returns 0 on success.
+int cow_load(FSContext *ctx, int group_commit);
+
+// Frees the state (close_filesystem, after the last cow_publish).
+void cow_unload(FSContext *ctx);
+
+// Makes every change since the last publication durable at once. Returns 0 on success (or when not
+// copy-on-write).
+int cow_publish(FSContext *ctx);
+
+// One operation is complete: publishes if it closes a group. Returns 0 on success.
+int cow_end_operation(FSContext *ctx);
+
+// Turns copy-on-write on (B+tree images whose files share no payload: the hash and dedup indexes
+// are dropped) or off. Both write the image durably. Return 0 on success, -1 if the image cannot
+// be converted (or readers are open, for cow_disable), -2 on I/O error.
+int cow_enable(FSContext *ctx);
+int cow_disable(FSContext *ctx);
+
+// The page was allocated since the last publication: it can be written in place.
+int cow_is_fresh(FSContext *ctx, long page_offset);
+
+// Allocator side (allocator.h): a free extent of `size` bytes (already rounded) or a free index page,
+// 0 if none; space given back, free at once if the published version does not use it.
+long cow_take(FSContext *ctx, long size);
+long cow_take_page(FSContext *ctx);
+void cow_give(FSContext *ctx, long offset, long size);
+
+// Readers (reader.h), from any thread: copies the published SuperBlock into *out and pins its
+// version, whose space is not handed out until cow_unpin. Returns 0, or -1 if not copy-on-write.
+int cow_pin(FSContext *ctx, SuperBlock *out);
+void cow_unpin(FSContext *ctx, long epoch);
+
+// Free space counters of a copy-on-write image (released space included).
+void cow_free_space_stats(FSContext *ctx, FreeSpaceStats *stats);
+
+#endif // COW_H
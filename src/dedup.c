@@ -0,0 +1,364 @@
+#include "dedup.h"
+#include "allocator.h"
+#include "hash_table.h"
+#include "stream.h"
+#include <stdlib.h>
+#include <string.h>
+
+// --- MurmurHash3 x64 128 (public domain, Austin Appleby), seed 0 ---
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t fmix64(uint64_t k) {
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+DedupHash dedup_hash(const unsigned char *data, size_t size) {
+    const uint64_t c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0;
+    size_t blocks = size / 16;
+    for (size_t i = 0; i < blocks; i++) {
+        uint64_t k1, k2;
+        memcpy(&k1, data + i * 16, 8);
+        memcpy(&k2, data + i * 16 + 8, 8);
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    const unsigned char *tail = data + blocks * 16;
+    uint64_t k1 = 0, k2 = 0;
+    switch (size & 15) {
+    case 15: k2 ^= (uint64_t)tail[14] << 48; // fall through
+    case 14: k2 ^= (uint64_t)tail[13] << 40; // fall through
+    case 13: k2 ^= (uint64_t)tail[12] << 32; // fall through
+    case 12: k2 ^= (uint64_t)tail[11] << 24; // fall through
+    case 11: k2 ^= (uint64_t)tail[10] << 16; // fall through
+    case 10: k2 ^= (uint64_t)tail[9] << 8;   // fall through
+    case 9:  k2 ^= (uint64_t)tail[8];
+             k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2; // fall through
+    case 8:  k1 ^= (uint64_t)tail[7] << 56;  // fall through
+    case 7:  k1 ^= (uint64_t)tail[6] << 48;  // fall through
+    case 6:  k1 ^= (uint64_t)tail[5] << 40;  // fall through
+    case 5:  k1 ^= (uint64_t)tail[4] << 32;  // fall through
+    case 4:  k1 ^= (uint64_t)tail[3] << 24;  // fall through
+    case 3:  k1 ^= (uint64_t)tail[2] << 16;  // fall through
+    case 2:  k1 ^= (uint64_t)tail[1] << 8;   // fall through
+    case 1:  k1 ^= (uint64_t)tail[0];
+             k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= size;
+    h2 ^= size;
+    h1 += h2;
+    h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2;
+    h2 += h1;
+    DedupHash h = { h1, h2 };
+    return h;
+}
+
+// --- Tables ---
+
+static uint64_t content_key(const DedupHash *hash) {
+    return hash->lo != 0 ? hash->lo : 1; // 0 marks empty slots
+}
+
+static uint64_t offset_key(long data_offset) {
+    uint64_t k = fmix64((uint64_t)data_offset);
+    return k != 0 ? k : 1;
+}
+
+// Returns 0, 1 if the image has no index, -1 if it cannot be read.
+static int read_header(FSContext *ctx, DedupHeader *h) {
+    if (!dedup_enabled(ctx)) return 1;
+    if (cache_read(&ctx->cache, ctx->sb.dedup_offset, h, sizeof(DedupHeader)) != 0) return -1;
+    return h->magic == DEDUP_MAGIC && h->slots > 0 && (h->slots & (h->slots - 1)) == 0 ? 0 : -1;
+}
+
+static int write_header(FSContext *ctx, const DedupHeader *h) {
+    return cache_write(&ctx->cache, ctx->sb.dedup_offset, h, sizeof(DedupHeader));
+}
+
+// Slot of the record matching the content hash and size (read into *out), or -1. Payloads and
+// chunks are told apart: a chunk is stored behind a block header.
+static long find_content(FSContext *ctx, const DedupHeader *h, const DedupHash *hash, long original_size,
+                         int chunk, HTSlot *slot, DedupRecord *out) {
+    uint64_t key = content_key(hash);
+    long mask = h->slots - 1;
+    for (long n = 0, i = key & mask; n < h->slots; n++, i = (i + 1) & mask) {
+        if (ht_read_slot(ctx, h->by_content, i, slot) != 0 || slot->hash == 0) return -1;
+        if (slot->hash != key) continue;
+        if (cache_read(&ctx->cache, slot->record, out, sizeof(DedupRecord)) != 0) return -1;
+        if (out->hash.lo == hash->lo && out->hash.hi == hash->hi && out->original_size == original_size
+            && out->chunk == chunk) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Slot of the record of the payload at data_offset (read into *out), or -1. The size tells it from
+// an empty payload, which takes no space and may have the same offset.
+static long find_offset(FSContext *ctx, const DedupHeader *h, long data_offset, long compressed_size,
+                        HTSlot *slot, DedupRecord *out) {
+    uint64_t key = offset_key(data_offset);
+    long mask = h->slots - 1;
+    for (long n = 0, i = key & mask; n < h->slots; n++, i = (i + 1) & mask) {
+        if (ht_read_slot(ctx, h->by_offset, i, slot) != 0 || slot->hash == 0) return -1;
+        if (slot->hash != key) continue;
+        if (cache_read(&ctx->cache, slot->record, out, sizeof(DedupRecord)) != 0) return -1;
+        if (out->data_offset == data_offset && out->compressed_size == compressed_size) return i;
+    }
+    return -1;
+}
+
+// Slot pointing at the record at `record` in a table, or -1.
+static long find_record(FSContext *ctx, long table, long slots, uint64_t key, long record) {
+    long mask = slots - 1;
+    for (long n = 0, i = key & mask; n < slots; n++, i = (i + 1) & mask) {
+        HTSlot s;
+        if (ht_read_slot(ctx, table, i, &s) != 0 || s.hash == 0) return -1;
+        if (s.hash == key && s.record == record) return i;
+    }
+    return -1;
+}
+
+// Both tables twice as large, every record placed again. Updates *h, which the caller writes back.
+static int rebuild(FSContext *ctx, DedupHeader *h) {
+    long slots = h->slots * 2;
+    long by_content = fs_allocate(ctx, slots * sizeof(HTSlot));
+    long by_offset = fs_allocate(ctx, slots * sizeof(HTSlot));
+    int res = ht_clear_slots(ctx, by_content, 0, slots) == 0 && ht_clear_slots(ctx, by_offset, 0, slots) == 0 ? 0 : -1;
+    for (long i = 0; i < h->slots && res == 0; i++) {
+        HTSlot s;
+        DedupRecord r;
+        if (ht_read_slot(ctx, h->by_content, i, &s) != 0) res = -1;
+        if (res != 0 || s.hash == 0) continue;
+        res = ht_place(ctx, by_content, slots, &s);
+        if (res == 0) res = cache_read(&ctx->cache, s.record, &r, sizeof(DedupRecord));
+        if (res == 0) {
+            HTSlot o = { offset_key(r.data_offset), s.record };
+            res = ht_place(ctx, by_offset, slots, &o);
+        }
+    }
+    if (res != 0) {
+        fs_release(ctx, by_content, slots * sizeof(HTSlot));
+        fs_release(ctx, by_offset, slots * sizeof(HTSlot));
+        return -1;
+    }
+    fs_release(ctx, h->by_content, h->slots * sizeof(HTSlot));
+    fs_release(ctx, h->by_offset, h->slots * sizeof(HTSlot));
+    h->by_content = by_content;
+    h->by_offset = by_offset;
+    h->slots = slots;
+    return 0;
+}
+
+// --- Index ---
+
+int dedup_enabled(FSContext *ctx) {
+    return ctx->sb.version >= 2 && ctx->sb.dedup_offset != 0 && !ctx->cow;
+}
+
+int dedup_create(FSContext *ctx) {
+    if (ctx->sb.version < 2 || ctx->cow) return -1;
+    if (ctx->sb.dedup_offset != 0) return 0;
+    DedupHeader h;
+    memset(&h, 0, sizeof(DedupHeader));
+    h.magic = DEDUP_MAGIC;
+    h.slots = DEDUP_MIN_SLOTS;
+    h.by_content = fs_allocate(ctx, h.slots * sizeof(HTSlot));
+    h.by_offset = fs_allocate(ctx, h.slots * sizeof(HTSlot));
+    long offset = fs_allocate(ctx, sizeof(DedupHeader));
+    if (ht_clear_slots(ctx, h.by_content, 0, h.slots) != 0 || ht_clear_slots(ctx, h.by_offset, 0, h.slots) != 0
+        || cache_write(&ctx->cache, offset, &h, sizeof(DedupHeader)) != 0) {
+        fs_release(ctx, h.by_content, h.slots * sizeof(HTSlot));
+        fs_release(ctx, h.by_offset, h.slots * sizeof(HTSlot));
+        fs_release(ctx, offset, sizeof(DedupHeader));
+        return -1;
+    }
+    ctx->sb.dedup_offset = offset;
+    return sync_superblock(ctx);
+}
+
+int dedup_drop(FSContext *ctx) {
+    DedupHeader h;
+    int res = read_header(ctx, &h);
+    if (res > 0) return 0;
+    if (res < 0 || h.references > h.count) return -1;
+
+    for (long i = 0; i < h.slots; i++) {
+        HTSlot s;
+        if (ht_read_slot(ctx, h.by_content, i, &s) != 0) return -1;
+        if (s.hash != 0) fs_release(ctx, s.record, sizeof(DedupRecord));
+    }
+    fs_release(ctx, h.by_content, h.slots * sizeof(HTSlot));
+    fs_release(ctx, h.by_offset, h.slots * sizeof(HTSlot));
+    fs_release(ctx, ctx->sb.dedup_offset, sizeof(DedupHeader));
+    ctx->sb.dedup_offset = 0;
+    return sync_superblock(ctx);
+}
+
+// The payload or chunk of a record holds `data` (its original_size bytes): the hash is only 128 bits.
+static int same_bytes(FSContext *ctx, const DedupRecord *r, const unsigned char *data) {
+    unsigned char *stored;
+    if (r->chunk) {
+        stored = read_block(ctx, r->data_offset, r->original_size);
+    } else {
+        Inode inode;
+        memset(&inode, 0, sizeof(Inode));
+        inode.type = FILE_NODE;
+        inode.codec = r->codec;
+        inode.data_offset = r->data_offset;
+        inode.compressed_size = r->compressed_size;
+        inode.original_size = r->original_size;
+        stored = read_inode_content(ctx, &inode, NULL);
+    }
+    int same = stored && memcmp(stored, data, r->original_size) == 0;
+    free(stored);
+    return same;
+}
+
+static int lookup(FSContext *ctx, const DedupHash *hash, const unsigned char *data, long original_size, int chunk,
+                  DedupRecord *out) {
+    DedupHeader h;
+    int res = read_header(ctx, &h);
+    if (res != 0) return 1; // Unreadable: the file gets a payload of its own
+    HTSlot s;
+    if (find_content(ctx, &h, hash, original_size, chunk, &s, out) < 0) return -1;
+    return !data || same_bytes(ctx, out, data) ? 0 : 2;
+}
+
+int dedup_lookup(FSContext *ctx, const DedupHash *hash, const unsigned char *data, long original_size,
+                 DedupRecord *out) {
+    return lookup(ctx, hash, data, original_size, 0, out);
+}
+
+int dedup_lookup_chunk(FSContext *ctx, const DedupHash *hash, const unsigned char *data, long original_size,
+                       DedupRecord *out) {
+    return lookup(ctx, hash, data, original_size, 1, out);
+}
+
+int dedup_ref(FSContext *ctx, const DedupRecord *record) {
+    DedupHeader h;
+    HTSlot s;
+    DedupRecord r;
+    if (read_header(ctx, &h) != 0 || find_offset(ctx, &h, record->data_offset, record->compressed_size, &s, &r) < 0) {
+        return -1;
+    }
+    r.refs++;
+    h.references++;
+    h.saved_bytes += r.compressed_size;
+    h.saved_original += r.original_size;
+    if (cache_write(&ctx->cache, s.record, &r, sizeof(DedupRecord)) != 0) return -1;
+    return write_header(ctx, &h);
+}
+
+// Records a payload or chunk with one reference (r->refs is set here). Another one with the same
+// hash and size (a collision the byte check turned down) stays the only one: lookups find one record
+// per hash, and compaction relies on it.
+static int insert(FSContext *ctx, DedupRecord *r) {
+    DedupHeader h;
+    int res = read_header(ctx, &h);
+    if (res != 0) return res > 0 ? 0 : -1;
+    HTSlot s;
+    DedupRecord other;
+    if (find_content(ctx, &h, &r->hash, r->original_size, r->chunk, &s, &other) >= 0) return 0;
+    if ((h.count + 1) * DEDUP_MAX_LOAD_DEN > h.slots * DEDUP_MAX_LOAD_NUM && rebuild(ctx, &h) != 0) return -1;
+
+    r->refs = 1;
+    HTSlot c = { content_key(&r->hash), fs_allocate(ctx, sizeof(DedupRecord)) };
+    HTSlot o = { offset_key(r->data_offset), c.record };
+    if (cache_write(&ctx->cache, c.record, r, sizeof(DedupRecord)) != 0
+        || ht_place(ctx, h.by_content, h.slots, &c) != 0) {
+        fs_release(ctx, c.record, sizeof(DedupRecord));
+        return -1;
+    }
+    if (ht_place(ctx, h.by_offset, h.slots, &o) != 0) {
+        // Not found by offset, it would never be released: take it out again
+        long i = find_record(ctx, h.by_content, h.slots, c.hash, c.record);
+        if (i >= 0 && ht_delete_at(ctx, h.by_content, h.slots, i) == 0) fs_release(ctx, c.record, sizeof(DedupRecord));
+        return -1;
+    }
+    h.count++;
+    h.references++;
+    h.stored_bytes += r->compressed_size;
+    return write_header(ctx, &h);
+}
+
+int dedup_insert(FSContext *ctx, const DedupHash *hash, const Inode *inode) {
+    DedupRecord r;
+    memset(&r, 0, sizeof(DedupRecord));
+    r.hash = *hash;
+    r.data_offset = inode->data_offset;
+    r.compressed_size = inode->compressed_size;
+    r.original_size = inode->original_size;
+    r.codec = inode->codec;
+    return insert(ctx, &r);
+}
+
+int dedup_insert_chunk(FSContext *ctx, const DedupHash *hash, long block_offset, long extent, long original_size,
+                       int codec) {
+    DedupRecord r;
+    memset(&r, 0, sizeof(DedupRecord));
+    r.hash = *hash;
+    r.data_offset = block_offset;
+    r.compressed_size = extent;
+    r.original_size = original_size;
+    r.codec = codec;
+    r.chunk = 1;
+    return insert(ctx, &r);
+}
+
+void dedup_release(FSContext *ctx, long data_offset, long compressed_size) {
+    DedupHeader h;
+    HTSlot s;
+    DedupRecord r;
+    long i = read_header(ctx, &h) == 0 ? find_offset(ctx, &h, data_offset, compressed_size, &s, &r) : -1;
+    if (i < 0) {
+        fs_release(ctx, data_offset, compressed_size);
+        return;
+    }
+
+    h.references--;
+    if (--r.refs > 0) {
+        // Still shared: the space stays
+        h.saved_bytes -= r.compressed_size;
+        h.saved_original -= r.original_size;
+        if (cache_write(&ctx->cache, s.record, &r, sizeof(DedupRecord)) == 0) write_header(ctx, &h);
+        return;
+    }
+
+    long c = find_record(ctx, h.by_content, h.slots, content_key(&r.hash), s.record);
+    if (ht_delete_at(ctx, h.by_offset, h.slots, i) != 0 || (c >= 0 && ht_delete_at(ctx, h.by_content, h.slots, c) != 0)) {
+        return; // Left allocated: only compaction gets the space back
+    }
+    fs_release(ctx, s.record, sizeof(DedupRecord));
+    fs_release(ctx, data_offset, compressed_size);
+    h.count--;
+    h.stored_bytes -= r.compressed_size;
+    write_header(ctx, &h);
+}
+
+int dedup_find_offset(FSContext *ctx, long data_offset, long compressed_size, DedupRecord *out) {
+    DedupHeader h;
+    int res = read_header(ctx, &h);
+    if (res != 0) return 1;
+    HTSlot s;
+    return find_offset(ctx, &h, data_offset, compressed_size, &s, out) >= 0 ? 0 : -1;
+}
+
+int dedup_stats(FSContext *ctx, DedupHeader *h) {
+    return read_header(ctx, h) == 0 ? 0 : -1;
+}
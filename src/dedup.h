@@ -0,0 +1,107 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include <stdint.h>
+#include "fs_core.h"
+
+// Content-addressed payloads (SuperBlock.dedup_offset, turned on per image).
+// Files stored in one piece (up to FS_STREAM_BLOCK) are looked up by a 128-bit hash of their
+// original bytes before being compressed: a file whose bytes are already in the image (the payload
+// found is decoded and compared) points its inode at the payload there, with no compression and no write. Each payload known to the index
+// counts the files pointing at it; deleting one of them drops a reference, and the payload's space
+// is released with the last one. Payloads written before dedup was turned on are not in the index:
+// they are released as before.
+//
+// Records (DedupRecord) are found through two slot tables of hash_table.h (HTSlot: a key and the
+// offset of the record): one keyed by content hash for adds, one keyed by payload offset for
+// deletes. Both are rebuilt twice as large in one go past DEDUP_MAX_LOAD (a record per distinct
+// payload: far fewer than the names of hash_table.h, which grows step by step).
+//
+// Larger files are cut into chunks at content-defined boundaries (stream.h) and each chunk is
+// looked up the same way: versions of a file that differ in a few places share most of their
+// chunks. Copy-on-write images (cow.h) are not deduplicated: the index is updated in place.
+// Compaction keeps the index and the sharing.
+
+#define DEDUP_MAGIC 0x44454455L     // "DEDU"
+#define DEDUP_MIN_SLOTS 1024
+#define DEDUP_MAX_LOAD_NUM 7        // Rebuild when count > slots * NUM / DEN
+#define DEDUP_MAX_LOAD_DEN 10
+
+typedef struct DedupHash {
+    uint64_t lo;
+    uint64_t hi;
+} DedupHash;
+
+typedef struct DedupRecord {
+    DedupHash hash;         // Of the original bytes
+    long data_offset;
+    long compressed_size;
+    long original_size;
+    long refs;              // Files pointing at the payload
+    int codec;
+    int chunk;              // 1: a chunk of a larger file, data_offset is its BlockHeader
+} DedupRecord;
+
+typedef struct DedupHeader {
+    long magic;
+    long count;             // Payloads and chunks in the index
+    long slots;             // Of each table
+    long by_content;
+    long by_offset;
+    long references;        // Files (or chunk lists) pointing at them
+    long stored_bytes;      // Their compressed sizes
+    long saved_bytes;       // Compressed bytes the extra references did not write
+    long saved_original;    // Original bytes they did not compress
+} DedupHeader;
+
+// 128-bit hash of file contents (MurmurHash3 x64).
+DedupHash dedup_hash(const unsigned char *data, size_t size);
+
+// The image deduplicates new payloads (version 2, index present, not copy-on-write).
+int dedup_enabled(FSContext *ctx);
+
+// Turns dedup on (an empty index: only new payloads are shared). Returns 0 on success, -1 for
+// version 1 and copy-on-write images.
+int dedup_create(FSContext *ctx);
+
+// Turns it off. Returns 0 on success (or without an index), -1 while files share payloads: the
+// index is what keeps them from being released with the first of those files.
+int dedup_drop(FSContext *ctx);
+
+// Looks a content hash up. Returns 0 and fills *out (the payload of a file of original_size bytes
+// with this hash), -1 if not found, 1 without an index. With `data` (the original bytes), the
+// payload is decoded and compared with them: 2 if they differ (a hash collision: the new payload
+// is not shared, dedup_insert keeps the record there). NULL skips the check (compaction, whose
+// record comes from another index).
+int dedup_lookup(FSContext *ctx, const DedupHash *hash, const unsigned char *data, long original_size,
+                 DedupRecord *out);
+
+// Same for a chunk: the block (header included) of a chunked file holding these bytes.
+int dedup_lookup_chunk(FSContext *ctx, const DedupHash *hash, const unsigned char *data, long original_size,
+                       DedupRecord *out);
+
+// A new file (or chunk list) gets the payload of `record` (from dedup_lookup: its offset and size
+// count). Returns 0 on success.
+int dedup_ref(FSContext *ctx, const DedupRecord *record);
+
+// A new payload was written and indexed with one file. Returns 0 on success (or without an
+// index); a payload that could not be recorded, or whose hash and size another one already has, is
+// simply not shared.
+int dedup_insert(FSContext *ctx, const DedupHash *hash, const Inode *inode);
+
+// A new chunk was written: the block of `extent` bytes at block_offset. Same returns.
+int dedup_insert_chunk(FSContext *ctx, const DedupHash *hash, long block_offset, long extent, long original_size,
+                       int codec);
+
+// Payload (or chunk) no longer used by a file (delete, failed insert): drops one reference, and releases
+// the space with the last one, or right away if the index does not know it.
+void dedup_release(FSContext *ctx, long data_offset, long compressed_size);
+
+// Record of the payload of compressed_size bytes at data_offset (compaction). Returns 0, -1 if
+// not found, 1 without an index.
+int dedup_find_offset(FSContext *ctx, long data_offset, long compressed_size, DedupRecord *out);
+
+// Returns 0 and fills *h (counters of dedup.h), or -1 if the image has no index.
+int dedup_stats(FSContext *ctx, DedupHeader *h);
+
+#endif // DEDUP_H
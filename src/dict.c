@@ -0,0 +1,294 @@
+#include "dict.h"
+#include "dedup.h"
+#include "huffman.h"
+#include "histogram.h"
+#include "codec.h"
+#include "allocator.h"
+#include "index.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long section_size(long count) {
+    return (long)sizeof(DictHeader) + count * DICT_TABLE_SIZE;
+}
+
+int dict_load(FSContext *ctx) {
+    ctx->dict_tables = NULL;
+    ctx->dict_count = 0;
+    if (ctx->sb.version < 2 || ctx->sb.dict_offset == 0) return 0;
+
+    DictHeader h;
+    if (cache_read(&ctx->cache, ctx->sb.dict_offset, &h, sizeof(DictHeader)) != 0
+        || h.count <= 0 || h.count > DICT_MAX_TABLES) {
+        return -1;
+    }
+    unsigned char *tables = malloc(h.count * DICT_TABLE_SIZE);
+    if (!tables) return -1;
+    if (cache_read(&ctx->cache, ctx->sb.dict_offset + sizeof(DictHeader), tables, h.count * DICT_TABLE_SIZE) != 0) {
+        free(tables);
+        return -1;
+    }
+    for (long i = 0; i < h.count * DICT_TABLE_SIZE; i++) {
+        if (tables[i] == 0 || tables[i] > HUFFMAN_MAX_CODE_LEN) {
+            free(tables);
+            return -1;
+        }
+    }
+    ctx->dict_tables = tables;
+    ctx->dict_count = h.count;
+    return 0;
+}
+
+// Writes a new section holding `count` tables and makes it the image's one. The caller updates
+// ctx->dict_tables / dict_count.
+static int write_tables(FSContext *ctx, const unsigned char *tables, long count) {
+    DictHeader h;
+    memset(&h, 0, sizeof(DictHeader));
+    h.count = count;
+    long offset = fs_allocate(ctx, section_size(count));
+    if (cache_write(&ctx->cache, offset, &h, sizeof(DictHeader)) != 0
+        || cache_write(&ctx->cache, offset + sizeof(DictHeader), tables, count * DICT_TABLE_SIZE) != 0) {
+        fs_release(ctx, offset, section_size(count));
+        return -1;
+    }
+    if (ctx->sb.dict_offset != 0) fs_release(ctx, ctx->sb.dict_offset, section_size(ctx->dict_count));
+    ctx->sb.dict_offset = offset;
+    return sync_superblock(ctx);
+}
+
+int dict_copy(FSContext *src, FSContext *dst) {
+    if (src->dict_count == 0) return 0;
+    unsigned char *tables = malloc(src->dict_count * DICT_TABLE_SIZE);
+    if (!tables) return -1;
+    memcpy(tables, src->dict_tables, src->dict_count * DICT_TABLE_SIZE);
+    if (write_tables(dst, tables, src->dict_count) != 0) {
+        free(tables);
+        return -1;
+    }
+    free(dst->dict_tables);
+    dst->dict_tables = tables;
+    dst->dict_count = src->dict_count;
+    return 0;
+}
+
+static const uint8_t* table_of(const FSContext *ctx, long id) {
+    return ctx->dict_tables + id * DICT_TABLE_SIZE;
+}
+
+// | table id | bitstream | (caller must free), or NULL.
+static unsigned char* encode_shared(const uint8_t *table, int id, const unsigned char *data, size_t size,
+                                    size_t *payload_size) {
+    size_t stream_size = 0;
+    unsigned char *stream = compress_data_with_code(data, size, table, &stream_size);
+    unsigned char *payload = stream ? malloc(stream_size + 1) : NULL;
+    if (payload) {
+        payload[0] = (unsigned char)id;
+        memcpy(payload + 1, stream, stream_size);
+        *payload_size = stream_size + 1;
+    }
+    free(stream);
+    return payload;
+}
+
+int dict_encode(FSContext *ctx, int codec, const unsigned char *data, size_t size,
+                unsigned char **payload, size_t *payload_size) {
+    int res = codec_encode_as(codec, data, size, payload, payload_size);
+    if (res < 0 || codec != CODEC_AUTO || ctx->dict_count == 0 || size == 0 || size > DICT_MAX_FILE) return res;
+
+    // Exact size with each table, from the histogram: only the best one is encoded, if it wins
+    unsigned int freq[MAX_SYMBOLS];
+    byte_histogram(data, size, freq);
+    long best = -1;
+    size_t best_size = *payload_size;
+    for (long t = 0; t < ctx->dict_count; t++) {
+        size_t shared_size = 1 + huffman_encoded_size(freq, table_of(ctx, t));
+        if (shared_size < best_size) {
+            best = t;
+            best_size = shared_size;
+        }
+    }
+    if (best < 0) return res;
+
+    size_t shared_size = 0;
+    unsigned char *shared = encode_shared(table_of(ctx, best), (int)best, data, size, &shared_size);
+    if (!shared) return res; // Keep the payload we already have
+    free(*payload);
+    *payload = shared;
+    *payload_size = shared_size;
+    return CODEC_HUFFMAN_SHARED;
+}
+
+unsigned char* dict_decompress(FSContext *ctx, int codec, const unsigned char *payload, size_t payload_size,
+                               size_t original_size) {
+    if (codec != CODEC_HUFFMAN_SHARED) return codec_decompress(codec, payload, payload_size, original_size);
+    if (payload_size < 1 || payload[0] >= ctx->dict_count) return NULL;
+    return decompress_data_with_code(payload + 1, payload_size - 1, original_size, table_of(ctx, payload[0]));
+}
+
+// --- Training ---
+
+typedef struct SmallFiles {
+    char (*names)[MAX_NAME_LEN];
+    long count;
+    long cap;
+    int failed;
+} SmallFiles;
+
+static int collect_small(FSContext *ctx, const Inode *inode, void *arg) {
+    SmallFiles *files = arg;
+    if (inode->type != FILE_NODE || inode->codec == CODEC_BLOCKS
+        || inode->original_size <= 0 || inode->original_size > DICT_MAX_FILE) {
+        return 0;
+    }
+    if (files->count == files->cap) {
+        long cap = files->cap ? files->cap * 2 : 1024;
+        char (*grown)[MAX_NAME_LEN] = realloc(files->names, cap * MAX_NAME_LEN);
+        if (!grown) {
+            files->failed = 1;
+            return -1;
+        }
+        files->names = grown;
+        files->cap = cap;
+    }
+    memcpy(files->names[files->count++], inode->name, MAX_NAME_LEN);
+    return 0;
+}
+
+// Histogram of a sample spread evenly over the files (name order).
+static void sample_histogram(FSContext *ctx, const SmallFiles *files, unsigned int freq[MAX_SYMBOLS],
+                             DictReport *report) {
+    memset(freq, 0, MAX_SYMBOLS * sizeof(unsigned int));
+    long step = files->count > DICT_SAMPLE_FILES ? files->count / DICT_SAMPLE_FILES : 1;
+    for (long i = 0; i < files->count && report->sampled_files < DICT_SAMPLE_FILES
+         && report->sampled_bytes < DICT_SAMPLE_BYTES; i += step) {
+        size_t size = 0;
+        unsigned char *content = get_file_content(ctx, files->names[i], &size);
+        if (!content) continue;
+        unsigned int file_freq[MAX_SYMBOLS];
+        byte_histogram(content, size, file_freq);
+        free(content);
+        // The sample stays under DICT_SAMPLE_BYTES + DICT_MAX_FILE: the sums fit
+        for (int s = 0; s < MAX_SYMBOLS; s++) freq[s] += file_freq[s];
+        report->sampled_files++;
+        report->sampled_bytes += (long)size;
+    }
+}
+
+// Recodes one file with table `id` if that makes it smaller. Returns 0 (recoded or not), -1 on I/O error.
+static int recode_file(FSContext *ctx, const char *name, int id, DictReport *report) {
+    Inode inode;
+    if (index_lookup(ctx, name, &inode) != 0) return 0;
+    // A payload shared by several files (dedup.h) stays as it is: recoding it would unshare it
+    DedupRecord shared;
+    if (dedup_find_offset(ctx, inode.data_offset, inode.compressed_size, &shared) == 0 && shared.refs > 1) return 0;
+    size_t size = 0;
+    unsigned char *content = get_file_content(ctx, name, &size);
+    if (!content) return 0; // Unreadable: left as it is
+
+    unsigned int freq[MAX_SYMBOLS];
+    byte_histogram(content, size, freq);
+    const uint8_t *table = table_of(ctx, id);
+    size_t payload_size = 1 + huffman_encoded_size(freq, table);
+    if ((long)payload_size >= inode.compressed_size) {
+        free(content);
+        return 0;
+    }
+    unsigned char *payload = encode_shared(table, id, content, size, &payload_size);
+    DedupHash hash = { 0, 0 };
+    if (dedup_enabled(ctx)) hash = dedup_hash(content, size);
+    free(content);
+    if (!payload) return -1;
+
+    Inode recoded = inode;
+    recoded.codec = CODEC_HUFFMAN_SHARED;
+    recoded.compressed_size = (long)payload_size;
+    recoded.data_offset = fs_allocate(ctx, recoded.compressed_size);
+    int res = cache_write(&ctx->cache, recoded.data_offset, payload, payload_size);
+    free(payload);
+    if (res != 0) {
+        fs_release(ctx, recoded.data_offset, recoded.compressed_size);
+        return -1;
+    }
+
+    // Same name: the insert cannot collide. If it fails all the same, the file gets its old inode
+    // back and the new payload is given back.
+    if (index_remove(ctx, name, NULL) != 0) {
+        fs_release(ctx, recoded.data_offset, recoded.compressed_size);
+        return -1;
+    }
+    if (index_insert(ctx, &recoded) != 0) {
+        index_insert(ctx, &inode);
+        fs_release(ctx, recoded.data_offset, recoded.compressed_size);
+        return -1;
+    }
+    dedup_release(ctx, inode.data_offset, inode.compressed_size);
+    if (dedup_enabled(ctx)) dedup_insert(ctx, &hash, &recoded);
+    report->recoded++;
+    report->bytes_before += inode.compressed_size;
+    report->bytes_after += recoded.compressed_size;
+    return 0;
+}
+
+int dict_train(FSContext *ctx, DictReport *report) {
+    memset(report, 0, sizeof(DictReport));
+    report->table_id = -1;
+    if (ctx->sb.version < 2 || ctx->dict_count >= DICT_MAX_TABLES) return -2;
+    double start = now_seconds();
+
+    SmallFiles files;
+    memset(&files, 0, sizeof(SmallFiles));
+    if (for_each_file(ctx, collect_small, &files) != 0 && files.failed) {
+        free(files.names);
+        return -1;
+    }
+    report->candidates = files.count;
+    if (files.count == 0) {
+        free(files.names);
+        return -2;
+    }
+
+    // 1. Train on the sample, 2. store the table under the next id
+    unsigned int freq[MAX_SYMBOLS];
+    sample_histogram(ctx, &files, freq, report);
+    uint8_t lengths[MAX_SYMBOLS];
+    huffman_train_code(freq, lengths);
+    for (long t = 0; t < ctx->dict_count; t++) {
+        if (memcmp(table_of(ctx, t), lengths, DICT_TABLE_SIZE) == 0) { // Nothing changed since
+            free(files.names);
+            return -2;
+        }
+    }
+
+    long id = ctx->dict_count;
+    unsigned char *tables = realloc(ctx->dict_tables, (id + 1) * DICT_TABLE_SIZE);
+    if (!tables) {
+        free(files.names);
+        return -1;
+    }
+    ctx->dict_tables = tables;
+    memcpy(tables + id * DICT_TABLE_SIZE, lengths, DICT_TABLE_SIZE);
+    if (write_tables(ctx, tables, id + 1) != 0) {
+        free(files.names);
+        return -1;
+    }
+    ctx->dict_count = id + 1;
+    report->table_id = (int)id;
+
+    // 3. Every small file that shrinks with it switches to it
+    int res = 0;
+    for (long i = 0; i < files.count && res == 0; i++) {
+        res = recode_file(ctx, files.names[i], (int)id, report);
+    }
+    free(files.names);
+
+    if (sync_superblock(ctx) != 0) res = -1;
+    report->seconds = now_seconds() - start;
+    return res;
+}
@@ -0,0 +1,59 @@
+#ifndef DICT_H
+#define DICT_H
+
+#include "fs_core.h"
+
+// Shared Huffman code tables for images holding many small, similar files (JSON, configs...).
+// Each small file compressed on its own pays for its code-length header and for a code built
+// from a few hundred bytes. A table trained once on a sample of the files of the image is stored
+// in the image instead, and files coded with it (CODEC_HUFFMAN_SHARED) only carry its id.
+//
+// Section (SuperBlock.dict_offset): | DictHeader | count tables of DICT_TABLE_SIZE code lengths |
+// Tables are never removed: a new one gets the next id and the section is rewritten whole.
+// Version 1 images have no tables.
+
+#define DICT_TABLE_SIZE 256         // One code length (1..15) per byte value
+#define DICT_MAX_TABLES 255         // Ids fit in the first byte of the payload
+// Only files up to this size are coded with the tables (above it a header of its own costs little).
+#define DICT_MAX_FILE (64 * 1024)
+// Training sample: at most this many files, this many bytes, spread over the image.
+#define DICT_SAMPLE_FILES 4096
+#define DICT_SAMPLE_BYTES (16L * 1024 * 1024)
+
+typedef struct DictHeader {
+    long count;
+    long reserved;
+} DictHeader;
+
+typedef struct DictReport {
+    int table_id;           // Id of the new table
+    long sampled_files;
+    long sampled_bytes;
+    long candidates;        // Small files looked at
+    long recoded;           // Files now coded with the new table
+    long bytes_before;      // Payloads of the recoded files, before and after
+    long bytes_after;
+    double seconds;
+} DictReport;
+
+// Loads the tables of an image into ctx (load_filesystem). Returns 0, or -1 if the section is damaged.
+int dict_load(FSContext *ctx);
+
+// Trains a table on a sample of the small files of the image, adds it, and recodes every small file
+// that gets smaller with it. Returns 0, -1 on error, -2 if there is nothing to train on (no small
+// file, version 1 image, DICT_MAX_TABLES reached or the same table already in the image).
+int dict_train(FSContext *ctx, DictReport *report);
+
+// codec_encode_as for a file stored in one piece in this image. With CODEC_AUTO, files up to
+// DICT_MAX_FILE are also tried with each shared table, and the smaller payload wins.
+int dict_encode(FSContext *ctx, int codec, const unsigned char *data, size_t size,
+                unsigned char **payload, size_t *payload_size);
+
+// codec_decompress for a payload of this image, CODEC_HUFFMAN_SHARED included.
+unsigned char* dict_decompress(FSContext *ctx, int codec, const unsigned char *payload, size_t payload_size,
+                               size_t original_size);
+
+// Gives another image the same tables under the same ids (compaction). Returns 0 on success.
+int dict_copy(FSContext *src, FSContext *dst);
+
+#endif // DICT_H
@@ -0,0 +1,351 @@
+#include "directory.h"
+#include "index.h"
+#include "hash_table.h"
+#include <stdlib.h>
+#include <string.h>
+
+int dir_enabled(const FSContext *ctx) {
+    return ctx->sb.version >= 2 && ctx->sb.index_type == INDEX_BTREE && ctx->sb.directories == 1;
+}
+
+int dir_valid_path(const char *path) {
+    size_t len = strnlen(path, MAX_NAME_LEN);
+    if (len == 0 || len >= MAX_NAME_LEN) return 0;
+    const char *component = path;
+    for (const char *p = path;; p++) {
+        if (*p != '/' && *p != '\0') continue;
+        size_t n = p - component;
+        if (n == 0 || (n == 1 && component[0] == '.') || (n == 2 && component[0] == '.' && component[1] == '.')) {
+            return 0;
+        }
+        if (*p == '\0') return 1;
+        component = p + 1;
+    }
+}
+
+int dir_compare_paths(const char *a, const char *b) {
+    for (;; a++, b++) {
+        int ca = *a == '\0' ? 0 : *a == '/' ? 1 : (unsigned char)*a + 1;
+        int cb = *b == '\0' ? 0 : *b == '/' ? 1 : (unsigned char)*b + 1;
+        if (ca != cb) return ca - cb;
+        if (ca == 0) return 0;
+    }
+}
+
+// Length of the parent directory's path in path[0..len) (0 = the root).
+static size_t parent_len(const char *path, size_t len) {
+    while (len > 0 && path[len - 1] != '/') len--;
+    return len > 0 ? len - 1 : 0;
+}
+
+// Where the last component starts, after a parent path of length plen.
+static size_t leaf_start(size_t plen) {
+    return plen > 0 ? plen + 1 : 0;
+}
+
+static void set_name(Inode *inode, const char *name, size_t len) {
+    memset(inode->name, 0, MAX_NAME_LEN);
+    memcpy(inode->name, name, len);
+}
+
+static void dir_inode(Inode *inode, const char *name, size_t len) {
+    memset(inode, 0, sizeof(Inode));
+    inode->type = DIRECTORY_NODE;
+    set_name(inode, name, len);
+    inode->parent_offset = -1;
+    inode->children_offset = BT_NONE;
+    inode->data_offset = -1;
+}
+
+// --- Directory cache ---
+
+static uint64_t path_hash(const char *path, size_t len) {
+    uint64_t h = 1469598103934665603ULL; // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)path[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static DentryCacheEntry* dcache_slot(FSContext *ctx, const char *path, size_t len) {
+    if (!ctx->dentries) ctx->dentries = calloc(1, sizeof(DentryCache));
+    if (!ctx->dentries) return NULL; // Every path walks from the root
+    return &ctx->dentries->slots[path_hash(path, len) & (DCACHE_SLOTS - 1)];
+}
+
+static int dcache_get(FSContext *ctx, const char *path, size_t len, long *root) {
+    DentryCacheEntry *e = dcache_slot(ctx, path, len);
+    if (!e || strncmp(e->path, path, len) != 0 || e->path[len] != '\0') return -1;
+    *root = e->root;
+    return 0;
+}
+
+static void dcache_put(FSContext *ctx, const char *path, size_t len, long root) {
+    DentryCacheEntry *e = dcache_slot(ctx, path, len);
+    if (!e) return;
+    memset(e->path, 0, MAX_NAME_LEN);
+    memcpy(e->path, path, len);
+    e->root = root;
+}
+
+static void dcache_forget(FSContext *ctx, const char *path, size_t len) {
+    DentryCacheEntry *e = dcache_slot(ctx, path, len);
+    if (e && strncmp(e->path, path, len) == 0 && e->path[len] == '\0') e->path[0] = '\0';
+}
+
+void dcache_reset(FSContext *ctx) {
+    if (ctx->dentries) memset(ctx->dentries->slots, 0, sizeof(ctx->dentries->slots));
+}
+
+void dcache_free(FSContext *ctx) {
+    free(ctx->dentries);
+    ctx->dentries = NULL;
+}
+
+// --- Resolution ---
+
+// Tree of the directory path[0..len) ("" = the root), walked from its longest cached prefix.
+// With `create`, missing directories are added on the way. Returns 0, or -1 if a component is
+// missing or is a file.
+static int resolve(FSContext *ctx, const char *path, size_t len, int create, long *root) {
+    if (len == 0) {
+        *root = ctx->sb.root_inode_offset;
+        return 0;
+    }
+    size_t start = len;
+    while (start > 0 && dcache_get(ctx, path, start, root) != 0) start = parent_len(path, start);
+    if (ctx->dentries) {
+        if (start == len) ctx->dentries->hits++;
+        else ctx->dentries->misses++;
+    }
+    if (start == 0) *root = ctx->sb.root_inode_offset;
+
+    while (start < len) {
+        size_t from = leaf_start(start);
+        const char *slash = memchr(path + from, '/', len - from);
+        size_t end = slash ? (size_t)(slash - path) : len;
+        char name[MAX_NAME_LEN];
+        memcpy(name, path + from, end - from);
+        name[end - from] = '\0';
+
+        Inode inode;
+        if (bt_search(ctx, *root, name, &inode) != 0) {
+            if (!create) return -1;
+            dir_inode(&inode, path, end);
+            if (index_insert(ctx, &inode) != 0) return -1;
+        } else if (inode.type != DIRECTORY_NODE) {
+            return -1;
+        }
+        *root = inode.children_offset;
+        dcache_put(ctx, path, end, *root);
+        start = end;
+    }
+    return 0;
+}
+
+// The tree of directory path[0..len) moved to `root` (its root page split or merged): updates the
+// directory's inode in its parent, the hash index and the cache.
+static int set_dir_root(FSContext *ctx, const char *path, size_t len, long root) {
+    if (len == 0) {
+        ctx->sb.root_inode_offset = root;
+        return 0;
+    }
+    size_t plen = parent_len(path, len);
+    char name[MAX_NAME_LEN];
+    memcpy(name, path + leaf_start(plen), len - leaf_start(plen));
+    name[len - leaf_start(plen)] = '\0';
+
+    long parent_root;
+    Inode inode;
+    if (resolve(ctx, path, plen, 0, &parent_root) != 0 || bt_search(ctx, parent_root, name, &inode) != 0) {
+        return -1;
+    }
+    inode.children_offset = root;
+    long old = parent_root;
+    if (bt_update(ctx, &parent_root, &inode) != 0) return -1;
+    if (parent_root != old && set_dir_root(ctx, path, plen, parent_root) != 0) return -1;
+    dcache_put(ctx, path, len, root);
+
+    set_name(&inode, path, len);
+    if (ht_update(ctx, &inode) != 0) ht_drop(ctx);
+    return 0;
+}
+
+int dir_lookup(FSContext *ctx, const char *path, Inode *out) {
+    if (!dir_valid_path(path)) return -1;
+    size_t len = strlen(path), plen = parent_len(path, len);
+    long root;
+    Inode inode;
+    if (resolve(ctx, path, plen, 0, &root) != 0 || bt_search(ctx, root, path + leaf_start(plen), &inode) != 0) {
+        return -1;
+    }
+    if (out) {
+        *out = inode;
+        set_name(out, path, len);
+    }
+    return 0;
+}
+
+int dir_insert(FSContext *ctx, const Inode *inode) {
+    const char *path = inode->name;
+    if (!dir_valid_path(path)) return -1;
+    size_t len = strlen(path), plen = parent_len(path, len);
+    long root;
+    if (resolve(ctx, path, plen, 1, &root) != 0) return -1;
+
+    Inode entry = *inode;
+    set_name(&entry, path + leaf_start(plen), len - leaf_start(plen));
+    long old = root;
+    if (bt_insert(ctx, &root, &entry) != 0) return -1;
+    if (root != old && set_dir_root(ctx, path, plen, root) != 0) {
+        dcache_reset(ctx);
+        return -1;
+    }
+    return 0;
+}
+
+int dir_remove(FSContext *ctx, const char *path, Inode *removed) {
+    if (!dir_valid_path(path)) return -1;
+    size_t len = strlen(path), plen = parent_len(path, len);
+    const char *name = path + leaf_start(plen);
+    long root;
+    Inode inode;
+    if (resolve(ctx, path, plen, 0, &root) != 0 || bt_search(ctx, root, name, &inode) != 0) return -1;
+    if (inode.type == DIRECTORY_NODE && inode.children_offset != BT_NONE) return -1; // Not empty
+
+    long old = root;
+    if (bt_delete(ctx, &root, name, NULL) != 0) return -1;
+    if (root != old && set_dir_root(ctx, path, plen, root) != 0) {
+        dcache_reset(ctx);
+        return -1;
+    }
+    if (inode.type == DIRECTORY_NODE) dcache_forget(ctx, path, len);
+    if (removed) {
+        *removed = inode;
+        set_name(removed, path, len);
+    }
+    return 0;
+}
+
+// --- Scans ---
+
+typedef struct DirWalk {
+    char path[MAX_NAME_LEN];    // Of the directory being listed
+    size_t len;
+    int recurse;
+    FileVisitor visit;
+    void *arg;
+} DirWalk;
+
+static int visit_entry(FSContext *ctx, const Inode *entry, void *arg) {
+    DirWalk *w = arg;
+    size_t start = leaf_start(w->len);
+    size_t name_len = strnlen(entry->name, MAX_NAME_LEN - 1);
+    if (start + name_len >= MAX_NAME_LEN) return 0; // No path leads there (damaged image)
+
+    Inode inode = *entry;
+    set_name(&inode, w->path, w->len);
+    if (w->len > 0) inode.name[w->len] = '/';
+    memcpy(inode.name + start, entry->name, name_len);
+    int res = w->visit(ctx, &inode, w->arg);
+    if (res != 0 || !w->recurse || inode.type != DIRECTORY_NODE) return res;
+
+    DirWalk sub = *w;
+    memcpy(sub.path, inode.name, MAX_NAME_LEN);
+    sub.len = start + name_len;
+    return bt_for_each(ctx, inode.children_offset, visit_entry, &sub);
+}
+
+int dir_for_each(FSContext *ctx, FileVisitor visit, void *arg) {
+    DirWalk w;
+    memset(&w, 0, sizeof(DirWalk));
+    w.recurse = 1;
+    w.visit = visit;
+    w.arg = arg;
+    return bt_for_each(ctx, ctx->sb.root_inode_offset, visit_entry, &w);
+}
+
+int dir_for_each_entry(FSContext *ctx, const char *dir, FileVisitor visit, void *arg) {
+    DirWalk w;
+    memset(&w, 0, sizeof(DirWalk));
+    w.len = strlen(dir);
+    long root;
+    if (w.len > 0 && !dir_valid_path(dir)) return -1;
+    if (resolve(ctx, dir, w.len, 0, &root) != 0) return -1;
+    memcpy(w.path, dir, w.len);
+    w.visit = visit;
+    w.arg = arg;
+    return bt_for_each(ctx, root, visit_entry, &w);
+}
+
+// --- Bulk loading ---
+
+int dir_build_begin(DirBuilder *b, FSContext *ctx) {
+    memset(b, 0, sizeof(DirBuilder));
+    b->ctx = ctx;
+    b->levels = calloc(DIR_MAX_DEPTH, sizeof(BTBuilder));
+    if (!b->levels || bt_build_begin(&b->levels[0], ctx) != 0) return -1;
+    b->depth = 1;
+    return 0;
+}
+
+// Starts the directory path[0..end).
+static int open_dir(DirBuilder *b, const char *path, size_t end) {
+    if (b->depth == DIR_MAX_DEPTH || bt_build_begin(&b->levels[b->depth], b->ctx) != 0) return -1;
+    memcpy(b->path, path, end);
+    b->path[end] = '\0';
+    b->ends[b->depth++] = end;
+    return 0;
+}
+
+// Finishes the deepest open directory and adds it to its parent, now that its tree is known.
+static int close_dir(DirBuilder *b) {
+    long root = bt_build_finish(&b->levels[--b->depth]);
+    size_t end = b->ends[b->depth], start = leaf_start(b->ends[b->depth - 1]);
+    if (root == -2) return -1;
+
+    Inode dir;
+    dir_inode(&dir, b->path + start, end - start);
+    dir.children_offset = root;
+    b->path[b->ends[b->depth - 1]] = '\0';
+    b->count++;
+    return bt_build_add(&b->levels[b->depth - 1], &dir);
+}
+
+int dir_build_add(DirBuilder *b, const Inode *inode) {
+    const char *path = inode->name;
+    if (!dir_valid_path(path)) return -1;
+    size_t len = strlen(path);
+
+    // Leave the directories the path is not in, enter the ones it is in
+    while (b->depth > 1) {
+        size_t end = b->ends[b->depth - 1];
+        if (end < len && path[end] == '/' && memcmp(path, b->path, end) == 0) break;
+        if (close_dir(b) != 0) return -1;
+    }
+    size_t from = b->depth > 1 ? b->ends[b->depth - 1] + 1 : 0;
+    for (const char *slash; (slash = memchr(path + from, '/', len - from)) != NULL; from = slash - path + 1) {
+        if (open_dir(b, path, slash - path) != 0) return -1;
+    }
+
+    // A directory is added to its parent when it is closed, with its tree
+    if (inode->type == DIRECTORY_NODE) return open_dir(b, path, len);
+    Inode entry = *inode;
+    set_name(&entry, path + from, len - from);
+    b->count++;
+    return bt_build_add(&b->levels[b->depth - 1], &entry);
+}
+
+long dir_build_finish(DirBuilder *b) {
+    int res = 0;
+    while (b->depth > 1) {
+        if (close_dir(b) != 0) res = -1;
+    }
+    long root = b->depth == 1 ? bt_build_finish(&b->levels[0]) : -2;
+    free(b->levels);
+    b->levels = NULL;
+    b->depth = 0;
+    if (b->ctx) dcache_reset(b->ctx);
+    return res == 0 ? root : -2;
+}
@@ -0,0 +1,88 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+#include <stdint.h>
+#include "fs_core.h"
+#include "btree.h"
+
+// Hierarchical directories (SuperBlock.directories, B+tree images).
+// Names are paths: "docs/notes.txt" is the entry "notes.txt" of the directory "docs". Every
+// directory keeps its entries in a B+tree of its own, keyed by the last component of their path:
+// the root directory's tree is at root_inode_offset, the others at the children_offset of their
+// DIRECTORY_NODE inode. A lookup reads one small tree per component instead of one tree holding
+// every name of the image.
+//
+// Resolving a directory walks its path one component at a time. The trees of recently resolved
+// directories are kept in a small cache (DentryCache, direct-mapped on the path): a path resolves
+// from its longest cached prefix, so files of the same deep directory do not walk from the root.
+// The cache follows every change made through index.h.
+//
+// The inodes handed out (index.h, for_each_file) carry the full path, at most MAX_NAME_LEN - 1
+// bytes like the names of flat images: the hash index and the snapshot stay keyed on it. A path
+// has no empty, "." or ".." components and no leading or trailing '/'. Adding a file creates the
+// directories missing on its path; a directory is removed only once empty.
+//
+// New images get directories; images written before keep their flat index (names with a '/' in
+// them are plain names) until compacted. Version 1 and red-black tree images have none.
+
+#define DCACHE_SLOTS 1024
+#define DIR_MAX_DEPTH (MAX_NAME_LEN / 2)    // Directories on a path, the root included
+
+typedef struct DentryCacheEntry {
+    char path[MAX_NAME_LEN];    // "" = free slot
+    long root;                  // Tree of the directory's entries
+} DentryCacheEntry;
+
+typedef struct DentryCache {
+    DentryCacheEntry slots[DCACHE_SLOTS];
+    long hits;                  // Paths resolved from the cache whole
+    long misses;                // Paths that walked some components
+} DentryCache;
+
+// The image keeps one tree per directory.
+int dir_enabled(const FSContext *ctx);
+
+// The path is usable as a name in such an image.
+int dir_valid_path(const char *path);
+
+// Path order: like strcmp, with '/' sorting before every other byte. It is the order of
+// dir_for_each: a directory comes right before its entries, each directory's entries in name order.
+int dir_compare_paths(const char *a, const char *b);
+
+// Index operations of a directory image (index.h does the snapshot and the hash index).
+// Returns 0 and fills *out (the full path in out->name), or -1 if not found.
+int dir_lookup(FSContext *ctx, const char *path, Inode *out);
+// Adds an inode in its directory, creating missing directories. Returns 0, or -1 if the path
+// exists, is not valid or goes through a file.
+int dir_insert(FSContext *ctx, const Inode *inode);
+// Returns 0 and the removed inode in *removed (may be NULL), or -1 if not found or a directory not empty.
+int dir_remove(FSContext *ctx, const char *path, Inode *removed);
+// Calls visit for every inode in path order (dir_compare_paths).
+int dir_for_each(FSContext *ctx, FileVisitor visit, void *arg);
+// Calls visit for the entries of one directory ("" = the root), in name order.
+// Returns -1 if there is no such directory.
+int dir_for_each_entry(FSContext *ctx, const char *dir, FileVisitor visit, void *arg);
+
+// Forgets every cached directory (the trees were rebuilt), or frees the cache (close_filesystem).
+void dcache_reset(FSContext *ctx);
+void dcache_free(FSContext *ctx);
+
+// Bulk loading of a directory image from inodes given in path order (compaction, batches into
+// an empty image): one BTBuilder per open directory. Directories may be given (empty ones
+// included) or implied by the paths. Fails on a path that is not valid, out of order, or below a file.
+typedef struct DirBuilder {
+    FSContext *ctx;
+    BTBuilder *levels;              // DIR_MAX_DEPTH builders, root first
+    size_t ends[DIR_MAX_DEPTH];     // End of each open directory's path in `path`
+    char path[MAX_NAME_LEN];        // Path of the deepest open directory
+    int depth;                      // Open directories, the root included
+    long count;                     // Inodes added, implied directories included
+} DirBuilder;
+
+int dir_build_begin(DirBuilder *b, FSContext *ctx);
+int dir_build_add(DirBuilder *b, const Inode *inode);
+// Closes the open directories. Returns the root directory's tree (BT_NONE if empty), or -2 on
+// error (also to be called after a failed dir_build_add, to free the builders).
+long dir_build_finish(DirBuilder *b);
+
+#endif // DIRECTORY_H
@@ -1,172 +1,461 @@
 #include "fs_core.h"
-#include "red_black_tree.h"
 #include "huffman.h"
+#include "codec.h"
+#include "allocator.h"
+#include "index.h"
+#include "btree.h"
+#include "stream.h"
+#include "dict.h"
+#include "snapshot.h"
+#include "hash_table.h"
+#include "directory.h"
+#include "journal.h"
+#include "cow.h"
+#include "dedup.h"
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 int init_filesystem(const char *filename) {
     FILE *f = fopen(filename, "wb");
     if (!f) return -1;
 
     SuperBlock sb;
-    sb.magic_number = MAGIC_NUMBER;
+    memset(&sb, 0, sizeof(SuperBlock));
+    sb.magic_number = MAGIC_NUMBER_V2;
+    sb.version = FS_VERSION;
     sb.root_inode_offset = -1; // Empty tree
-    sb.next_free_page_offset = sizeof(SuperBlock);
-    sb.fs_size = sizeof(SuperBlock);
+    sb.index_type = INDEX_BTREE;
+    sb.directories = 1;
+    sb.next_free_page_offset = FS_HEADER_SIZE;
+    sb.fs_size = FS_HEADER_SIZE;
 
-    fwrite(&sb, sizeof(SuperBlock), 1, f);
+    // Header region: SuperBlock followed by zeros up to FS_HEADER_SIZE
+    unsigned char header[FS_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, &sb, sizeof(SuperBlock));
+
+    if (fwrite(header, sizeof(header), 1, f) != 1) {
+        fclose(f);
+        return -1;
+    }
     fclose(f);
+    // A log left by an earlier image of that name must not be replayed into this one
+    journal_discard(filename);
     return 0;
 }
 
 int load_filesystem(const char *filename, FSContext *ctx) {
+    return load_filesystem_opts(filename, ctx, NULL);
+}
+
+static int load_fail(FSContext *ctx, int code) {
+    cache_destroy(&ctx->cache);
+    fclose(ctx->file);
+    ctx->file = NULL;
+    return code;
+}
+
+int load_filesystem_opts(const char *filename, FSContext *ctx, const FSOptions *opts) {
+    ctx->dict_tables = NULL;
+    ctx->dict_count = 0;
+    ctx->snapshot = NULL;
+    ctx->snapshot_map = NULL;
+    ctx->dentries = NULL;
+    ctx->cow = NULL;
     ctx->file = fopen(filename, "rb+");
     if (!ctx->file) return -1;
 
-    fseek(ctx->file, 0, SEEK_SET);
-    if (fread(&ctx->sb, sizeof(SuperBlock), 1, ctx->file) != 1) {
+    // The last session did not close: bring the image to its last commit before reading anything
+    if (journal_recover(filename, fileno(ctx->file)) < 0) {
         fclose(ctx->file);
-        return -2;
+        ctx->file = NULL;
+        return -1;
     }
 
-    if (ctx->sb.magic_number != MAGIC_NUMBER) {
+    // All I/O from here on goes through the page cache (positional reads/writes on the descriptor),
+    // or through a mapping of the whole file in mmap mode.
+    int res = (opts && opts->use_mmap)
+        ? cache_init_mapped(&ctx->cache, fileno(ctx->file))
+        : cache_init(&ctx->cache, fileno(ctx->file), opts ? opts->cache_pages : 0);
+    if (res != 0) {
         fclose(ctx->file);
-        return -3; // Invalid file
+        ctx->file = NULL;
+        return -1;
     }
 
+    // Every version starts with the legacy SuperBlock fields; the magic number tells what follows.
+    memset(&ctx->sb, 0, sizeof(SuperBlock));
+    if (ctx->cache.file_size < (long)LEGACY_SUPERBLOCK_SIZE) return load_fail(ctx, -2);
+    cache_read(&ctx->cache, 0, &ctx->sb, LEGACY_SUPERBLOCK_SIZE);
+
+    if (ctx->sb.magic_number == MAGIC_NUMBER) {
+        ctx->sb.version = 1;
+    } else if (ctx->sb.magic_number == MAGIC_NUMBER_V2) {
+        if (ctx->cache.file_size < (long)sizeof(SuperBlock)) return load_fail(ctx, -2);
+        cache_read(&ctx->cache, 0, &ctx->sb, sizeof(SuperBlock));
+        if (ctx->sb.version < 2 || ctx->sb.version > FS_VERSION) {
+            return load_fail(ctx, -4); // Written by a newer version
+        }
+        // Copy-on-write: the current SuperBlock may be in the second slot
+        if (ctx->cache.file_size >= FS_HEADER_SIZE && cow_select_superblock(ctx) != 0) return load_fail(ctx, -3);
+    } else {
+        return load_fail(ctx, -3); // Invalid file
+    }
+
+    // Version 1: never hand out space below the physical end of file (older builds appended at
+    // SEEK_END without always keeping next_free_page_offset up to date).
+    ctx->pending_releases = 0;
+    ctx->merged_extents = 0;
+    if (ctx->sb.version < 2 && ctx->sb.next_free_page_offset < ctx->cache.file_size) {
+        ctx->sb.next_free_page_offset = ctx->cache.file_size;
+    }
+
+    // Shared code tables: without them some payloads cannot be decoded
+    if (dict_load(ctx) != 0) return load_fail(ctx, -3);
+    snapshot_load(ctx);
+
+    int group_commit = opts ? opts->group_commit : 0;
+    if (ctx->sb.cow == 1 ? cow_load(ctx, group_commit) != 0
+        : group_commit > 0 && !ctx->cache.map && journal_attach(ctx, filename, group_commit) != 0) {
+        snapshot_unload(ctx);
+        free(ctx->dict_tables);
+        ctx->dict_tables = NULL;
+        return load_fail(ctx, -1);
+    }
     return 0;
 }
 
+int sync_superblock(FSContext *ctx) {
+    if (ctx->cow) return 0; // cow_publish writes it, in the other slot
+    // Version 1 images only have room for the legacy fields: the first node follows them.
+    size_t size = ctx->sb.version >= 2 ? sizeof(SuperBlock) : LEGACY_SUPERBLOCK_SIZE;
+    return cache_write(&ctx->cache, 0, &ctx->sb, size);
+}
+
+int sync_filesystem(FSContext *ctx) {
+    if (ctx->cow) return cow_publish(ctx);
+    if (ctx->cache.journal) return journal_commit(ctx);
+    if (sync_superblock(ctx) != 0) return -1;
+    if (cache_sync(&ctx->cache) != 0) return -1;
+    return fsync(ctx->cache.fd);
+}
+
+int end_operation(FSContext *ctx) {
+    if (ctx->cow) return cow_end_operation(ctx);
+    return journal_end_operation(ctx);
+}
+
 void close_filesystem(FSContext *ctx) {
     if (ctx->file) {
-        // Update SuperBlock before closing
-        fseek(ctx->file, 0, SEEK_SET);
-        fwrite(&ctx->sb, sizeof(SuperBlock), 1, ctx->file);
+        // Tidy the free lists, then update SuperBlock and write back every dirty page before closing.
+        // Space given back to next_free_page_offset is cut off the file.
+        // A stale index snapshot is rewritten first (its old section is released).
+        snapshot_refresh(ctx);
+        snapshot_unload(ctx);
+        // With a journal, the last group is committed and the log copied into the image; if that
+        // fails nothing more is written: the log is replayed at the next load.
+        // A copy-on-write image publishes what is left, and nothing is written after that.
+        if (ctx->pending_releases > 0) fs_merge_free_space(ctx);
+        sync_superblock(ctx);
+        cow_publish(ctx);
+        cow_unload(ctx);
+        if (journal_detach(ctx) == 0) {
+            cache_sync(&ctx->cache);
+            if (ctx->sb.version >= 2) cache_truncate(&ctx->cache, ctx->sb.next_free_page_offset);
+        }
+        cache_destroy(&ctx->cache);
         fclose(ctx->file);
         ctx->file = NULL;
     }
+    free(ctx->dict_tables);
+    ctx->dict_tables = NULL;
+    ctx->dict_count = 0;
+    dcache_free(ctx);
 }
 
 int add_file(FSContext *ctx, const char *path, const unsigned char *data, size_t size) {
+    return add_file_codec(ctx, path, data, size, CODEC_AUTO);
+}
+
+static void fill_file_inode(Inode *inode, const char *path, int codec, size_t size, long data_offset,
+                            long compressed_size) {
+    memset(inode, 0, sizeof(Inode));
+    inode->type = FILE_NODE;
+    inode->codec = codec;
+    strncpy(inode->name, path, MAX_NAME_LEN - 1);
+    inode->name[MAX_NAME_LEN - 1] = '\0';
+    inode->original_size = size;
+    inode->compressed_size = compressed_size;
+    inode->data_offset = data_offset;
+    inode->parent_offset = -1; // Directories are found by path (directory.h)
+    inode->children_offset = -1;
+}
+
+// A file whose bytes are the payload of `record`: only an index entry and a reference.
+static int add_shared_file(FSContext *ctx, const char *path, const DedupRecord *record) {
+    Inode inode;
+    fill_file_inode(&inode, path, record->codec, record->original_size, record->data_offset, record->compressed_size);
+    // The reference first: a file in the index must never count for less than it is
+    if (dedup_ref(ctx, record) != 0) return -1;
+    int res = index_insert(ctx, &inode);
+    if (res != 0) {
+        dedup_release(ctx, record->data_offset, record->compressed_size);
+        return res;
+    }
+    sync_superblock(ctx);
+    return end_operation(ctx);
+}
+
+int add_file_codec(FSContext *ctx, const char *path, const unsigned char *data, size_t size, int requested) {
     // 1. Compress data
-    size_t compressed_size = 0;
-    unsigned char *compressed_data = compress_data(data, size, &compressed_size);
-    if (!compressed_data) return -1;
+    // Version 1 images have no codec field: keep the legacy stream format so older builds can read them.
+    // Otherwise use the requested codec or pick one from a sample, and store the bytes as-is when
+    // compression does not pay off.
+    int codec;
+    size_t compressed_size = size;
+    unsigned char *compressed_data = NULL;
 
-    // 2. Write to next free page
-    // We should probably check if file already exists in RBT to avoid duplicates or handle overwrite.
-    // For now, assume new file or simple error if duplicate (handled by rb_insert).
+    if (ctx->sb.version >= 2 && size > FS_STREAM_BLOCK) {
+        // Large file: independently decoded blocks (stream.h), so ranges can be read on their own
+        FSFile *f = fs_open_write_codec(ctx, path, requested);
+        if (!f) return -1;
+        long written = fs_write(f, data, size);
+        int res = fs_close(f);
+        return written < 0 ? -1 : res;
+    }
 
-    fseek(ctx->file, 0, SEEK_END);
-    long write_offset = ftell(ctx->file);
-    // Or use sb.next_free_page_offset if we were managing holes, but append is safe.
-    // Let's stick to append-only for simplicity. 
-    // Ideally we update sb.next_free_page_offset.
-    if (write_offset < ctx->sb.next_free_page_offset) {
-        write_offset = ctx->sb.next_free_page_offset;
-        fseek(ctx->file, write_offset, SEEK_SET);
+    // Bytes the image already holds: the file shares their payload (dedup.h), nothing to compress or write
+    int dedup = dedup_enabled(ctx) && size > 0;
+    DedupHash hash;
+    if (dedup) {
+        DedupRecord hit;
+        hash = dedup_hash(data, size);
+        if (dedup_lookup(ctx, &hash, data, (long)size, &hit) == 0) return add_shared_file(ctx, path, &hit);
     }
 
-    fwrite(compressed_data, 1, compressed_size, ctx->file);
-    free(compressed_data);
+    if (ctx->sb.version >= 2) {
+        codec = dict_encode(ctx, requested, data, size, &compressed_data, &compressed_size);
+        if (codec < 0) return -1;
+    } else {
+        codec = CODEC_HUFFMAN_LEGACY;
+        compressed_data = codec_compress(codec, data, size, &compressed_size);
+        if (!compressed_data) return -1;
+    }
+    const unsigned char *payload = compressed_data ? compressed_data : data;
 
-    // Update SuperBlock next free
-    ctx->sb.next_free_page_offset = write_offset + compressed_size;
-    ctx->sb.fs_size = ctx->sb.next_free_page_offset;
+    // 2. Write to next free page
+    // We should probably check if file already exists in RBT to avoid duplicates or handle overwrite.
+    // For now, assume new file or simple error if duplicate (handled by the index).
+    long write_offset = fs_allocate(ctx, compressed_size);
+    int write_res = cache_write(&ctx->cache, write_offset, payload, compressed_size);
+    free(compressed_data);
+    if (write_res != 0) return -1;
 
     // 3. Create Inode
     Inode inode;
-    inode.type = FILE_NODE;
-    strncpy(inode.name, path, MAX_NAME_LEN - 1);
-    inode.name[MAX_NAME_LEN - 1] = '\0';
-    inode.original_size = size;
-    inode.compressed_size = compressed_size;
-    inode.data_offset = write_offset;
-    inode.parent_offset = -1; // Flat FS for now, or need logic to find parent dir
-    inode.children_offset = -1;
-
-    // 4. Insert into RBT
-    // If we support directories, we need to find the parent directory's RBT root.
-    // "fs_data.bin Structure ... Root Inode ... File Node"
-    // Prompt structure allows hierarchy but doesn't mandate full `mkdir` logic unless implied.
-    // "add_file(fs_context, path...)"
-    // If path is "foo/bar.txt", we should find "foo".
-    // For simplicity given size, we'll treat `path` as just the name in the Root specific RBT.
-    // If the user wants full paths, we need `mkdir` and path parsing.
-    // "Objective: ... Implémentation d'un Arbre Rouge-Noir pour l'arborescence." -> Implies hierarchy.
-    // But `add_file` just takes `path`.
-    // I'll implement flat structure for the MVP to pass the "logic defined" constraint, 
-    // or assume path is just filename.
-    // Let's assume root directory integration.
-
-    long new_node_offset = -1;
-    long *root_ptr = &ctx->sb.root_inode_offset; 
-    
-    // Note: rb_insert calls create_node which appends RBTNode.
-    // This might conflict if we are also appending data.
-    // RBT implementation in `red_black_tree.c` uses `fseek(file, 0, SEEK_END)` for new nodes.
-    // This is fine, we just update `next_free_page_offset` locally if needed, but RBT allocations
-    // are small and also appended.
-    // We should ensure we don't overwrite.
-    // In `red_black_tree.c` I used `fseek(file, 0, SEEK_END)`.
-    // That works with append-only log structure.
-    
-    int res = rb_insert(ctx->file, root_ptr, inode, &new_node_offset);
+    fill_file_inode(&inode, path, codec, size, write_offset, compressed_size);
+
+    // 4. Insert into the index (red-black tree or B+tree, see index.h)
+    // With directories the path is resolved one component at a time, and the directories missing
+    // on it are created: "docs/notes.txt" goes in the tree of "docs".
+    // Note: nodes and index pages take their space from the allocator like the payload above,
+    // so data and index never overlap.
+    int res = index_insert(ctx, &inode);
     if (res != 0) {
-        // Duplicate or error. Space is wasted but logic holds.
+        // Duplicate or error: give the payload space back.
+        fs_release(ctx, write_offset, compressed_size);
         return res;
     }
+    if (dedup) dedup_insert(ctx, &hash, &inode);
 
-    // Since rb_insert might have updated the root offset (via rebalancing) and allocated new nodes at end of file,
-    // we need to make sure our `sb` tracks the file end if we rely on `next_free_page_offset`.
-    // Actually, `rb_insert` will extend the file.
-    // So we should update `sb` before/after.
-    fseek(ctx->file, 0, SEEK_END);
-    ctx->sb.fs_size = ftell(ctx->file);
-    ctx->sb.next_free_page_offset = ctx->sb.fs_size;
-    
-    // Sync SB
-    fseek(ctx->file, 0, SEEK_SET);
-    fwrite(&ctx->sb, sizeof(SuperBlock), 1, ctx->file);
+    // Sync SB (into the cache; it reaches the file with the other dirty pages on sync/close)
+    sync_superblock(ctx);
 
-    return 0;
+    return end_operation(ctx);
+}
+
+int make_directory(FSContext *ctx, const char *path) {
+    if (!dir_enabled(ctx)) return -2;
+
+    Inode inode;
+    memset(&inode, 0, sizeof(Inode));
+    inode.type = DIRECTORY_NODE;
+    strncpy(inode.name, path, MAX_NAME_LEN - 1);
+    inode.parent_offset = -1;
+    inode.children_offset = BT_NONE; // No entries yet
+    inode.data_offset = -1;
+    if (index_insert(ctx, &inode) != 0) return -1;
+    if (sync_superblock(ctx) != 0) return -1;
+    return end_operation(ctx);
+}
+
+int delete_file(FSContext *ctx, const char *path) {
+    Inode inode;
+    if (index_remove(ctx, path, &inode) != 0) return -1;
+    if (inode.type == FILE_NODE && inode.codec == CODEC_BLOCKS) {
+        fs_release_blocks(ctx, inode.data_offset);
+    } else if (inode.type == FILE_NODE) {
+        dedup_release(ctx, inode.data_offset, inode.compressed_size); // Released with its last file
+    }
+
+    // The root may have changed and the free lists did
+    if (sync_superblock(ctx) != 0) return -1;
+    return end_operation(ctx);
 }
 
 unsigned char* get_file_content(FSContext *ctx, const char *path, size_t *out_size) {
-    long node_offset = rb_search(ctx->file, ctx->sb.root_inode_offset, path);
-    if (node_offset == -1) return NULL;
+    Inode inode;
+    if (index_lookup(ctx, path, &inode) != 0) return NULL;
+    return read_inode_content(ctx, &inode, out_size);
+}
 
-    RBTNode node;
-    read_rb_node(ctx->file, node_offset, &node);
+unsigned char* read_inode_content(FSContext *ctx, const Inode *inode, size_t *out_size) {
+    if (inode->type != FILE_NODE) return NULL; // It's a directory
+
+    int codec = inode->codec;
+    if (codec == CODEC_BLOCKS) {
+        // Written with fs_write: decoded block by block
+        unsigned char *content = read_blocks(ctx, inode);
+        if (content && out_size) *out_size = inode->original_size;
+        return content;
+    }
 
-    if (node.inode.type != FILE_NODE) return NULL; // It's a directory
+    // Mapped image: decode straight from the mapped pages, no intermediate copy.
+    const unsigned char *mapped = cache_ptr(&ctx->cache, inode->data_offset, inode->compressed_size);
+    if (mapped) {
+        unsigned char *original = dict_decompress(ctx, codec, mapped, inode->compressed_size, inode->original_size);
+        if (original && out_size) *out_size = inode->original_size;
+        return original;
+    }
 
-    unsigned char *compressed_data = malloc(node.inode.compressed_size);
-    fseek(ctx->file, node.inode.data_offset, SEEK_SET);
-    if (fread(compressed_data, 1, node.inode.compressed_size, ctx->file) != node.inode.compressed_size) {
+    unsigned char *compressed_data = malloc(inode->compressed_size + 1); // +1: never malloc(0) for empty files
+    if (!compressed_data) return NULL;
+    if (cache_read(&ctx->cache, inode->data_offset, compressed_data, inode->compressed_size) != 0) {
         free(compressed_data);
         return NULL;
     }
 
-    unsigned char *original = decompress_data(compressed_data, node.inode.compressed_size, node.inode.original_size);
+    if (codec == CODEC_STORED) {
+        // Nothing to decode: hand out the bytes we just read
+        if (out_size) *out_size = inode->original_size;
+        return compressed_data;
+    }
+
+    unsigned char *original = dict_decompress(ctx, codec, compressed_data, inode->compressed_size, inode->original_size);
     free(compressed_data);
+    if (!original) return NULL;
 
-    if (out_size) *out_size = node.inode.original_size;
+    if (out_size) *out_size = inode->original_size;
     return original;
 }
 
-void list_files_recursive(FILE *file, long current_offset) {
-    if (current_offset == -1) return;
-    
-    RBTNode node;
-    read_rb_node(file, current_offset, &node);
-    
-    list_files_recursive(file, node.left_offset);
-    printf("File: %s (Size: %ld compressed, %ld original)\n", node.inode.name, node.inode.compressed_size, node.inode.original_size);
-    list_files_recursive(file, node.right_offset);
+static int print_file(FSContext *ctx, const Inode *inode, void *arg) {
+    if (inode->type == DIRECTORY_NODE) {
+        printf("Dir:  %s/\n", inode->name);
+        return 0;
+    }
+    printf("File: %s (Size: %ld compressed, %ld original, %s)\n", inode->name, inode->compressed_size,
+           inode->original_size, codec_name(inode->codec));
+    return 0;
 }
 
 void list_files(FSContext *ctx) {
     printf("Listing files in FS:\n");
-    list_files_recursive(ctx->file, ctx->sb.root_inode_offset);
+    for_each_file(ctx, print_file, NULL);
+}
+
+int list_directory(FSContext *ctx, const char *dir) {
+    printf("Listing '%s':\n", dir);
+    return for_each_in_directory(ctx, dir, print_file, NULL);
+}
+
+int for_each_file(FSContext *ctx, FileVisitor visit, void *arg) {
+    return index_for_each(ctx, visit, arg);
+}
+
+int for_each_in_directory(FSContext *ctx, const char *dir, FileVisitor visit, void *arg) {
+    if (dir_enabled(ctx)) return dir_for_each_entry(ctx, dir, visit, arg);
+    // Flat image: everything is at the root
+    return dir[0] == '\0' ? index_for_each(ctx, visit, arg) : -1;
+}
+
+void print_fs_stats(FSContext *ctx) {
+    const CacheStats st = ctx->cache.stats; // Before walking the free lists
+    long accesses = st.hits + st.misses;
+
+    printf("Image: version %ld, %ld bytes used\n", ctx->sb.version, ctx->sb.fs_size);
+    if (ctx->sb.index_type == INDEX_BTREE) {
+        int height = bt_height(ctx, ctx->sb.root_inode_offset);
+        printf("Index: B+tree, %d level%s\n", height, height > 1 ? "s" : "");
+    } else {
+        printf("Index: red-black tree\n");
+    }
+    if (dir_enabled(ctx)) {
+        printf("Directories: one B+tree each");
+        if (ctx->dentries) {
+            printf(", directory cache %ld hits, %ld misses", ctx->dentries->hits, ctx->dentries->misses);
+        }
+        printf("\n");
+    }
+    HTStats ht;
+    if (ht_stats(ctx, &ht) == 0) {
+        printf("Hash index: %ld names, %ld slots%s\n", ht.count, ht.slots, ht.growing ? " (growing)" : "");
+    }
+    DedupHeader dd;
+    if (dedup_stats(ctx, &dd) == 0) {
+        // Ratio: bytes the files would take each with payloads of their own, over the bytes stored
+        printf("Dedup: %ld references to %ld payloads and chunks (%ld bytes), ratio %.2f, %ld bytes not written (%ld before compression)\n",
+               dd.references, dd.count, dd.stored_bytes,
+               dd.stored_bytes > 0 ? (double)(dd.stored_bytes + dd.saved_bytes) / dd.stored_bytes : 1.0,
+               dd.saved_bytes, dd.saved_original);
+    }
+    if (ctx->cow) {
+        const CowStats cs = ctx->cow->stats;
+        printf("Copy-on-write: epoch %ld, %ld operations in %ld publications, %ld fsyncs, %ld pages shadowed\n",
+               ctx->sb.epoch, cs.operations, cs.publications, cs.fsyncs, cs.shadowed);
+    }
+    if (ctx->dict_count > 0) printf("Shared code tables: %ld\n", ctx->dict_count);
+    long snapshot_entries = 0, snapshot_bytes = 0;
+    int snapshot = snapshot_info(ctx, &snapshot_entries, &snapshot_bytes);
+    if (snapshot >= 0) {
+        printf("Index snapshot: %ld entries, %ld bytes (%s)\n", snapshot_entries, snapshot_bytes,
+               snapshot == 0 ? "current" : "stale, rewritten at close");
+    }
+
+    FreeSpaceStats fs;
+    if (get_free_space_stats(ctx, &fs) == 0) {
+        printf("Space: %ld bytes allocated, %ld bytes free in %ld extents (largest %ld, fragmentation %.1f%%)\n",
+               fs.used_bytes, fs.free_bytes, fs.free_extents, fs.largest_extent, fragmentation_percent(&fs));
+        if (fs.free_pages > 0) printf("  index pages: %ld free\n", fs.free_pages);
+        for (int bin = 0; bin < FS_FREE_BINS; bin++) {
+            if (fs.bin_extents[bin] == 0) continue;
+            if (bin == 0) {
+                printf("  node slots: %ld free\n", fs.bin_extents[bin]);
+            } else if (bin == FS_FREE_BINS - 1) {
+                printf("  >= %ld bytes: %ld extents, %ld bytes\n", (long)FS_FREE_MIN << (bin - 1),
+                       fs.bin_extents[bin], fs.bin_bytes[bin]);
+            } else {
+                printf("  %ld-%ld bytes: %ld extents, %ld bytes\n", (long)FS_FREE_MIN << (bin - 1),
+                       ((long)FS_FREE_MIN << bin) - 1, fs.bin_extents[bin], fs.bin_bytes[bin]);
+            }
+        }
+    }
+
+    if (ctx->cache.map) {
+        printf("Mapped image: %ld bytes mapped, %ld reads and writes served in place\n",
+               ctx->cache.map_size, st.hits);
+        return;
+    }
+    printf("Page cache: %d pages of %d bytes\n", ctx->cache.capacity, CACHE_PAGE_SIZE);
+    printf("  hits %ld, misses %ld (hit ratio %.1f%%)\n", st.hits, st.misses,
+           accesses ? 100.0 * st.hits / accesses : 0.0);
+    printf("  evictions %ld, write-backs %ld\n", st.evictions, st.writebacks);
+    printf("  bypassed reads %ld, bypassed writes %ld\n", st.bypass_reads, st.bypass_writes);
+    if (ctx->cache.journal) {
+        const JournalStats js = ctx->cache.journal->stats;
+        printf("Journal: commit every %d operations, %ld operations in %ld commits, %ld fsyncs\n",
+               ctx->cache.journal->group_commit, js.operations, js.commits, js.fsyncs);
+        printf("  %ld pages logged, %ld checkpoints, log %ld bytes\n", js.frames, js.checkpoints, js.log_size);
+    }
 }
@@ -3,35 +3,106 @@
 
 #include <stdio.h>
 #include "fs_structs.h"
+#include "page_cache.h"
 
 typedef struct FSContext {
     FILE *file;
     SuperBlock sb;
+    PageCache cache;    // Every read/write of the image goes through it
+    long pending_releases;  // Extents released since the free lists were last merged (allocator.h)
+    long merged_extents;    // Free extents the last merge left (allocator.h: when to merge again)
+    unsigned char *dict_tables; // Shared code tables (dict.h), loaded with the image: DICT_TABLE_SIZE bytes each
+    long dict_count;
+    const struct SnapshotHeader *snapshot;  // Mapped index snapshot (snapshot.h) while it is current, else NULL
+    void *snapshot_map;
+    size_t snapshot_map_size;
+    long snapshot_generation;   // Generation of the image's snapshot section, -1 if none
+    int index_changed;          // The index was changed since load or since the last snapshot
+    struct DentryCache *dentries;   // Recently resolved directories (directory.h), allocated on first use
+    struct CowState *cow;           // Copy-on-write images (cow.h), else NULL
 } FSContext;
 
+// Optional settings for load_filesystem_opts (NULL or zeroed fields = defaults).
+typedef struct FSOptions {
+    int cache_pages;    // Page cache size in CACHE_PAGE_SIZE pages (0 = CACHE_DEFAULT_PAGES)
+    int use_mmap;       // Map the whole image instead of caching pages: nodes and payloads are read
+                        // in place (best for read-mostly workloads)
+    int group_commit;   // Journal the changes (journal.h), committing every group_commit operations with
+                        // one fsync (0 = no journal: changes reach the file on sync or close). Pages mode only.
+                        // Copy-on-write images (cow.h) have no journal: they publish every group_commit operations.
+} FSOptions;
+
 // Initialize a new filesystem in the given file.
 // Returns 0 on success, < 0 on failure.
 int init_filesystem(const char *filename);
 
 // Load an existing filesystem.
-// Populates context.
-// Returns 0 on success.
+// Populates context. Version 1 (legacy) images are accepted as-is.
+// A write-ahead log left by a session that did not close (journal.h) is replayed first; a
+// copy-on-write image (cow.h) opens as of its last publication.
+// Returns 0 on success, -3 if the file is not a filesystem, -4 if it was written by a newer version.
 int load_filesystem(const char *filename, FSContext *ctx);
+int load_filesystem_opts(const char *filename, FSContext *ctx, const FSOptions *opts);
+
+// Write the in-memory SuperBlock back (only the legacy fields for version 1 images).
+// Goes through the page cache: see sync_filesystem for durability. Returns 0 on success.
+// Copy-on-write images only write it when publishing.
+int sync_superblock(FSContext *ctx);
+
+// Flush the SuperBlock and every dirty cached page to the file, then fsync.
+// With a journal: commits the operations of the open group. Copy-on-write: publishes.
+// Returns 0 on success.
+int sync_filesystem(FSContext *ctx);
+
+// An operation that changed the image is complete: commits or publishes when it closes a group
+// (journal.h, cow.h). Returns 0 on success.
+int end_operation(FSContext *ctx);
 
-// Close filesystem.
+// Close filesystem (writes back the cache, without fsync; a journal is committed and checkpointed,
+// a copy-on-write image published).
 void close_filesystem(FSContext *ctx);
 
 // Add a file to the filesystem.
-// path: currently just filename (flat structure simplified or full path handling logic).
+// path: name in the image; with directories (directory.h) a path such as "docs/notes.txt", whose
+// missing directories are created.
 // data: original content.
-// size: size of data.
+// size: size of data. Files larger than FS_STREAM_BLOCK are stored as blocks (stream.h).
 int add_file(FSContext *ctx, const char *path, const unsigned char *data, size_t size);
+// Same with the codec picked by the caller (codec.h: CODEC_AUTO = choose_codec, CODEC_HUFFMAN_X4 for
+// files decoded often...). Version 1 images ignore it: they only hold the legacy Huffman format.
+// An image with dedup (dedup.h) gives a file whose bytes it already holds that payload, whatever
+// its codec.
+int add_file_codec(FSContext *ctx, const char *path, const unsigned char *data, size_t size, int codec);
+
+// Create an empty directory (and the missing ones above it).
+// Returns 0 on success, -1 if the path exists or is not valid, -2 if the image has no directories.
+int make_directory(FSContext *ctx, const char *path);
+
+// Remove a file or an empty directory: unlinks its node and gives the node slot and the payload back to the allocator.
+// Returns 0 on success, -1 if not found (or a directory that is not empty).
+int delete_file(FSContext *ctx, const char *path);
 
 // Retrieve file content.
 // Returns buffer (caller must free) or NULL.
 unsigned char* get_file_content(FSContext *ctx, const char *path, size_t *out_size);
+// Same for a file whose inode the caller already has (no lookup).
+unsigned char* read_inode_content(FSContext *ctx, const Inode *inode, size_t *out_size);
 
 // List files (debug).
 void list_files(FSContext *ctx);
+// List the entries of one directory ("" = the root). Returns 0, or -1 if there is no such directory.
+int list_directory(FSContext *ctx, const char *dir);
+
+// Calls visit for every file, in name order. Stops early if visit returns non-zero (and returns that value).
+// With directories, directories are visited too, each right before its entries.
+typedef int (*FileVisitor)(FSContext *ctx, const Inode *inode, void *arg);
+int for_each_file(FSContext *ctx, FileVisitor visit, void *arg);
+
+// Same for the entries of one directory only ("" = the root), in name order.
+// Returns -1 if there is no such directory.
+int for_each_in_directory(FSContext *ctx, const char *dir, FileVisitor visit, void *arg);
+
+// Print SuperBlock and page cache counters (to size the cache for a workload).
+void print_fs_stats(FSContext *ctx);
 
 #endif // FS_CORE_H
@@ -4,7 +4,29 @@
 #include <stdint.h>
 
 #define MAX_NAME_LEN 64
-#define MAGIC_NUMBER 0xCAFEBABE
+#define MAGIC_NUMBER 0xCAFEBABE      // Version 1 images: bare 32-byte SuperBlock, nodes right after it
+#define MAGIC_NUMBER_V2 0xCAFED00D   // Version >= 2 images: SuperBlock with a version field
+
+// Current on-disk format version (see SuperBlock.version).
+// 1: legacy, Huffman streams carry a 1 KB frequency table.
+// 2: Huffman streams carry a version byte and canonical code lengths.
+#define FS_VERSION 2
+
+// Version >= 2 images reserve this much space at the start of the file for the SuperBlock.
+// The region is zero-filled at init, so fields appended to SuperBlock later read as 0 in older images.
+#define FS_HEADER_SIZE 4096
+#define LEGACY_SUPERBLOCK_SIZE (4 * sizeof(long))
+
+// Allocations start on this boundary so records can be accessed in place in a mapped image.
+#define FS_ALLOC_ALIGN 8
+// Free extent lists kept in the SuperBlock (see allocator.h).
+#define FS_FREE_BINS 16
+// Index pages (btree.h): size and alignment in the image.
+#define FS_PAGE_SIZE 4096
+
+// Name index of the image (SuperBlock.index_type).
+#define INDEX_RBTREE 0   // One RBTNode record per file (version 1 images, older version 2 images)
+#define INDEX_BTREE 1    // B+tree of FS_PAGE_SIZE pages, root at root_inode_offset
 
 // Offsets in the binary file are represented as long (or int64_t usually, using long for C ANSI compatibility in 64-bit env, or int64_t if available. Using long per prompt implication, but distinct type is safer).
 // Prompt struct says: "root_inode_offset (position...)"
@@ -14,9 +36,26 @@
 
 typedef struct SuperBlock {
     long magic_number;
-    long root_inode_offset;      // Offset to the root RBTNode of the entire FS (or root dir)
+    long root_inode_offset;      // Offset to the root RBTNode of the entire FS (or root dir),
+                                 // or to the root B+tree page (index_type)
     long next_free_page_offset;  // Simple allocator implementation
     long fs_size;
+    // --- Version >= 2 only: a version 1 image stops here (LEGACY_SUPERBLOCK_SIZE) ---
+    long version;
+    long free_bins[FS_FREE_BINS];  // Heads of the free extent lists (allocator.h), 0 = empty
+    long index_type;               // INDEX_RBTREE or INDEX_BTREE
+    long free_pages;               // Head of the list of released index pages, 0 = empty
+    long dict_offset;              // Shared code tables (dict.h), 0 = none
+    long generation;               // Bumped by every session that changes the index (snapshot.h)
+    long snapshot_offset;          // Index snapshot (snapshot.h), 0 = none
+    long hash_offset;              // Hash index of the names (hash_table.h), 0 = none
+    long directories;              // 1: one B+tree per directory, names are paths (directory.h)
+    long cow;                      // 1: copy-on-write updates, published through two SuperBlock slots (cow.h)
+    long epoch;                    // Copy-on-write publications: the slot holding the highest one is current
+    long cow_free_offset;          // Copy-on-write: table of the free extents (cow.h), 0 = none
+    long checksum;                 // Copy-on-write: of every field above (cow.h)
+    long dedup_offset;             // Index of the payloads by content (dedup.h), 0 = none. After the
+                                   // checksum: copy-on-write images have none
 } SuperBlock;
 
 typedef enum NodeType {
@@ -27,12 +66,15 @@ typedef enum NodeType {
 typedef struct Inode {
     int type; // NodeType
     char name[MAX_NAME_LEN];
+    int codec;                  // Codec used for the payload (codec.h). Sits in what used to be alignment
+                                // padding, so the node layout is unchanged; only meaningful in version >= 2
+                                // images (version 1 payloads are always legacy Huffman streams).
     long parent_offset;         // Offset of the parent Inode (or RBTNode?) - Prompt says "offset du parent"
                                 // If Inodes are inside RBTNodes, this probably points to the parent Directory's RBTNode or Inode logic.
                                 // Let's assume it points to the Parent Directory Inode's RBTNode offset.
     
     // For Directories:
-    long children_offset;       // Offset to the Root RBTNode of the children tree. -1 if empty.
+    long children_offset;       // Root of the B+tree of its entries (directory.h). -1 if empty.
 
     // For Files:
     long data_offset;           // Offset to the first chunk of data.
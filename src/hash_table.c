@@ -0,0 +1,313 @@
+#include "hash_table.h"
+#include "allocator.h"
+#include "index.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const unsigned char zeros[16 * 1024];
+
+static uint64_t name_hash(const char *name) {
+    uint64_t h = 1469598103934665603ULL; // FNV-1a
+    for (const unsigned char *p = (const unsigned char *)name; *p; p++) {
+        h ^= *p;
+        h *= 1099511628211ULL;
+    }
+    return h != 0 ? h : 1; // 0 marks empty slots
+}
+
+// Returns 0, 1 if the image has no hash index, -1 if it cannot be read.
+static int read_header(FSContext *ctx, HTHeader *h) {
+    if (ctx->sb.version < 2 || ctx->sb.hash_offset == 0) return 1;
+    if (cache_read(&ctx->cache, ctx->sb.hash_offset, h, sizeof(HTHeader)) != 0) return -1;
+    return h->magic == HT_MAGIC && h->slots > 0 && (h->slots & (h->slots - 1)) == 0 ? 0 : -1;
+}
+
+static int write_header(FSContext *ctx, const HTHeader *h) {
+    return cache_write(&ctx->cache, ctx->sb.hash_offset, h, sizeof(HTHeader));
+}
+
+static long record_size(const char *name) {
+    return (long)(offsetof(HTRecord, name) + strnlen(name, MAX_NAME_LEN - 1) + 1);
+}
+
+int ht_read_slot(FSContext *ctx, long table, long i, HTSlot *s) {
+    return cache_read(&ctx->cache, table + i * (long)sizeof(HTSlot), s, sizeof(HTSlot));
+}
+
+int ht_write_slot(FSContext *ctx, long table, long i, const HTSlot *s) {
+    return cache_write(&ctx->cache, table + i * (long)sizeof(HTSlot), s, sizeof(HTSlot));
+}
+
+int ht_clear_slots(FSContext *ctx, long table, long from, long n) {
+    long offset = table + from * (long)sizeof(HTSlot);
+    long end = offset + n * (long)sizeof(HTSlot);
+    for (; offset < end; offset += sizeof(zeros)) {
+        long len = end - offset < (long)sizeof(zeros) ? end - offset : (long)sizeof(zeros);
+        if (cache_write(&ctx->cache, offset, zeros, len) != 0) return -1;
+    }
+    return 0;
+}
+
+// Slot of `name` in one table (its inode in *out, may be NULL), or -1.
+static long find_in(FSContext *ctx, long table, long slots, uint64_t hash, const char *name, Inode *out) {
+    long mask = slots - 1;
+    for (long n = 0, i = hash & mask; n < slots; n++, i = (i + 1) & mask) {
+        HTSlot s;
+        if (ht_read_slot(ctx, table, i, &s) != 0 || s.hash == 0) return -1;
+        if (s.hash != hash) continue;
+        // Read whole: past the stored name are other records or zeros
+        HTRecord r;
+        if (cache_read(&ctx->cache, s.record, &r, sizeof(HTRecord)) != 0) return -1;
+        r.name[MAX_NAME_LEN - 1] = '\0';
+        if (strcmp(r.name, name) == 0) {
+            if (out) {
+                memset(out, 0, sizeof(Inode));
+                memcpy(out->name, r.name, MAX_NAME_LEN);
+                out->type = r.type;
+                out->codec = r.codec;
+                out->parent_offset = r.parent_offset;
+                out->children_offset = r.children_offset;
+                out->data_offset = r.data_offset;
+                out->original_size = r.original_size;
+                out->compressed_size = r.compressed_size;
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+int ht_place(FSContext *ctx, long table, long slots, const HTSlot *s) {
+    long mask = slots - 1;
+    for (long n = 0, i = s->hash & mask; n < slots; n++, i = (i + 1) & mask) {
+        HTSlot cur;
+        if (ht_read_slot(ctx, table, i, &cur) != 0) return -1;
+        if (cur.hash == 0) return ht_write_slot(ctx, table, i, s);
+    }
+    return -1;
+}
+
+int ht_delete_at(FSContext *ctx, long table, long slots, long i) {
+    long mask = slots - 1;
+    for (long j = (i + 1) & mask; j != i; j = (j + 1) & mask) {
+        HTSlot s;
+        if (ht_read_slot(ctx, table, j, &s) != 0) return -1;
+        if (s.hash == 0) break;
+        long home = s.hash & mask;
+        if (((i - home) & mask) < ((j - home) & mask)) {
+            if (ht_write_slot(ctx, table, i, &s) != 0) return -1;
+            i = j;
+        }
+    }
+    HTSlot empty = { 0, 0 };
+    return ht_write_slot(ctx, table, i, &empty);
+}
+
+static int moving(const HTHeader *h) {
+    return h->next_table != 0 && h->cleared == h->next_slots;
+}
+
+// One step of growth (see hash_table.h), run before each insert or delete. Updates *h, which the
+// caller writes back.
+static int grow_step(FSContext *ctx, HTHeader *h) {
+    if (h->next_table == 0) {
+        if (h->count * HT_MAX_LOAD_DEN <= h->slots * HT_MAX_LOAD_NUM) return 0;
+        h->next_slots = h->slots * 2;
+        h->next_table = fs_allocate(ctx, h->next_slots * sizeof(HTSlot));
+        h->cleared = 0;
+        h->moved = 0;
+        return 0;
+    }
+
+    // 1. Clear the successor (space from the allocator holds anything)
+    if (h->cleared < h->next_slots) {
+        long n = h->next_slots - h->cleared < HT_CLEAR_STEP ? h->next_slots - h->cleared : HT_CLEAR_STEP;
+        if (ht_clear_slots(ctx, h->next_table, h->cleared, n) != 0) return -1;
+        h->cleared += n;
+        if (h->cleared < h->next_slots) return 0;
+
+        // Moving starts on an empty slot so it only ever takes whole clusters: the slots left
+        // behind keep probe sequences that never cross the moved ones.
+        HTSlot s;
+        for (h->move_start = 0; h->move_start < h->slots; h->move_start++) {
+            if (ht_read_slot(ctx, h->table, h->move_start, &s) != 0) return -1;
+            if (s.hash == 0) break;
+        }
+        return 0;
+    }
+
+    // 2. Move at least HT_MOVE_STEP slots, stopping on an empty one
+    long mask = h->slots - 1;
+    for (long done = 0; h->moved < h->slots; done++, h->moved++) {
+        long i = (h->move_start + h->moved) & mask;
+        HTSlot s;
+        if (ht_read_slot(ctx, h->table, i, &s) != 0) return -1;
+        if (s.hash == 0) {
+            if (done >= HT_MOVE_STEP) break;
+            continue;
+        }
+        HTSlot empty = { 0, 0 };
+        if (ht_place(ctx, h->next_table, h->next_slots, &s) != 0 || ht_write_slot(ctx, h->table, i, &empty) != 0) {
+            return -1;
+        }
+    }
+    if (h->moved == h->slots) {
+        fs_release(ctx, h->table, h->slots * sizeof(HTSlot));
+        h->table = h->next_table;
+        h->slots = h->next_slots;
+        h->next_table = 0;
+        h->next_slots = 0;
+        h->cleared = 0;
+        h->move_start = 0;
+        h->moved = 0;
+    }
+    return 0;
+}
+
+int ht_create(FSContext *ctx, long expected) {
+    if (ctx->sb.version < 2) return -1;
+    HTHeader h;
+    memset(&h, 0, sizeof(HTHeader));
+    h.magic = HT_MAGIC;
+    // Room to spare: a table built for a known set of names should not start growing right away
+    h.slots = HT_MIN_SLOTS;
+    while (expected * 2 > h.slots) h.slots *= 2;
+    h.table = fs_allocate(ctx, h.slots * sizeof(HTSlot));
+    long offset = fs_allocate(ctx, sizeof(HTHeader));
+    if (ht_clear_slots(ctx, h.table, 0, h.slots) != 0
+        || cache_write(&ctx->cache, offset, &h, sizeof(HTHeader)) != 0) {
+        fs_release(ctx, h.table, h.slots * sizeof(HTSlot));
+        fs_release(ctx, offset, sizeof(HTHeader));
+        return -1;
+    }
+    ctx->sb.hash_offset = offset;
+    return sync_superblock(ctx);
+}
+
+static int count_names(FSContext *ctx, const Inode *inode, void *arg) {
+    (*(long *)arg)++;
+    return 0;
+}
+
+static int insert_name(FSContext *ctx, const Inode *inode, void *arg) {
+    return ht_insert(ctx, inode);
+}
+
+int ht_build(FSContext *ctx) {
+    long count = 0;
+    if (ctx->sb.version < 2 || ctx->sb.hash_offset != 0) return -1;
+    if (index_for_each(ctx, count_names, &count) != 0 || ht_create(ctx, count) != 0) return -1;
+    return index_for_each(ctx, insert_name, NULL);
+}
+
+int ht_lookup(FSContext *ctx, const char *name, Inode *out) {
+    HTHeader h;
+    int res = read_header(ctx, &h);
+    if (res != 0) return 1; // Unreadable: the ordered index answers
+
+    uint64_t hash = name_hash(name);
+    if (moving(&h) && find_in(ctx, h.next_table, h.next_slots, hash, name, out) >= 0) return 0;
+    return find_in(ctx, h.table, h.slots, hash, name, out) >= 0 ? 0 : -1;
+}
+
+static void fill_record(HTRecord *r, const Inode *inode) {
+    memset(r, 0, sizeof(HTRecord));
+    memcpy(r->name, inode->name, strnlen(inode->name, MAX_NAME_LEN - 1));
+    r->type = inode->type;
+    r->codec = inode->codec;
+    r->parent_offset = inode->parent_offset;
+    r->children_offset = inode->children_offset;
+    r->data_offset = inode->data_offset;
+    r->original_size = inode->original_size;
+    r->compressed_size = inode->compressed_size;
+}
+
+// Slot of `name` in whichever table holds it (*table, *slots), or -1.
+static long locate(FSContext *ctx, const HTHeader *h, uint64_t hash, const char *name, long *table, long *slots) {
+    if (moving(h)) {
+        long i = find_in(ctx, h->next_table, h->next_slots, hash, name, NULL);
+        if (i >= 0) {
+            *table = h->next_table;
+            *slots = h->next_slots;
+            return i;
+        }
+    }
+    *table = h->table;
+    *slots = h->slots;
+    return find_in(ctx, h->table, h->slots, hash, name, NULL);
+}
+
+int ht_insert(FSContext *ctx, const Inode *inode) {
+    HTHeader h;
+    int res = read_header(ctx, &h);
+    if (res != 0) return res > 0 ? 0 : -1;
+    if (grow_step(ctx, &h) != 0) return -1;
+
+    HTRecord r;
+    fill_record(&r, inode);
+    HTSlot s;
+    s.hash = name_hash(r.name);
+    s.record = fs_allocate(ctx, record_size(r.name));
+    if (cache_write(&ctx->cache, s.record, &r, record_size(r.name)) != 0) {
+        fs_release(ctx, s.record, record_size(r.name));
+        return -1;
+    }
+    // While moving, new names go straight to the successor
+    res = moving(&h) ? ht_place(ctx, h.next_table, h.next_slots, &s) : ht_place(ctx, h.table, h.slots, &s);
+    if (res != 0) {
+        fs_release(ctx, s.record, record_size(r.name));
+        return -1;
+    }
+    h.count++;
+    return write_header(ctx, &h);
+}
+
+int ht_update(FSContext *ctx, const Inode *inode) {
+    HTHeader h;
+    int res = read_header(ctx, &h);
+    if (res != 0) return res > 0 ? 0 : -1;
+
+    HTRecord r;
+    fill_record(&r, inode);
+    long table, slots;
+    long i = locate(ctx, &h, name_hash(r.name), r.name, &table, &slots);
+    HTSlot s;
+    if (i < 0 || ht_read_slot(ctx, table, i, &s) != 0) return -1;
+    // Same name, same record size: rewritten in place
+    return cache_write(&ctx->cache, s.record, &r, record_size(r.name));
+}
+
+int ht_remove(FSContext *ctx, const char *name) {
+    HTHeader h;
+    int res = read_header(ctx, &h);
+    if (res != 0) return res > 0 ? 0 : -1;
+    if (grow_step(ctx, &h) != 0) return -1;
+
+    long table, slots;
+    long i = locate(ctx, &h, name_hash(name), name, &table, &slots);
+    if (i < 0) {
+        write_header(ctx, &h); // The growth step above still counts
+        return -1;
+    }
+
+    HTSlot s;
+    if (ht_read_slot(ctx, table, i, &s) != 0 || ht_delete_at(ctx, table, slots, i) != 0) return -1;
+    fs_release(ctx, s.record, record_size(name));
+    h.count--;
+    return write_header(ctx, &h);
+}
+
+void ht_drop(FSContext *ctx) {
+    ctx->sb.hash_offset = 0;
+    sync_superblock(ctx);
+}
+
+int ht_stats(FSContext *ctx, HTStats *stats) {
+    HTHeader h;
+    if (read_header(ctx, &h) != 0) return -1;
+    stats->count = h.count;
+    stats->slots = h.slots + h.next_slots;
+    stats->growing = h.next_table != 0;
+    return 0;
+}
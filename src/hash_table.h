@@ -0,0 +1,108 @@
+#ifndef HASH_TABLE_H
+#define HASH_TABLE_H
+
+#include <stdint.h>
+#include "fs_core.h"
+
+// On-disk hash index of the names, kept next to the ordered index (index.h) for point lookups:
+// one probe sequence in a table of HTSlot instead of a name comparison at every level of a tree.
+// The ordered index stays the reference (duplicates, listing, compaction); index_insert and
+// index_remove keep both in step.
+//
+// Open addressing with linear probing over a power-of-two table of 16-byte slots (FNV-1a hash of
+// the name, offset of an HTRecord). Deletion shifts the rest of the cluster back, so there are no
+// tombstones. Each name's inode fields live in a record of its own, read once per lookup.
+//
+// Growth is incremental: past HT_MAX_LOAD the table gets a successor twice as large, which every
+// following insert or delete first clears (HT_CLEAR_STEP slots), then fills by moving the old
+// table over (HT_MOVE_STEP slots, rounded up to the end of a cluster). Meanwhile lookups look in
+// both tables. No operation pays for more than one step.
+//
+// Images get one when their index is created empty (init, compaction); images written before it
+// keep looking names up in their tree until compacted. Version 1 images have none.
+
+#define HT_MAGIC 0x48415348L        // "HASH"
+#define HT_MIN_SLOTS 1024
+#define HT_MAX_LOAD_NUM 7           // Grow when count > slots * NUM / DEN
+#define HT_MAX_LOAD_DEN 10
+#define HT_CLEAR_STEP 256           // Slots of the successor cleared per operation
+#define HT_MOVE_STEP 32             // Slots of the old table moved per operation (at least)
+
+typedef struct HTSlot {
+    uint64_t hash;          // 0 = empty
+    long record;            // Offset of the HTRecord
+} HTSlot;
+
+// Inode of one name. Only the name's length + 1 bytes of `name` are stored.
+typedef struct HTRecord {
+    int type;
+    int codec;
+    long parent_offset;
+    long children_offset;
+    long data_offset;
+    long original_size;
+    long compressed_size;
+    char name[MAX_NAME_LEN];
+} HTRecord;
+
+typedef struct HTHeader {
+    long magic;
+    long count;             // Names in the index (both tables)
+    long table;             // Slots of the table
+    long slots;
+    long next_table;        // Successor while growing, 0 = none
+    long next_slots;
+    long cleared;           // Slots of the successor cleared so far (moving starts when all are)
+    long move_start;        // First slot of the old table moved (an empty slot)
+    long moved;             // Slots of the old table moved so far
+} HTHeader;
+
+// --- Slot tables ---
+// Linear probing over a power-of-two table of HTSlot at `table` in the image, a hash of 0 marking
+// an empty slot. Also used by the dedup index (dedup.h). Return 0 on success.
+
+int ht_read_slot(FSContext *ctx, long table, long i, HTSlot *s);
+int ht_write_slot(FSContext *ctx, long table, long i, const HTSlot *s);
+// Empties slots [from, from + n).
+int ht_clear_slots(FSContext *ctx, long table, long from, long n);
+// Puts a slot in the first empty place of its probe sequence. Returns -1 if the table is full.
+int ht_place(FSContext *ctx, long table, long slots, const HTSlot *s);
+// Empties slot i, moving back every later slot of the cluster whose probe sequence passes over the
+// hole (no tombstones).
+int ht_delete_at(FSContext *ctx, long table, long slots, long i);
+
+// Creates an empty hash index sized for `expected` names, for an image whose index is empty.
+// Returns 0 on success.
+int ht_create(FSContext *ctx, long expected);
+
+// Creates a hash index holding every name of the ordered index, sized so it does not need to grow
+// soon (compaction). Returns 0 on success.
+int ht_build(FSContext *ctx);
+
+// Returns 0 and fills *out (may be NULL), -1 if not found, 1 if the image has no hash index.
+int ht_lookup(FSContext *ctx, const char *name, Inode *out);
+
+// Adds a name the ordered index did not have. Returns 0 on success (or without a hash index).
+int ht_insert(FSContext *ctx, const Inode *inode);
+
+// Rewrites the fields of a name it has (a directory whose tree moved, directory.h). Returns 0 on
+// success (or without a hash index), -1 if not found.
+int ht_update(FSContext *ctx, const Inode *inode);
+
+// Removes a name. Returns 0 on success (or without a hash index), -1 if not found.
+int ht_remove(FSContext *ctx, const char *name);
+
+// Stops using the hash index after a failed update (the ordered index stays right). Its space is
+// only reclaimed by compaction.
+void ht_drop(FSContext *ctx);
+
+typedef struct HTStats {
+    long count;
+    long slots;             // Both tables while growing
+    int growing;
+} HTStats;
+
+// Returns 0 and fills *stats, or -1 if the image has no hash index.
+int ht_stats(FSContext *ctx, HTStats *stats);
+
+#endif // HASH_TABLE_H
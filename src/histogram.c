@@ -0,0 +1,135 @@
+#include "histogram.h"
+#include <string.h>
+#include <stdint.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HISTOGRAM_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+
+// AVX2: a 32-byte chunk holding at least this many copies of its first byte is counted by value.
+#define HISTOGRAM_RUN_MIN 20
+
+typedef unsigned int SubTables[4][HISTOGRAM_SYMBOLS];
+
+static void histogram_naive(const unsigned char *data, size_t size, unsigned int freq[HISTOGRAM_SYMBOLS]) {
+    memset(freq, 0, HISTOGRAM_SYMBOLS * sizeof(unsigned int));
+    for (size_t i = 0; i < size; i++) freq[data[i]]++;
+}
+
+// The 8 bytes of w over the 4 tables (any order will do: only the sums are used).
+static inline void count_word(SubTables sub, uint64_t w) {
+    sub[0][w & 0xFF]++;
+    sub[1][(w >> 8) & 0xFF]++;
+    sub[2][(w >> 16) & 0xFF]++;
+    sub[3][(w >> 24) & 0xFF]++;
+    sub[0][(w >> 32) & 0xFF]++;
+    sub[1][(w >> 40) & 0xFF]++;
+    sub[2][(w >> 48) & 0xFF]++;
+    sub[3][w >> 56]++;
+}
+
+static void merge_sub_tables(SubTables sub, const unsigned char *tail, size_t tail_size,
+                             unsigned int freq[HISTOGRAM_SYMBOLS]) {
+    for (size_t i = 0; i < tail_size; i++) sub[0][tail[i]]++;
+    for (int s = 0; s < HISTOGRAM_SYMBOLS; s++) {
+        freq[s] = sub[0][s] + sub[1][s] + sub[2][s] + sub[3][s];
+    }
+}
+
+static void histogram_scalar(const unsigned char *data, size_t size, unsigned int freq[HISTOGRAM_SYMBOLS]) {
+    SubTables sub;
+    memset(sub, 0, sizeof(SubTables));
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        uint64_t a, b;
+        memcpy(&a, data + i, 8);
+        memcpy(&b, data + i + 8, 8);
+        count_word(sub, a);
+        count_word(sub, b);
+    }
+    merge_sub_tables(sub, data + i, size - i, freq);
+}
+
+#ifdef HISTOGRAM_HAVE_AVX2
+// Every CPU with AVX2 also has POPCNT and BMI1 (tzcnt).
+__attribute__((target("avx2,popcnt,bmi")))
+static void histogram_avx2(const unsigned char *data, size_t size, unsigned int freq[HISTOGRAM_SYMBOLS]) {
+    SubTables sub;
+    memset(sub, 0, sizeof(SubTables));
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned int same = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)data[i])));
+        int count = __builtin_popcount(same);
+        if (count >= HISTOGRAM_RUN_MIN) {
+            // Mostly one value (runs, skewed data): one add for all its copies, then the other bytes
+            sub[0][data[i]] += count;
+            for (unsigned int rest = ~same; rest; rest &= rest - 1) {
+                int pos = __builtin_ctz(rest);
+                sub[pos & 3][data[i + pos]]++;
+            }
+            continue;
+        }
+        // Mixed bytes: plain loads are cheaper than extracting the lanes
+        for (int w = 0; w < 32; w += 8) {
+            uint64_t word;
+            memcpy(&word, data + i + w, 8);
+            count_word(sub, word);
+        }
+    }
+    merge_sub_tables(sub, data + i, size - i, freq);
+}
+#endif
+
+int histogram_kernel_available(int kernel) {
+    switch (kernel) {
+        case HISTOGRAM_AUTO:
+        case HISTOGRAM_NAIVE:
+        case HISTOGRAM_SCALAR:
+            return 1;
+#ifdef HISTOGRAM_HAVE_AVX2
+        case HISTOGRAM_AVX2:
+            return __builtin_cpu_supports("avx2") ? 1 : 0;
+#endif
+        default:
+            return 0;
+    }
+}
+
+void byte_histogram(const unsigned char *data, size_t size, unsigned int freq[HISTOGRAM_SYMBOLS]) {
+    if (size < HISTOGRAM_MIN_SPLIT) {
+        histogram_naive(data, size, freq);
+        return;
+    }
+#ifdef HISTOGRAM_HAVE_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        histogram_avx2(data, size, freq);
+        return;
+    }
+#endif
+    histogram_scalar(data, size, freq);
+}
+
+int byte_histogram_kernel(int kernel, const unsigned char *data, size_t size, unsigned int freq[HISTOGRAM_SYMBOLS]) {
+    if (!histogram_kernel_available(kernel)) return -1;
+    switch (kernel) {
+        case HISTOGRAM_NAIVE: histogram_naive(data, size, freq); break;
+        case HISTOGRAM_SCALAR: histogram_scalar(data, size, freq); break;
+#ifdef HISTOGRAM_HAVE_AVX2
+        case HISTOGRAM_AVX2: histogram_avx2(data, size, freq); break;
+#endif
+        default: byte_histogram(data, size, freq); break;
+    }
+    return 0;
+}
+
+const char* histogram_kernel_name(int kernel) {
+    switch (kernel) {
+        case HISTOGRAM_AUTO: return "auto";
+        case HISTOGRAM_NAIVE: return "naive";
+        case HISTOGRAM_SCALAR: return "scalar x4";
+        case HISTOGRAM_AVX2: return "avx2";
+        default: return "unknown";
+    }
+}
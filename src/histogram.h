@@ -0,0 +1,35 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stddef.h>
+
+// Byte histograms, the first pass of every Huffman encoder and of the codec estimate.
+// A plain `freq[data[i]]++` loop stalls whenever a byte repeats: each increment has to wait for the
+// store of the previous one to the same counter. The kernels below spread consecutive bytes over
+// 4 sub-tables (summed at the end) so neighbouring increments never touch the same counter, and
+// the AVX2 kernel also counts a 32-byte run of one value (padding, runs of spaces or zeros) with
+// a single add. The AVX2 kernel is picked at runtime when the CPU has it.
+
+#define HISTOGRAM_SYMBOLS 256
+// Below this size the sub-tables cost more to clear and merge than they save.
+#define HISTOGRAM_MIN_SPLIT 1024
+
+typedef enum HistogramKernel {
+    HISTOGRAM_AUTO = 0,     // Best kernel for this CPU
+    HISTOGRAM_NAIVE = 1,    // One table, one increment per byte (reference)
+    HISTOGRAM_SCALAR = 2,   // 4 sub-tables, 8 bytes per load
+    HISTOGRAM_AVX2 = 3      // 4 sub-tables, 32 bytes per load, whole runs in one add
+} HistogramKernel;
+
+// Count of each byte value in data[0..size). freq is overwritten.
+void byte_histogram(const unsigned char *data, size_t size, unsigned int freq[HISTOGRAM_SYMBOLS]);
+
+// Same with a given kernel (benchmarks, cross-checks). Returns 0, or -1 if the CPU lacks it.
+int byte_histogram_kernel(int kernel, const unsigned char *data, size_t size, unsigned int freq[HISTOGRAM_SYMBOLS]);
+
+// 1 if the kernel can run on this CPU.
+int histogram_kernel_available(int kernel);
+
+const char* histogram_kernel_name(int kernel);
+
+#endif // HISTOGRAM_H
@@ -1,172 +1,217 @@
 #include "huffman.h"
+#include "histogram.h"
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
 
-// Priority Queue for Huffman Tree construction
-typedef struct PQNode {
-    HuffmanNode *tree_node;
-    struct PQNode *next;
-} PQNode;
+// --- Tree construction ---
+// Nodes come from the caller's HuffmanTree arena: leaves first in symbol order, then every parent
+// as it is created, so a node's index is also its creation order. The live subtrees wait in a
+// binary min-heap of node indices ordered by frequency; among equal frequencies the most recently
+// created node comes out first. That is the order of the sorted list used before, which matters:
+// version 1 streams only store frequencies, and the decoder must rebuild exactly the same tree.
 
-PQNode* pq_new(HuffmanNode *tree_node) {
-    PQNode *node = malloc(sizeof(PQNode));
-    node->tree_node = tree_node;
-    node->next = NULL;
-    return node;
+// 1 if node a must leave the heap before node b.
+static inline int heap_before(const HuffmanNode *nodes, int a, int b) {
+    if (nodes[a].frequency != nodes[b].frequency) return nodes[a].frequency < nodes[b].frequency;
+    return a > b;
 }
 
-void pq_insert(PQNode **head, HuffmanNode *tree_node) {
-    PQNode *node = pq_new(tree_node);
-    if (!*head || (*head)->tree_node->frequency >= tree_node->frequency) {
-        node->next = *head;
-        *head = node;
-    } else {
-        PQNode *current = *head;
-        while (current->next && current->next->tree_node->frequency < tree_node->frequency) {
-            current = current->next;
-        }
-        node->next = current->next;
-        current->next = node;
+static void heap_push(const HuffmanNode *nodes, int *heap, int *size, int node) {
+    int i = (*size)++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!heap_before(nodes, node, heap[parent])) break;
+        heap[i] = heap[parent];
+        i = parent;
     }
+    heap[i] = node;
 }
 
-HuffmanNode* pq_pop(PQNode **head) {
-    if (!*head) return NULL;
-    PQNode *temp = *head;
-    *head = (*head)->next;
-    HuffmanNode *tree_node = temp->tree_node;
-    free(temp);
-    return tree_node;
+static int heap_pop(const HuffmanNode *nodes, int *heap, int *size) {
+    int top = heap[0];
+    int last = heap[--(*size)];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= *size) break;
+        if (child + 1 < *size && heap_before(nodes, heap[child + 1], heap[child])) child++;
+        if (!heap_before(nodes, heap[child], last)) break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
 }
 
-HuffmanNode* build_huffman_tree_from_freq(unsigned int freq[MAX_SYMBOLS]) {
-    PQNode *head = NULL;
+HuffmanNode* build_huffman_tree(const unsigned int freq[MAX_SYMBOLS], HuffmanTree *tree) {
+    HuffmanNode *nodes = tree->nodes;
+    int heap[MAX_SYMBOLS];
+    int heap_size = 0;
+    tree->count = 0;
+
     for (int i = 0; i < MAX_SYMBOLS; i++) {
         if (freq[i] > 0) {
-            HuffmanNode *node = malloc(sizeof(HuffmanNode));
-            node->symbol = (unsigned char)i;
-            node->frequency = freq[i];
-            node->left = NULL;
-            node->right = NULL;
-            pq_insert(&head, node);
+            HuffmanNode *leaf = &nodes[tree->count];
+            leaf->symbol = (unsigned char)i;
+            leaf->frequency = freq[i];
+            leaf->left = NULL;
+            leaf->right = NULL;
+            heap_push(nodes, heap, &heap_size, tree->count++);
         }
     }
+    if (heap_size == 0) return NULL;
 
-    if (!head) return NULL;
-
-    while (head->next) {
-        HuffmanNode *left = pq_pop(&head);
-        HuffmanNode *right = pq_pop(&head);
+    while (heap_size > 1) {
+        int left = heap_pop(nodes, heap, &heap_size);
+        int right = heap_pop(nodes, heap, &heap_size);
 
-        HuffmanNode *parent = malloc(sizeof(HuffmanNode));
+        HuffmanNode *parent = &nodes[tree->count];
         parent->symbol = 0; // Internal node
-        parent->frequency = left->frequency + right->frequency;
-        parent->left = left;
-        parent->right = right;
-
-        pq_insert(&head, parent);
+        parent->frequency = nodes[left].frequency + nodes[right].frequency;
+        parent->left = &nodes[left];
+        parent->right = &nodes[right];
+        heap_push(nodes, heap, &heap_size, tree->count++);
     }
 
-    return pq_pop(&head);
-}
-
-void free_huffman_tree(HuffmanNode *root) {
-    if (!root) return;
-    free_huffman_tree(root->left);
-    free_huffman_tree(root->right);
-    free(root);
+    return &nodes[heap[0]];
 }
 
-void generate_codes_recursive(HuffmanNode *node, char *current_code, int depth, char *codes[MAX_SYMBOLS]) {
-    if (!node) return;
+static void generate_codes_recursive(const HuffmanNode *node, uint64_t code, int depth,
+                                     uint64_t codes[MAX_SYMBOLS], uint8_t lengths[MAX_SYMBOLS]) {
     if (!node->left && !node->right) {
-        current_code[depth] = '\0';
-        codes[node->symbol] = strdup(current_code);
+        codes[node->symbol] = code;
+        lengths[node->symbol] = (uint8_t)depth;
         return;
     }
-    if (node->left) {
-        current_code[depth] = '0';
-        generate_codes_recursive(node->left, current_code, depth + 1, codes);
-    }
-    if (node->right) {
-        current_code[depth] = '1';
-        generate_codes_recursive(node->right, current_code, depth + 1, codes);
-    }
+    generate_codes_recursive(node->left, code << 1, depth + 1, codes, lengths);
+    generate_codes_recursive(node->right, (code << 1) | 1, depth + 1, codes, lengths);
 }
 
-void generate_huffman_codes(HuffmanNode *root, char *codes[MAX_SYMBOLS]) {
-    char buffer[256];
-    generate_codes_recursive(root, buffer, 0, codes);
+void generate_huffman_codes(const HuffmanNode *root, uint64_t codes[MAX_SYMBOLS], uint8_t lengths[MAX_SYMBOLS]) {
+    memset(codes, 0, MAX_SYMBOLS * sizeof(uint64_t));
+    memset(lengths, 0, MAX_SYMBOLS);
+    if (root) generate_codes_recursive(root, 0, 0, codes, lengths);
 }
 
-// Compress data: | Freq Table (256*4 bytes) | Data content |
-unsigned char* compress_data(const unsigned char *data, size_t size, size_t *out_size) {
-    unsigned int freq[MAX_SYMBOLS] = {0};
-    for (size_t i = 0; i < size; i++) freq[data[i]]++;
+// --- Bit writer ---
+// MSB-first bitstream built in a 64-bit accumulator and stored a whole word at a time: a flush
+// writes 8 bytes and moves on by the number of complete bytes, the partial byte being rewritten by
+// the next flush. Buffers need HUFFMAN_WRITE_SLACK bytes past the end of the stream.
+
+#define HUFFMAN_WRITE_SLACK 8
+
+typedef struct BitWriter {
+    unsigned char *out;
+    size_t pos;          // Byte holding the first pending bit
+    uint64_t acc;        // Pending bits, left-aligned
+    int bits;            // Number of pending bits (< 8 after a flush)
+} BitWriter;
+
+static inline void store_be64(unsigned char *p, uint64_t v) {
+    p[0] = (unsigned char)(v >> 56);
+    p[1] = (unsigned char)(v >> 48);
+    p[2] = (unsigned char)(v >> 40);
+    p[3] = (unsigned char)(v >> 32);
+    p[4] = (unsigned char)(v >> 24);
+    p[5] = (unsigned char)(v >> 16);
+    p[6] = (unsigned char)(v >> 8);
+    p[7] = (unsigned char)v;
+}
 
-    HuffmanNode *root = build_huffman_tree_from_freq(freq);
-    char *codes[MAX_SYMBOLS] = {0};
-    if (root) generate_huffman_codes(root, codes);
+static void bit_writer_init(BitWriter *bw, unsigned char *out) {
+    bw->out = out;
+    bw->pos = 0;
+    bw->acc = 0;
+    bw->bits = 0;
+}
+
+// Appends a code of 1 to 56 bits. The pending bits must stay within 64 until the next flush.
+static inline void bit_writer_put(BitWriter *bw, uint64_t code, int len) {
+    bw->acc |= code << (64 - bw->bits - len);
+    bw->bits += len;
+}
+
+static inline void bit_writer_flush(BitWriter *bw) {
+    store_be64(bw->out + bw->pos, bw->acc);
+    bw->pos += bw->bits >> 3;
+    bw->acc <<= bw->bits & ~7;
+    bw->bits &= 7;
+}
+
+// Returns the number of bytes in the stream (the last one padded with zero bits).
+static size_t bit_writer_finish(BitWriter *bw) {
+    bit_writer_flush(bw);
+    return bw->pos + (bw->bits > 0);
+}
+
+// Exact stream size for a histogram and its code lengths.
+static size_t encoded_bytes(const unsigned int freq[MAX_SYMBOLS], const uint8_t lengths[MAX_SYMBOLS]) {
+    uint64_t bits = 0;
+    for (int i = 0; i < MAX_SYMBOLS; i++) bits += (uint64_t)freq[i] * lengths[i];
+    return (size_t)((bits + 7) / 8);
+}
+
+// Legacy format (version 1 images): | Freq Table (256*4 bytes) | Data content |
+// The codes are read off the tree (not canonical). Frequencies fit in 32 bits, which keeps the tree
+// well under 56 levels: one code per flush always fits in the accumulator.
+unsigned char* compress_data_legacy(const unsigned char *data, size_t size, size_t *out_size) {
+    unsigned int freq[MAX_SYMBOLS];
+    byte_histogram(data, size, freq);
+
+    HuffmanTree tree;
+    uint64_t codes[MAX_SYMBOLS];
+    uint8_t lengths[MAX_SYMBOLS];
+    generate_huffman_codes(build_huffman_tree(freq, &tree), codes, lengths);
 
-    // Calculate size
     // Header size: 256 * 4 bytes for frequencies
     size_t header_size = MAX_SYMBOLS * sizeof(unsigned int);
-    size_t buffer_size = header_size + size; // Approximation, usually smaller compressed
-    unsigned char *output = malloc(buffer_size); // Initial guess, might realloc if strictly needed, but let's be safe
-    // Since Huffman can expand slightly in worst case or overhead... let's allocate 2*size + header
-    unsigned char *final_output = malloc(header_size + size * 2 + 1024);
-    
-    // Write header
+    size_t stream_size = encoded_bytes(freq, lengths);
+    unsigned char *final_output = malloc(header_size + stream_size + HUFFMAN_WRITE_SLACK);
+    if (!final_output) return NULL;
     memcpy(final_output, freq, header_size);
 
-    size_t bit_pos = 0;
-    size_t byte_pos = header_size;
-    memset(final_output + byte_pos, 0, size * 2); 
-
-    for (size_t i = 0; i < size; i++) {
-        char *code = codes[data[i]];
-        if (!code) continue; 
-        for (int j = 0; code[j]; j++) {
-            if (code[j] == '1') {
-                final_output[byte_pos] |= (1 << (7 - bit_pos));
-            }
-            bit_pos++;
-            if (bit_pos == 8) {
-                bit_pos = 0;
-                byte_pos++;
-            }
+    // A lone symbol has an empty code: no bits at all
+    BitWriter bw;
+    bit_writer_init(&bw, final_output + header_size);
+    if (stream_size > 0) {
+        for (size_t i = 0; i < size; i++) {
+            bit_writer_put(&bw, codes[data[i]], lengths[data[i]]);
+            bit_writer_flush(&bw);
         }
     }
-    if (bit_pos > 0) byte_pos++; // Finish partial byte
-
-    *out_size = byte_pos;
-
-    // Cleanup
-    free_huffman_tree(root);
-    for (int i = 0; i < MAX_SYMBOLS; i++) {
-        if (codes[i]) free(codes[i]);
-    }
-    free(output); // Oops, I used final_output. Free unused `output`.
-    
+    *out_size = header_size + bit_writer_finish(&bw);
     return final_output;
 }
 
-unsigned char* decompress_data(const unsigned char *compressed_data, size_t compressed_size, size_t original_size) {
+// Reference decoder: one bit at a time, following the tree pointers down to a leaf.
+// Kept for benchmarks and to cross-check the table-driven decoder below.
+unsigned char* decompress_data_bitwise(const unsigned char *compressed_data, size_t compressed_size, size_t original_size) {
     if (compressed_size < MAX_SYMBOLS * sizeof(unsigned int)) return NULL;
 
     unsigned int freq[MAX_SYMBOLS];
     memcpy(freq, compressed_data, MAX_SYMBOLS * sizeof(unsigned int));
 
-    HuffmanNode *root = build_huffman_tree_from_freq(freq);
+    HuffmanTree tree;
+    HuffmanNode *root = build_huffman_tree(freq, &tree);
     unsigned char *output = malloc(original_size + 1); // +1 safety
+    if (!output) return NULL;
 
     size_t bit_pos = 0;
     size_t byte_pos = MAX_SYMBOLS * sizeof(unsigned int);
     size_t out_pos = 0;
 
+    if (root && !root->left && !root->right) {
+        // Only one distinct byte: its code is empty, every output byte is that symbol.
+        memset(output, root->symbol, original_size);
+        out_pos = original_size;
+    }
+
     HuffmanNode *current = root;
-    while (out_pos < original_size && byte_pos < compressed_size) {
+    while (root && out_pos < original_size && byte_pos < compressed_size) {
         int bit = (compressed_data[byte_pos] >> (7 - bit_pos)) & 1;
         bit_pos++;
         if (bit_pos == 8) {
@@ -183,6 +228,995 @@ unsigned char* decompress_data(const unsigned char *compressed_data, size_t comp
         }
     }
 
-    free_huffman_tree(root);
+    return output;
+}
+
+// --- Table-driven decoder ---
+//
+// The code is flattened into a small array trie (at most MAX_SYMBOLS - 1 internal nodes), and a
+// primary table indexed by the next HUFFMAN_TABLE_BITS bits of the stream tells in one lookup
+// which symbols (up to 3) are completely contained in that window and how many bits they use.
+// Codes longer than the window (rare: they belong to the least frequent symbols) fall back to
+// walking the trie from the node reached at the end of the window.
+//
+// Table entry layout:
+//   bits 0-4  : number of bits consumed
+//   bits 5-6  : number of symbols decoded (0 = code longer than the window)
+//   bits 8-31 : the decoded symbols, first one in bits 8-15
+//               (or, when no symbol fits, the trie node reached after the window)
+
+#define HUFFMAN_TABLE_BITS 11
+#define HUFFMAN_TABLE_SIZE (1 << HUFFMAN_TABLE_BITS)
+#define HUFFMAN_TABLE_MAX_SYMS 3
+
+typedef struct HuffmanDecoder {
+    int16_t trie[MAX_SYMBOLS][2]; // child >= 0: internal node index, < 0: leaf -(symbol + 1)
+    int trie_size;
+    int single_symbol;            // >= 0 when the code has a single (zero-length) symbol
+    uint32_t table[HUFFMAN_TABLE_SIZE];
+} HuffmanDecoder;
+
+static int decoder_add_subtree(HuffmanDecoder *dec, const HuffmanNode *node) {
+    if (!node->left && !node->right) return -(node->symbol + 1);
+    int index = dec->trie_size++;
+    int left = decoder_add_subtree(dec, node->left);
+    int right = decoder_add_subtree(dec, node->right);
+    dec->trie[index][0] = (int16_t)left;
+    dec->trie[index][1] = (int16_t)right;
+    return index;
+}
+
+static void decoder_build_table(HuffmanDecoder *dec) {
+    for (uint32_t window = 0; window < HUFFMAN_TABLE_SIZE; window++) {
+        int node = 0;
+        int count = 0;
+        int consumed = 0;
+        uint32_t symbols = 0;
+
+        for (int b = 0; b < HUFFMAN_TABLE_BITS; b++) {
+            int bit = (window >> (HUFFMAN_TABLE_BITS - 1 - b)) & 1;
+            int next = dec->trie[node][bit];
+            if (next < 0) {
+                symbols |= (uint32_t)(-next - 1) << (8 + 8 * count);
+                count++;
+                consumed = b + 1;
+                node = 0;
+                if (count == HUFFMAN_TABLE_MAX_SYMS) break;
+            } else {
+                node = next;
+            }
+        }
+
+        if (count == 0) {
+            dec->table[window] = HUFFMAN_TABLE_BITS | ((uint32_t)node << 8);
+        } else {
+            dec->table[window] = (uint32_t)consumed | ((uint32_t)count << 5) | symbols;
+        }
+    }
+}
+
+// Builds the decoder for the tree reconstructed from a frequency table.
+// Returns 0 when the tree is empty (no symbol at all).
+static int decoder_init_from_tree(HuffmanDecoder *dec, const HuffmanNode *root) {
+    dec->trie_size = 0;
+    dec->single_symbol = -1;
+    if (!root) return 0;
+    if (!root->left && !root->right) {
+        dec->single_symbol = root->symbol;
+        return 1;
+    }
+    decoder_add_subtree(dec, root);
+    decoder_build_table(dec);
+    return 1;
+}
+
+// --- Decoder cache ---
+// Reading a file again, or another file compressed with the same code, finds its decoder here
+// instead of rebuilding the trie and the table (which costs as much as decoding a few KB).
+// Entries are keyed by what a decoder is built from, the frequency table (version 1) or the code
+// lengths, and copied out under the lock: nobody keeps a pointer into the cache. The least
+// recently used entry is replaced.
+
+#define DECODER_CACHE_SIZE 8
+#define DECODER_KEY_MAX (MAX_SYMBOLS * sizeof(unsigned int))
+
+typedef struct DecoderCacheEntry {
+    uint64_t hash;
+    size_t key_size;            // 0 = free slot
+    unsigned long last_use;
+    unsigned char key[DECODER_KEY_MAX];
+    HuffmanDecoder dec;
+} DecoderCacheEntry;
+
+static DecoderCacheEntry decoder_cache[DECODER_CACHE_SIZE];
+static unsigned long decoder_cache_clock;
+static pthread_mutex_t decoder_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// FNV-1a
+static uint64_t key_hash(const unsigned char *key, size_t size) {
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; i++) {
+        h ^= key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Copies the decoder cached for `key` into dec. Returns 1 if there was one.
+static int decoder_cache_get(const void *key, size_t key_size, uint64_t hash, HuffmanDecoder *dec) {
+    int found = 0;
+    pthread_mutex_lock(&decoder_cache_lock);
+    for (int i = 0; i < DECODER_CACHE_SIZE; i++) {
+        DecoderCacheEntry *e = &decoder_cache[i];
+        if (e->key_size == key_size && e->hash == hash && memcmp(e->key, key, key_size) == 0) {
+            e->last_use = ++decoder_cache_clock;
+            memcpy(dec, &e->dec, sizeof(HuffmanDecoder));
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&decoder_cache_lock);
+    return found;
+}
+
+static void decoder_cache_put(const void *key, size_t key_size, uint64_t hash, const HuffmanDecoder *dec) {
+    pthread_mutex_lock(&decoder_cache_lock);
+    DecoderCacheEntry *victim = &decoder_cache[0];
+    for (int i = 1; i < DECODER_CACHE_SIZE && victim->key_size != 0; i++) {
+        if (decoder_cache[i].key_size == 0 || decoder_cache[i].last_use < victim->last_use) victim = &decoder_cache[i];
+    }
+    victim->hash = hash;
+    victim->key_size = key_size;
+    victim->last_use = ++decoder_cache_clock;
+    memcpy(victim->key, key, key_size);
+    memcpy(&victim->dec, dec, sizeof(HuffmanDecoder));
+    pthread_mutex_unlock(&decoder_cache_lock);
+}
+
+// Decoder of a version 1 stream, from its frequency table. Returns 0 when the table is empty.
+static int decoder_from_freq(HuffmanDecoder *dec, const unsigned int freq[MAX_SYMBOLS]) {
+    uint64_t hash = key_hash((const unsigned char *)freq, DECODER_KEY_MAX);
+    if (decoder_cache_get(freq, DECODER_KEY_MAX, hash, dec)) return 1;
+
+    HuffmanTree tree;
+    int res = decoder_init_from_tree(dec, build_huffman_tree(freq, &tree));
+    if (res > 0) decoder_cache_put(freq, DECODER_KEY_MAX, hash, dec);
+    return res;
+}
+
+static inline uint64_t load_be64(const unsigned char *p) {
+    return ((uint64_t)p[0] << 56) | ((uint64_t)p[1] << 48) | ((uint64_t)p[2] << 40) | ((uint64_t)p[3] << 32) |
+           ((uint64_t)p[4] << 24) | ((uint64_t)p[5] << 16) | ((uint64_t)p[6] << 8) | (uint64_t)p[7];
+}
+
+// Position in an MSB-first bitstream.
+typedef struct BitReader {
+    const unsigned char *in;
+    size_t in_size;
+    size_t pos;          // Next input byte to load
+    uint64_t bitbuf;     // Next bits of the stream, left-aligned
+    int bitcount;        // Number of valid bits in bitbuf
+} BitReader;
+
+static void bit_reader_init(BitReader *br, const unsigned char *in, size_t in_size) {
+    br->in = in;
+    br->in_size = in_size;
+    br->pos = 0;
+    br->bitbuf = 0;
+    br->bitcount = 0;
+}
+
+// Fast path: only while 8 whole bytes are left to load.
+static inline int bit_reader_fast(const BitReader *br) {
+    return br->pos + 8 <= br->in_size;
+}
+
+// Tops bitbuf up to at least 56 bits, 8 bytes at a time.
+static inline void bit_reader_refill(BitReader *br) {
+    br->bitbuf |= load_be64(br->in + br->pos) >> br->bitcount;
+    br->pos += (63 - br->bitcount) >> 3;
+    br->bitcount |= 56;
+}
+
+// One table lookup after a refill: decodes up to HUFFMAN_TABLE_MAX_SYMS symbols (out needs room
+// for all of them). Returns the number of symbols written, 0 if the stream ran out.
+static inline size_t decode_step(const HuffmanDecoder *dec, BitReader *br, unsigned char *out) {
+    uint32_t entry = dec->table[br->bitbuf >> (64 - HUFFMAN_TABLE_BITS)];
+    int count = (entry >> 5) & 3;
+    int bits = entry & 31;
+    br->bitbuf <<= bits;
+    br->bitcount -= bits;
+
+    if (count) {
+        out[0] = (unsigned char)(entry >> 8);
+        out[1] = (unsigned char)(entry >> 16);
+        out[2] = (unsigned char)(entry >> 24);
+        return count;
+    }
+
+    int node = (int)(entry >> 8);
+    for (;;) {
+        if (br->bitcount == 0) {
+            // Very long code (only possible with degenerate frequency tables)
+            if (br->pos >= br->in_size) return 0;
+            br->bitbuf = (uint64_t)br->in[br->pos++] << 56;
+            br->bitcount = 8;
+        }
+        int next = dec->trie[node][br->bitbuf >> 63];
+        br->bitbuf <<= 1;
+        br->bitcount--;
+        if (next < 0) {
+            out[0] = (unsigned char)(-next - 1);
+            return 1;
+        }
+        node = next;
+    }
+}
+
+// One bit at a time through the trie, stopping exactly at the end of the input.
+// Returns the new output position.
+static size_t decode_tail(const HuffmanDecoder *dec, BitReader *br, unsigned char *out, size_t out_pos, size_t out_size) {
+    while (out_pos < out_size) {
+        int node = 0;
+        for (;;) {
+            if (br->bitcount == 0) {
+                if (br->pos >= br->in_size) return out_pos;
+                br->bitbuf |= (uint64_t)br->in[br->pos++] << 56;
+                br->bitcount = 8;
+            }
+            int next = dec->trie[node][br->bitbuf >> 63];
+            br->bitbuf <<= 1;
+            br->bitcount--;
+            if (next < 0) {
+                out[out_pos++] = (unsigned char)(-next - 1);
+                break;
+            }
+            node = next;
+        }
+    }
+    return out_pos;
+}
+
+// Decodes the rest of a stream into out[out_pos..out_size). Returns the new output position
+// (short of out_size if the stream is truncated).
+static size_t decode_stream(const HuffmanDecoder *dec, BitReader *br, unsigned char *out, size_t out_pos, size_t out_size) {
+    // Fast path: refill 8 bytes at a time and decode up to 3 symbols per lookup.
+    // Only runs while the window is entirely real data and the output has room for a full entry.
+    while (out_pos + HUFFMAN_TABLE_MAX_SYMS <= out_size && bit_reader_fast(br)) {
+        bit_reader_refill(br);
+        size_t n = decode_step(dec, br, out + out_pos);
+        if (n == 0) return out_pos;
+        out_pos += n;
+    }
+    return decode_tail(dec, br, out, out_pos, out_size);
+}
+
+// Decodes an MSB-first bitstream into exactly out_size symbols (fewer if the stream is truncated).
+// Returns the number of symbols written.
+static size_t decoder_run(const HuffmanDecoder *dec, const unsigned char *in, size_t in_size,
+                          unsigned char *out, size_t out_size) {
+    if (dec->single_symbol >= 0) {
+        memset(out, dec->single_symbol, out_size);
+        return out_size;
+    }
+
+    BitReader br;
+    bit_reader_init(&br, in, in_size);
+    return decode_stream(dec, &br, out, 0, out_size);
+}
+
+unsigned char* decompress_data_legacy(const unsigned char *compressed_data, size_t compressed_size, size_t original_size) {
+    if (compressed_size < MAX_SYMBOLS * sizeof(unsigned int)) return NULL;
+
+    unsigned int freq[MAX_SYMBOLS];
+    memcpy(freq, compressed_data, MAX_SYMBOLS * sizeof(unsigned int));
+
+    HuffmanDecoder *dec = malloc(sizeof(HuffmanDecoder));
+    unsigned char *output = malloc(original_size + 1); // +1 safety
+    if (!dec || !output) {
+        free(dec);
+        free(output);
+        return NULL;
+    }
+
+    // No symbol at all is only valid for an empty file; a short stream is truncated or corrupt
+    size_t header_size = MAX_SYMBOLS * sizeof(unsigned int);
+    int ok = decoder_from_freq(dec, freq) > 0
+        ? decoder_run(dec, compressed_data + header_size, compressed_size - header_size, output, original_size) == original_size
+        : original_size == 0;
+    free(dec);
+    if (!ok) {
+        free(output);
+        return NULL;
+    }
+    return output;
+}
+
+// --- Canonical codes (stream format version 2) ---
+//
+// | version (1) | count (1) | code lengths | Data content |
+//
+// count <= HUFFMAN_SPARSE_MAX: `count` pairs (symbol, length) follow.
+// count == HUFFMAN_DENSE: 128 bytes follow, one 4-bit length per symbol (0 = unused), high nibble first.
+// Only the code lengths are stored: the codes are reassigned canonically (shorter codes first,
+// then by symbol value) on both sides, so the header is at most HUFFMAN_MAX_HEADER bytes.
+
+#define HUFFMAN_SPARSE_MAX 63
+#define HUFFMAN_DENSE 0xFF
+#define HUFFMAN_MAX_TREE_DEPTH MAX_SYMBOLS
+
+static void tree_depths(const HuffmanNode *node, int depth, uint8_t lengths[MAX_SYMBOLS]) {
+    if (!node->left && !node->right) {
+        lengths[node->symbol] = (uint8_t)depth;
+        return;
+    }
+    tree_depths(node->left, depth + 1, lengths);
+    tree_depths(node->right, depth + 1, lengths);
+}
+
+// Brings every code length down to HUFFMAN_MAX_CODE_LEN (the header stores lengths on 4 bits).
+// Same adjustment as the JPEG standard (Annex K.3): the two deepest leaves are moved up and
+// a shallower leaf is pushed one level down, until nothing is deeper than the limit. The lengths
+// are then handed out again, the most frequent symbols getting the shortest ones.
+static void limit_code_lengths(const unsigned int freq[MAX_SYMBOLS], uint8_t lengths[MAX_SYMBOLS]) {
+    int bl_count[HUFFMAN_MAX_TREE_DEPTH + 1] = {0};
+    int max_len = 0;
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        if (lengths[i]) {
+            bl_count[lengths[i]]++;
+            if (lengths[i] > max_len) max_len = lengths[i];
+        }
+    }
+    if (max_len <= HUFFMAN_MAX_CODE_LEN) return;
+
+    for (int len = max_len; len > HUFFMAN_MAX_CODE_LEN; len--) {
+        while (bl_count[len] > 0) {
+            int j = len - 2;
+            while (bl_count[j] == 0) j--;
+            bl_count[len] -= 2;
+            bl_count[len - 1]++;
+            bl_count[j + 1] += 2;
+            bl_count[j]--;
+        }
+    }
+
+    // Used symbols by decreasing frequency (insertion sort: at most 256 entries, rare path).
+    int order[MAX_SYMBOLS];
+    int n = 0;
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        if (!lengths[i]) continue;
+        int j = n++;
+        while (j > 0 && freq[order[j - 1]] < freq[i]) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+
+    int k = 0;
+    for (int len = 1; len <= HUFFMAN_MAX_CODE_LEN; len++) {
+        for (int c = 0; c < bl_count[len]; c++) lengths[order[k++]] = (uint8_t)len;
+    }
+}
+
+// Code length of every symbol (0 = unused). Returns the number of used symbols.
+// A lone symbol gets length 1 so it can be described in the header; no bits are emitted for it.
+static int huffman_code_lengths(unsigned int freq[MAX_SYMBOLS], uint8_t lengths[MAX_SYMBOLS]) {
+    memset(lengths, 0, MAX_SYMBOLS);
+    HuffmanTree tree;
+    HuffmanNode *root = build_huffman_tree(freq, &tree);
+    if (!root) return 0;
+
+    int used = (tree.count + 1) / 2; // n leaves, n - 1 parents
+
+    if (used == 1) {
+        lengths[root->symbol] = 1;
+    } else {
+        tree_depths(root, 0, lengths);
+        limit_code_lengths(freq, lengths);
+    }
+    return used;
+}
+
+static void canonical_codes(const uint8_t lengths[MAX_SYMBOLS], uint32_t codes[MAX_SYMBOLS]) {
+    int bl_count[HUFFMAN_MAX_CODE_LEN + 1] = {0};
+    uint32_t next_code[HUFFMAN_MAX_CODE_LEN + 1];
+    for (int i = 0; i < MAX_SYMBOLS; i++) bl_count[lengths[i]]++;
+    bl_count[0] = 0;
+
+    uint32_t code = 0;
+    for (int len = 1; len <= HUFFMAN_MAX_CODE_LEN; len++) {
+        code = (code + bl_count[len - 1]) << 1;
+        next_code[len] = code;
+    }
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        codes[i] = lengths[i] ? next_code[lengths[i]]++ : 0;
+    }
+}
+
+static size_t write_code_lengths(unsigned char *out, const uint8_t lengths[MAX_SYMBOLS], int used) {
+    out[0] = HUFFMAN_FORMAT_V2;
+    if (used <= HUFFMAN_SPARSE_MAX) {
+        size_t pos = 2;
+        out[1] = (unsigned char)used;
+        for (int i = 0; i < MAX_SYMBOLS; i++) {
+            if (lengths[i]) {
+                out[pos++] = (unsigned char)i;
+                out[pos++] = lengths[i];
+            }
+        }
+        return pos;
+    }
+    out[1] = HUFFMAN_DENSE;
+    for (int i = 0; i < MAX_SYMBOLS / 2; i++) {
+        out[2 + i] = (unsigned char)((lengths[2 * i] << 4) | lengths[2 * i + 1]);
+    }
+    return 2 + MAX_SYMBOLS / 2;
+}
+
+// Returns the header size, or -1 if the header is malformed.
+static long read_code_lengths(const unsigned char *in, size_t size, uint8_t lengths[MAX_SYMBOLS]) {
+    if (size < 2) return -1;
+    memset(lengths, 0, MAX_SYMBOLS);
+
+    int count = in[1];
+    if (count == HUFFMAN_DENSE) {
+        if (size < 2 + MAX_SYMBOLS / 2) return -1;
+        for (int i = 0; i < MAX_SYMBOLS / 2; i++) {
+            lengths[2 * i] = in[2 + i] >> 4;
+            lengths[2 * i + 1] = in[2 + i] & 0x0F;
+        }
+        return 2 + MAX_SYMBOLS / 2;
+    }
+
+    if (count > HUFFMAN_SPARSE_MAX || size < 2 + 2 * (size_t)count) return -1;
+    for (int i = 0; i < count; i++) {
+        int len = in[3 + 2 * i];
+        if (len == 0 || len > HUFFMAN_MAX_CODE_LEN) return -1;
+        lengths[in[2 + 2 * i]] = (uint8_t)len;
+    }
+    return 2 + 2 * count;
+}
+
+// Builds the decoder for a set of canonical code lengths.
+// Returns 0 for an empty code, 1 on success, -1 if the lengths do not form a complete prefix code.
+static int decoder_init_from_lengths(HuffmanDecoder *dec, const uint8_t lengths[MAX_SYMBOLS]) {
+    dec->trie_size = 0;
+    dec->single_symbol = -1;
+
+    int used = 0;
+    long kraft = 0;
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        if (!lengths[i]) continue;
+        if (lengths[i] > HUFFMAN_MAX_CODE_LEN) return -1;
+        used++;
+        kraft += 1L << (HUFFMAN_MAX_CODE_LEN - lengths[i]);
+        dec->single_symbol = i;
+    }
+    if (used == 0) return 0;
+    if (used == 1) return 1;
+    dec->single_symbol = -1;
+    if (kraft != 1L << HUFFMAN_MAX_CODE_LEN) return -1;
+
+    uint32_t codes[MAX_SYMBOLS];
+    canonical_codes(lengths, codes);
+
+    // 0 marks a missing child (the root is never anybody's child).
+    memset(dec->trie, 0, sizeof(dec->trie));
+    dec->trie_size = 1;
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        int len = lengths[i];
+        if (!len) continue;
+        int node = 0;
+        for (int b = len - 1; b > 0; b--) {
+            int bit = (codes[i] >> b) & 1;
+            int child = dec->trie[node][bit];
+            if (child < 0) return -1;
+            if (child == 0) {
+                child = dec->trie_size++;
+                dec->trie[node][bit] = (int16_t)child;
+            }
+            node = child;
+        }
+        if (dec->trie[node][codes[i] & 1] != 0) return -1;
+        dec->trie[node][codes[i] & 1] = (int16_t)-(i + 1);
+    }
+
+    decoder_build_table(dec);
+    return 1;
+}
+
+// decoder_init_from_lengths through the decoder cache. Same return values.
+static int decoder_from_lengths(HuffmanDecoder *dec, const uint8_t lengths[MAX_SYMBOLS]) {
+    uint64_t hash = key_hash(lengths, MAX_SYMBOLS);
+    if (decoder_cache_get(lengths, MAX_SYMBOLS, hash, dec)) return 1;
+
+    int res = decoder_init_from_lengths(dec, lengths);
+    if (res > 0) decoder_cache_put(lengths, MAX_SYMBOLS, hash, dec);
+    return res;
+}
+
+// --- Segmented streams (format version 3) ---
+// Inputs of several HUFFMAN_SEGMENT_SIZE segments are histogrammed and encoded one segment per task
+// on a pool of threads. All segments share one code (built from the summed histograms); each
+// bitstream starts on a byte boundary and its size is recorded, so decoding is parallel too.
+//   | 3 | code lengths | segment count (u32) | stream bytes of each segment (u32 each) | streams |
+// Every segment holds HUFFMAN_SEGMENT_SIZE symbols except the last one.
+
+typedef void (*SegmentTask)(void *arg, size_t segment);
+
+typedef struct SegmentPool {
+    SegmentTask task;
+    void *arg;
+    size_t count;
+    size_t next;            // First segment nobody has claimed yet
+    pthread_mutex_t lock;
+} SegmentPool;
+
+static void* segment_worker(void *arg) {
+    SegmentPool *pool = arg;
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t segment = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (segment >= pool->count) break;
+        pool->task(pool->arg, segment);
+    }
+    return NULL;
+}
+
+// Runs task(arg, i) for every segment on `threads` threads (the caller's included).
+static void run_segments(SegmentTask task, void *arg, size_t count, int threads) {
+    SegmentPool pool;
+    pool.task = task;
+    pool.arg = arg;
+    pool.count = count;
+    pool.next = 0;
+    pthread_mutex_init(&pool.lock, NULL);
+
+    if ((size_t)threads > count) threads = (int)count;
+    pthread_t workers[HUFFMAN_MAX_THREADS];
+    int started = 0;
+    while (started + 1 < threads && pthread_create(&workers[started], NULL, segment_worker, &pool) == 0) {
+        started++;
+    }
+    segment_worker(&pool);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    pthread_mutex_destroy(&pool.lock);
+}
+
+static int resolve_threads(int threads) {
+    if (threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus < 1 ? 1 : (int)cpus;
+    }
+    return threads > HUFFMAN_MAX_THREADS ? HUFFMAN_MAX_THREADS : threads;
+}
+
+// MSB-first bitstream of data[0..size) into out (room for the stream plus HUFFMAN_WRITE_SLACK).
+// Codes are at most 15 bits: three of them fit in the accumulator between flushes.
+// Returns the number of bytes written.
+static size_t encode_symbols(const unsigned char *data, size_t size, const uint8_t lengths[MAX_SYMBOLS],
+                             const uint32_t codes[MAX_SYMBOLS], unsigned char *out) {
+    BitWriter bw;
+    bit_writer_init(&bw, out);
+    size_t i = 0;
+    for (; i + 3 <= size; i += 3) {
+        bit_writer_put(&bw, codes[data[i]], lengths[data[i]]);
+        bit_writer_put(&bw, codes[data[i + 1]], lengths[data[i + 1]]);
+        bit_writer_put(&bw, codes[data[i + 2]], lengths[data[i + 2]]);
+        bit_writer_flush(&bw);
+    }
+    for (; i < size; i++) {
+        bit_writer_put(&bw, codes[data[i]], lengths[data[i]]);
+    }
+    return bit_writer_finish(&bw);
+}
+
+typedef struct SegmentedEncode {
+    const unsigned char *data;
+    size_t size;
+    unsigned int (*freq)[MAX_SYMBOLS];  // Per-segment histograms
+    const uint8_t *lengths;
+    const uint32_t *codes;
+    unsigned char **streams;            // Per-segment bitstreams
+    size_t *stream_sizes;
+    int failed;
+} SegmentedEncode;
+
+static size_t segment_len(size_t size, size_t segment) {
+    size_t start = segment * HUFFMAN_SEGMENT_SIZE;
+    return size - start < HUFFMAN_SEGMENT_SIZE ? size - start : HUFFMAN_SEGMENT_SIZE;
+}
+
+static void histogram_segment(void *arg, size_t segment) {
+    SegmentedEncode *enc = arg;
+    const unsigned char *p = enc->data + segment * HUFFMAN_SEGMENT_SIZE;
+    size_t n = segment_len(enc->size, segment);
+    byte_histogram(p, n, enc->freq[segment]);
+}
+
+static void encode_segment(void *arg, size_t segment) {
+    SegmentedEncode *enc = arg;
+    size_t n = segment_len(enc->size, segment);
+    unsigned char *out = malloc(encoded_bytes(enc->freq[segment], enc->lengths) + HUFFMAN_WRITE_SLACK);
+    if (!out) {
+        enc->failed = 1; // Benign race: every writer stores the same value
+        return;
+    }
+    enc->stream_sizes[segment] = encode_symbols(enc->data + segment * HUFFMAN_SEGMENT_SIZE, n,
+                                                enc->lengths, enc->codes, out);
+    enc->streams[segment] = out;
+}
+
+static unsigned char* compress_segmented(const unsigned char *data, size_t size, size_t *out_size, int threads) {
+    size_t count = (size + HUFFMAN_SEGMENT_SIZE - 1) / HUFFMAN_SEGMENT_SIZE;
+    SegmentedEncode enc;
+    memset(&enc, 0, sizeof(SegmentedEncode));
+    enc.data = data;
+    enc.size = size;
+    enc.freq = malloc(count * sizeof(*enc.freq));
+    enc.streams = calloc(count, sizeof(unsigned char *));
+    enc.stream_sizes = calloc(count, sizeof(size_t));
+    unsigned char *output = NULL;
+    if (!enc.freq || !enc.streams || !enc.stream_sizes) goto done;
+
+    // 1. Histograms in parallel, then one code for all segments
+    run_segments(histogram_segment, &enc, count, threads);
+    unsigned int freq[MAX_SYMBOLS] = {0};
+    for (size_t s = 0; s < count; s++) {
+        for (int i = 0; i < MAX_SYMBOLS; i++) freq[i] += enc.freq[s][i];
+    }
+    uint8_t lengths[MAX_SYMBOLS];
+    uint32_t codes[MAX_SYMBOLS];
+    int used = huffman_code_lengths(freq, lengths);
+    canonical_codes(lengths, codes);
+    enc.lengths = lengths;
+    enc.codes = codes;
+
+    // 2. Bitstreams in parallel (a lone symbol needs no bits)
+    if (used > 1) {
+        run_segments(encode_segment, &enc, count, threads);
+        if (enc.failed) goto done;
+    }
+
+    // 3. Header, segment sizes, streams back to back
+    size_t total = 0;
+    for (size_t s = 0; s < count; s++) total += enc.stream_sizes[s];
+    output = malloc(HUFFMAN_MAX_HEADER + 4 + count * 4 + total + 1);
+    if (!output) goto done;
+    size_t pos = write_code_lengths(output, lengths, used);
+    output[0] = HUFFMAN_FORMAT_SEGMENTED;
+    uint32_t n32 = (uint32_t)count;
+    memcpy(output + pos, &n32, 4);
+    pos += 4;
+    for (size_t s = 0; s < count; s++) {
+        n32 = (uint32_t)enc.stream_sizes[s];
+        memcpy(output + pos, &n32, 4);
+        pos += 4;
+    }
+    for (size_t s = 0; s < count; s++) {
+        if (enc.stream_sizes[s]) memcpy(output + pos, enc.streams[s], enc.stream_sizes[s]);
+        pos += enc.stream_sizes[s];
+    }
+    *out_size = pos;
+
+done:
+    if (enc.streams) {
+        for (size_t s = 0; s < count; s++) free(enc.streams[s]);
+    }
+    free(enc.streams);
+    free(enc.stream_sizes);
+    free(enc.freq);
+    return output;
+}
+
+typedef struct SegmentedDecode {
+    const HuffmanDecoder *dec;
+    const unsigned char *streams;
+    const size_t *stream_offsets;   // count + 1 entries
+    unsigned char *output;
+    size_t size;
+    int failed;
+} SegmentedDecode;
+
+static void decode_segment(void *arg, size_t segment) {
+    SegmentedDecode *d = arg;
+    size_t n = segment_len(d->size, segment);
+    size_t in_size = d->stream_offsets[segment + 1] - d->stream_offsets[segment];
+    if (decoder_run(d->dec, d->streams + d->stream_offsets[segment], in_size,
+                    d->output + segment * HUFFMAN_SEGMENT_SIZE, n) != n) {
+        d->failed = 1;
+    }
+}
+
+static unsigned char* decompress_segmented(const unsigned char *in, size_t in_size, size_t original_size, int threads) {
+    uint8_t lengths[MAX_SYMBOLS];
+    long header_size = read_code_lengths(in, in_size, lengths);
+    if (header_size < 0 || in_size < (size_t)header_size + 4) return NULL;
+
+    uint32_t n32;
+    memcpy(&n32, in + header_size, 4);
+    size_t count = n32;
+    size_t pos = header_size + 4;
+    if (count != (original_size + HUFFMAN_SEGMENT_SIZE - 1) / HUFFMAN_SEGMENT_SIZE || in_size - pos < count * 4) {
+        return NULL;
+    }
+
+    size_t *offsets = malloc((count + 1) * sizeof(size_t));
+    HuffmanDecoder *dec = malloc(sizeof(HuffmanDecoder));
+    unsigned char *output = malloc(original_size + 1);
+    int ok = offsets && dec && output;
+    if (ok) {
+        offsets[0] = 0;
+        for (size_t s = 0; s < count; s++) {
+            memcpy(&n32, in + pos + s * 4, 4);
+            offsets[s + 1] = offsets[s] + n32;
+        }
+        pos += count * 4;
+        ok = offsets[count] <= in_size - pos && decoder_from_lengths(dec, lengths) > 0;
+    }
+    if (ok) {
+        SegmentedDecode d;
+        d.dec = dec;
+        d.streams = in + pos;
+        d.stream_offsets = offsets;
+        d.output = output;
+        d.size = original_size;
+        d.failed = 0;
+        run_segments(decode_segment, &d, count, threads);
+        ok = !d.failed;
+    }
+
+    free(offsets);
+    free(dec);
+    if (!ok) {
+        free(output);
+        return NULL;
+    }
+    return output;
+}
+
+// --- Interleaved streams (format version 4) ---
+// The input is cut into HUFFMAN_X4_STREAMS quarters sharing one code, each encoded into its own
+// byte-aligned bitstream. The decoder advances the four streams in the same loop: their refills and
+// table lookups do not depend on each other, so the CPU overlaps them instead of waiting on the bit
+// position of a single stream. One thread, any input size.
+//   | 4 | code lengths | stream bytes of streams 0, 1 and 2 (u32 each) | streams |
+// Streams 0 to 2 hold (size + 3) / 4 symbols, stream 3 the rest (its bytes run to the end).
+
+#define HUFFMAN_X4_STREAMS 4
+
+// First symbol of quarter `stream`, clamped to size (the last quarters of tiny inputs are empty).
+static size_t x4_start(size_t size, int stream) {
+    size_t start = (size + HUFFMAN_X4_STREAMS - 1) / HUFFMAN_X4_STREAMS * stream;
+    return start < size ? start : size;
+}
+
+unsigned char* compress_data_x4(const unsigned char *data, size_t size, size_t *out_size) {
+    // One histogram per stream (their sum gives the code, each one its exact stream size)
+    unsigned int stream_freq[HUFFMAN_X4_STREAMS][MAX_SYMBOLS];
+    unsigned int freq[MAX_SYMBOLS] = {0};
+    for (int s = 0; s < HUFFMAN_X4_STREAMS; s++) {
+        byte_histogram(data + x4_start(size, s), x4_start(size, s + 1) - x4_start(size, s), stream_freq[s]);
+        for (int i = 0; i < MAX_SYMBOLS; i++) freq[i] += stream_freq[s][i];
+    }
+
+    uint8_t lengths[MAX_SYMBOLS];
+    uint32_t codes[MAX_SYMBOLS];
+    int used = huffman_code_lengths(freq, lengths);
+    canonical_codes(lengths, codes);
+
+    size_t stream_bytes[HUFFMAN_X4_STREAMS];
+    size_t total = 0;
+    for (int s = 0; s < HUFFMAN_X4_STREAMS; s++) {
+        stream_bytes[s] = used > 1 ? encoded_bytes(stream_freq[s], lengths) : 0;
+        total += stream_bytes[s];
+    }
+    unsigned char *output = malloc(HUFFMAN_MAX_HEADER + 4 * (HUFFMAN_X4_STREAMS - 1) + total + HUFFMAN_WRITE_SLACK);
+    if (!output) return NULL;
+
+    size_t pos = write_code_lengths(output, lengths, used);
+    output[0] = HUFFMAN_FORMAT_X4;
+    for (int s = 0; s < HUFFMAN_X4_STREAMS - 1; s++) {
+        uint32_t n32 = (uint32_t)stream_bytes[s];
+        memcpy(output + pos, &n32, 4);
+        pos += 4;
+    }
+    for (int s = 0; s < HUFFMAN_X4_STREAMS; s++) {
+        size_t start = x4_start(size, s);
+        if (stream_bytes[s]) encode_symbols(data + start, x4_start(size, s + 1) - start, lengths, codes, output + pos);
+        pos += stream_bytes[s];
+    }
+
+    *out_size = pos;
+    return output;
+}
+
+// Decodes the four streams into out[0..out_size). Returns the number of symbols written.
+static size_t decoder_run_x4(const HuffmanDecoder *dec, const unsigned char *in, const size_t offsets[HUFFMAN_X4_STREAMS + 1],
+                             unsigned char *out, size_t out_size) {
+    if (dec->single_symbol >= 0) {
+        memset(out, dec->single_symbol, out_size);
+        return out_size;
+    }
+
+    size_t q1 = x4_start(out_size, 1), q2 = x4_start(out_size, 2), q3 = x4_start(out_size, 3);
+    BitReader b0, b1, b2, b3;
+    bit_reader_init(&b0, in + offsets[0], offsets[1] - offsets[0]);
+    bit_reader_init(&b1, in + offsets[1], offsets[2] - offsets[1]);
+    bit_reader_init(&b2, in + offsets[2], offsets[3] - offsets[2]);
+    bit_reader_init(&b3, in + offsets[3], offsets[4] - offsets[3]);
+    size_t p0 = 0, p1 = q1, p2 = q2, p3 = q3;
+
+    // The four fast paths in one loop, while every stream has 8 bytes left to load and room for a
+    // full table entry. Whichever stream gets there first ends it; the rest is decoded stream by stream.
+    while (p0 + HUFFMAN_TABLE_MAX_SYMS <= q1 && p1 + HUFFMAN_TABLE_MAX_SYMS <= q2
+           && p2 + HUFFMAN_TABLE_MAX_SYMS <= q3 && p3 + HUFFMAN_TABLE_MAX_SYMS <= out_size
+           && bit_reader_fast(&b0) && bit_reader_fast(&b1) && bit_reader_fast(&b2) && bit_reader_fast(&b3)) {
+        bit_reader_refill(&b0);
+        bit_reader_refill(&b1);
+        bit_reader_refill(&b2);
+        bit_reader_refill(&b3);
+        size_t n0 = decode_step(dec, &b0, out + p0);
+        size_t n1 = decode_step(dec, &b1, out + p1);
+        size_t n2 = decode_step(dec, &b2, out + p2);
+        size_t n3 = decode_step(dec, &b3, out + p3);
+        p0 += n0;
+        p1 += n1;
+        p2 += n2;
+        p3 += n3;
+        if (!n0 || !n1 || !n2 || !n3) return 0; // Truncated stream
+    }
+
+    size_t written = decode_stream(dec, &b0, out, p0, q1);
+    written += decode_stream(dec, &b1, out, p1, q2) - q1;
+    written += decode_stream(dec, &b2, out, p2, q3) - q2;
+    written += decode_stream(dec, &b3, out, p3, out_size) - q3;
+    return written;
+}
+
+static unsigned char* decompress_x4(const unsigned char *in, size_t in_size, size_t original_size) {
+    uint8_t lengths[MAX_SYMBOLS];
+    long header_size = read_code_lengths(in, in_size, lengths);
+    size_t pos = header_size + 4 * (HUFFMAN_X4_STREAMS - 1);
+    if (header_size < 0 || in_size < pos) return NULL;
+
+    size_t offsets[HUFFMAN_X4_STREAMS + 1];
+    offsets[0] = 0;
+    for (int s = 0; s < HUFFMAN_X4_STREAMS - 1; s++) {
+        uint32_t n32;
+        memcpy(&n32, in + header_size + 4 * s, 4);
+        offsets[s + 1] = offsets[s] + n32;
+    }
+    offsets[HUFFMAN_X4_STREAMS] = in_size - pos;
+    if (offsets[HUFFMAN_X4_STREAMS - 1] > in_size - pos) return NULL;
+
+    HuffmanDecoder *dec = malloc(sizeof(HuffmanDecoder));
+    unsigned char *output = malloc(original_size + 1);
+    int res = dec && output ? decoder_from_lengths(dec, lengths) : -1;
+    int ok = res > 0 ? decoder_run_x4(dec, in + pos, offsets, output, original_size) == original_size
+                     : res == 0 && original_size == 0;
+    free(dec);
+    if (!ok) {
+        free(output);
+        return NULL;
+    }
+    return output;
+}
+
+// --- Shared codes (dict.h) ---
+// A code trained once on many small files and stored apart from them: the payload is the bare
+// bitstream, with no header at all. Every symbol gets a code so any data can use it.
+
+void huffman_train_code(unsigned int freq[MAX_SYMBOLS], uint8_t lengths[MAX_SYMBOLS]) {
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        if (freq[i] < UINT32_MAX) freq[i]++; // Unseen symbols count as seen once
+    }
+    huffman_code_lengths(freq, lengths);
+}
+
+size_t huffman_encoded_size(const unsigned int freq[MAX_SYMBOLS], const uint8_t lengths[MAX_SYMBOLS]) {
+    return encoded_bytes(freq, lengths);
+}
+
+unsigned char* compress_data_with_code(const unsigned char *data, size_t size, const uint8_t lengths[MAX_SYMBOLS],
+                                       size_t *out_size) {
+    unsigned int freq[MAX_SYMBOLS];
+    byte_histogram(data, size, freq);
+    for (int i = 0; i < MAX_SYMBOLS; i++) {
+        if (freq[i] && !lengths[i]) return NULL; // Symbol without a code
+    }
+    uint32_t codes[MAX_SYMBOLS];
+    canonical_codes(lengths, codes);
+
+    unsigned char *output = malloc(encoded_bytes(freq, lengths) + HUFFMAN_WRITE_SLACK);
+    if (!output) return NULL;
+    *out_size = encode_symbols(data, size, lengths, codes, output);
+    return output;
+}
+
+unsigned char* decompress_data_with_code(const unsigned char *in, size_t in_size, size_t original_size,
+                                         const uint8_t lengths[MAX_SYMBOLS]) {
+    HuffmanDecoder *dec = malloc(sizeof(HuffmanDecoder));
+    unsigned char *output = malloc(original_size + 1);
+    int ok = dec && output && decoder_from_lengths(dec, lengths) > 0
+             && decoder_run(dec, in, in_size, output, original_size) == original_size;
+    free(dec);
+    if (!ok) {
+        free(output);
+        return NULL;
+    }
+    return output;
+}
+
+unsigned char* compress_data(const unsigned char *data, size_t size, size_t *out_size) {
+    return compress_data_mt(data, size, out_size, 1);
+}
+
+unsigned char* compress_data_mt(const unsigned char *data, size_t size, size_t *out_size, int threads) {
+    if (size >= 2 * HUFFMAN_SEGMENT_SIZE) {
+        return compress_segmented(data, size, out_size, resolve_threads(threads));
+    }
+
+    unsigned int freq[MAX_SYMBOLS];
+    byte_histogram(data, size, freq);
+
+    uint8_t lengths[MAX_SYMBOLS];
+    uint32_t codes[MAX_SYMBOLS];
+    int used = huffman_code_lengths(freq, lengths);
+    canonical_codes(lengths, codes);
+
+    size_t stream_size = used > 1 ? encoded_bytes(freq, lengths) : 0;
+    unsigned char *final_output = malloc(HUFFMAN_MAX_HEADER + stream_size + HUFFMAN_WRITE_SLACK);
+    if (!final_output) return NULL;
+
+    size_t byte_pos = write_code_lengths(final_output, lengths, used);
+    if (stream_size) byte_pos += encode_symbols(data, size, lengths, codes, final_output + byte_pos);
+
+    *out_size = byte_pos;
+    return final_output;
+}
+
+unsigned char* decompress_data(const unsigned char *compressed_data, size_t compressed_size, size_t original_size) {
+    return decompress_data_mt(compressed_data, compressed_size, original_size, 1);
+}
+
+unsigned char* decompress_data_mt(const unsigned char *compressed_data, size_t compressed_size, size_t original_size,
+                                  int threads) {
+    if (compressed_size >= 1 && compressed_data[0] == HUFFMAN_FORMAT_SEGMENTED) {
+        return decompress_segmented(compressed_data, compressed_size, original_size, resolve_threads(threads));
+    }
+    if (compressed_size >= 1 && compressed_data[0] == HUFFMAN_FORMAT_X4) {
+        return decompress_x4(compressed_data, compressed_size, original_size);
+    }
+    if (compressed_size < 1 || compressed_data[0] != HUFFMAN_FORMAT_V2) return NULL; // Unknown format version
+
+    uint8_t lengths[MAX_SYMBOLS];
+    long header_size = read_code_lengths(compressed_data, compressed_size, lengths);
+    if (header_size < 0) return NULL;
+
+    HuffmanDecoder *dec = malloc(sizeof(HuffmanDecoder));
+    unsigned char *output = malloc(original_size + 1); // +1 safety
+    if (!dec || !output) {
+        free(dec);
+        free(output);
+        return NULL;
+    }
+
+    int res = decoder_from_lengths(dec, lengths);
+    if (res < 0 || (res == 0 && original_size > 0)) {
+        free(dec);
+        free(output);
+        return NULL;
+    }
+    // A short stream is truncated or corrupt
+    int ok = res == 0 || decoder_run(dec, compressed_data + header_size, compressed_size - header_size,
+                                     output, original_size) == original_size;
+    free(dec);
+    if (!ok) {
+        free(output);
+        return NULL;
+    }
     return output;
 }
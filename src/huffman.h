@@ -2,6 +2,7 @@
 #define HUFFMAN_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define MAX_SYMBOLS 256
 
@@ -17,27 +18,87 @@ typedef struct {
     size_t bit_count;    // Total bits used
 } CompressedData;
 
-// Function prototypes
-HuffmanNode* build_huffman_tree(const unsigned char *data, size_t size);
-void free_huffman_tree(HuffmanNode *root);
-void generate_huffman_codes(HuffmanNode *root, char *codes[MAX_SYMBOLS]);
+// Arena for one tree: at most MAX_SYMBOLS leaves and MAX_SYMBOLS - 1 internal nodes.
+#define HUFFMAN_MAX_NODES (2 * MAX_SYMBOLS - 1)
 
-// Compresses data. 
+typedef struct HuffmanTree {
+    HuffmanNode nodes[HUFFMAN_MAX_NODES];
+    int count;          // Nodes in use
+} HuffmanTree;
+
+// Builds the Huffman tree of a histogram inside `tree` (a min-heap of subtrees, no allocation).
+// Returns the root, or NULL if every frequency is 0. The nodes live as long as `tree`.
+HuffmanNode* build_huffman_tree(const unsigned int freq[MAX_SYMBOLS], HuffmanTree *tree);
+// Code of every leaf as an integer (MSB = first bit) and its length in bits (0 = unused symbol).
+void generate_huffman_codes(const HuffmanNode *root, uint64_t codes[MAX_SYMBOLS], uint8_t lengths[MAX_SYMBOLS]);
+
+// Stream format version, first byte of every stream written by compress_data.
+// Version 1 (legacy) streams have no version byte: they start directly with the 1 KB frequency table.
+#define HUFFMAN_FORMAT_V2 2
+
+// Segmented streams (compress_data on inputs of 2 segments or more): one shared code, one
+// byte-aligned bitstream per segment, encoded and decoded in parallel.
+#define HUFFMAN_FORMAT_SEGMENTED 3
+#define HUFFMAN_SEGMENT_SIZE (256 * 1024)
+#define HUFFMAN_MAX_THREADS 16
+
+// Interleaved streams (compress_data_x4): the input is cut into 4 streams sharing one code, which the
+// decoder advances in the same loop so their dependency chains overlap on one core.
+#define HUFFMAN_FORMAT_X4 4
+
+// Canonical codes are limited to 15 bits so each length fits in 4 bits in the header.
+#define HUFFMAN_MAX_CODE_LEN 15
+// version + count + 256 packed 4-bit lengths
+#define HUFFMAN_MAX_HEADER (2 + MAX_SYMBOLS / 2)
+
+// Compresses data with canonical Huffman codes (format version 2, or 3 for inputs of several
+// segments), on the calling thread: its callers (blocks of stream.c, batch.c workers) already run
+// in parallel, and a pool of their own per call would only oversubscribe the CPUs.
 // Returns a buffer that must be freed by caller. 
 // out_size is set to the size of the returned buffer in bytes.
+// Layout: | version | code lengths (compact, <= HUFFMAN_MAX_HEADER bytes) | bitstream |
 unsigned char* compress_data(const unsigned char *data, size_t size, size_t *out_size);
+// Same with an explicit number of threads for the segments (0 = one per CPU, at most
+// HUFFMAN_MAX_THREADS), for a caller that has the CPUs to itself.
+unsigned char* compress_data_mt(const unsigned char *data, size_t size, size_t *out_size, int threads);
+
+// Compresses into 4 interleaved streams (format version 4), on the calling thread. Same ratio as
+// compress_data give or take a few bytes; decodes faster on one core. Read back by decompress_data.
+unsigned char* compress_data_x4(const unsigned char *data, size_t size, size_t *out_size);
 
-// Decompresses data.
-// Returns a buffer with original data.
-// original_size must be known (or we can store it in the compressed stream, but Inode handles it).
-// The tree must be reconstructed or stored. 
-// Requirement: "decompress_data(compressed_data, size, tree, output_buffer)"
-// We need to support serializing the tree or rebuilding it? 
-// Usually we store the frequency table or the tree structure with the file.
-// For this assignment, we might assume the tree is stored or frequencies are stored.
-// Let's implement a way to serialize/deserialize the tree or frequency table to be embedded in the file.
-// For simplicity, we'll prefix the compressed data with the frequency table (256 * 4 bytes = 1KB overhead, acceptable?).
-// Or optimized tree serialization.
+// Decompresses a stream produced by compress_data or compress_data_x4. The format is selected by
+// the version byte.
+// Returns a buffer with original data (caller must free), or NULL if the stream is not understood.
+// original_size must be known (the Inode records it).
+// Decoding uses lookup tables indexed by the next bits of the stream (several symbols per lookup).
+// decompress_data decodes on the calling thread. decompress_data_mt decodes segmented streams one
+// segment per task on `threads` threads (0 = one per CPU), interleaved streams always on the
+// calling thread.
 unsigned char* decompress_data(const unsigned char *compressed_data, size_t compressed_size, size_t original_size);
+unsigned char* decompress_data_mt(const unsigned char *compressed_data, size_t compressed_size, size_t original_size,
+                                  int threads);
+
+// Shared codes (dict.h): one code for many files, stored once in the image. Payloads are bare
+// bitstreams.
+// Code lengths for a training histogram, every symbol included (unseen ones count once). freq is modified.
+void huffman_train_code(unsigned int freq[MAX_SYMBOLS], uint8_t lengths[MAX_SYMBOLS]);
+// Size in bytes of the bitstream of data with this histogram, coded with `lengths`.
+size_t huffman_encoded_size(const unsigned int freq[MAX_SYMBOLS], const uint8_t lengths[MAX_SYMBOLS]);
+// Bitstream of data coded with `lengths` (caller must free), or NULL if a byte has no code.
+unsigned char* compress_data_with_code(const unsigned char *data, size_t size, const uint8_t lengths[MAX_SYMBOLS],
+                                       size_t *out_size);
+// Decodes exactly original_size bytes (caller must free), or NULL if the stream is invalid.
+unsigned char* decompress_data_with_code(const unsigned char *in, size_t in_size, size_t original_size,
+                                         const uint8_t lengths[MAX_SYMBOLS]);
+
+// Legacy format used by version 1 images: the frequency table (256 * 4 bytes) is stored in front of the
+// bitstream and the tree is rebuilt from it. Still written to version 1 images so they stay readable by
+// older builds.
+unsigned char* compress_data_legacy(const unsigned char *data, size_t size, size_t *out_size);
+unsigned char* decompress_data_legacy(const unsigned char *compressed_data, size_t compressed_size, size_t original_size);
+
+// Reference decoder for the legacy format, walking the tree one bit at a time. Same output as
+// decompress_data_legacy, only kept to benchmark and cross-check the table-driven decoder.
+unsigned char* decompress_data_bitwise(const unsigned char *compressed_data, size_t compressed_size, size_t original_size);
 
 #endif // HUFFMAN_H
@@ -0,0 +1,86 @@
+#include "index.h"
+#include "red_black_tree.h"
+#include "btree.h"
+#include "codec.h"
+#include "snapshot.h"
+#include "hash_table.h"
+#include "directory.h"
+
+int index_lookup(FSContext *ctx, const char *name, Inode *out) {
+    int res = snapshot_lookup(ctx, name, out);
+    if (res <= 0) return res;
+    res = ht_lookup(ctx, name, out);
+    if (res <= 0) return res;
+
+    if (dir_enabled(ctx)) return dir_lookup(ctx, name, out);
+    if (ctx->sb.index_type == INDEX_BTREE) {
+        return bt_search(ctx, ctx->sb.root_inode_offset, name, out);
+    }
+
+    long node_offset = rb_search(ctx, ctx->sb.root_inode_offset, name);
+    if (node_offset == -1) return -1;
+    if (out) {
+        RBTNode node;
+        read_rb_node(ctx, node_offset, &node);
+        *out = node.inode;
+        if (ctx->sb.version < 2) out->codec = CODEC_HUFFMAN_LEGACY;
+    }
+    return 0;
+}
+
+int index_insert(FSContext *ctx, const Inode *inode) {
+    if (snapshot_invalidate(ctx) != 0) return -1;
+    // An index that starts empty gets a hash index along with it (not copy-on-write ones, cow.h)
+    if (ctx->sb.version >= 2 && !ctx->cow && ctx->sb.hash_offset == 0 && ctx->sb.root_inode_offset == -1) {
+        ht_create(ctx, 0);
+    }
+
+    int res;
+    if (dir_enabled(ctx)) {
+        res = dir_insert(ctx, inode);
+    } else if (ctx->sb.index_type == INDEX_BTREE) {
+        res = bt_insert(ctx, &ctx->sb.root_inode_offset, inode);
+    } else {
+        res = rb_insert(ctx, &ctx->sb.root_inode_offset, *inode, NULL);
+    }
+    if (res == 0 && ht_insert(ctx, inode) != 0) ht_drop(ctx);
+    return res;
+}
+
+int index_remove(FSContext *ctx, const char *name, Inode *removed) {
+    if (snapshot_invalidate(ctx) != 0) return -1;
+    int res;
+    if (dir_enabled(ctx)) {
+        res = dir_remove(ctx, name, removed);
+    } else if (ctx->sb.index_type == INDEX_BTREE) {
+        res = bt_delete(ctx, &ctx->sb.root_inode_offset, name, removed);
+    } else if (removed && index_lookup(ctx, name, removed) != 0) {
+        return -1;
+    } else {
+        res = rb_delete(ctx, &ctx->sb.root_inode_offset, name);
+    }
+    if (res == 0 && ht_remove(ctx, name) != 0) ht_drop(ctx);
+    return res;
+}
+
+static int rb_for_each(FSContext *ctx, long current_offset, FileVisitor visit, void *arg) {
+    if (current_offset == -1) return 0;
+
+    RBTNode node;
+    read_rb_node(ctx, current_offset, &node);
+
+    int res = rb_for_each(ctx, node.left_offset, visit, arg);
+    if (res != 0) return res;
+    if (ctx->sb.version < 2) node.inode.codec = CODEC_HUFFMAN_LEGACY;
+    res = visit(ctx, &node.inode, arg);
+    if (res != 0) return res;
+    return rb_for_each(ctx, node.right_offset, visit, arg);
+}
+
+int index_for_each(FSContext *ctx, FileVisitor visit, void *arg) {
+    if (dir_enabled(ctx)) return dir_for_each(ctx, visit, arg);
+    if (ctx->sb.index_type == INDEX_BTREE) {
+        return bt_for_each(ctx, ctx->sb.root_inode_offset, visit, arg);
+    }
+    return rb_for_each(ctx, ctx->sb.root_inode_offset, visit, arg);
+}
@@ -0,0 +1,28 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "fs_core.h"
+
+// Name index of the image, whichever structure it uses (SuperBlock.index_type):
+// the red-black tree of RBTNode records (red_black_tree.h) or the B+tree (btree.h).
+// Version 1 images and version 2 images created before the B+tree keep their red-black tree;
+// new images and compacted images use the B+tree.
+// Lookups are answered from the index snapshot (snapshot.h) when the image has a current one,
+// else from the hash index (hash_table.h) when the image has one. Both follow every change.
+// In images with directories (directory.h) the B+tree is one tree per directory and names are paths.
+
+// Looks a name up. Returns 0 and fills *out, or -1 if not found.
+int index_lookup(FSContext *ctx, const char *name, Inode *out);
+
+// Adds an inode keyed by its name. Returns 0 on success, -1 if the name exists (or, with
+// directories, is not a valid path or goes through a file).
+int index_insert(FSContext *ctx, const Inode *inode);
+
+// Removes a name, returning its inode in *removed (may be NULL). Returns 0, or -1 if not found
+// (or a directory that is not empty).
+int index_remove(FSContext *ctx, const char *name, Inode *removed);
+
+// Calls visit for every inode in name order, or path order with directories (see for_each_file).
+int index_for_each(FSContext *ctx, FileVisitor visit, void *arg);
+
+#endif // INDEX_H
@@ -0,0 +1,371 @@
+#include "journal.h"
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FRAME_SIZE (sizeof(JournalRecord) + CACHE_PAGE_SIZE)
+
+static char* log_path(const char *image_path) {
+    size_t len = strlen(image_path);
+    char *path = malloc(len + sizeof(JOURNAL_SUFFIX));
+    if (!path) return NULL;
+    memcpy(path, image_path, len);
+    memcpy(path + len, JOURNAL_SUFFIX, sizeof(JOURNAL_SUFFIX));
+    return path;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, long offset) {
+    const unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Returns 0 only if all len bytes were read.
+static int pread_all(int fd, void *buf, size_t len, long offset) {
+    unsigned char *p = buf;
+    while (len > 0) {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// 64-bit words, FNV-1a style: the chain from the first record makes any torn or stale record
+// (and every record after it) fail.
+static uint64_t checksum(uint64_t sum, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i + 8 <= len; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        sum = (sum ^ w) * 0x100000001B3ULL;
+    }
+    return sum ^ (sum >> 29);
+}
+
+static uint64_t record_checksum(uint64_t prev, const JournalRecord *r, const unsigned char *page) {
+    uint64_t sum = checksum(prev, r, offsetof(JournalRecord, checksum));
+    return page ? checksum(sum, page, CACHE_PAGE_SIZE) : sum;
+}
+
+// --- Page -> frame map ---
+
+static long slot_of(const Journal *j, long page_no) {
+    return (long)(((unsigned long)page_no * 0x9E3779B97F4A7C15UL) >> 17) & (j->capacity - 1);
+}
+
+static int map_put(Journal *j, long page_no, long offset);
+
+static int map_grow(Journal *j) {
+    JournalEntry *old = j->entries;
+    long old_capacity = j->capacity;
+    j->capacity = old_capacity ? old_capacity * 2 : 1024;
+    j->entries = malloc(j->capacity * sizeof(JournalEntry));
+    if (!j->entries) {
+        j->entries = old;
+        j->capacity = old_capacity;
+        return -1;
+    }
+    for (long i = 0; i < j->capacity; i++) j->entries[i].page_no = -1;
+    j->count = 0;
+    for (long i = 0; i < old_capacity; i++) {
+        if (old[i].page_no != -1) map_put(j, old[i].page_no, old[i].offset);
+    }
+    free(old);
+    return 0;
+}
+
+static int map_put(Journal *j, long page_no, long offset) {
+    if ((j->count + 1) * 10 > j->capacity * 7 && map_grow(j) != 0) return -1;
+    long slot = slot_of(j, page_no);
+    while (j->entries[slot].page_no != -1 && j->entries[slot].page_no != page_no) {
+        slot = (slot + 1) & (j->capacity - 1);
+    }
+    if (j->entries[slot].page_no == -1) j->count++;
+    j->entries[slot].page_no = page_no;
+    j->entries[slot].offset = offset;
+    return 0;
+}
+
+static long map_get(const Journal *j, long page_no) {
+    if (j->count == 0) return -1;
+    for (long slot = slot_of(j, page_no); j->entries[slot].page_no != -1; slot = (slot + 1) & (j->capacity - 1)) {
+        if (j->entries[slot].page_no == page_no) return j->entries[slot].offset;
+    }
+    return -1;
+}
+
+static void map_clear(Journal *j) {
+    for (long i = 0; i < j->capacity; i++) j->entries[i].page_no = -1;
+    j->count = 0;
+}
+
+// --- Log file ---
+
+// Empties the log under a new salt. The header is fsynced: a crash must not leave the records of
+// the previous round behind a header that would still accept them.
+static int start_log(Journal *j) {
+    JournalHeader h;
+    memset(&h, 0, sizeof(JournalHeader));
+    h.magic = JOURNAL_MAGIC;
+    h.salt = j->salt * 0x9E3779B97F4A7C15ULL + (uint64_t)time(NULL) + ((uint64_t)getpid() << 32) + 1;
+    h.page_size = CACHE_PAGE_SIZE;
+    if (ftruncate(j->fd, 0) != 0 || pwrite_all(j->fd, &h, sizeof(JournalHeader), 0) != 0 || fsync(j->fd) != 0) {
+        return -1;
+    }
+    j->stats.fsyncs++;
+    j->salt = h.salt;
+    j->checksum = h.salt;
+    j->end = sizeof(JournalHeader);
+    j->committed_end = j->end;
+    map_clear(j);
+    return 0;
+}
+
+typedef struct PageRef {
+    long page_no;
+    long offset;
+} PageRef;
+
+static int compare_page_refs(const void *a, const void *b) {
+    long pa = ((const PageRef *)a)->page_no, pb = ((const PageRef *)b)->page_no;
+    return (pa > pb) - (pa < pb);
+}
+
+// Copies the latest frame of every page in the map into the image (in file order), cuts the image
+// to file_size and fsyncs it.
+static int copy_to_image(Journal *j, int image_fd, long file_size) {
+    PageRef *refs = malloc((j->count + 1) * sizeof(PageRef));
+    unsigned char *page = malloc(CACHE_PAGE_SIZE);
+    if (!refs || !page) {
+        free(refs);
+        free(page);
+        return -1;
+    }
+    long n = 0;
+    for (long i = 0; i < j->capacity; i++) {
+        if (j->entries[i].page_no == -1) continue;
+        refs[n].page_no = j->entries[i].page_no;
+        refs[n].offset = j->entries[i].offset;
+        n++;
+    }
+    qsort(refs, n, sizeof(PageRef), compare_page_refs);
+
+    int res = 0;
+    for (long i = 0; i < n && res == 0; i++) {
+        long start = refs[i].page_no * CACHE_PAGE_SIZE;
+        long len = file_size - start;
+        if (len <= 0) continue;
+        if (len > CACHE_PAGE_SIZE) len = CACHE_PAGE_SIZE;
+        res = pread_all(j->fd, page, CACHE_PAGE_SIZE, refs[i].offset + sizeof(JournalRecord));
+        if (res == 0) res = pwrite_all(image_fd, page, len, start);
+    }
+    free(refs);
+    free(page);
+    if (res == 0 && ftruncate(image_fd, file_size) != 0) res = -1;
+    if (res == 0 && fsync(image_fd) != 0) res = -1;
+    j->stats.fsyncs++;
+    return res;
+}
+
+static int checkpoint(Journal *j, int image_fd, long file_size) {
+    if (copy_to_image(j, image_fd, file_size) != 0) return -1;
+    j->stats.checkpoints++;
+    return start_log(j);
+}
+
+static void free_journal(Journal *j) {
+    if (j->fd >= 0) close(j->fd);
+    free(j->entries);
+    free(j->path);
+    free(j);
+}
+
+// --- Recovery ---
+
+// Reads the record at pos (and its page into `page`) and checks it against the chain.
+// Returns 0, or -1 at the end of the valid records.
+static int read_record(Journal *j, long pos, JournalRecord *r, unsigned char *page) {
+    if (pread_all(j->fd, r, sizeof(JournalRecord), pos) != 0 || r->salt != j->salt) return -1;
+    if (r->page_no != JOURNAL_COMMIT) {
+        if (r->page_no < 0 || pread_all(j->fd, page, CACHE_PAGE_SIZE, pos + sizeof(JournalRecord)) != 0) return -1;
+    }
+    if (record_checksum(j->checksum, r, r->page_no != JOURNAL_COMMIT ? page : NULL) != r->checksum) return -1;
+    j->checksum = r->checksum;
+    return 0;
+}
+
+int journal_recover(const char *image_path, int image_fd) {
+    char *path = log_path(image_path);
+    if (!path) return -1;
+    Journal *j = calloc(1, sizeof(Journal));
+    unsigned char *page = malloc(CACHE_PAGE_SIZE);
+    if (!j || !page) {
+        free(path);
+        free(j);
+        free(page);
+        return -1;
+    }
+    j->path = path;
+    j->fd = open(path, O_RDONLY);
+    if (j->fd < 0) {
+        free_journal(j);
+        free(page);
+        return 0; // Clean: no log
+    }
+
+    // 1. Last valid commit record
+    JournalHeader h;
+    int commits = 0;
+    long file_size = 0;
+    if (pread_all(j->fd, &h, sizeof(JournalHeader), 0) == 0 && h.magic == JOURNAL_MAGIC
+        && h.page_size == CACHE_PAGE_SIZE) {
+        j->salt = h.salt;
+        j->checksum = h.salt;
+        JournalRecord r;
+        for (long pos = sizeof(JournalHeader); read_record(j, pos, &r, page) == 0; ) {
+            pos += r.page_no == JOURNAL_COMMIT ? (long)sizeof(JournalRecord) : (long)FRAME_SIZE;
+            if (r.page_no == JOURNAL_COMMIT) {
+                commits++;
+                j->committed_end = pos;
+                file_size = r.file_size;
+            }
+        }
+    }
+
+    // 2. Latest committed frame of every page, copied into the image
+    int res = 0;
+    for (long pos = sizeof(JournalHeader); pos < j->committed_end && res == 0; ) {
+        JournalRecord r;
+        res = pread_all(j->fd, &r, sizeof(JournalRecord), pos);
+        if (res == 0 && r.page_no != JOURNAL_COMMIT) res = map_put(j, r.page_no, pos);
+        pos += r.page_no == JOURNAL_COMMIT ? (long)sizeof(JournalRecord) : (long)FRAME_SIZE;
+    }
+    if (res == 0 && commits > 0) res = copy_to_image(j, image_fd, file_size);
+
+    // The image is up to date: the log has served (a failed replay keeps it for the next load)
+    if (res == 0) unlink(path);
+    free_journal(j);
+    free(page);
+    return res == 0 ? commits : -1;
+}
+
+void journal_discard(const char *image_path) {
+    char *path = log_path(image_path);
+    if (path) unlink(path);
+    free(path);
+}
+
+// --- Attached journal ---
+
+int journal_attach(FSContext *ctx, const char *image_path, int group_commit) {
+    if (ctx->cache.map || ctx->cache.journal) return -1;
+    Journal *j = calloc(1, sizeof(Journal));
+    if (!j) return -1;
+    j->fd = -1;
+    j->path = log_path(image_path);
+    j->group_commit = group_commit > 0 ? group_commit : 1;
+    if (!j->path || map_grow(j) != 0) {
+        free_journal(j);
+        return -1;
+    }
+    j->fd = open(j->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (j->fd < 0 || start_log(j) != 0) {
+        if (j->fd >= 0) unlink(j->path);
+        free_journal(j);
+        return -1;
+    }
+    // Pages written before (none after a load) go to the image as usual
+    if (cache_sync(&ctx->cache) != 0) {
+        unlink(j->path);
+        free_journal(j);
+        return -1;
+    }
+    ctx->cache.journal = j;
+    return 0;
+}
+
+int journal_write_page(Journal *j, long page_no, const unsigned char *data) {
+    unsigned char frame[FRAME_SIZE];
+    JournalRecord r;
+    r.page_no = page_no;
+    r.file_size = 0;
+    r.salt = j->salt;
+    r.checksum = record_checksum(j->checksum, &r, data);
+    memcpy(frame, &r, sizeof(JournalRecord));
+    memcpy(frame + sizeof(JournalRecord), data, CACHE_PAGE_SIZE);
+    if (pwrite_all(j->fd, frame, FRAME_SIZE, j->end) != 0 || map_put(j, page_no, j->end) != 0) return -1;
+    j->checksum = r.checksum;
+    j->end += FRAME_SIZE;
+    j->stats.frames++;
+    j->stats.log_size = j->end;
+    return 0;
+}
+
+int journal_read_page(Journal *j, long page_no, unsigned char *data) {
+    long offset = map_get(j, page_no);
+    if (offset < 0) return 0;
+    return pread_all(j->fd, data, CACHE_PAGE_SIZE, offset + sizeof(JournalRecord)) == 0 ? 1 : -1;
+}
+
+int journal_commit(FSContext *ctx) {
+    Journal *j = ctx->cache.journal;
+    if (!j) return 0;
+
+    // The SuperBlock only if it changed: a commit with nothing to write costs no fsync
+    SuperBlock logged;
+    size_t sb_size = ctx->sb.version >= 2 ? sizeof(SuperBlock) : LEGACY_SUPERBLOCK_SIZE;
+    if (cache_read(&ctx->cache, 0, &logged, sb_size) != 0) return -1;
+    if (memcmp(&logged, &ctx->sb, sb_size) != 0 && sync_superblock(ctx) != 0) return -1;
+    if (cache_sync(&ctx->cache) != 0) return -1;
+
+    j->stats.operations += j->pending;
+    j->pending = 0;
+    if (j->end == j->committed_end) return 0;
+
+    JournalRecord r;
+    r.page_no = JOURNAL_COMMIT;
+    r.file_size = ctx->cache.file_size;
+    r.salt = j->salt;
+    r.checksum = record_checksum(j->checksum, &r, NULL);
+    if (pwrite_all(j->fd, &r, sizeof(JournalRecord), j->end) != 0 || fdatasync(j->fd) != 0) return -1;
+    j->checksum = r.checksum;
+    j->end += sizeof(JournalRecord);
+    j->committed_end = j->end;
+    j->stats.commits++;
+    j->stats.fsyncs++;
+    j->stats.log_size = j->end;
+
+    if (j->end > JOURNAL_CHECKPOINT_SIZE) return checkpoint(j, ctx->cache.fd, ctx->cache.file_size);
+    return 0;
+}
+
+int journal_end_operation(FSContext *ctx) {
+    Journal *j = ctx->cache.journal;
+    if (!j) return 0;
+    if (++j->pending < j->group_commit) return 0;
+    return journal_commit(ctx);
+}
+
+int journal_detach(FSContext *ctx) {
+    Journal *j = ctx->cache.journal;
+    if (!j) return 0;
+    int res = journal_commit(ctx);
+    if (res == 0 && j->count > 0) res = checkpoint(j, ctx->cache.fd, ctx->cache.file_size);
+    // A log that could not be applied stays for load_filesystem to replay
+    if (res == 0) unlink(j->path);
+    ctx->cache.journal = NULL;
+    free_journal(j);
+    return res;
+}
@@ -0,0 +1,102 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdint.h>
+#include "fs_core.h"
+
+// Write-ahead log of the page cache (FSOptions.group_commit, pages mode only).
+// While a journal is attached, nothing is written into the image in place: a dirty page leaving
+// the cache (eviction, cache_sync) is appended to the log next to the image ("<image>-wal") as a
+// frame holding the whole page, and later reads of that page find it there. A commit writes the
+// pages still dirty, then a commit record, and fsyncs the log once. Committing every
+// group_commit operations (add_file, delete_file, make_directory, a batch) puts many of them
+// behind one fsync; an operation is durable once its group is committed (sync_filesystem and
+// close_filesystem commit the open group).
+//
+// Once the log outgrows JOURNAL_CHECKPOINT_SIZE, a commit also checkpoints it: the latest frame
+// of every page is copied into the image, the image fsynced and the log started over. A clean
+// close checkpoints and removes the log.
+//
+// A log left behind (crash, kill) is replayed by load_filesystem before anything is read: the
+// frames up to the last valid commit record are copied into the image, so it comes back as of
+// that commit, each operation in it whole. Frames written after it (an open group, pages evicted
+// in the middle of an operation) never reached the image and are dropped. Frames are chained by
+// a checksum: a torn write at the end of the log stops the replay there.
+
+#define JOURNAL_SUFFIX "-wal"
+#define JOURNAL_MAGIC 0x4A524E4CUL              // "JRNL"
+#define JOURNAL_COMMIT (-1L)                    // page_no of a commit record
+#define JOURNAL_CHECKPOINT_SIZE (16L * 1024 * 1024)
+
+typedef struct JournalHeader {
+    uint64_t magic;
+    uint64_t salt;          // Changes every time the log starts over: older records do not match
+    long page_size;
+    long reserved;
+} JournalHeader;
+
+// Record header. A frame is followed by the page (CACHE_PAGE_SIZE bytes), a commit record by nothing.
+typedef struct JournalRecord {
+    long page_no;           // Page of the image, or JOURNAL_COMMIT
+    long file_size;         // Commit: size of the image
+    uint64_t salt;
+    uint64_t checksum;      // Of the fields above and the page, chained from the previous record
+} JournalRecord;
+
+typedef struct JournalStats {
+    long frames;            // Pages written to the log
+    long commits;
+    long fsyncs;            // Of the log and, at checkpoints, of the image
+    long checkpoints;
+    long operations;        // Operations committed
+    long log_size;          // Current size of the log
+} JournalStats;
+
+typedef struct JournalEntry {
+    long page_no;           // -1 = empty
+    long offset;            // Latest frame of the page in the log
+} JournalEntry;
+
+typedef struct Journal {
+    int fd;
+    char *path;
+    int group_commit;       // Operations per commit
+    int pending;            // Operations since the last commit
+    uint64_t salt;
+    uint64_t checksum;      // Of the last record written
+    long end;               // End of the log
+    long committed_end;     // End of the last commit record
+    JournalEntry *entries;  // Page -> latest frame, open addressing
+    long capacity;
+    long count;
+    JournalStats stats;
+} Journal;
+
+// Replays the log of the image at `image_path` (open as image_fd), if there is one, and removes it.
+// Returns the number of commits replayed, or -1 on I/O error.
+int journal_recover(const char *image_path, int image_fd);
+
+// Removes the log of the image at `image_path`, if any (a new image takes the name).
+void journal_discard(const char *image_path);
+
+// Starts journaling the writes of ctx's page cache (pages mode), committing every group_commit
+// operations. Returns 0 on success.
+int journal_attach(FSContext *ctx, const char *image_path, int group_commit);
+
+// Commits, checkpoints and removes the log, then writes go to the image again. Returns 0 on success.
+int journal_detach(FSContext *ctx);
+
+// One operation is complete: commits if it closes a group. Returns 0 on success (or without a journal).
+int journal_end_operation(FSContext *ctx);
+
+// Commits the operations since the last commit (SuperBlock included) with one fsync.
+// Returns 0 on success (or without a journal).
+int journal_commit(FSContext *ctx);
+
+// Page cache side: writes a dirty page to the log / reads the latest logged version of a page.
+// journal_write_page returns 0 on success; journal_read_page returns 1 if found, 0 if the page was
+// never logged, -1 on I/O error.
+int journal_write_page(Journal *j, long page_no, const unsigned char *data);
+int journal_read_page(Journal *j, long page_no, unsigned char *data);
+
+#endif // JOURNAL_H
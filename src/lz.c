@@ -0,0 +1,154 @@
+#include "lz.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define LZ_HASH_BITS 14
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+// Matches never start in the last bytes of the input (keeps the 4-byte reads in bounds).
+#define LZ_LAST_LITERALS 5
+
+static inline uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static unsigned char* write_length(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+static unsigned char* write_sequence(unsigned char *op, const unsigned char *literals, size_t lit_len,
+                                     size_t offset, size_t match_len) {
+    unsigned char *token = op++;
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+
+    *token = (unsigned char)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+    if (lit_len >= 15) op = write_length(op, lit_len - 15);
+    memcpy(op, literals, lit_len);
+    op += lit_len;
+
+    if (match_len) {
+        *op++ = (unsigned char)(offset & 0xFF);
+        *op++ = (unsigned char)(offset >> 8);
+        if (ml >= 15) op = write_length(op, ml - 15);
+    }
+    return op;
+}
+
+unsigned char* lz_compress(const unsigned char *data, size_t size, size_t *out_size) {
+    unsigned char *output = malloc(1 + LZ_COMPRESS_BOUND(size));
+    if (!output) return NULL;
+
+    unsigned char *op = output;
+    *op++ = LZ_FORMAT_V1;
+
+    size_t anchor = 0;
+    if (size > LZ_MIN_MATCH + LZ_LAST_LITERALS) {
+        int32_t *table = malloc(LZ_HASH_SIZE * sizeof(int32_t));
+        if (!table) {
+            free(output);
+            return NULL;
+        }
+        memset(table, 0xFF, LZ_HASH_SIZE * sizeof(int32_t)); // -1: empty slot
+
+        size_t limit = size - LZ_LAST_LITERALS;
+        size_t ip = 0;
+        unsigned int misses = 0;
+        while (ip + LZ_MIN_MATCH <= limit) {
+            uint32_t seq = read32(data + ip);
+            uint32_t h = lz_hash(seq);
+            int32_t ref = table[h];
+            table[h] = (int32_t)ip;
+
+            if (ref >= 0 && ip - (size_t)ref <= LZ_MAX_OFFSET && read32(data + ref) == seq) {
+                size_t len = LZ_MIN_MATCH;
+                while (ip + len < limit && data[ref + len] == data[ip + len]) len++;
+
+                op = write_sequence(op, data + anchor, ip - anchor, ip - (size_t)ref, len);
+                ip += len;
+                anchor = ip;
+                misses = 0;
+            } else {
+                // Skip faster through data that does not match (incompressible stretches).
+                ip += 1 + (misses++ >> 5);
+            }
+        }
+        free(table);
+    }
+
+    op = write_sequence(op, data + anchor, size - anchor, 0, 0);
+    *out_size = (size_t)(op - output);
+    return output;
+}
+
+// Reads a length extension. Returns 0 on truncated input.
+static int read_length(const unsigned char **ip, const unsigned char *end, size_t *len) {
+    unsigned char b;
+    do {
+        if (*ip >= end) return 0;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return 1;
+}
+
+unsigned char* lz_decompress(const unsigned char *compressed_data, size_t compressed_size, size_t original_size) {
+    if (compressed_size < 1 || compressed_data[0] != LZ_FORMAT_V1) return NULL;
+
+    unsigned char *output = malloc(original_size + 1); // +1 safety
+    if (!output) return NULL;
+
+    const unsigned char *ip = compressed_data + 1;
+    const unsigned char *end = compressed_data + compressed_size;
+    size_t op = 0;
+
+    while (ip < end) {
+        unsigned char token = *ip++;
+
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !read_length(&ip, end, &lit_len)) goto corrupt;
+        if (lit_len > (size_t)(end - ip) || lit_len > original_size - op) goto corrupt;
+        memcpy(output + op, ip, lit_len);
+        ip += lit_len;
+        op += lit_len;
+
+        if (ip == end) break; // Last sequence: literals only
+
+        if (end - ip < 2) goto corrupt;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op) goto corrupt;
+
+        size_t match_len = token & 0x0F;
+        if (match_len == 15 && !read_length(&ip, end, &match_len)) goto corrupt;
+        match_len += LZ_MIN_MATCH;
+        if (match_len > original_size - op) goto corrupt;
+
+        unsigned char *dst = output + op;
+        const unsigned char *src = dst - offset;
+        if (offset >= match_len) {
+            memcpy(dst, src, match_len);
+        } else {
+            // Overlapping copy (runs): must go forward byte by byte
+            for (size_t i = 0; i < match_len; i++) dst[i] = src[i];
+        }
+        op += match_len;
+    }
+
+    if (op != original_size) goto corrupt;
+    return output;
+
+corrupt:
+    free(output);
+    return NULL;
+}
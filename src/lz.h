@@ -0,0 +1,29 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+
+// Byte-oriented LZ77 codec (same family as LZ4): no entropy coding, so it compresses less than
+// Huffman on text but decodes with plain memcpy and handles repeated content Huffman cannot see.
+//
+// Stream: | version (1) | sequences |
+// Sequence: | token | [literal length ext] | literals | offset (2, LE) | [match length ext] |
+//   token high nibble = literal count, low nibble = match length - LZ_MIN_MATCH,
+//   15 in a nibble means extension bytes follow (each 255 adds 255, the first byte < 255 ends it).
+// The last sequence only has literals.
+
+#define LZ_FORMAT_V1 1
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+
+// Worst case output size for an input of `size` bytes (incompressible data).
+#define LZ_COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+// Compresses data. Returns a buffer that must be freed by caller, out_size is its size in bytes.
+unsigned char* lz_compress(const unsigned char *data, size_t size, size_t *out_size);
+
+// Decompresses exactly original_size bytes.
+// Returns a buffer (caller must free), or NULL if the stream is corrupt or of an unknown version.
+unsigned char* lz_decompress(const unsigned char *compressed_data, size_t compressed_size, size_t original_size);
+
+#endif // LZ_H
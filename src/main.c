@@ -2,6 +2,15 @@
 #include <string.h>
 #include <stdlib.h>
 #include "fs_core.h"
+#include "bench.h"
+#include "compact.h"
+#include "batch.h"
+#include "stream.h"
+#include "codec.h"
+#include "dict.h"
+#include "snapshot.h"
+#include "cow.h"
+#include "dedup.h"
 #include "ui/interface.h"
 
 // Simple usage:
@@ -9,6 +18,19 @@
 // ./fs_prog init fs.bin
 // ...
 
+static int count_and_lookup(FSContext *ctx, const Inode *inode, void *arg) {
+    long *count = arg;
+    if (inode->type != FILE_NODE) return 0;
+    FSFile *f = fs_open_read(ctx, inode->name);
+    if (f) {
+        unsigned char buf[64 * 1024];
+        while (fs_read(f, buf, sizeof(buf)) > 0) {}
+        fs_close(f);
+    }
+    (*count)++;
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     // Si la commande est "gui" ou aucun argument n'est fourni (optionnel), lancer l'interface
     if (argc >= 2 && strcmp(argv[1], "gui") == 0) {
@@ -22,15 +44,31 @@ int main(int argc, char *argv[]) {
 
         printf("  %s init <fs_file>\n", argv[0]);
         printf("  %s add <fs_file> <dest_filename> <content>\n", argv[0]);
-        printf("  %s addfile <fs_file> <dest_filename> <src_file_path>\n", argv[0]);
+        printf("  %s addfile <fs_file> <dest_filename> <src_file_path> [auto|huffman|huffman-x4|lz|stored]\n", argv[0]);
+        printf("  %s import <fs_file> <src_dir> [group_commit]\n", argv[0]);
         printf("  %s get <fs_file> <filename>\n", argv[0]);
-        printf("  %s list <fs_file>\n", argv[0]);
+        printf("  %s peek <fs_file> <filename> <offset> <length>\n", argv[0]);
+        printf("  %s rm <fs_file> <filename|empty_dir>\n", argv[0]);
+        printf("  %s mkdir <fs_file> <dir_path>\n", argv[0]);
+        printf("  %s list <fs_file> [dir_path]\n", argv[0]);
+        printf("  %s stats <fs_file> [cache_pages|mmap]\n", argv[0]);
+        printf("  %s compact <fs_file>\n", argv[0]);
+        printf("  %s train <fs_file>\n", argv[0]);
+        printf("  %s snapshot <fs_file> [off]\n", argv[0]);
+        printf("  %s cow <fs_file> on|off\n", argv[0]);
+        printf("  %s dedup <fs_file> on|off\n", argv[0]);
+        printf("  %s bench <name|all>\n", argv[0]);
         return 1;
     }
 
     const char *cmd = argv[1];
     const char *fs_file = argv[2];
 
+    if (strcmp(cmd, "bench") == 0) {
+        // No filesystem involved: argv[2] is the benchmark name.
+        return run_benchmark(argv[2]);
+    }
+
     if (strcmp(cmd, "init") == 0) {
         if (init_filesystem(fs_file) == 0) {
             printf("Filesystem initialized in %s\n", fs_file);
@@ -60,65 +98,283 @@ int main(int argc, char *argv[]) {
         if (argc < 5) return 1;
         const char *dest_filename = argv[3];
         const char *src_path = argv[4];
+        int codec = CODEC_AUTO;
+        if (argc > 5 && codec_from_name(argv[5], &codec) != 0) {
+            fprintf(stderr, "Unknown codec '%s'.\n", argv[5]);
+            return 1;
+        }
 
         FILE *f = fopen(src_path, "rb");
         if (!f) {
             fprintf(stderr, "Cannot open source file %s\n", src_path);
             return 1;
         }
-        fseek(f, 0, SEEK_END);
-        long size = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        unsigned char *buf = malloc(size);
-        fread(buf, 1, size, f);
-        fclose(f);
 
         FSContext ctx;
         if (load_filesystem(fs_file, &ctx) != 0) {
-            free(buf);
+            fclose(f);
             fprintf(stderr, "Failed to load FS.\n");
             return 1;
         }
 
-        if (add_file(&ctx, dest_filename, buf, size) == 0) {
+        // Streamed block by block: the source file never has to fit in memory
+        FSFile *out = fs_open_write_codec(&ctx, dest_filename, codec);
+        int res = out ? 0 : -1;
+        if (out) {
+            unsigned char buf[64 * 1024];
+            size_t n;
+            while (res == 0 && (n = fread(buf, 1, sizeof(buf), f)) > 0) {
+                if (fs_write(out, buf, n) < 0) res = -1;
+            }
+            if (ferror(f)) res = -1;
+            if (fs_close(out) != 0) res = -1;
+        }
+        fclose(f);
+
+        if (res == 0) {
             printf("File '%s' added from '%s'.\n", dest_filename, src_path);
         } else {
             fprintf(stderr, "Failed to add file.\n");
         }
-        
-        free(buf);
         close_filesystem(&ctx);
 
+    } else if (strcmp(cmd, "import") == 0) {
+        if (argc < 4) return 1;
+        // With a group size, the import goes through the write-ahead log: an interrupted import
+        // leaves the image as of its last commit instead of unreadable.
+        FSOptions opts = {0};
+        if (argc >= 5) opts.group_commit = atoi(argv[4]);
+        FSContext ctx;
+        if (load_filesystem_opts(fs_file, &ctx, &opts) != 0) {
+            fprintf(stderr, "Failed to load FS.\n");
+            return 1;
+        }
+
+        ImportReport report;
+        int res = import_directory(&ctx, argv[3], &report);
+        close_filesystem(&ctx);
+        if (res != 0) {
+            fprintf(stderr, "Import of '%s' failed after %ld files.\n", argv[3], report.files);
+            return 1;
+        }
+        printf("Imported %ld files (%ld skipped): %ld -> %ld bytes in %.3f s\n", report.files,
+               report.skipped, report.bytes_in, report.bytes_stored, report.seconds);
+        if (report.deduplicated > 0) {
+            printf("Deduplicated %ld files (%ld bytes not compressed nor written, about %.3f s saved)\n",
+                   report.deduplicated, report.bytes_deduplicated, report.seconds_saved);
+        }
+
     } else if (strcmp(cmd, "get") == 0) {
         const char *filename = argv[3];
+        // Read-only: map the image and decode straight from the mapping.
+        FSOptions opts = {0};
+        opts.use_mmap = 1;
         FSContext ctx;
-        if (load_filesystem(fs_file, &ctx) != 0) {
+        if (load_filesystem_opts(fs_file, &ctx, &opts) != 0) {
+            fprintf(stderr, "Failed to load FS.\n");
+            return 1;
+        }
+
+        FSFile *in = fs_open_read(&ctx, filename);
+        if (in) {
+            // Write to stdout or save? Let's print string if it looks like one, or binary.
+            // Decoded a block at a time, so large files go through in bounded memory.
+            printf("Content of %s (%ld bytes):\n", filename, in->inode.original_size);
+            unsigned char buf[64 * 1024];
+            long n;
+            while ((n = fs_read(in, buf, sizeof(buf))) > 0) fwrite(buf, 1, n, stdout);
+            printf("\n");
+            if (n < 0) fprintf(stderr, "Read error.\n");
+            fs_close(in);
+        } else {
+            fprintf(stderr, "File not found or error.\n");
+        }
+        close_filesystem(&ctx);
+
+    } else if (strcmp(cmd, "peek") == 0) {
+        // Raw bytes of a range: only the blocks covering it are decoded
+        if (argc < 6) return 1;
+        FSOptions opts = {0};
+        opts.use_mmap = 1;
+        FSContext ctx;
+        if (load_filesystem_opts(fs_file, &ctx, &opts) != 0) {
             fprintf(stderr, "Failed to load FS.\n");
             return 1;
         }
 
         size_t size = 0;
-        unsigned char *content = get_file_content(&ctx, filename, &size);
+        unsigned char *content = read_range(&ctx, argv[3], atol(argv[4]), strtoul(argv[5], NULL, 10), &size);
         if (content) {
-            // Write to stdout or save? Let's print string if it looks like one, or binary.
-            // For safety, let's just print as string with length constraint
-            printf("Content of %s (%ld bytes):\n", filename, size);
             fwrite(content, 1, size, stdout);
-            printf("\n");
             free(content);
         } else {
-            fprintf(stderr, "File not found or error.\n");
+            fprintf(stderr, "File not found or offset past its end.\n");
         }
         close_filesystem(&ctx);
 
+    } else if (strcmp(cmd, "rm") == 0) {
+        if (argc < 4) return 1;
+        FSContext ctx;
+        if (load_filesystem(fs_file, &ctx) != 0) {
+            fprintf(stderr, "Failed to load FS.\n");
+            return 1;
+        }
+        if (delete_file(&ctx, argv[3]) == 0) {
+            printf("File '%s' deleted.\n", argv[3]);
+        } else {
+            fprintf(stderr, "File not found (or directory not empty).\n");
+        }
+        close_filesystem(&ctx);
+    } else if (strcmp(cmd, "mkdir") == 0) {
+        if (argc < 4) return 1;
+        FSContext ctx;
+        if (load_filesystem(fs_file, &ctx) != 0) {
+            fprintf(stderr, "Failed to load FS.\n");
+            return 1;
+        }
+        int res = make_directory(&ctx, argv[3]);
+        close_filesystem(&ctx);
+        if (res == -2) {
+            fprintf(stderr, "This image has no directories (compact it first).\n");
+            return 1;
+        } else if (res != 0) {
+            fprintf(stderr, "Cannot create '%s' (exists, invalid path or below a file).\n", argv[3]);
+            return 1;
+        }
+        printf("Directory '%s' created.\n", argv[3]);
     } else if (strcmp(cmd, "list") == 0) {
         FSContext ctx;
         if (load_filesystem(fs_file, &ctx) != 0) {
             fprintf(stderr, "Failed to load FS.\n");
             return 1;
         }
-        list_files(&ctx);
+        if (argc >= 4) {
+            // One directory, without walking the others
+            if (list_directory(&ctx, argv[3]) != 0) fprintf(stderr, "Directory not found.\n");
+        } else {
+            list_files(&ctx);
+        }
+        close_filesystem(&ctx);
+    } else if (strcmp(cmd, "stats") == 0) {
+        // Looks every file up by name once, then reports the page cache counters for that workload.
+        FSOptions opts = {0};
+        if (argc >= 4 && strcmp(argv[3], "mmap") == 0) opts.use_mmap = 1;
+        else if (argc >= 4) opts.cache_pages = atoi(argv[3]);
+
+        FSContext ctx;
+        if (load_filesystem_opts(fs_file, &ctx, &opts) != 0) {
+            fprintf(stderr, "Failed to load FS.\n");
+            return 1;
+        }
+        long files = 0;
+        for_each_file(&ctx, count_and_lookup, &files);
+        printf("%ld files looked up\n", files);
+        print_fs_stats(&ctx);
+        close_filesystem(&ctx);
+    } else if (strcmp(cmd, "compact") == 0) {
+        CompactReport report;
+        int res = compact_filesystem(fs_file, &report);
+        if (res != 0) {
+            fprintf(stderr, res == -2 ? "Failed to load FS.\n" : "Compaction failed (image left unchanged).\n");
+            return 1;
+        }
+        printf("Compacted %ld files (%ld re-encoded): %ld -> %ld bytes, %ld bytes reclaimed in %.3f s\n",
+               report.files, report.recoded, report.old_size, report.new_size,
+               report.old_size - report.new_size, report.seconds);
+    } else if (strcmp(cmd, "train") == 0) {
+        FSContext ctx;
+        if (load_filesystem(fs_file, &ctx) != 0) {
+            fprintf(stderr, "Failed to load FS.\n");
+            return 1;
+        }
+        DictReport report;
+        int res = dict_train(&ctx, &report);
+        close_filesystem(&ctx);
+        if (res == -2) {
+            fprintf(stderr, "Nothing to train on (no small files, version 1 image, table limit reached or same table).\n");
+            return 1;
+        }
+        if (report.table_id >= 0) {
+            printf("Trained shared table #%d on %ld files (%ld bytes)\n",
+                   report.table_id, report.sampled_files, report.sampled_bytes);
+            long saved = report.bytes_before - report.bytes_after;
+            printf("Recoded %ld of %ld small files: %ld -> %ld bytes, %ld bytes saved (%.1f%%) in %.3f s\n",
+                   report.recoded, report.candidates, report.bytes_before, report.bytes_after, saved,
+                   report.bytes_before ? 100.0 * saved / report.bytes_before : 0.0, report.seconds);
+        }
+        if (res != 0) {
+            fprintf(stderr, "Training failed.\n");
+            return 1;
+        }
+    } else if (strcmp(cmd, "snapshot") == 0) {
+        FSContext ctx;
+        if (load_filesystem(fs_file, &ctx) != 0) {
+            fprintf(stderr, "Failed to load FS.\n");
+            return 1;
+        }
+        int off = argc >= 4 && strcmp(argv[3], "off") == 0;
+        int res = off ? snapshot_drop(&ctx) : snapshot_write(&ctx);
+        long entries = 0, bytes = 0;
+        if (res == 0 && !off) snapshot_info(&ctx, &entries, &bytes);
         close_filesystem(&ctx);
+        if (res != 0) {
+            fprintf(stderr, ctx.sb.version < 2 ? "Version 1 images have no index snapshot.\n"
+                                               : "Failed to write the index snapshot.\n");
+            return 1;
+        }
+        if (off) {
+            printf("Index snapshot removed.\n");
+        } else {
+            printf("Index snapshot written: %ld entries, %ld bytes (kept up to date at close)\n", entries, bytes);
+        }
+    } else if (strcmp(cmd, "cow") == 0) {
+        // Turning it on drops the hash and dedup indexes: nothing but the exact words
+        if (argc < 4 || (strcmp(argv[3], "on") != 0 && strcmp(argv[3], "off") != 0)) {
+            fprintf(stderr, "Usage: %s cow <fs_file> on|off\n", argv[0]);
+            return 1;
+        }
+        FSContext ctx;
+        if (load_filesystem(fs_file, &ctx) != 0) {
+            fprintf(stderr, "Failed to load FS.\n");
+            return 1;
+        }
+        int off = strcmp(argv[3], "off") == 0;
+        int res = off ? cow_disable(&ctx) : cow_enable(&ctx);
+        long epoch = ctx.sb.epoch;
+        close_filesystem(&ctx);
+        if (res == -1) {
+            fprintf(stderr, off ? "Readers are open.\n"
+                                : "Copy-on-write needs a version 2 image with a B+tree index (compact it first) "
+                                  "whose files share no payload (dedup).\n");
+            return 1;
+        } else if (res != 0) {
+            fprintf(stderr, "Failed to convert the image.\n");
+            return 1;
+        }
+        if (off) {
+            printf("Copy-on-write off: updates are made in place again.\n");
+        } else {
+            printf("Copy-on-write on (epoch %ld): every sync publishes a new version atomically.\n", epoch);
+        }
+    } else if (strcmp(cmd, "dedup") == 0) {
+        if (argc < 4 || (strcmp(argv[3], "on") != 0 && strcmp(argv[3], "off") != 0)) {
+            fprintf(stderr, "Usage: %s dedup <fs_file> on|off\n", argv[0]);
+            return 1;
+        }
+        FSContext ctx;
+        if (load_filesystem(fs_file, &ctx) != 0) {
+            fprintf(stderr, "Failed to load FS.\n");
+            return 1;
+        }
+        int off = strcmp(argv[3], "off") == 0;
+        int res = off ? dedup_drop(&ctx) : dedup_create(&ctx);
+        close_filesystem(&ctx);
+        if (res != 0) {
+            fprintf(stderr, off ? "Files share payloads: the index cannot be dropped.\n"
+                                : "Dedup needs a version 2 image that is not copy-on-write.\n");
+            return 1;
+        }
+        printf(off ? "Dedup off.\n" : "Dedup on: files whose bytes are already stored share their payload.\n");
     } else {
         printf("Unknown command.\n");
         return 1;
@@ -0,0 +1,353 @@
+#include "page_cache.h"
+#include "journal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+static int bucket_of(const PageCache *cache, long page_no) {
+    return (int)(((unsigned long)page_no * 2654435761UL) % (unsigned long)cache->bucket_count);
+}
+
+static int lookup(const PageCache *cache, long page_no) {
+    for (int slot = cache->buckets[bucket_of(cache, page_no)]; slot != -1; slot = cache->next_in_bucket[slot]) {
+        if (cache->pages[slot].page_no == page_no) return slot;
+    }
+    return -1;
+}
+
+static void unlink_slot(PageCache *cache, int slot) {
+    int *link = &cache->buckets[bucket_of(cache, cache->pages[slot].page_no)];
+    while (*link != slot) link = &cache->next_in_bucket[*link];
+    *link = cache->next_in_bucket[slot];
+    cache->pages[slot].page_no = -1;
+}
+
+static int pwrite_all(int fd, const unsigned char *buf, size_t len, long offset) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, offset);
+        if (n <= 0) return -1;
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Reads up to len bytes; whatever lies past the end of the file is zero-filled.
+static int pread_full(int fd, unsigned char *buf, size_t len, long offset) {
+    while (len > 0) {
+        ssize_t n = pread(fd, buf, len, offset);
+        if (n < 0) return -1;
+        if (n == 0) {
+            memset(buf, 0, len);
+            return 0;
+        }
+        buf += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int write_back(PageCache *cache, int slot) {
+    CachePage *page = &cache->pages[slot];
+    if (cache->journal) {
+        // Whole page into the log; the image is only written at checkpoints
+        if (journal_write_page(cache->journal, page->page_no, page->data) != 0) return -1;
+        page->dirty = 0;
+        cache->stats.writebacks++;
+        return 0;
+    }
+    long start = page->page_no * CACHE_PAGE_SIZE;
+    long len = cache->file_size - start;
+    if (len > CACHE_PAGE_SIZE) len = CACHE_PAGE_SIZE;
+    // Never extend the file with the unused tail of the last page
+    if (len > 0 && pwrite_all(cache->fd, page->data, len, start) != 0) return -1;
+    page->dirty = 0;
+    cache->stats.writebacks++;
+    return 0;
+}
+
+// CLOCK: the hand skips (and clears) recently referenced pages, the first unreferenced one is replaced.
+static int find_victim(PageCache *cache) {
+    for (;;) {
+        int slot = cache->clock_hand;
+        cache->clock_hand = (cache->clock_hand + 1) % cache->capacity;
+
+        CachePage *page = &cache->pages[slot];
+        if (page->page_no == -1) return slot;
+        if (page->referenced) {
+            page->referenced = 0;
+            continue;
+        }
+        if (page->dirty && write_back(cache, slot) != 0) return -1;
+        unlink_slot(cache, slot);
+        cache->stats.evictions++;
+        return slot;
+    }
+}
+
+// Returns the slot holding page_no, loading it if needed (unless it is about to be fully overwritten).
+static int get_page(PageCache *cache, long page_no, int overwrite) {
+    int slot = lookup(cache, page_no);
+    if (slot != -1) {
+        cache->stats.hits++;
+        cache->pages[slot].referenced = 1;
+        return slot;
+    }
+
+    cache->stats.misses++;
+    slot = find_victim(cache);
+    if (slot == -1) return -1;
+
+    CachePage *page = &cache->pages[slot];
+    int logged = 0;
+    if (!overwrite && cache->journal) {
+        // The latest version of a page written back since the last checkpoint is in the log
+        logged = journal_read_page(cache->journal, page_no, page->data);
+        if (logged < 0) return -1;
+    }
+    if (overwrite) {
+        memset(page->data, 0, CACHE_PAGE_SIZE);
+    } else if (!logged && pread_full(cache->fd, page->data, CACHE_PAGE_SIZE, page_no * CACHE_PAGE_SIZE) != 0) {
+        return -1;
+    }
+
+    page->page_no = page_no;
+    page->dirty = 0;
+    page->referenced = 1;
+    int bucket = bucket_of(cache, page_no);
+    cache->next_in_bucket[slot] = cache->buckets[bucket];
+    cache->buckets[bucket] = slot;
+    return slot;
+}
+
+int cache_init(PageCache *cache, int fd, int capacity) {
+    memset(cache, 0, sizeof(PageCache));
+    if (capacity <= 0) capacity = CACHE_DEFAULT_PAGES;
+
+    cache->fd = fd;
+    cache->capacity = capacity;
+    cache->bucket_count = capacity * 2 + 1;
+    cache->pages = calloc(capacity, sizeof(CachePage));
+    cache->memory = malloc((size_t)capacity * CACHE_PAGE_SIZE);
+    cache->buckets = malloc(cache->bucket_count * sizeof(int));
+    cache->next_in_bucket = malloc(capacity * sizeof(int));
+    if (!cache->pages || !cache->memory || !cache->buckets || !cache->next_in_bucket) {
+        cache_destroy(cache);
+        return -1;
+    }
+
+    for (int i = 0; i < capacity; i++) {
+        cache->pages[i].page_no = -1;
+        cache->pages[i].data = cache->memory + (size_t)i * CACHE_PAGE_SIZE;
+    }
+    memset(cache->buckets, 0xFF, cache->bucket_count * sizeof(int));
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        cache_destroy(cache);
+        return -1;
+    }
+    cache->file_size = st.st_size;
+    return 0;
+}
+
+int cache_init_mapped(PageCache *cache, int fd) {
+    memset(cache, 0, sizeof(PageCache));
+    cache->fd = fd;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) return -1;
+    cache->file_size = st.st_size;
+    cache->map_size = st.st_size;
+    cache->map = mmap(NULL, cache->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (cache->map == MAP_FAILED) {
+        cache->map = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+// Extends the file and the mapping so that [0, end) is mapped. The new mapping is made before the
+// old one is dropped: on failure the cache keeps working on the old one.
+static int grow_mapping(PageCache *cache, long end) {
+    long new_size = cache->map_size * 2;
+    if (new_size < cache->map_size + CACHE_MAP_GROW) new_size = cache->map_size + CACHE_MAP_GROW;
+    if (new_size < end) new_size = end;
+
+    if (ftruncate(cache->fd, new_size) != 0) return -1;
+    unsigned char *map = mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, cache->fd, 0);
+    if (map == MAP_FAILED) {
+        int res = ftruncate(cache->fd, cache->map_size);
+        (void)res;
+        return -1;
+    }
+    munmap(cache->map, cache->map_size);
+    cache->map = map;
+    cache->map_size = new_size;
+    return 0;
+}
+
+const void* cache_ptr(PageCache *cache, long offset, size_t len) {
+    if (!cache->map || offset < 0 || offset + (long)len > cache->file_size) return NULL;
+    return cache->map + offset;
+}
+
+void cache_destroy(PageCache *cache) {
+    if (cache->map) {
+        munmap(cache->map, cache->map_size);
+        cache->map = NULL;
+        if (cache->map_size > cache->file_size) {
+            // Drop the slack added by grow_mapping. If this fails the zeros simply stay past the end
+            // of the image: load_filesystem never allocates below the physical end of file anyway.
+            int res = ftruncate(cache->fd, cache->file_size);
+            (void)res;
+        }
+    }
+    free(cache->pages);
+    free(cache->memory);
+    free(cache->buckets);
+    free(cache->next_in_bucket);
+    cache->pages = NULL;
+    cache->memory = NULL;
+    cache->buckets = NULL;
+    cache->next_in_bucket = NULL;
+}
+
+int cache_read(PageCache *cache, long offset, void *buf, size_t len) {
+    unsigned char *out = buf;
+
+    if (cache->map) {
+        cache->stats.hits++;
+        size_t avail = offset < cache->map_size ? (size_t)(cache->map_size - offset) : 0;
+        if (avail > len) avail = len;
+        memcpy(out, cache->map + offset, avail);
+        memset(out + avail, 0, len - avail);
+        return 0;
+    }
+
+    if (len >= CACHE_BYPASS_SIZE && !cache->journal) {
+        cache->stats.bypass_reads++;
+        if (pread_full(cache->fd, out, len, offset) != 0) return -1;
+        // Cached copies (possibly dirty) are the up-to-date version of their pages
+        for (long page_no = offset / CACHE_PAGE_SIZE; page_no * CACHE_PAGE_SIZE < offset + (long)len; page_no++) {
+            int slot = lookup(cache, page_no);
+            if (slot == -1 || !cache->pages[slot].dirty) continue;
+            long start = page_no * CACHE_PAGE_SIZE;
+            long from = start > offset ? start : offset;
+            long to = start + CACHE_PAGE_SIZE < offset + (long)len ? start + CACHE_PAGE_SIZE : offset + (long)len;
+            memcpy(out + (from - offset), cache->pages[slot].data + (from - start), to - from);
+        }
+        return 0;
+    }
+
+    while (len > 0) {
+        long page_no = offset / CACHE_PAGE_SIZE;
+        size_t in_page = offset % CACHE_PAGE_SIZE;
+        size_t n = CACHE_PAGE_SIZE - in_page;
+        if (n > len) n = len;
+
+        int slot = get_page(cache, page_no, 0);
+        if (slot == -1) return -1;
+        memcpy(out, cache->pages[slot].data + in_page, n);
+
+        out += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int cache_write(PageCache *cache, long offset, const void *buf, size_t len) {
+    const unsigned char *in = buf;
+    if (cache->map) {
+        cache->stats.hits++;
+        if (offset + (long)len > cache->map_size && grow_mapping(cache, offset + len) != 0) return -1;
+        memcpy(cache->map + offset, in, len);
+        if (offset + (long)len > cache->file_size) cache->file_size = offset + len;
+        return 0;
+    }
+
+    if (offset + (long)len > cache->file_size) cache->file_size = offset + len;
+
+    if (len >= CACHE_BYPASS_SIZE && !cache->journal) {
+        cache->stats.bypass_writes++;
+        if (pwrite_all(cache->fd, in, len, offset) != 0) return -1;
+        // Keep cached copies coherent with what is now in the file
+        for (long page_no = offset / CACHE_PAGE_SIZE; page_no * CACHE_PAGE_SIZE < offset + (long)len; page_no++) {
+            int slot = lookup(cache, page_no);
+            if (slot == -1) continue;
+            long start = page_no * CACHE_PAGE_SIZE;
+            long from = start > offset ? start : offset;
+            long to = start + CACHE_PAGE_SIZE < offset + (long)len ? start + CACHE_PAGE_SIZE : offset + (long)len;
+            memcpy(cache->pages[slot].data + (from - start), in + (from - offset), to - from);
+        }
+        return 0;
+    }
+
+    while (len > 0) {
+        long page_no = offset / CACHE_PAGE_SIZE;
+        size_t in_page = offset % CACHE_PAGE_SIZE;
+        size_t n = CACHE_PAGE_SIZE - in_page;
+        if (n > len) n = len;
+
+        int slot = get_page(cache, page_no, n == CACHE_PAGE_SIZE);
+        if (slot == -1) return -1;
+        memcpy(cache->pages[slot].data + in_page, in, n);
+        cache->pages[slot].dirty = 1;
+
+        in += n;
+        offset += n;
+        len -= n;
+    }
+    return 0;
+}
+
+typedef struct DirtyRef {
+    long page_no;
+    int slot;
+} DirtyRef;
+
+static int compare_dirty(const void *a, const void *b) {
+    long pa = ((const DirtyRef *)a)->page_no;
+    long pb = ((const DirtyRef *)b)->page_no;
+    return (pa > pb) - (pa < pb);
+}
+
+int cache_truncate(PageCache *cache, long size) {
+    if (size >= cache->file_size) return 0;
+    cache->file_size = size;
+    // The mapping must stay backed by the file: it is trimmed when unmapped (cache_destroy).
+    // A journaled file is cut to the committed size at the next checkpoint.
+    if (cache->map || cache->journal) return 0;
+    // Cached pages past the new end are harmless: write_back never writes beyond file_size.
+    return ftruncate(cache->fd, size);
+}
+
+int cache_sync(PageCache *cache) {
+    if (cache->map) return msync(cache->map, cache->map_size, MS_SYNC);
+
+    DirtyRef *dirty = malloc(cache->capacity * sizeof(DirtyRef));
+    if (!dirty) return -1;
+
+    int count = 0;
+    for (int i = 0; i < cache->capacity; i++) {
+        if (cache->pages[i].page_no != -1 && cache->pages[i].dirty) {
+            dirty[count].page_no = cache->pages[i].page_no;
+            dirty[count].slot = i;
+            count++;
+        }
+    }
+    // File order: turns the write-back into mostly sequential I/O
+    qsort(dirty, count, sizeof(DirtyRef), compare_dirty);
+
+    int res = 0;
+    for (int i = 0; i < count; i++) {
+        if (write_back(cache, dirty[i].slot) != 0) res = -1;
+    }
+    free(dirty);
+    return res;
+}
@@ -0,0 +1,90 @@
+#ifndef PAGE_CACHE_H
+#define PAGE_CACHE_H
+
+#include <stddef.h>
+
+// Write-back cache of fixed-size pages of the image file.
+// All tree and data I/O goes through it (cache_read / cache_write at absolute offsets), so a tree
+// operation touching the same nodes several times (rotations, fixups) only pays for the first access.
+// Dirty pages reach the file when evicted, or on cache_sync (close_filesystem / sync_filesystem).
+//
+// Mapped mode (cache_init_mapped) replaces the pages by one shared mmap of the whole file: reads and
+// writes become memcpy, and cache_ptr gives direct access to records and payloads in place.
+// The mapping grows (by at least CACHE_MAP_GROW bytes) when a write goes past its end.
+//
+// With a journal attached (journal.h, pages mode), dirty pages go to the write-ahead log instead
+// of the image, and pages missing from the cache are read from the log when it has them. Large
+// requests then go through the pages too.
+
+#define CACHE_PAGE_SIZE 4096
+#define CACHE_DEFAULT_PAGES 256  // 1 MB
+// Requests at least this large go straight to the file (payloads): no point in flushing the
+// tree pages out of the cache for data that is read once.
+#define CACHE_BYPASS_SIZE (16 * CACHE_PAGE_SIZE)
+#define CACHE_MAP_GROW (1024 * 1024)
+
+struct Journal;
+
+typedef struct CacheStats {
+    long hits;
+    long misses;
+    long evictions;
+    long writebacks;     // Dirty pages written to the file
+    long bypass_reads;   // Large requests served without the cache
+    long bypass_writes;
+} CacheStats;
+
+typedef struct CachePage {
+    long page_no;        // -1: slot unused
+    int dirty;
+    int referenced;      // CLOCK bit: set on access, cleared when the hand passes
+    unsigned char *data;
+} CachePage;
+
+typedef struct PageCache {
+    int fd;
+    int capacity;
+    CachePage *pages;
+    unsigned char *memory;   // Backing store of all pages
+    int *buckets;            // Hash of page_no -> first slot (-1 = empty)
+    int *next_in_bucket;
+    int bucket_count;
+    int clock_hand;
+    long file_size;          // Current end of file, including data still in dirty pages
+    CacheStats stats;
+
+    // Mapped mode
+    unsigned char *map;      // NULL when using pages
+    long map_size;           // Size of the mapping (the file is extended to match, trimmed at destroy)
+
+    struct Journal *journal; // Write-ahead log (journal.h), NULL = write-back to the file
+} PageCache;
+
+// capacity: number of pages (<= 0 for CACHE_DEFAULT_PAGES). Returns 0 on success.
+int cache_init(PageCache *cache, int fd, int capacity);
+
+// Mapped mode: maps the whole file. Returns 0 on success.
+int cache_init_mapped(PageCache *cache, int fd);
+
+// Release the memory. Dirty pages are NOT written: call cache_sync first.
+// In mapped mode, unmaps and trims the file back to file_size.
+void cache_destroy(PageCache *cache);
+
+// Read/write len bytes at offset. Reads past the end of the file return zeros.
+// Return 0 on success, -1 on I/O error.
+int cache_read(PageCache *cache, long offset, void *buf, size_t len);
+int cache_write(PageCache *cache, long offset, const void *buf, size_t len);
+
+// Write every dirty page back (in file order; to the log with a journal), or msync the mapping.
+// Returns 0 on success.
+int cache_sync(PageCache *cache);
+
+// Shrink the file to `size` bytes (no-op if it is not larger). Returns 0 on success.
+// With a journal the file is cut at the next checkpoint.
+int cache_truncate(PageCache *cache, long size);
+
+// Mapped mode only: pointer to [offset, offset + len) inside the mapping, or NULL (pages mode, or out
+// of range). Zero-copy access; only valid until the next cache_write (which may move the mapping).
+const void* cache_ptr(PageCache *cache, long offset, size_t len);
+
+#endif // PAGE_CACHE_H
@@ -0,0 +1,61 @@
+#include "reader.h"
+#include "cow.h"
+#include "dict.h"
+#include "directory.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Pins the published version and sets the context up on it.
+static int attach(FSReader *reader, int cache_pages) {
+    FSContext *ctx = &reader->ctx;
+    memset(ctx, 0, sizeof(FSContext));
+    ctx->snapshot_generation = -1;
+    if (cow_pin(reader->writer, &ctx->sb) != 0) return -1;
+    reader->epoch = ctx->sb.epoch;
+
+    // The published version is on disk (cow_publish syncs it first): no need for the writer's pages
+    if (cache_init(&ctx->cache, reader->writer->cache.fd, cache_pages) != 0) {
+        cow_unpin(reader->writer, reader->epoch);
+        return -1;
+    }
+    if (dict_load(ctx) != 0) {
+        cache_destroy(&ctx->cache);
+        cow_unpin(reader->writer, reader->epoch);
+        return -1;
+    }
+    return 0;
+}
+
+static void detach(FSReader *reader) {
+    FSContext *ctx = &reader->ctx;
+    cache_destroy(&ctx->cache); // Never dirty
+    free(ctx->dict_tables);
+    ctx->dict_tables = NULL;
+    dcache_free(ctx);
+    cow_unpin(reader->writer, reader->epoch);
+}
+
+FSReader* reader_open(FSContext *writer, int cache_pages) {
+    if (!writer->cow) return NULL;
+    FSReader *reader = malloc(sizeof(FSReader));
+    if (!reader) return NULL;
+    reader->writer = writer;
+    if (attach(reader, cache_pages) != 0) {
+        free(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+int reader_refresh(FSReader *reader) {
+    int cache_pages = reader->ctx.cache.capacity;
+    detach(reader);
+    // A failed attach leaves nothing pinned and nothing to free
+    return attach(reader, cache_pages);
+}
+
+void reader_close(FSReader *reader) {
+    if (!reader) return;
+    if (reader->ctx.cache.pages) detach(reader);
+    free(reader);
+}
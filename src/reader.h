@@ -0,0 +1,32 @@
+#ifndef READER_H
+#define READER_H
+
+#include "fs_core.h"
+
+// Concurrent readers of a copy-on-write image (cow.h), in the process of its writer.
+// A reader is a read-only context on the version published when it was opened: it has its own
+// page cache on the writer's file descriptor (positional reads, no shared file position), its own
+// directory cache and code tables, so one thread per reader can call get_file_content,
+// for_each_file... while the writer goes on adding and deleting through its own context.
+// The version is pinned (cow_pin): the writer does not hand out the space it uses until the reader
+// is closed or refreshed, so a reader sees the same files throughout, and a reader left open keeps
+// that space in use.
+// Readers must be closed before the writer closes the image or turns copy-on-write off.
+
+typedef struct FSReader {
+    FSContext ctx;      // Pass &reader->ctx to the read functions of fs_core.h; never write through it
+    FSContext *writer;
+    long epoch;         // Version read
+} FSReader;
+
+// Opens a reader on the published version. cache_pages: as in FSOptions (0 = CACHE_DEFAULT_PAGES).
+// Returns NULL if the image is not copy-on-write or on error.
+FSReader* reader_open(FSContext *writer, int cache_pages);
+
+// Moves the reader to the version published since (its caches are dropped). Returns 0 on success;
+// on failure the reader is unusable and must be closed.
+int reader_refresh(FSReader *reader);
+
+void reader_close(FSReader *reader);
+
+#endif // READER_H
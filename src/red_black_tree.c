@@ -1,60 +1,49 @@
 #include "red_black_tree.h"
+#include "allocator.h"
 #include <stdlib.h>
 #include <string.h>
 
 // Helper to create a new node
-long create_node(FILE *file, Inode inode) {
+long create_node(FSContext *ctx, Inode inode) {
     RBTNode node;
+    memset(&node, 0, sizeof(RBTNode));
     node.inode = inode;
     node.color = RED; // New nodes are always red
     node.left_offset = -1;
     node.right_offset = -1;
     node.parent_offset = -1;
 
-    // Allocate space at the end of the file or use an allocator
-    // For this simple implementation, we append to the end.
-    // In a real FS, we should use the SuperBlock's next_free_page_offset, but here we assume we can append.
-    // However, the prompt mentions SuperBlock.next_free_page_offset. We should ideally use that.
-    // But since `rb_insert` doesn't take SuperBlock, we'll assume we read/write 'next_free_page_offset' from the file header or append.
-    // Let's rely on fseek(file, 0, SEEK_END) for new nodes for now to keep it simple, 
-    // or better: The caller 'fs_core' usually manages allocation.
-    // To respect the prompt's structure, let's assume we simply append to the file for now and return the offset.
-    
-    fseek(file, 0, SEEK_END);
-    long offset = ftell(file);
-    fwrite(&node, sizeof(RBTNode), 1, file);
+    // Space comes from the filesystem allocator (reused node slot, or end of the used space).
+    long offset = fs_allocate(ctx, sizeof(RBTNode));
+    write_rb_node(ctx, offset, &node);
     return offset;
 }
 
-void write_rb_node(FILE *file, long offset, RBTNode *node) {
+// Node I/O goes through the page cache: the repeated reads and writes of the same few nodes
+// during fixups and rotations are served from memory.
+void write_rb_node(FSContext *ctx, long offset, RBTNode *node) {
     if (offset == -1) return;
-    long current_pos = ftell(file);
-    fseek(file, offset, SEEK_SET);
-    fwrite(node, sizeof(RBTNode), 1, file);
-    fseek(file, current_pos, SEEK_SET);
+    cache_write(&ctx->cache, offset, node, sizeof(RBTNode));
 }
 
-void read_rb_node(FILE *file, long offset, RBTNode *node) {
+void read_rb_node(FSContext *ctx, long offset, RBTNode *node) {
     if (offset == -1) return;
-    long current_pos = ftell(file);
-    fseek(file, offset, SEEK_SET);
-    fread(node, sizeof(RBTNode), 1, file);
-    fseek(file, current_pos, SEEK_SET);
+    cache_read(&ctx->cache, offset, node, sizeof(RBTNode));
 }
 
 // Rotations
-void left_rotate(FILE *file, long *root_offset, long x_offset) {
+void left_rotate(FSContext *ctx, long *root_offset, long x_offset) {
     RBTNode x, y;
-    read_rb_node(file, x_offset, &x);
+    read_rb_node(ctx, x_offset, &x);
     long y_offset = x.right_offset;
-    read_rb_node(file, y_offset, &y);
+    read_rb_node(ctx, y_offset, &y);
 
     x.right_offset = y.left_offset;
     if (y.left_offset != -1) {
         RBTNode y_left;
-        read_rb_node(file, y.left_offset, &y_left);
+        read_rb_node(ctx, y.left_offset, &y_left);
         y_left.parent_offset = x_offset;
-        write_rb_node(file, y.left_offset, &y_left);
+        write_rb_node(ctx, y.left_offset, &y_left);
     }
 
     y.parent_offset = x.parent_offset;
@@ -62,34 +51,34 @@ void left_rotate(FILE *file, long *root_offset, long x_offset) {
         *root_offset = y_offset;
     } else {
         RBTNode p;
-        read_rb_node(file, x.parent_offset, &p);
+        read_rb_node(ctx, x.parent_offset, &p);
         if (x_offset == p.left_offset) {
             p.left_offset = y_offset;
         } else {
             p.right_offset = y_offset;
         }
-        write_rb_node(file, x.parent_offset, &p);
+        write_rb_node(ctx, x.parent_offset, &p);
     }
 
     y.left_offset = x_offset;
     x.parent_offset = y_offset;
 
-    write_rb_node(file, x_offset, &x);
-    write_rb_node(file, y_offset, &y);
+    write_rb_node(ctx, x_offset, &x);
+    write_rb_node(ctx, y_offset, &y);
 }
 
-void right_rotate(FILE *file, long *root_offset, long y_offset) {
+void right_rotate(FSContext *ctx, long *root_offset, long y_offset) {
     RBTNode y, x;
-    read_rb_node(file, y_offset, &y);
+    read_rb_node(ctx, y_offset, &y);
     long x_offset = y.left_offset;
-    read_rb_node(file, x_offset, &x);
+    read_rb_node(ctx, x_offset, &x);
 
     y.left_offset = x.right_offset;
     if (x.right_offset != -1) {
         RBTNode x_right;
-        read_rb_node(file, x.right_offset, &x_right);
+        read_rb_node(ctx, x.right_offset, &x_right);
         x_right.parent_offset = y_offset;
-        write_rb_node(file, x.right_offset, &x_right);
+        write_rb_node(ctx, x.right_offset, &x_right);
     }
 
     x.parent_offset = y.parent_offset;
@@ -97,40 +86,40 @@ void right_rotate(FILE *file, long *root_offset, long y_offset) {
         *root_offset = x_offset;
     } else {
         RBTNode p;
-        read_rb_node(file, y.parent_offset, &p);
+        read_rb_node(ctx, y.parent_offset, &p);
         if (y_offset == p.right_offset) {
             p.right_offset = x_offset;
         } else {
             p.left_offset = x_offset;
         }
-        write_rb_node(file, y.parent_offset, &p);
+        write_rb_node(ctx, y.parent_offset, &p);
     }
 
     x.right_offset = y_offset;
     y.parent_offset = x_offset;
 
-    write_rb_node(file, y_offset, &y);
-    write_rb_node(file, x_offset, &x);
+    write_rb_node(ctx, y_offset, &y);
+    write_rb_node(ctx, x_offset, &x);
 }
 
-void rb_insert_fixup(FILE *file, long *root_offset, long k_offset) {
+void rb_insert_fixup(FSContext *ctx, long *root_offset, long k_offset) {
     RBTNode k;
-    read_rb_node(file, k_offset, &k);
+    read_rb_node(ctx, k_offset, &k);
 
     while (k.parent_offset != -1) {
         RBTNode p;
-        read_rb_node(file, k.parent_offset, &p);
+        read_rb_node(ctx, k.parent_offset, &p);
         if (p.color != RED) break;
 
         RBTNode gp;
-        read_rb_node(file, p.parent_offset, &gp); // Grandparent must exist if parent is RED (root is black)
+        read_rb_node(ctx, p.parent_offset, &gp); // Grandparent must exist if parent is RED (root is black)
 
         if (k.parent_offset == gp.left_offset) {
             long u_offset = gp.right_offset;
             RBTNode u;
             int u_is_red = 0;
             if (u_offset != -1) {
-                read_rb_node(file, u_offset, &u);
+                read_rb_node(ctx, u_offset, &u);
                 u_is_red = (u.color == RED);
             }
 
@@ -138,17 +127,17 @@ void rb_insert_fixup(FILE *file, long *root_offset, long k_offset) {
                 p.color = BLACK;
                 u.color = BLACK;
                 gp.color = RED;
-                write_rb_node(file, k.parent_offset, &p);
-                write_rb_node(file, u_offset, &u);
-                write_rb_node(file, p.parent_offset, &gp);
+                write_rb_node(ctx, k.parent_offset, &p);
+                write_rb_node(ctx, u_offset, &u);
+                write_rb_node(ctx, p.parent_offset, &gp);
                 k_offset = p.parent_offset;
-                read_rb_node(file, k_offset, &k); // Update k for next iteration
+                read_rb_node(ctx, k_offset, &k); // Update k for next iteration
             } else {
                 if (k_offset == p.right_offset) {
                     k_offset = k.parent_offset;
-                    left_rotate(file, root_offset, k_offset);
+                    left_rotate(ctx, root_offset, k_offset);
                     // Reload p after rotation
-                    read_rb_node(file, k_offset, &p); // k_offset is now the old parent
+                    read_rb_node(ctx, k_offset, &p); // k_offset is now the old parent
                     // Actually, after rotation, structure changes.
                     // Standard logic:
                     /*
@@ -162,15 +151,15 @@ void rb_insert_fixup(FILE *file, long *root_offset, long k_offset) {
                    // The logic above: k_offset = k.parent_offset matches CLRS 'z = z.p'.
                 }
                 // Case 3
-                read_rb_node(file, k_offset, &k); // Refresh k info
-                read_rb_node(file, k.parent_offset, &p);
-                read_rb_node(file, p.parent_offset, &gp);
+                read_rb_node(ctx, k_offset, &k); // Refresh k info
+                read_rb_node(ctx, k.parent_offset, &p);
+                read_rb_node(ctx, p.parent_offset, &gp);
                 
                 p.color = BLACK;
                 gp.color = RED;
-                write_rb_node(file, k.parent_offset, &p);
-                write_rb_node(file, p.parent_offset, &gp);
-                right_rotate(file, root_offset, p.parent_offset);
+                write_rb_node(ctx, k.parent_offset, &p);
+                write_rb_node(ctx, p.parent_offset, &gp);
+                right_rotate(ctx, root_offset, p.parent_offset);
             }
         } else {
             // Mirror image
@@ -178,7 +167,7 @@ void rb_insert_fixup(FILE *file, long *root_offset, long k_offset) {
             RBTNode u;
             int u_is_red = 0;
             if (u_offset != -1) {
-                read_rb_node(file, u_offset, &u);
+                read_rb_node(ctx, u_offset, &u);
                 u_is_red = (u.color == RED);
             }
 
@@ -186,43 +175,43 @@ void rb_insert_fixup(FILE *file, long *root_offset, long k_offset) {
                 p.color = BLACK;
                 u.color = BLACK;
                 gp.color = RED;
-                write_rb_node(file, k.parent_offset, &p);
-                write_rb_node(file, u_offset, &u);
-                write_rb_node(file, p.parent_offset, &gp);
+                write_rb_node(ctx, k.parent_offset, &p);
+                write_rb_node(ctx, u_offset, &u);
+                write_rb_node(ctx, p.parent_offset, &gp);
                 k_offset = p.parent_offset;
-                read_rb_node(file, k_offset, &k);
+                read_rb_node(ctx, k_offset, &k);
             } else {
                 if (k_offset == p.left_offset) {
                     k_offset = k.parent_offset;
-                    right_rotate(file, root_offset, k_offset);
+                    right_rotate(ctx, root_offset, k_offset);
                 }
-                read_rb_node(file, k_offset, &k);
-                read_rb_node(file, k.parent_offset, &p);
-                read_rb_node(file, p.parent_offset, &gp);
+                read_rb_node(ctx, k_offset, &k);
+                read_rb_node(ctx, k.parent_offset, &p);
+                read_rb_node(ctx, p.parent_offset, &gp);
 
                 p.color = BLACK;
                 gp.color = RED;
-                write_rb_node(file, k.parent_offset, &p);
-                write_rb_node(file, p.parent_offset, &gp);
-                left_rotate(file, root_offset, p.parent_offset);
+                write_rb_node(ctx, k.parent_offset, &p);
+                write_rb_node(ctx, p.parent_offset, &gp);
+                left_rotate(ctx, root_offset, p.parent_offset);
             }
         }
     }
 
     RBTNode root;
-    read_rb_node(file, *root_offset, &root);
+    read_rb_node(ctx, *root_offset, &root);
     if (root.color != BLACK) {
         root.color = BLACK;
-        write_rb_node(file, *root_offset, &root);
+        write_rb_node(ctx, *root_offset, &root);
     }
 }
 
-int rb_insert(FILE *file, long *root_offset, Inode new_inode, long *ret_offset) {
-    long z_offset = create_node(file, new_inode);
+int rb_insert(FSContext *ctx, long *root_offset, Inode new_inode, long *ret_offset) {
+    long z_offset = create_node(ctx, new_inode);
     if (ret_offset) *ret_offset = z_offset;
 
     RBTNode z;
-    read_rb_node(file, z_offset, &z); // Load the new node
+    read_rb_node(ctx, z_offset, &z); // Load the new node
 
     long y_offset = -1;
     long x_offset = *root_offset;
@@ -230,50 +219,59 @@ int rb_insert(FILE *file, long *root_offset, Inode new_inode, long *ret_offset)
     while (x_offset != -1) {
         y_offset = x_offset;
         RBTNode x;
-        read_rb_node(file, x_offset, &x);
+        read_rb_node(ctx, x_offset, &x);
         if (strcmp(z.inode.name, x.inode.name) < 0) {
             x_offset = x.left_offset;
         } else if (strcmp(z.inode.name, x.inode.name) > 0) {
             x_offset = x.right_offset;
         } else {
-            // Duplicate name
+            // Duplicate name: the new node was never linked
+            fs_release(ctx, z_offset, sizeof(RBTNode));
+            if (ret_offset) *ret_offset = -1;
             return -1; 
         }
     }
 
     z.parent_offset = y_offset;
-    write_rb_node(file, z_offset, &z);
+    write_rb_node(ctx, z_offset, &z);
 
     if (y_offset == -1) {
         *root_offset = z_offset;
     } else {
         RBTNode y;
-        read_rb_node(file, y_offset, &y);
+        read_rb_node(ctx, y_offset, &y);
         if (strcmp(z.inode.name, y.inode.name) < 0) {
             y.left_offset = z_offset;
         } else {
             y.right_offset = z_offset;
         }
-        write_rb_node(file, y_offset, &y);
+        write_rb_node(ctx, y_offset, &y);
     }
 
-    rb_insert_fixup(file, root_offset, z_offset);
+    rb_insert_fixup(ctx, root_offset, z_offset);
     return 0;
 }
 
-long rb_search(FILE *file, long root_offset, const char *name) {
+long rb_search(FSContext *ctx, long root_offset, const char *name) {
     long current_offset = root_offset;
-    RBTNode current;
+    RBTNode copy;
 
     while (current_offset != -1) {
-        read_rb_node(file, current_offset, &current);
-        int cmp = strcmp(name, current.inode.name);
+        // Mapped image: compare in place instead of copying the whole node (only aligned nodes,
+        // older images may have nodes at odd offsets).
+        const RBTNode *current = (current_offset & (FS_ALLOC_ALIGN - 1)) == 0
+            ? cache_ptr(&ctx->cache, current_offset, sizeof(RBTNode)) : NULL;
+        if (!current) {
+            read_rb_node(ctx, current_offset, &copy);
+            current = &copy;
+        }
+        int cmp = strcmp(name, current->inode.name);
         if (cmp == 0) {
             return current_offset;
         } else if (cmp < 0) {
-            current_offset = current.left_offset;
+            current_offset = current->left_offset;
         } else {
-            current_offset = current.right_offset;
+            current_offset = current->right_offset;
         }
     }
     return -1;
@@ -289,36 +287,36 @@ long rb_search(FILE *file, long root_offset, const char *name) {
 // The user requirement "rb_delete(root, name) : Supprimer un Inode et rééquilibrer." implies full logic.
 // I will implement it now.
 
-void rb_transplant(FILE *file, long *root_offset, long u_offset, long v_offset) {
+void rb_transplant(FSContext *ctx, long *root_offset, long u_offset, long v_offset) {
     RBTNode u;
-    read_rb_node(file, u_offset, &u);
+    read_rb_node(ctx, u_offset, &u);
 
     if (u.parent_offset == -1) {
         *root_offset = v_offset;
     } else {
         RBTNode p;
-        read_rb_node(file, u.parent_offset, &p);
+        read_rb_node(ctx, u.parent_offset, &p);
         if (u_offset == p.left_offset) {
             p.left_offset = v_offset;
         } else {
             p.right_offset = v_offset;
         }
-        write_rb_node(file, u.parent_offset, &p);
+        write_rb_node(ctx, u.parent_offset, &p);
     }
     if (v_offset != -1) {
         RBTNode v;
-        read_rb_node(file, v_offset, &v);
+        read_rb_node(ctx, v_offset, &v);
         v.parent_offset = u.parent_offset;
-        write_rb_node(file, v_offset, &v);
+        write_rb_node(ctx, v_offset, &v);
     }
 }
 
 // Minimum node in subtree
-long rb_minimum(FILE *file, long node_offset) {
+long rb_minimum(FSContext *ctx, long node_offset) {
     long current = node_offset;
     RBTNode node;
     while (current != -1) {
-        read_rb_node(file, current, &node);
+        read_rb_node(ctx, current, &node);
         if (node.left_offset == -1) break;
         current = node.left_offset;
     }
@@ -326,7 +324,7 @@ long rb_minimum(FILE *file, long node_offset) {
 }
 
 // Fixup for deletion
-void rb_delete_fixup(FILE *file, long *root_offset, long x_offset, long x_parent_offset) {
+void rb_delete_fixup(FSContext *ctx, long *root_offset, long x_offset, long x_parent_offset) {
     // Note: x_offset can be -1 (NIL). We need x_parent_offset to traverse up.
     // If x_offset is not -1, we can get parent from it. 
     // This iterative logic follows CLRS but adapted for file offsets.
@@ -339,28 +337,28 @@ void rb_delete_fixup(FILE *file, long *root_offset, long x_offset, long x_parent
         // Read x (handle NIL)
         int x_color = BLACK;
         if (x_offset != -1) {
-             read_rb_node(file, x_offset, &x);
+             read_rb_node(ctx, x_offset, &x);
              x_color = x.color;
              x_parent_offset = x.parent_offset; // Update parent tracker
         }
         if (x_color == RED) break; // If x becomes red, we just make it black
 
-        read_rb_node(file, x_parent_offset, &p);
+        read_rb_node(ctx, x_parent_offset, &p);
 
         if (x_offset == p.left_offset) {
             w_offset = p.right_offset;
-            read_rb_node(file, w_offset, &w);
+            read_rb_node(ctx, w_offset, &w);
             
             if (w.color == RED) {
                 w.color = BLACK;
                 p.color = RED;
-                write_rb_node(file, w_offset, &w);
-                write_rb_node(file, x_parent_offset, &p);
-                left_rotate(file, root_offset, x_parent_offset);
+                write_rb_node(ctx, w_offset, &w);
+                write_rb_node(ctx, x_parent_offset, &p);
+                left_rotate(ctx, root_offset, x_parent_offset);
                 // Update new sibling w
-                read_rb_node(file, x_parent_offset, &p); // Reload p (now lower)
+                read_rb_node(ctx, x_parent_offset, &p); // Reload p (now lower)
                 w_offset = p.right_offset;
-                read_rb_node(file, w_offset, &w);
+                read_rb_node(ctx, w_offset, &w);
             }
             
             int left_child_black = 1;
@@ -368,18 +366,18 @@ void rb_delete_fixup(FILE *file, long *root_offset, long x_offset, long x_parent
             /* Check w children colors */
             if (w.left_offset != -1) {
                 RBTNode wl;
-                read_rb_node(file, w.left_offset, &wl);
+                read_rb_node(ctx, w.left_offset, &wl);
                 if (wl.color == RED) left_child_black = 0;
             }
             if (w.right_offset != -1) {
                 RBTNode wr;
-                read_rb_node(file, w.right_offset, &wr);
+                read_rb_node(ctx, w.right_offset, &wr);
                 if (wr.color == RED) right_child_black = 0;
             }
 
             if (left_child_black && right_child_black) {
                 w.color = RED;
-                write_rb_node(file, w_offset, &w);
+                write_rb_node(ctx, w_offset, &w);
                 x_offset = x_parent_offset; // x = x.p
                 // Loop continues
             } else {
@@ -387,109 +385,109 @@ void rb_delete_fixup(FILE *file, long *root_offset, long x_offset, long x_parent
                     // Case 3
                     if (w.left_offset != -1) {
                          RBTNode wl;
-                         read_rb_node(file, w.left_offset, &wl);
+                         read_rb_node(ctx, w.left_offset, &wl);
                          wl.color = BLACK;
-                         write_rb_node(file, w.left_offset, &wl);
+                         write_rb_node(ctx, w.left_offset, &wl);
                     }
                     w.color = RED;
-                    write_rb_node(file, w_offset, &w);
-                    right_rotate(file, root_offset, w_offset);
+                    write_rb_node(ctx, w_offset, &w);
+                    right_rotate(ctx, root_offset, w_offset);
                     // Update w
-                    read_rb_node(file, x_parent_offset, &p);
+                    read_rb_node(ctx, x_parent_offset, &p);
                     w_offset = p.right_offset;
-                    read_rb_node(file, w_offset, &w);
+                    read_rb_node(ctx, w_offset, &w);
                 }
                 // Case 4
                 w.color = p.color;
                 p.color = BLACK;
-                write_rb_node(file, x_parent_offset, &p);
+                write_rb_node(ctx, x_parent_offset, &p);
                 if (w.right_offset != -1) {
                     RBTNode wr;
-                    read_rb_node(file, w.right_offset, &wr);
+                    read_rb_node(ctx, w.right_offset, &wr);
                     wr.color = BLACK;
-                    write_rb_node(file, w.right_offset, &wr);
+                    write_rb_node(ctx, w.right_offset, &wr);
                 }
-                write_rb_node(file, w_offset, &w);
-                left_rotate(file, root_offset, x_parent_offset);
+                write_rb_node(ctx, w_offset, &w);
+                left_rotate(ctx, root_offset, x_parent_offset);
                 x_offset = *root_offset; // terminate
             }
         } else {
             // Mirror of above
             w_offset = p.left_offset;
-            read_rb_node(file, w_offset, &w);
+            read_rb_node(ctx, w_offset, &w);
             
             if (w.color == RED) {
                 w.color = BLACK;
                 p.color = RED;
-                write_rb_node(file, w_offset, &w);
-                write_rb_node(file, x_parent_offset, &p);
-                right_rotate(file, root_offset, x_parent_offset);
-                read_rb_node(file, x_parent_offset, &p); 
+                write_rb_node(ctx, w_offset, &w);
+                write_rb_node(ctx, x_parent_offset, &p);
+                right_rotate(ctx, root_offset, x_parent_offset);
+                read_rb_node(ctx, x_parent_offset, &p); 
                 w_offset = p.left_offset;
-                read_rb_node(file, w_offset, &w);
+                read_rb_node(ctx, w_offset, &w);
             }
             
             int left_child_black = 1;
             int right_child_black = 1;
             if (w.left_offset != -1) {
                 RBTNode wl;
-                read_rb_node(file, w.left_offset, &wl);
+                read_rb_node(ctx, w.left_offset, &wl);
                 if (wl.color == RED) left_child_black = 0;
             }
             if (w.right_offset != -1) {
                 RBTNode wr;
-                read_rb_node(file, w.right_offset, &wr);
+                read_rb_node(ctx, w.right_offset, &wr);
                 if (wr.color == RED) right_child_black = 0;
             }
 
             if (left_child_black && right_child_black) {
                 w.color = RED;
-                write_rb_node(file, w_offset, &w);
+                write_rb_node(ctx, w_offset, &w);
                 x_offset = x_parent_offset; 
             } else {
                 if (left_child_black) {
                     if (w.right_offset != -1) {
                          RBTNode wr;
-                         read_rb_node(file, w.right_offset, &wr);
+                         read_rb_node(ctx, w.right_offset, &wr);
                          wr.color = BLACK;
-                         write_rb_node(file, w.right_offset, &wr);
+                         write_rb_node(ctx, w.right_offset, &wr);
                     }
                     w.color = RED;
-                    write_rb_node(file, w_offset, &w);
-                    left_rotate(file, root_offset, w_offset);
-                    read_rb_node(file, x_parent_offset, &p);
+                    write_rb_node(ctx, w_offset, &w);
+                    left_rotate(ctx, root_offset, w_offset);
+                    read_rb_node(ctx, x_parent_offset, &p);
                     w_offset = p.left_offset;
-                    read_rb_node(file, w_offset, &w);
+                    read_rb_node(ctx, w_offset, &w);
                 }
                 w.color = p.color;
                 p.color = BLACK;
-                write_rb_node(file, x_parent_offset, &p);
+                write_rb_node(ctx, x_parent_offset, &p);
                 if (w.left_offset != -1) {
                     RBTNode wl;
-                    read_rb_node(file, w.left_offset, &wl);
+                    read_rb_node(ctx, w.left_offset, &wl);
                     wl.color = BLACK;
-                    write_rb_node(file, w.left_offset, &wl);
+                    write_rb_node(ctx, w.left_offset, &wl);
                 }
-                write_rb_node(file, w_offset, &w);
-                right_rotate(file, root_offset, x_parent_offset);
+                write_rb_node(ctx, w_offset, &w);
+                right_rotate(ctx, root_offset, x_parent_offset);
                 x_offset = *root_offset; 
             }
         }
     }
     
     if (x_offset != -1) {
-        read_rb_node(file, x_offset, &x);
+        read_rb_node(ctx, x_offset, &x);
         x.color = BLACK;
-        write_rb_node(file, x_offset, &x);
+        write_rb_node(ctx, x_offset, &x);
     }
 }
 
-int rb_delete(FILE *file, long *root_offset, const char *name) {
-    long z_offset = rb_search(file, *root_offset, name);
+int rb_delete(FSContext *ctx, long *root_offset, const char *name) {
+    long z_offset = rb_search(ctx, *root_offset, name);
     if (z_offset == -1) return -1; // Not found
 
     RBTNode z;
-    read_rb_node(file, z_offset, &z);
+    read_rb_node(ctx, z_offset, &z);
 
     long y_offset = z_offset;
     RBTNode y = z; // y is the node to be physically removed/moved
@@ -500,14 +498,14 @@ int rb_delete(FILE *file, long *root_offset, const char *name) {
     if (z.left_offset == -1) {
         x_offset = z.right_offset;
         x_parent_offset = z.parent_offset; // The parent of x becomes z's parent
-        rb_transplant(file, root_offset, z_offset, z.right_offset);
+        rb_transplant(ctx, root_offset, z_offset, z.right_offset);
     } else if (z.right_offset == -1) {
         x_offset = z.left_offset;
         x_parent_offset = z.parent_offset;
-        rb_transplant(file, root_offset, z_offset, z.left_offset);
+        rb_transplant(ctx, root_offset, z_offset, z.left_offset);
     } else {
-        y_offset = rb_minimum(file, z.right_offset);
-        read_rb_node(file, y_offset, &y);
+        y_offset = rb_minimum(ctx, z.right_offset);
+        read_rb_node(ctx, y_offset, &y);
         y_original_color = y.color;
         
         x_offset = y.right_offset; 
@@ -516,36 +514,39 @@ int rb_delete(FILE *file, long *root_offset, const char *name) {
              x_parent_offset = y_offset; // x.p = y
         } else {
              x_parent_offset = y.parent_offset;
-             rb_transplant(file, root_offset, y_offset, y.right_offset);
+             rb_transplant(ctx, root_offset, y_offset, y.right_offset);
              
              // y moves to z's spot
              y.right_offset = z.right_offset;
              // Update z.right parent
              if (y.right_offset != -1) {
                  RBTNode yr;
-                 read_rb_node(file, y.right_offset, &yr);
+                 read_rb_node(ctx, y.right_offset, &yr);
                  yr.parent_offset = y_offset;
-                 write_rb_node(file, y.right_offset, &yr);
+                 write_rb_node(ctx, y.right_offset, &yr);
              }
         }
         
-        rb_transplant(file, root_offset, z_offset, y_offset);
+        rb_transplant(ctx, root_offset, z_offset, y_offset);
+        y.parent_offset = z.parent_offset; // Set on disk by rb_transplant: keep our copy in step
         
         y.left_offset = z.left_offset;
         // Update z.left parent
         if (y.left_offset != -1) {
             RBTNode yl;
-            read_rb_node(file, y.left_offset, &yl);
+            read_rb_node(ctx, y.left_offset, &yl);
             yl.parent_offset = y_offset;
-            write_rb_node(file, y.left_offset, &yl);
+            write_rb_node(ctx, y.left_offset, &yl);
         }
         y.color = z.color;
-        write_rb_node(file, y_offset, &y);
+        write_rb_node(ctx, y_offset, &y);
     }
 
     if (y_original_color == BLACK) {
-        rb_delete_fixup(file, root_offset, x_offset, x_parent_offset);
+        rb_delete_fixup(ctx, root_offset, x_offset, x_parent_offset);
     }
-    
+
+    // z is unlinked in every case (a successor takes its place, not its record): reuse its slot.
+    fs_release(ctx, z_offset, sizeof(RBTNode));
     return 0; 
 }
@@ -0,0 +1,271 @@
+#include "snapshot.h"
+#include "allocator.h"
+#include "index.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static uint64_t name_hash(const char *name, size_t len) {
+    uint64_t h = 1469598103934665603ULL; // FNV-1a
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)name[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static long directory_size(long bucket_bits) {
+    return ((1L << bucket_bits) + 1) * (long)sizeof(uint64_t);
+}
+
+static long section_size(const SnapshotHeader *h) {
+    return (long)sizeof(SnapshotHeader) + directory_size(h->bucket_bits) + h->records_size;
+}
+
+static long record_size(long name_len) {
+    return ((long)sizeof(SnapshotEntry) + name_len + 1 + 7) & ~7L;
+}
+
+static uint64_t bucket_of(uint64_t hash, long bucket_bits) {
+    return bucket_bits ? hash >> (64 - bucket_bits) : 0;
+}
+
+// Header of the image's snapshot section, checked against the image. Returns 0, or -1 if there is
+// none or it is damaged (a released section starts with a free extent header).
+static int read_header(FSContext *ctx, SnapshotHeader *h) {
+    if (ctx->sb.version < 2 || ctx->sb.snapshot_offset == 0) return -1;
+    if (cache_read(&ctx->cache, ctx->sb.snapshot_offset, h, sizeof(SnapshotHeader)) != 0) return -1;
+    if (h->magic != SNAPSHOT_MAGIC || h->count < 0
+        || h->bucket_bits < 0 || h->bucket_bits > 32 || h->records_size < 0) {
+        return -1;
+    }
+    if (ctx->sb.snapshot_offset + section_size(h) > ctx->cache.file_size) return -1;
+    return 0;
+}
+
+void snapshot_load(FSContext *ctx) {
+    ctx->snapshot = NULL;
+    ctx->snapshot_map = NULL;
+    ctx->snapshot_map_size = 0;
+    ctx->snapshot_generation = -1;
+    ctx->index_changed = 0;
+
+    SnapshotHeader h;
+    if (read_header(ctx, &h) != 0) return;
+    ctx->snapshot_generation = h.generation;
+    if (h.generation != ctx->sb.generation) return; // Stale: rewritten at close
+
+    // The mapping starts on the page holding the header
+    long page = sysconf(_SC_PAGESIZE);
+    long start = ctx->sb.snapshot_offset & ~(page - 1);
+    size_t skew = ctx->sb.snapshot_offset - start;
+    size_t size = skew + section_size(&h);
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, ctx->cache.fd, start);
+    if (map == MAP_FAILED) return;
+    // A lookup touches a few scattered pages: no read-around on faults
+    madvise(map, size, MADV_RANDOM);
+
+    ctx->snapshot_map = map;
+    ctx->snapshot_map_size = size;
+    ctx->snapshot = (const SnapshotHeader *)((const unsigned char *)map + skew);
+}
+
+void snapshot_unload(FSContext *ctx) {
+    if (ctx->snapshot_map) munmap(ctx->snapshot_map, ctx->snapshot_map_size);
+    ctx->snapshot = NULL;
+    ctx->snapshot_map = NULL;
+    ctx->snapshot_map_size = 0;
+}
+
+int snapshot_lookup(FSContext *ctx, const char *name, Inode *out) {
+    const SnapshotHeader *h = ctx->snapshot;
+    if (!h) return 1;
+
+    const uint64_t *directory = (const uint64_t *)(h + 1);
+    const unsigned char *records = (const unsigned char *)directory + directory_size(h->bucket_bits);
+    size_t name_len = strlen(name);
+    uint64_t hash = name_hash(name, name_len);
+    uint64_t b = bucket_of(hash, h->bucket_bits);
+    // Offsets and lengths are checked against the section: a damaged one reads as not found
+    uint64_t end = directory[b + 1] < (uint64_t)h->records_size ? directory[b + 1] : (uint64_t)h->records_size;
+
+    for (uint64_t pos = directory[b]; pos + sizeof(SnapshotEntry) <= end;) {
+        const SnapshotEntry *e = (const SnapshotEntry *)(records + pos);
+        if (e->hash > hash || pos + record_size(e->name_len) > end) break;
+        const char *e_name = (const char *)(e + 1);
+        if (e->hash == hash && e->name_len == name_len && memcmp(e_name, name, name_len) == 0) {
+            if (out) {
+                memset(out, 0, sizeof(Inode));
+                memcpy(out->name, name, name_len < MAX_NAME_LEN ? name_len : MAX_NAME_LEN - 1);
+                out->type = e->type;
+                out->codec = e->codec;
+                out->data_offset = e->data_offset;
+                out->original_size = e->original_size;
+                out->compressed_size = e->compressed_size;
+                out->parent_offset = e->parent_offset;
+                out->children_offset = e->children_offset;
+            }
+            return 0;
+        }
+        pos += record_size(e->name_len);
+    }
+    return -1;
+}
+
+int snapshot_invalidate(FSContext *ctx) {
+    if (ctx->index_changed || ctx->sb.version < 2) return 0;
+    ctx->index_changed = 1;
+    ctx->sb.generation++;
+    snapshot_unload(ctx);
+    if (ctx->snapshot_generation != ctx->sb.generation - 1) return 0; // Already stale on disk
+
+    // Pages are written back in any order (evictions): the new generation goes first
+    if (sync_superblock(ctx) != 0 || cache_sync(&ctx->cache) != 0) return -1;
+    return 0;
+}
+
+// --- Writing ---
+
+typedef struct BuildEntry {
+    SnapshotEntry e;
+    long name_offset;       // In SnapshotBuilder.names
+} BuildEntry;
+
+typedef struct SnapshotBuilder {
+    BuildEntry *entries;
+    long count;
+    long cap;
+    char *names;
+    long names_size;
+    long names_cap;
+    long records_size;
+} SnapshotBuilder;
+
+static int collect_entry(FSContext *ctx, const Inode *inode, void *arg) {
+    SnapshotBuilder *b = arg;
+    size_t len = strnlen(inode->name, MAX_NAME_LEN - 1);
+    if (b->count == b->cap) {
+        long cap = b->cap ? b->cap * 2 : 1024;
+        BuildEntry *grown = realloc(b->entries, cap * sizeof(BuildEntry));
+        if (!grown) return -1;
+        b->entries = grown;
+        b->cap = cap;
+    }
+    if (b->names_size + (long)len > b->names_cap) {
+        long cap = b->names_cap ? b->names_cap * 2 : 16 * 1024;
+        char *grown = realloc(b->names, cap);
+        if (!grown) return -1;
+        b->names = grown;
+        b->names_cap = cap;
+    }
+
+    BuildEntry *be = &b->entries[b->count++];
+    SnapshotEntry *e = &be->e;
+    memset(e, 0, sizeof(SnapshotEntry));
+    memcpy(b->names + b->names_size, inode->name, len);
+    be->name_offset = b->names_size;
+    e->hash = name_hash(inode->name, len);
+    e->name_len = (uint16_t)len;
+    e->codec = (int16_t)inode->codec;
+    e->type = (int16_t)inode->type;
+    e->data_offset = inode->data_offset;
+    e->original_size = inode->original_size;
+    e->compressed_size = inode->compressed_size;
+    e->parent_offset = inode->parent_offset;
+    e->children_offset = inode->children_offset;
+    b->names_size += len;
+    b->records_size += record_size(len);
+    return 0;
+}
+
+static int compare_hashes(const void *a, const void *b) {
+    uint64_t ha = ((const BuildEntry *)a)->e.hash, hb = ((const BuildEntry *)b)->e.hash;
+    return (ha > hb) - (ha < hb);
+}
+
+// Lays the section out in one buffer (caller must free), or NULL.
+static unsigned char* build_section(FSContext *ctx, SnapshotBuilder *b, long *size) {
+    SnapshotHeader h;
+    memset(&h, 0, sizeof(SnapshotHeader));
+    h.magic = SNAPSHOT_MAGIC;
+    h.generation = ctx->sb.generation;
+    h.count = b->count;
+    h.records_size = b->records_size;
+    while (h.bucket_bits < 32 && (b->count >> h.bucket_bits) > SNAPSHOT_BUCKET_FILL) h.bucket_bits++;
+
+    *size = section_size(&h);
+    unsigned char *buf = calloc(1, *size);
+    if (!buf) return NULL;
+    memcpy(buf, &h, sizeof(SnapshotHeader));
+    uint64_t *directory = (uint64_t *)(buf + sizeof(SnapshotHeader));
+    unsigned char *records = (unsigned char *)directory + directory_size(h.bucket_bits);
+
+    if (b->count > 0) qsort(b->entries, b->count, sizeof(BuildEntry), compare_hashes); // Empty: no array
+    long pos = 0;
+    uint64_t bucket = 0;
+    for (long i = 0; i < b->count; i++) {
+        const SnapshotEntry *e = &b->entries[i].e;
+        uint64_t e_bucket = bucket_of(e->hash, h.bucket_bits);
+        while (bucket <= e_bucket) directory[bucket++] = pos;
+
+        memcpy(records + pos, e, sizeof(SnapshotEntry));
+        memcpy(records + pos + sizeof(SnapshotEntry), b->names + b->entries[i].name_offset, e->name_len);
+        pos += record_size(e->name_len); // calloc: NUL and padding already there
+    }
+    while (bucket <= (1ULL << h.bucket_bits)) directory[bucket++] = pos;
+    return buf;
+}
+
+int snapshot_write(FSContext *ctx) {
+    if (ctx->sb.version < 2) return -1;
+
+    SnapshotBuilder b;
+    memset(&b, 0, sizeof(SnapshotBuilder));
+    long size = 0;
+    unsigned char *section = NULL;
+    if (index_for_each(ctx, collect_entry, &b) == 0) section = build_section(ctx, &b, &size);
+    free(b.entries);
+    free(b.names);
+    if (!section) return -1;
+
+    long offset = fs_allocate(ctx, size);
+    int res = cache_write(&ctx->cache, offset, section, size);
+    free(section);
+    // The section reaches the file before the SuperBlock pointing to it
+    if (res == 0) res = cache_sync(&ctx->cache);
+    if (res != 0) {
+        fs_release(ctx, offset, size);
+        return -1;
+    }
+
+    snapshot_drop(ctx);
+    ctx->sb.snapshot_offset = offset;
+    ctx->snapshot_generation = ctx->sb.generation;
+    ctx->index_changed = 0; // The next change bumps the generation again
+    return sync_superblock(ctx);
+}
+
+int snapshot_refresh(FSContext *ctx) {
+    if (ctx->sb.version < 2 || ctx->sb.snapshot_offset == 0) return 0;
+    if (ctx->snapshot_generation == ctx->sb.generation) return 0;
+    return snapshot_write(ctx);
+}
+
+int snapshot_drop(FSContext *ctx) {
+    snapshot_unload(ctx);
+    if (ctx->sb.version < 2 || ctx->sb.snapshot_offset == 0) return 0;
+    SnapshotHeader h;
+    if (read_header(ctx, &h) == 0) fs_release(ctx, ctx->sb.snapshot_offset, section_size(&h));
+    ctx->sb.snapshot_offset = 0;
+    ctx->snapshot_generation = -1;
+    return sync_superblock(ctx);
+}
+
+int snapshot_info(FSContext *ctx, long *entries, long *bytes) {
+    SnapshotHeader h;
+    if (read_header(ctx, &h) != 0) return -1;
+    if (entries) *entries = h.count;
+    if (bytes) *bytes = section_size(&h);
+    return h.generation == ctx->sb.generation ? 0 : 1;
+}
@@ -0,0 +1,74 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include "fs_core.h"
+
+// Index snapshot: an optional read-only copy of the name index, laid out to be looked up straight
+// from a mapping of the image. A fresh process answers its first lookups with a few page faults
+// instead of walking the index from the root through the page cache.
+//
+// Section (SuperBlock.snapshot_offset):
+// | SnapshotHeader | directory: 2^bucket_bits + 1 uint64 | records |
+// A record is a SnapshotEntry followed by its NUL-terminated name, padded to 8 bytes. Records are
+// sorted by the FNV-1a hash of their name; the top bucket_bits bits of the hash select a bucket,
+// the records from directory[b] to directory[b + 1] (byte offsets in the records area), about
+// SNAPSHOT_BUCKET_FILL of them. A lookup touches one directory page and one or two record pages.
+//
+// The snapshot is current while its generation equals SuperBlock.generation. A session that changes
+// the index bumps the counter once, and writes it before any changed index page can reach the file:
+// the snapshot is ignored from then on (lookups go through the index) and rewritten at close.
+// It is turned on by snapshot_write (`snapshot` command); version 1 images have none.
+
+#define SNAPSHOT_MAGIC 0x534E4150L    // "SNAP"
+#define SNAPSHOT_BUCKET_FILL 32
+
+typedef struct SnapshotHeader {
+    long magic;
+    long generation;        // SuperBlock.generation when written
+    long count;
+    long bucket_bits;
+    long records_size;
+} SnapshotHeader;
+
+typedef struct SnapshotEntry {
+    uint64_t hash;
+    long data_offset;
+    long original_size;
+    long compressed_size;
+    long parent_offset;
+    long children_offset;
+    int16_t codec;
+    int16_t type;
+    uint16_t name_len;      // Without the NUL
+    uint16_t reserved;
+} SnapshotEntry;
+
+// Maps the image's snapshot if it is current (load_filesystem). A missing, stale or damaged snapshot
+// is not an error: lookups use the index and close_filesystem rewrites it.
+void snapshot_load(FSContext *ctx);
+
+// Unmaps it (close_filesystem).
+void snapshot_unload(FSContext *ctx);
+
+// Looks a name up in the mapped snapshot. Returns 0 and fills *out (may be NULL), -1 if not found,
+// 1 if there is no current snapshot to answer from.
+int snapshot_lookup(FSContext *ctx, const char *name, Inode *out);
+
+// To be called before changing the index (index.h, bulk builds). Returns 0 on success.
+int snapshot_invalidate(FSContext *ctx);
+
+// Writes a snapshot of the index as it is now, replacing the previous one, and keeps the image's
+// snapshot current from then on. Returns 0 on success, -1 on error or on a version 1 image.
+int snapshot_write(FSContext *ctx);
+
+// Rewrites the snapshot if the image has one and it is not current (close_filesystem). Returns 0 on success.
+int snapshot_refresh(FSContext *ctx);
+
+// Removes the snapshot section. Returns 0 on success.
+int snapshot_drop(FSContext *ctx);
+
+// Entries and section size of the image's snapshot. Returns 0 if current, 1 if stale, -1 if none.
+int snapshot_info(FSContext *ctx, long *entries, long *bytes);
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,543 @@
+#include "stream.h"
+#include "allocator.h"
+#include "index.h"
+#include "codec.h"
+#include "dedup.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Chunk boundaries: the top bits of the gear hash are all zero. More bits before FS_CHUNK_AVG, fewer
+// after, so chunk sizes gather around it (normalized chunking).
+#define CHUNK_MASK_SMALL (~0ULL << (64 - 18))
+#define CHUNK_MASK_LARGE (~0ULL << (64 - 14))
+
+static uint64_t gear[256];
+static pthread_once_t gear_once = PTHREAD_ONCE_INIT;
+
+static int read_header(FSContext *ctx, long offset, BlockHeader *h) {
+    if (cache_read(&ctx->cache, offset, h, sizeof(BlockHeader)) != 0) return -1;
+    // Encoded blocks are never larger than the data (codec_encode falls back to stored)
+    if (h->codec == CODEC_BLOCKS || h->original_size < 0 || h->original_size > FS_STREAM_BLOCK
+        || h->stored_size < 0 || h->stored_size > h->original_size) {
+        return -1;
+    }
+    return 0;
+}
+
+static long block_extent(const BlockHeader *h) {
+    return (long)sizeof(BlockHeader) + h->stored_size;
+}
+
+static long table_extent(long count, int chunked) {
+    return (long)sizeof(BlockTable) + count * (long)sizeof(long) * (chunked ? 2 : 1);
+}
+
+// Block offsets listed by the table at `offset` (caller must free), or NULL. A chunk table also
+// gives their ends in *ends (caller must free), NULL otherwise.
+static long* load_table(FSContext *ctx, long offset, BlockTable *t, long **ends) {
+    *ends = NULL;
+    if (cache_read(&ctx->cache, offset, t, sizeof(BlockTable)) != 0) return NULL;
+    long unit = t->block_size != 0 ? t->block_size : 1;
+    if (t->block_size < 0 || t->block_size > FS_STREAM_BLOCK || t->count <= 0 || t->count > (1L << 40) / unit) {
+        return NULL;
+    }
+    long bytes = t->count * (long)sizeof(long);
+    long *blocks = malloc(bytes);
+    if (blocks && cache_read(&ctx->cache, offset + sizeof(BlockTable), blocks, bytes) != 0) {
+        free(blocks);
+        return NULL;
+    }
+    if (blocks && t->block_size == 0) {
+        *ends = malloc(bytes);
+        if (!*ends || cache_read(&ctx->cache, offset + sizeof(BlockTable) + bytes, *ends, bytes) != 0) {
+            free(*ends);
+            *ends = NULL;
+            free(blocks);
+            return NULL;
+        }
+    }
+    return blocks;
+}
+
+// `ends` is NULL for blocks of block_size.
+static long write_table(FSContext *ctx, const long *blocks, const long *ends, long count, long block_size) {
+    BlockTable t;
+    t.count = count;
+    t.block_size = block_size;
+    long bytes = count * (long)sizeof(long);
+    long offset = fs_allocate(ctx, table_extent(count, ends != NULL));
+    if (cache_write(&ctx->cache, offset, &t, sizeof(BlockTable)) != 0
+        || cache_write(&ctx->cache, offset + sizeof(BlockTable), blocks, bytes) != 0
+        || (ends && cache_write(&ctx->cache, offset + sizeof(BlockTable) + bytes, ends, bytes) != 0)) {
+        fs_release(ctx, offset, table_extent(count, ends != NULL));
+        return -1;
+    }
+    return offset;
+}
+
+// Gives each block back, or drops the file's reference to it when it is a shared chunk.
+static void release_block_list(FSContext *ctx, const long *blocks, long count) {
+    for (long i = 0; i < count; i++) {
+        BlockHeader h;
+        if (read_header(ctx, blocks[i], &h) == 0) dedup_release(ctx, blocks[i], block_extent(&h));
+    }
+}
+
+// --- Chunking ---
+
+// 256 fixed pseudo-random words (splitmix64): the same boundaries in every build.
+static void init_gear(void) {
+    uint64_t x = 0;
+    for (int i = 0; i < 256; i++) {
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        gear[i] = z ^ (z >> 31);
+    }
+}
+
+// Length of the chunk starting at data, out of n bytes (all of them if n is below FS_CHUNK_MIN).
+// Only bytes after FS_CHUNK_MIN are hashed: no chunk ends before anyway.
+static size_t cut_point(const unsigned char *data, size_t n) {
+    if (n <= FS_CHUNK_MIN) return n;
+    size_t normal = n < FS_CHUNK_AVG ? n : FS_CHUNK_AVG;
+    size_t max = n < FS_CHUNK_MAX ? n : FS_CHUNK_MAX;
+    uint64_t h = 0;
+    size_t i = FS_CHUNK_MIN;
+    for (; i < normal; i++) {
+        h = (h << 1) + gear[data[i]];
+        if (!(h & CHUNK_MASK_SMALL)) return i + 1;
+    }
+    for (; i < max; i++) {
+        h = (h << 1) + gear[data[i]];
+        if (!(h & CHUNK_MASK_LARGE)) return i + 1;
+    }
+    return max;
+}
+
+// --- Writing ---
+
+FSFile* fs_open_write(FSContext *ctx, const char *path) {
+    return fs_open_write_codec(ctx, path, CODEC_AUTO);
+}
+
+FSFile* fs_open_write_codec(FSContext *ctx, const char *path, int codec) {
+    FSFile *f = calloc(1, sizeof(FSFile));
+    if (!f) return NULL;
+    strncpy(f->inode.name, path, MAX_NAME_LEN - 1);
+
+    Inode existing;
+    f->block_cap = FS_STREAM_BLOCK;
+    f->block = f->inode.name[0] != '\0' && index_lookup(ctx, f->inode.name, &existing) != 0
+        ? malloc(f->block_cap) : NULL;
+    if (!f->block) {
+        free(f);
+        return NULL;
+    }
+
+    f->ctx = ctx;
+    f->writing = 1;
+    f->codec = codec;
+    f->chunked = dedup_enabled(ctx);
+    f->block_size = f->chunked ? 0 : FS_STREAM_BLOCK;
+    if (f->chunked) pthread_once(&gear_once, init_gear);
+    f->current = -1;
+    f->inode.type = FILE_NODE;
+    f->inode.codec = CODEC_BLOCKS;
+    f->inode.parent_offset = -1;
+    f->inode.children_offset = -1;
+    f->inode.data_offset = -1;
+    return f;
+}
+
+// Room in the table for one more block.
+static int grow_table(FSFile *f) {
+    if (f->block_count < f->blocks_cap) return 0;
+    long cap = f->blocks_cap ? f->blocks_cap * 2 : 64;
+    long *grown = realloc(f->blocks, cap * sizeof(long));
+    if (!grown) return -1;
+    f->blocks = grown;
+    if (f->chunked) {
+        grown = realloc(f->ends, cap * sizeof(long));
+        if (!grown) return -1;
+        f->ends = grown;
+    }
+    f->blocks_cap = cap;
+    return 0;
+}
+
+// Encodes `size` bytes as one block and writes it. Returns its offset (*extent: header included,
+// *codec: the one picked), or -1.
+static long store_block(FSFile *f, const unsigned char *data, size_t size, long *extent, int *codec) {
+    FSContext *ctx = f->ctx;
+    unsigned char *encoded = NULL;
+    size_t stored = 0;
+    *codec = codec_encode_as(f->codec, data, size, &encoded, &stored);
+    if (*codec < 0) return -1;
+
+    BlockHeader h;
+    memset(&h, 0, sizeof(BlockHeader));
+    h.codec = *codec;
+    h.original_size = (int)size;
+    h.stored_size = (int)stored;
+    *extent = block_extent(&h);
+    long offset = fs_allocate(ctx, *extent);
+
+    int res = cache_write(&ctx->cache, offset, &h, sizeof(BlockHeader));
+    if (res == 0) res = cache_write(&ctx->cache, offset + sizeof(BlockHeader), encoded ? encoded : data, stored);
+    free(encoded);
+    if (res != 0) {
+        fs_release(ctx, offset, *extent);
+        return -1;
+    }
+    return offset;
+}
+
+// Encodes the buffered data as one block and adds it to the table.
+static int write_block(FSFile *f) {
+    long extent;
+    int codec;
+    if (grow_table(f) != 0) return -1;
+    long offset = store_block(f, f->block, f->block_len, &extent, &codec);
+    if (offset == -1) return -1;
+
+    f->blocks[f->block_count++] = offset;
+    f->inode.compressed_size += extent;
+    f->block_len = 0;
+    return 0;
+}
+
+// Adds one chunk to the table: the block of the image holding the same bytes if there is one
+// (nothing to encode or write), a new block otherwise.
+static int write_chunk(FSFile *f, const unsigned char *data, size_t size) {
+    FSContext *ctx = f->ctx;
+    if (grow_table(f) != 0) return -1;
+
+    DedupHash hash = dedup_hash(data, size);
+    DedupRecord hit;
+    long offset, extent;
+    if (dedup_lookup_chunk(ctx, &hash, data, (long)size, &hit) == 0 && dedup_ref(ctx, &hit) == 0) {
+        offset = hit.data_offset;
+        extent = hit.compressed_size;
+    } else {
+        int codec;
+        offset = store_block(f, data, size, &extent, &codec);
+        if (offset == -1) return -1;
+        dedup_insert_chunk(ctx, &hash, offset, extent, (long)size, codec);
+    }
+
+    long start = f->block_count > 0 ? f->ends[f->block_count - 1] : 0;
+    f->blocks[f->block_count] = offset;
+    f->ends[f->block_count++] = start + (long)size;
+    f->inode.compressed_size += extent;
+    return 0;
+}
+
+// Cuts the buffered data into chunks. The last FS_CHUNK_MAX bytes stay buffered, their chunk may
+// end past them, except at close (`last`).
+static int write_chunks(FSFile *f, int last) {
+    size_t pos = 0;
+    while (f->block_len - pos > (last ? 0 : FS_CHUNK_MAX)) {
+        size_t size = cut_point(f->block + pos, f->block_len - pos);
+        if (write_chunk(f, f->block + pos, size) != 0) return -1;
+        pos += size;
+    }
+    memmove(f->block, f->block + pos, f->block_len - pos);
+    f->block_len -= pos;
+    return 0;
+}
+
+long fs_write(FSFile *f, const void *data, size_t size) {
+    if (!f->writing || f->failed) return -1;
+    const unsigned char *src = data;
+    size_t left = size;
+    while (left > 0) {
+        if (f->block_len == f->block_cap) {
+            // Full: out it goes, unless the image cannot hold blocks (version 1: one piece at close)
+            int res = 0;
+            if (f->ctx->sb.version >= 2) {
+                res = f->chunked ? write_chunks(f, 0) : write_block(f);
+            } else {
+                unsigned char *grown = realloc(f->block, f->block_cap * 2);
+                if (grown) {
+                    f->block = grown;
+                    f->block_cap *= 2;
+                } else {
+                    res = -1;
+                }
+            }
+            if (res != 0) {
+                f->failed = 1;
+                return -1;
+            }
+        }
+        size_t n = f->block_cap - f->block_len < left ? f->block_cap - f->block_len : left;
+        memcpy(f->block + f->block_len, src, n);
+        f->block_len += n;
+        src += n;
+        left -= n;
+    }
+    f->inode.original_size += size;
+    return (long)size;
+}
+
+static int close_writer(FSFile *f) {
+    FSContext *ctx = f->ctx;
+    if (!f->failed && f->block_count == 0) {
+        // Everything fit in one block: stored in one piece, like add_file does
+        return add_file_codec(ctx, f->inode.name, f->block, f->block_len, f->codec);
+    }
+
+    int res = f->failed ? -1 : 0;
+    if (res == 0 && f->block_len > 0) res = f->chunked ? write_chunks(f, 1) : write_block(f);
+    if (res == 0) {
+        f->inode.data_offset = write_table(ctx, f->blocks, f->ends, f->block_count, f->block_size);
+        if (f->inode.data_offset == -1) res = -1;
+    }
+    if (res == 0) {
+        f->inode.compressed_size += table_extent(f->block_count, f->chunked);
+        res = index_insert(ctx, &f->inode);
+        if (res != 0) fs_release(ctx, f->inode.data_offset, table_extent(f->block_count, f->chunked));
+    }
+    if (res != 0) {
+        release_block_list(ctx, f->blocks, f->block_count);
+        return -1;
+    }
+    if (sync_superblock(ctx) != 0) return -1;
+    return end_operation(ctx);
+}
+
+// --- Reading ---
+
+// File offset of the first byte of block i.
+static long block_start(const FSFile *f, long i) {
+    if (!f->ends) return i * f->block_size;
+    return i > 0 ? f->ends[i - 1] : 0;
+}
+
+// Block holding byte `offset` (the last one at the end of the file: nothing left to decode).
+static long block_at(const FSFile *f, long offset) {
+    long i = offset / (f->block_size ? f->block_size : 1);
+    if (f->ends) {
+        // First chunk ending past the offset
+        long lo = 0, hi = f->block_count;
+        while (lo < hi) {
+            long mid = lo + (hi - lo) / 2;
+            if (f->ends[mid] <= offset) lo = mid + 1;
+            else hi = mid;
+        }
+        i = lo;
+    }
+    return i < f->block_count ? i : f->block_count - 1;
+}
+
+// The table describes a file of `size` bytes.
+static int table_fits(const BlockTable *t, const long *ends, long size) {
+    if (ends) return ends[t->count - 1] == size;
+    return t->count == (size + t->block_size - 1) / t->block_size;
+}
+
+// Reader of a file the caller has already looked up.
+static FSFile* open_read_inode(FSContext *ctx, const Inode *inode) {
+    if (inode->type != FILE_NODE) return NULL;
+
+    FSFile *f = calloc(1, sizeof(FSFile));
+    if (!f) return NULL;
+    f->ctx = ctx;
+    f->inode = *inode;
+    f->current = -1;
+    if (inode->codec == CODEC_BLOCKS) {
+        BlockTable t;
+        f->blocks = load_table(ctx, inode->data_offset, &t, &f->ends);
+        if (!f->blocks || !table_fits(&t, f->ends, inode->original_size)) {
+            free(f->blocks);
+            free(f->ends);
+            free(f);
+            return NULL;
+        }
+        f->block_count = t.count;
+        f->block_size = t.block_size;
+    } else {
+        // Stored in one piece (add_file): decoded whole, as a single block
+        f->block = read_inode_content(ctx, inode, &f->block_len);
+        if (!f->block) {
+            free(f);
+            return NULL;
+        }
+        f->current = 0;
+    }
+    return f;
+}
+
+FSFile* fs_open_read(FSContext *ctx, const char *path) {
+    Inode inode;
+    if (index_lookup(ctx, path, &inode) != 0) return NULL;
+    return open_read_inode(ctx, &inode);
+}
+
+unsigned char* read_block(FSContext *ctx, long offset, long original_size) {
+    BlockHeader h;
+    if (read_header(ctx, offset, &h) != 0 || h.original_size != original_size) return NULL;
+
+    long data = offset + sizeof(BlockHeader);
+    const unsigned char *mapped = cache_ptr(&ctx->cache, data, h.stored_size);
+    if (mapped) return codec_decompress(h.codec, mapped, h.stored_size, h.original_size);
+
+    unsigned char *stored = malloc(h.stored_size + 1);
+    if (!stored) return NULL;
+    if (cache_read(&ctx->cache, data, stored, h.stored_size) != 0) {
+        free(stored);
+        return NULL;
+    }
+    if (h.codec == CODEC_STORED) {
+        if (h.stored_size == h.original_size) return stored;
+        free(stored);
+        return NULL;
+    }
+    unsigned char *decoded = codec_decompress(h.codec, stored, h.stored_size, h.original_size);
+    free(stored);
+    return decoded;
+}
+
+// Decodes block i into f->block.
+static int load_block(FSFile *f, long i) {
+    long start = block_start(f, i);
+    long end = f->ends ? f->ends[i] : start + f->block_size;
+    long len = (end < f->inode.original_size ? end : f->inode.original_size) - start;
+    unsigned char *decoded = read_block(f->ctx, f->blocks[i], len);
+    if (!decoded) return -1;
+
+    free(f->block);
+    f->block = decoded;
+    f->block_len = len;
+    f->block_pos = 0;
+    f->current = i;
+    return 0;
+}
+
+long fs_read(FSFile *f, void *buf, size_t size) {
+    if (f->writing) return -1;
+    unsigned char *dst = buf;
+    size_t done = 0;
+    while (done < size) {
+        if (f->block_pos == f->block_len) {
+            if (f->current + 1 >= f->block_count) break; // One piece: block_count is 0
+            if (load_block(f, f->current + 1) != 0) return -1;
+            continue;
+        }
+        size_t n = f->block_len - f->block_pos < size - done ? f->block_len - f->block_pos : size - done;
+        memcpy(dst + done, f->block + f->block_pos, n);
+        f->block_pos += n;
+        f->position += n;
+        done += n;
+    }
+    return (long)done;
+}
+
+int fs_seek(FSFile *f, long offset) {
+    if (f->writing || offset < 0 || offset > f->inode.original_size) return -1;
+    if (!f->blocks) {
+        f->block_pos = offset;
+    } else {
+        long i = block_at(f, offset);
+        if (i != f->current && load_block(f, i) != 0) return -1;
+        f->block_pos = offset - block_start(f, i);
+    }
+    f->position = offset;
+    return 0;
+}
+
+int fs_close(FSFile *f) {
+    int res = f->writing ? close_writer(f) : 0;
+    free(f->block);
+    free(f->blocks);
+    free(f->ends);
+    free(f);
+    return res;
+}
+
+unsigned char* read_range(FSContext *ctx, const char *path, long offset, size_t len, size_t *out_size) {
+    FSFile *f = fs_open_read(ctx, path);
+    if (!f) return NULL;
+    unsigned char *buf = NULL;
+    if (fs_seek(f, offset) == 0) {
+        long left = f->inode.original_size - offset;
+        if ((long)len > left) len = left;
+        buf = malloc(len + 1);
+        if (buf && fs_read(f, buf, len) != (long)len) {
+            free(buf);
+            buf = NULL;
+        }
+    }
+    fs_close(f);
+    if (buf && out_size) *out_size = len;
+    return buf;
+}
+
+// --- Block tables ---
+
+void fs_release_blocks(FSContext *ctx, long table_offset) {
+    BlockTable t;
+    long *ends;
+    long *blocks = load_table(ctx, table_offset, &t, &ends);
+    if (!blocks) return;
+    release_block_list(ctx, blocks, t.count);
+    fs_release(ctx, table_offset, table_extent(t.count, ends != NULL));
+    free(blocks);
+    free(ends);
+}
+
+unsigned char* read_blocks(FSContext *ctx, const Inode *inode) {
+    FSFile *f = open_read_inode(ctx, inode);
+    if (!f) return NULL;
+    unsigned char *content = malloc(inode->original_size + 1);
+    if (content && fs_read(f, content, inode->original_size) != inode->original_size) {
+        free(content);
+        content = NULL;
+    }
+    fs_close(f);
+    return content;
+}
+
+long copy_blocks(FSContext *src, long table_offset, FSContext *dst) {
+    BlockTable t;
+    long *ends;
+    long *blocks = load_table(src, table_offset, &t, &ends);
+    if (!blocks) return -1;
+
+    // Same blocks, in the same order, listed by a new table
+    int res = 0;
+    for (long i = 0; i < t.count && res == 0; i++) {
+        BlockHeader h;
+        if (read_header(src, blocks[i], &h) != 0) {
+            res = -1;
+            break;
+        }
+        long extent = block_extent(&h);
+
+        // A chunk shared in the source is copied with the first file using it, the others share the copy
+        DedupRecord shared, copied;
+        int dedup = ends && dedup_find_offset(src, blocks[i], extent, &shared) == 0 && shared.chunk;
+        if (dedup && dedup_lookup_chunk(dst, &shared.hash, NULL, shared.original_size, &copied) == 0) {
+            blocks[i] = copied.data_offset;
+            res = dedup_ref(dst, &copied);
+            continue;
+        }
+
+        unsigned char *block = malloc(extent);
+        if (!block || cache_read(&src->cache, blocks[i], block, extent) != 0) {
+            res = -1;
+        } else {
+            blocks[i] = fs_allocate(dst, extent);
+            res = cache_write(&dst->cache, blocks[i], block, extent);
+        }
+        free(block);
+        if (res == 0 && dedup) dedup_insert_chunk(dst, &shared.hash, blocks[i], extent, shared.original_size, h.codec);
+    }
+    long copy = res == 0 ? write_table(dst, blocks, ends, t.count, t.block_size) : -1;
+    free(blocks);
+    free(ends);
+    return copy;
+}
@@ -0,0 +1,109 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "fs_core.h"
+
+// Streaming and random-access reads and writes, for files that do not fit in memory.
+// A file written with fs_write is cut into FS_STREAM_BLOCK blocks, each encoded on its own
+// (codec_encode picks the codec per block) and stored in its own extent behind a BlockHeader.
+// A block table written at close lists the blocks in file order: block i holds bytes
+// [i * block_size, (i + 1) * block_size), so any byte range is decoded from the blocks covering it.
+// The inode records CODEC_BLOCKS, the table in data_offset and the bytes of all the extents in
+// compressed_size.
+// Peak memory is about two blocks plus the table (8 bytes per block) whatever the file size.
+//
+// Files that fit in one block are stored in one piece like add_file stores them (add_file itself
+// stores larger buffers in blocks). fs_open_read reads every file, files stored in one piece being
+// decoded whole.
+// Version 1 images have no codec field: files are written in one piece there, at close.
+//
+// When the image deduplicates (dedup.h), the blocks are chunks cut where the content says so
+// instead of every FS_STREAM_BLOCK bytes: a gear hash rolls over the bytes (FastCDC), and a chunk
+// ends where its top bits are zero, between FS_CHUNK_MIN and FS_CHUNK_MAX bytes, around
+// FS_CHUNK_AVG. An insertion or deletion only moves the boundaries next to it, so the next version of a
+// file cuts the rest into the same chunks: each is hashed, and one the image already holds is
+// pointed at without being compressed or written again. The table of a chunked file has a block_size
+// of 0 and lists, after the block offsets, the file offset where each chunk ends.
+
+#define FS_STREAM_BLOCK (1024 * 1024)
+#define FS_CHUNK_MIN (16 * 1024)
+#define FS_CHUNK_AVG (64 * 1024)
+#define FS_CHUNK_MAX (256 * 1024)
+
+typedef struct BlockHeader {
+    int codec;              // Codec of this block (never CODEC_BLOCKS)
+    int original_size;      // File bytes in the block (block_size except in the last block)
+    int stored_size;        // Encoded bytes following the header
+    int reserved;
+} BlockHeader;
+
+// Start of the block table, followed by `count` block offsets (then `count` chunk ends).
+typedef struct BlockTable {
+    long count;
+    long block_size;        // File bytes per block, 0 for chunks
+} BlockTable;
+
+typedef struct FSFile {
+    FSContext *ctx;
+    int writing;
+    int failed;             // Writer: a block could not be written, fs_close discards the file
+    int codec;              // Writer: codec requested for the blocks (CODEC_AUTO = chosen per block)
+    int chunked;            // Writer: cuts content-defined chunks and shares them (dedup.h)
+    Inode inode;            // Reader: the file. Writer: filled in as blocks are written
+    unsigned char *block;   // Data of the current block
+    size_t block_len;       // Writer: bytes buffered. Reader: bytes in the decoded block
+    size_t block_pos;       // Reader: next byte to hand out
+    size_t block_cap;       // Writer: size of the buffer (grows past FS_STREAM_BLOCK for version 1)
+    long *blocks;           // Block offsets (writer: the blocks written so far), NULL for one piece
+    long *ends;             // Chunks: file offset past each block, NULL for blocks of block_size
+    long block_count;
+    long block_size;
+    long blocks_cap;        // Writer: room in `blocks` and `ends`
+    long current;           // Reader: index of the decoded block, -1 = none
+    long position;          // Reader: offset in the file of the next byte handed out
+} FSFile;
+
+// Opens a new file for writing. Returns NULL if the name exists or is empty.
+FSFile* fs_open_write(FSContext *ctx, const char *path);
+// Same, encoding every block with `codec` (codec.h: CODEC_AUTO, or a codec accepted by codec_encode_as).
+FSFile* fs_open_write_codec(FSContext *ctx, const char *path, int codec);
+
+// Appends data. Returns `size`, or -1 on error.
+long fs_write(FSFile *f, const void *data, size_t size);
+
+// Opens a file for reading. Returns NULL if not found.
+FSFile* fs_open_read(FSContext *ctx, const char *path);
+
+// Reads up to `size` bytes. Returns the number of bytes read, 0 at the end of the file, -1 on error.
+long fs_read(FSFile *f, void *buf, size_t size);
+
+// Moves the read position (0 to the file size). Only the block (or chunk) holding it is decoded.
+// Returns 0 on success, -1 on error.
+int fs_seek(FSFile *f, long offset);
+
+// Closes a file. For a writer, the file is added to the index here: returns 0 on success, -1 if it
+// could not be written or the name was taken meanwhile (the blocks are given back).
+int fs_close(FSFile *f);
+
+// Bytes [offset, offset + len) of a file, cut short at its end (*out_size). Decodes only the blocks
+// covering the range. Returns a buffer the caller must free, or NULL.
+unsigned char* read_range(FSContext *ctx, const char *path, long offset, size_t len, size_t *out_size);
+
+// --- Block tables (fs_core, compaction) ---
+
+// Gives the blocks and the table of a CODEC_BLOCKS payload back to the allocator (a shared chunk
+// drops a reference instead).
+void fs_release_blocks(FSContext *ctx, long table_offset);
+
+// Whole content of a CODEC_BLOCKS file (caller must free), or NULL.
+unsigned char* read_blocks(FSContext *ctx, const Inode *inode);
+
+// Decoded bytes of the block (or chunk) at `offset`, which must hold original_size bytes (caller
+// must free), or NULL.
+unsigned char* read_block(FSContext *ctx, long offset, long original_size);
+
+// Copies the blocks and the table into another image, one block at a time. A chunk shared in the
+// source is copied once and shared the same way. Returns the offset of the table there, or -1 on error.
+long copy_blocks(FSContext *src, long table_offset, FSContext *dst);
+
+#endif // STREAM_H
@@ -1,6 +1,6 @@
 #include "interface.h"
 #include "../fs_core.h"
-#include "../red_black_tree.h"
+#include "../stream.h"
 #include <gtk/gtk.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,7 +25,8 @@ enum {
     COLUMN_SIZE_ORIG,
     COLUMN_SIZE_COMP,
     COLUMN_TYPE,
-    COLUMN_NODE_OFFSET, // Pour garder une référence vers le noeud du fichier
+    COLUMN_DATA_OFFSET, // Pour garder une référence vers les données du fichier
+    COLUMN_PATH,        // Chemin complet dans l'image (vide : ligne d'attente d'un dossier pas encore lu)
     N_COLUMNS
 };
 
@@ -54,66 +55,115 @@ void log_message(AppData *app, const char *format, ...) {
 }
 
 /**
- * Fonction récursive pour parcourir l'arbre binaire et remplir le GtkTreeStore.
- * Cette fonction lit les noeuds directement depuis le fichier.
+ * Dossier en cours de remplissage : les entrées lues sont ajoutées sous `parent` (NULL : racine).
  */
-void traverser_et_remplir_tree(FILE *file, long current_offset, GtkTreeStore *store, GtkTreeIter *parent) {
-    if (current_offset == -1) return;
-
-    RBTNode node;
-    // Lecture du noeud à l'offset donné
-    read_rb_node(file, current_offset, &node);
+typedef struct {
+    GtkTreeStore *store;
+    GtkTreeIter *parent;
+    size_t prefix_len;  // Longueur du chemin du dossier, retirée des noms affichés
+} RemplissageDossier;
 
-    // On traite le sous-arbre gauche (ordre in-order pour l'affichage alphabétique si l'arbre est trié)
-    traverser_et_remplir_tree(file, node.left_offset, store, parent);
+/**
+ * Ajoute une entrée d'un dossier dans le GtkTreeStore (appelée pour chaque entrée, dans l'ordre
+ * des noms, par for_each_in_directory : l'index est lu via le cache de pages du contexte).
+ * Un sous-dossier non vide reçoit une ligne d'attente, remplacée par son contenu quand on le déplie.
+ */
+static int ajouter_au_tree(FSContext *ctx, const Inode *inode, void *arg) {
+    RemplissageDossier *r = arg;
 
-    // Ajout du noeud courant dans l'interface
+    // Ajout de l'entrée courante dans l'interface
     GtkTreeIter iter;
-    gtk_tree_store_append(store, &iter, parent);
+    gtk_tree_store_append(r->store, &iter, r->parent);
     
     // Choix de l'icône selon le type
-    const char *icon_name = (node.inode.type == DIRECTORY_NODE) ? "folder" : "text-x-generic";
-    if (node.inode.type == DIRECTORY_NODE) {
-        // Pour être sûr d'utiliser une icône dossier standard
-        icon_name = "folder"; 
-    }
+    const char *icon_name = (inode->type == DIRECTORY_NODE) ? "folder" : "text-x-generic";
+    const char *nom = inode->name + (r->prefix_len > 0 ? r->prefix_len + 1 : 0);
 
-    gtk_tree_store_set(store, &iter,
+    gtk_tree_store_set(r->store, &iter,
                        COLUMN_ICON, icon_name,
-                       COLUMN_NAME, node.inode.name,
-                       COLUMN_SIZE_ORIG, node.inode.original_size,
-                       COLUMN_SIZE_COMP, node.inode.compressed_size,
-                       COLUMN_TYPE, (node.inode.type == FILE_NODE) ? "Fichier" : "Dossier",
-                       COLUMN_NODE_OFFSET, current_offset,
+                       COLUMN_NAME, nom,
+                       COLUMN_SIZE_ORIG, inode->original_size,
+                       COLUMN_SIZE_COMP, inode->compressed_size,
+                       COLUMN_TYPE, (inode->type == FILE_NODE) ? "Fichier" : "Dossier",
+                       COLUMN_DATA_OFFSET, inode->data_offset,
+                       COLUMN_PATH, inode->name,
                        -1);
 
-    // Si c'est un dossier et qu'il a des enfants, on devrait théoriquement appeler récursivement
-    // sur le children_offset de l'inode.
-    // MAIS : Dans l'implémentation actuelle, nous avons un arbre à plat ou basique.
-    // Si la structure supportait les dossiers, on ferait :
-    /*
-    if (node.inode.type == DIRECTORY_NODE && node.inode.children_offset != -1) {
-        traverser_et_remplir_tree(file, node.inode.children_offset, store, &iter);
+    if (inode->type == DIRECTORY_NODE && inode->children_offset != -1) {
+        GtkTreeIter attente;
+        gtk_tree_store_append(r->store, &attente, &iter);
+        gtk_tree_store_set(r->store, &attente, COLUMN_NAME, "...", COLUMN_PATH, "", -1);
     }
-    */
-   
-    // On traite le sous-arbre droit
-    traverser_et_remplir_tree(file, node.right_offset, store, parent);
+    return 0;
 }
 
 /**
- * Actualise l'affichage de l'arbre.
+ * Remplit un niveau de l'arbre avec les entrées du dossier `dossier` ("" : racine), sans lire
+ * ses sous-dossiers : chacun a son propre arbre dans l'image, lu quand on le déplie.
+ */
+static void traverser_et_remplir_tree(AppData *app, const char *dossier, GtkTreeIter *parent) {
+    RemplissageDossier r = { app->tree_store, parent, strlen(dossier) };
+    if (for_each_in_directory(app->fs_ctx, dossier, ajouter_au_tree, &r) != 0) {
+        log_message(app, "Erreur : Impossible de lire le dossier %s.", dossier);
+    }
+}
+
+/**
+ * Actualise l'affichage de l'arbre (les dossiers sont relus quand on les déplie).
  */
 void actualiser_arborescence(AppData *app) {
     gtk_tree_store_clear(app->tree_store);
     
     if (app->fs_ctx->sb.root_inode_offset != -1) {
-        traverser_et_remplir_tree(app->fs_ctx->file, app->fs_ctx->sb.root_inode_offset, app->tree_store, NULL);
+        traverser_et_remplir_tree(app, "", NULL);
     } else {
         log_message(app, "Système de fichiers vide.");
     }
 }
 
+/**
+ * Callback dépliage d'un dossier : sa ligne d'attente est remplacée par ses entrées.
+ */
+static gboolean on_row_expand(GtkTreeView *tree_view, GtkTreeIter *iter, GtkTreePath *path, gpointer data) {
+    AppData *app = (AppData *)data;
+    GtkTreeModel *model = GTK_TREE_MODEL(app->tree_store);
+    GtkTreeIter enfant;
+    if (!gtk_tree_model_iter_children(model, &enfant, iter)) return FALSE;
+
+    char *chemin_enfant;
+    gtk_tree_model_get(model, &enfant, COLUMN_PATH, &chemin_enfant, -1);
+    int attente = chemin_enfant == NULL || chemin_enfant[0] == '\0';
+    g_free(chemin_enfant);
+    if (!attente) return FALSE; // Déjà lu
+
+    char *dossier;
+    gtk_tree_model_get(model, iter, COLUMN_PATH, &dossier, -1);
+    gtk_tree_store_remove(app->tree_store, &enfant);
+    traverser_et_remplir_tree(app, dossier, iter);
+    g_free(dossier);
+    return FALSE;
+}
+
+/**
+ * Chemin complet de la ligne sélectionnée (à libérer avec g_free), ou NULL.
+ */
+static char* chemin_selectionne(AppData *app, int *est_dossier) {
+    GtkTreeSelection *selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(app->tree_view));
+    GtkTreeModel *model;
+    GtkTreeIter iter;
+    if (!gtk_tree_selection_get_selected(selection, &model, &iter)) return NULL;
+
+    char *chemin, *type;
+    gtk_tree_model_get(model, &iter, COLUMN_PATH, &chemin, COLUMN_TYPE, &type, -1);
+    if (est_dossier) *est_dossier = type != NULL && strcmp(type, "Dossier") == 0;
+    g_free(type);
+    if (chemin && chemin[0] == '\0') { // Ligne d'attente
+        g_free(chemin);
+        return NULL;
+    }
+    return chemin;
+}
+
 
 /* --- Callbacks --- */
 
@@ -140,32 +190,44 @@ void on_add_clicked(GtkWidget *widget, gpointer data) {
     if (res == GTK_RESPONSE_ACCEPT) {
         char *filename = gtk_file_chooser_get_filename(GTK_FILE_CHOOSER(dialog));
         
-        // Lire le fichier réel
+        // Lire le fichier réel (par blocs : la taille du fichier n'est pas limitée par la mémoire)
         FILE *f = fopen(filename, "rb");
         if (f) {
             fseek(f, 0, SEEK_END);
             long fsize = ftell(f);
             fseek(f, 0, SEEK_SET);
 
-            unsigned char *content = malloc(fsize);
-            fread(content, 1, fsize, f);
-            fclose(f);
-
-            // Extraire le nom de fichier du chemin complet
+            // Extraire le nom de fichier du chemin complet. Il est ajouté dans le dossier
+            // sélectionné s'il y en a un.
             char *basename = g_path_get_basename(filename);
+            int est_dossier = 0;
+            char *dossier = chemin_selectionne(app, &est_dossier);
+            char *destination = est_dossier ? g_strdup_printf("%s/%s", dossier, basename) : g_strdup(basename);
+            g_free(dossier);
 
             // Ajouter au système
-            log_message(app, "Importation de %s (%ld octets)...", basename, fsize);
-            int ret = add_file(app->fs_ctx, basename, content, fsize);
-            
+            log_message(app, "Importation de %s (%ld octets)...", destination, fsize);
+            FSFile *out = fs_open_write(app->fs_ctx, destination);
+            int ret = out ? 0 : -1;
+            if (out) {
+                unsigned char buf[64 * 1024];
+                size_t n;
+                while (ret == 0 && (n = fread(buf, 1, sizeof(buf), f)) > 0) {
+                    if (fs_write(out, buf, n) < 0) ret = -2;
+                }
+                if (fs_close(out) != 0 && ret == 0) ret = -1;
+            }
+            fclose(f);
+
             if (ret == 0) {
+                sync_filesystem(app->fs_ctx); // Le cache de pages est écrit sur le disque
                 log_message(app, "Succès : Fichier ajouté.");
                 actualiser_arborescence(app);
             } else {
                 log_message(app, "Erreur : Impossible d'ajouter le fichier (Code %d).", ret);
             }
 
-            free(content);
+            g_free(destination);
             g_free(basename);
         } else {
             log_message(app, "Erreur : Impossible de lire le fichier source.");
@@ -181,29 +243,22 @@ void on_add_clicked(GtkWidget *widget, gpointer data) {
  */
 void on_delete_clicked(GtkWidget *widget, gpointer data) {
     AppData *app = (AppData *)data;
-    GtkTreeSelection *selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(app->tree_view));
-    GtkTreeModel *model;
-    GtkTreeIter iter;
-
-    if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
-        char *name;
-        gtk_tree_model_get(model, &iter, COLUMN_NAME, &name, -1);
+    char *name = chemin_selectionne(app, NULL);
 
+    if (name) {
         log_message(app, "Suppression de %s...", name);
         
-        // Appel à la logique de suppression (rb_delete)
-        long *root_ptr = &app->fs_ctx->sb.root_inode_offset;
-        int ret = rb_delete(app->fs_ctx->file, root_ptr, name);
+        // Appel à la logique de suppression (le nœud et les données sont rendus à l'allocateur)
+        int ret = delete_file(app->fs_ctx, name);
         
         if (ret == 0) {
-            // Mettre à jour le SuperBlock car la racine a pu changer
-            fseek(app->fs_ctx->file, 0, SEEK_SET);
-            fwrite(&app->fs_ctx->sb, sizeof(SuperBlock), 1, app->fs_ctx->file);
+            // Écrire le SuperBlock et le cache sur le disque
+            sync_filesystem(app->fs_ctx);
             
             log_message(app, "Fichier supprimé.");
             actualiser_arborescence(app);
         } else {
-             log_message(app, "Erreur : Fichier non trouvé ou suppression échouée.");
+             log_message(app, "Erreur : Fichier non trouvé, dossier non vide ou suppression échouée.");
         }
 
         g_free(name);
@@ -217,34 +272,38 @@ void on_delete_clicked(GtkWidget *widget, gpointer data) {
  */
 void on_extract_clicked(GtkWidget *widget, gpointer data) {
     AppData *app = (AppData *)data;
-    GtkTreeSelection *selection = gtk_tree_view_get_selection(GTK_TREE_VIEW(app->tree_view));
-    GtkTreeModel *model;
-    GtkTreeIter iter;
-
-    if (gtk_tree_selection_get_selected(selection, &model, &iter)) {
-        char *name;
-        gtk_tree_model_get(model, &iter, COLUMN_NAME, &name, -1);
+    char *name = chemin_selectionne(app, NULL);
 
+    if (name) {
         log_message(app, "Extraction de %s...", name);
 
-        size_t size;
-        unsigned char *data_ptr = get_file_content(app->fs_ctx, name, &size);
+        FSFile *in = fs_open_read(app->fs_ctx, name);
 
-        if (data_ptr) {
-            // Sauvegarder sur le disque
+        if (in) {
+            // Sauvegarder sur le disque, bloc par bloc
             // Pour simplifier, on extrait dans le dossier courant avec le préfixe "extracted_"
+            // Les '/' du chemin deviennent des '_'
             char out_name[256];
             snprintf(out_name, sizeof(out_name), "extracted_%s", name);
+            for (char *p = out_name; *p; p++) {
+                if (*p == '/') *p = '_';
+            }
             
             FILE *f_out = fopen(out_name, "wb");
             if (f_out) {
-                fwrite(data_ptr, 1, size, f_out);
+                unsigned char buf[64 * 1024];
+                long n;
+                while ((n = fs_read(in, buf, sizeof(buf))) > 0) fwrite(buf, 1, n, f_out);
                 fclose(f_out);
-                log_message(app, "Fichier extrait vers : %s", out_name);
+                if (n == 0) {
+                    log_message(app, "Fichier extrait vers : %s", out_name);
+                } else {
+                    log_message(app, "Erreur : Impossible de lire les données du fichier.");
+                }
             } else {
                 log_message(app, "Erreur d'écriture sur le disque.");
             }
-            free(data_ptr);
+            fs_close(in);
         } else {
             log_message(app, "Erreur : Impossible de lire les données du fichier.");
         }
@@ -271,16 +330,26 @@ void on_command_activate(GtkEntry *entry, gpointer data) {
     } else if (strncmp(text, "rm ", 3) == 0) {
         const char *name = text + 3;
         // Simuler clic suppression (sans sélection, donc appel direct logique)
-        long *root_ptr = &app->fs_ctx->sb.root_inode_offset;
-        int ret = rb_delete(app->fs_ctx->file, root_ptr, name);
+        int ret = delete_file(app->fs_ctx, name);
          if (ret == 0) {
-            fseek(app->fs_ctx->file, 0, SEEK_SET);
-            fwrite(&app->fs_ctx->sb, sizeof(SuperBlock), 1, app->fs_ctx->file);
+            sync_filesystem(app->fs_ctx);
             log_message(app, "Fichier %s supprimé.", name);
             actualiser_arborescence(app);
         } else {
              log_message(app, "Erreur lors de la suppression de %s.", name);
         }
+    } else if (strncmp(text, "mkdir ", 6) == 0) {
+        const char *name = text + 6;
+        int ret = make_directory(app->fs_ctx, name);
+        if (ret == 0) {
+            sync_filesystem(app->fs_ctx);
+            log_message(app, "Dossier %s créé.", name);
+            actualiser_arborescence(app);
+        } else if (ret == -2) {
+            log_message(app, "Erreur : Cette image n'a pas de dossiers (la compacter d'abord).");
+        } else {
+            log_message(app, "Erreur lors de la création de %s.", name);
+        }
     } else if (strncmp(text, "add ", 4) == 0) {
         log_message(app, "Utilisez le bouton 'Ajouter' pour une meilleure expérience.");
     } else {
@@ -334,9 +403,12 @@ void lancer_interface(int argc, char *argv[]) {
                                         G_TYPE_LONG,   // Size Orig
                                         G_TYPE_LONG,   // Size Comp
                                         G_TYPE_STRING, // Type Str
-                                        G_TYPE_LONG);  // Node Offset
+                                        G_TYPE_LONG,   // Data Offset
+                                        G_TYPE_STRING); // Path
 
     app.tree_view = gtk_tree_view_new_with_model(GTK_TREE_MODEL(app.tree_store));
+    // Les dossiers sont lus quand on les déplie
+    g_signal_connect(app.tree_view, "test-expand-row", G_CALLBACK(on_row_expand), &app);
 
     // Cell Renderers
     GtkCellRenderer *renderer_pixbuf = gtk_cell_renderer_pixbuf_new();
@@ -384,7 +456,7 @@ void lancer_interface(int argc, char *argv[]) {
     gtk_box_pack_start(GTK_BOX(vbox_console), scroll_console, TRUE, TRUE, 0);
 
     GtkWidget *entry_cmd = gtk_entry_new();
-    gtk_entry_set_placeholder_text(GTK_ENTRY(entry_cmd), "Entrez une commande (ex: ls, rm fichier.txt)...");
+    gtk_entry_set_placeholder_text(GTK_ENTRY(entry_cmd), "Entrez une commande (ex: ls, rm fichier.txt, mkdir docs)...");
     g_signal_connect(entry_cmd, "activate", G_CALLBACK(on_command_activate), &app);
     gtk_box_pack_start(GTK_BOX(vbox_console), entry_cmd, FALSE, FALSE, 0);
 